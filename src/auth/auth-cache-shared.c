@@ -0,0 +1,512 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "auth-common.h"
+#include "ioloop.h"
+#include "str.h"
+#include "safe-mkstemp.h"
+#include "mmap-util.h"
+#include "xxhash64.h"
+#include "auth-cache-shared.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+   The file begins with a header, which is followed by buckets of
+   AUTH_CACHE_SHARED_WAYS slots. A key can be stored in any of the slots in
+   its bucket. When the bucket is full, the oldest entry is replaced.
+
+   Each slot is protected by a sequence number: writers make it odd while
+   they're modifying the slot, and readers retry/skip if the number is odd
+   or it changed while they were reading. Writers never wait for each other:
+   if the slot is already being modified, the write is just skipped, which
+   is fine for a cache.
+
+   The high 32 bits of the sequence contain the time when the slot was
+   locked. If a writer dies while modifying a slot, the slot would stay
+   locked forever. So once the lock is older than
+   AUTH_CACHE_SHARED_STALE_LOCK_SECS, the next user of the slot takes over
+   the lock and drops the half-written entry.
+*/
+
+#define AUTH_CACHE_SHARED_MAGIC 0x41434853
+#define AUTH_CACHE_SHARED_VERSION 2
+#define AUTH_CACHE_SHARED_SLOT_SIZE 512
+#define AUTH_CACHE_SHARED_WAYS 4
+#define AUTH_CACHE_SHARED_READ_RETRIES 3
+#define AUTH_CACHE_SHARED_STALE_LOCK_SECS 60
+
+#define AUTH_CACHE_SHARED_SEQ(seq, lock_time) \
+	(((uint64_t)(lock_time) << 32) | ((seq) & 0xffffffff))
+#define AUTH_CACHE_SHARED_SEQ_LOCK_TIME(seq) ((seq) >> 32)
+
+struct auth_cache_shared_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t bucket_count;
+	/* hash of the configuration that affects the cached entries */
+	uint64_t config_hash;
+};
+
+struct auth_cache_shared_slot {
+	/* odd while the slot is being modified */
+	uint64_t seq;
+	uint32_t hash;
+	uint32_t created;
+	/* 0 = empty slot */
+	uint16_t key_len;
+	uint16_t value_len;
+	uint8_t last_success;
+	uint8_t unused[3];
+	/* key + value, without NULs */
+	char data[AUTH_CACHE_SHARED_SLOT_SIZE - 24];
+};
+
+struct auth_cache_shared {
+	char *path;
+	void *mmap_base;
+	size_t mmap_size;
+
+	struct auth_cache_shared_slot *slots;
+	unsigned int bucket_count;
+	uint64_t config_hash;
+};
+
+static size_t auth_cache_shared_get_file_size(unsigned int bucket_count)
+{
+	return AUTH_CACHE_SHARED_SLOT_SIZE +
+		(size_t)bucket_count * AUTH_CACHE_SHARED_WAYS *
+		AUTH_CACHE_SHARED_SLOT_SIZE;
+}
+
+static unsigned int auth_cache_shared_get_bucket_count(size_t size)
+{
+	unsigned int bucket_count = 1;
+	size_t bucket_size =
+		AUTH_CACHE_SHARED_WAYS * AUTH_CACHE_SHARED_SLOT_SIZE;
+
+	/* largest power of two that fits */
+	while (auth_cache_shared_get_file_size(bucket_count * 2) <= size &&
+	       bucket_count < (1U << 30) / bucket_size)
+		bucket_count *= 2;
+	return bucket_count;
+}
+
+static bool
+auth_cache_shared_mmap(struct auth_cache_shared *shared, int fd,
+		       bool verify)
+{
+	const struct auth_cache_shared_header *hdr;
+	struct stat st;
+
+	if (verify) {
+		if (fstat(fd, &st) < 0) {
+			i_error("fstat(%s) failed: %m", shared->path);
+			return FALSE;
+		}
+		if (st.st_uid != geteuid() || (st.st_mode & 0077) != 0) {
+			/* the file contains credentials - don't trust it
+			   unless it's private to us */
+			i_error("%s: File must be owned by uid %s and "
+				"have mode 0600 - recreating it",
+				shared->path, dec2str(geteuid()));
+			return FALSE;
+		}
+		if ((uoff_t)st.st_size != shared->mmap_size) {
+			/* different size - recreate */
+			return FALSE;
+		}
+	}
+
+	shared->mmap_base = mmap(NULL, shared->mmap_size,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared->mmap_base == MAP_FAILED) {
+		shared->mmap_base = NULL;
+		i_error("mmap(%s) failed: %m", shared->path);
+		return FALSE;
+	}
+	hdr = shared->mmap_base;
+	if (verify &&
+	    (hdr->magic != AUTH_CACHE_SHARED_MAGIC ||
+	     hdr->version != AUTH_CACHE_SHARED_VERSION ||
+	     hdr->slot_size != AUTH_CACHE_SHARED_SLOT_SIZE ||
+	     hdr->bucket_count != shared->bucket_count ||
+	     hdr->config_hash != shared->config_hash)) {
+		if (munmap(shared->mmap_base, shared->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", shared->path);
+		shared->mmap_base = NULL;
+		return FALSE;
+	}
+	shared->slots = PTR_OFFSET(shared->mmap_base,
+				   AUTH_CACHE_SHARED_SLOT_SIZE);
+	return TRUE;
+}
+
+static int
+auth_cache_shared_create(struct auth_cache_shared *shared, bool replace)
+{
+	struct auth_cache_shared_header *hdr;
+	string_t *temp_path = t_str_new(128);
+	int fd, ret, link_errno;
+
+	str_append(temp_path, shared->path);
+	str_append_c(temp_path, '.');
+	fd = safe_mkstemp(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1) {
+		i_error("safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return -1;
+	}
+	if (ftruncate(fd, shared->mmap_size) < 0) {
+		i_error("ftruncate(%s) failed: %m", str_c(temp_path));
+		i_close_fd(&fd);
+		i_unlink(str_c(temp_path));
+		return -1;
+	}
+	if (!auth_cache_shared_mmap(shared, fd, FALSE)) {
+		i_close_fd(&fd);
+		i_unlink(str_c(temp_path));
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	hdr = shared->mmap_base;
+	hdr->magic = AUTH_CACHE_SHARED_MAGIC;
+	hdr->version = AUTH_CACHE_SHARED_VERSION;
+	hdr->slot_size = AUTH_CACHE_SHARED_SLOT_SIZE;
+	hdr->bucket_count = shared->bucket_count;
+	hdr->config_hash = shared->config_hash;
+
+	/* If another process just created the file, use the existing one
+	   so we all share the same file. An existing file with different
+	   parameters is replaced. */
+	if (replace) {
+		if ((ret = rename(str_c(temp_path), shared->path)) < 0) {
+			i_error("rename(%s, %s) failed: %m",
+				str_c(temp_path), shared->path);
+			i_unlink(str_c(temp_path));
+		}
+	} else {
+		if ((ret = link(str_c(temp_path), shared->path)) < 0 &&
+		    errno != EEXIST) {
+			i_error("link(%s, %s) failed: %m",
+				str_c(temp_path), shared->path);
+		}
+		link_errno = errno;
+		i_unlink(str_c(temp_path));
+		errno = link_errno;
+	}
+	if (ret < 0) {
+		ret = errno == EEXIST ? 0 : -1;
+		if (munmap(shared->mmap_base, shared->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", shared->path);
+		shared->mmap_base = NULL;
+		return ret;
+	}
+	return 1;
+}
+
+static int auth_cache_shared_open_existing(struct auth_cache_shared *shared)
+{
+	int fd;
+	bool ret;
+
+	fd = open(shared->path, O_RDWR);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("open(%s) failed: %m", shared->path);
+		return -1;
+	}
+	ret = auth_cache_shared_mmap(shared, fd, TRUE);
+	i_close_fd(&fd);
+	return ret ? 1 : -1;
+}
+
+struct auth_cache_shared *
+auth_cache_shared_open(const char *path, size_t size, uint64_t config_hash)
+{
+	struct auth_cache_shared *shared;
+	unsigned int i;
+	int ret;
+
+	shared = i_new(struct auth_cache_shared, 1);
+	shared->path = i_strdup(path);
+	shared->bucket_count = auth_cache_shared_get_bucket_count(size);
+	shared->config_hash = config_hash;
+	shared->mmap_size =
+		auth_cache_shared_get_file_size(shared->bucket_count);
+
+	for (i = 0;; i++) {
+		if ((ret = auth_cache_shared_open_existing(shared)) > 0)
+			break;
+		T_BEGIN {
+			ret = auth_cache_shared_create(shared, ret < 0);
+		} T_END;
+		if (ret > 0)
+			break;
+		if (ret < 0 || i == 2) {
+			auth_cache_shared_close(&shared);
+			return NULL;
+		}
+	}
+	return shared;
+}
+
+void auth_cache_shared_close(struct auth_cache_shared **_shared)
+{
+	struct auth_cache_shared *shared = *_shared;
+
+	*_shared = NULL;
+	if (shared->mmap_base != NULL) {
+		if (munmap(shared->mmap_base, shared->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", shared->path);
+	}
+	i_free(shared->path);
+	i_free(shared);
+}
+
+static struct auth_cache_shared_slot *
+auth_cache_shared_get_bucket(struct auth_cache_shared *shared,
+			     const char *key, size_t key_len, uint32_t *hash_r)
+{
+	uint64_t hash = xxh64(key, key_len, 0);
+	unsigned int bucket;
+
+	*hash_r = hash & 0xffffffff;
+	bucket = (hash >> 32) & (shared->bucket_count - 1);
+	return &shared->slots[bucket * AUTH_CACHE_SHARED_WAYS];
+}
+
+/* Take over a locked slot whose writer has apparently died. The slot's
+   entry is dropped. Returns TRUE if the slot is now locked by us. */
+static bool
+auth_cache_shared_slot_lock_stale(struct auth_cache_shared_slot *slot,
+				  uint64_t seq, uint64_t *seq_r)
+{
+	uint64_t new_seq;
+
+	i_assert((seq & 1) != 0);
+
+	if (AUTH_CACHE_SHARED_SEQ_LOCK_TIME(seq) +
+	    AUTH_CACHE_SHARED_STALE_LOCK_SECS > (uint64_t)ioloop_time)
+		return FALSE;
+	new_seq = AUTH_CACHE_SHARED_SEQ(seq + 2, ioloop_time);
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, new_seq, FALSE,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return FALSE;
+	slot->key_len = 0;
+	*seq_r = new_seq;
+	return TRUE;
+}
+
+static bool
+auth_cache_shared_slot_lock(struct auth_cache_shared_slot *slot,
+			    uint64_t *seq_r)
+{
+	uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	uint64_t new_seq;
+
+	if ((seq & 1) != 0)
+		return auth_cache_shared_slot_lock_stale(slot, seq, seq_r);
+	new_seq = AUTH_CACHE_SHARED_SEQ(seq + 1, ioloop_time);
+	if (!__atomic_compare_exchange_n(&slot->seq, &seq, new_seq, FALSE,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return FALSE;
+	*seq_r = new_seq;
+	return TRUE;
+}
+
+static void
+auth_cache_shared_slot_unlock(struct auth_cache_shared_slot *slot,
+			      uint64_t seq)
+{
+	__atomic_store_n(&slot->seq, AUTH_CACHE_SHARED_SEQ(seq + 1, 0),
+			 __ATOMIC_RELEASE);
+}
+
+static bool
+auth_cache_shared_slot_has_key(const struct auth_cache_shared_slot *slot,
+			       uint32_t hash, const char *key, size_t key_len)
+{
+	return slot->hash == hash && slot->key_len == key_len &&
+		key_len <= sizeof(slot->data) &&
+		memcmp(slot->data, key, key_len) == 0;
+}
+
+bool auth_cache_shared_lookup(struct auth_cache_shared *shared,
+			      const char *key, const char **value_r,
+			      time_t *created_r, bool *last_success_r)
+{
+	struct auth_cache_shared_slot *slots;
+	size_t key_len = strlen(key);
+	unsigned int i, retry, value_len;
+	uint32_t hash;
+	uint64_t seq, lock_seq;
+	char *value;
+	bool found;
+
+	slots = auth_cache_shared_get_bucket(shared, key, key_len, &hash);
+	for (i = 0; i < AUTH_CACHE_SHARED_WAYS; i++) {
+		struct auth_cache_shared_slot *slot = &slots[i];
+
+		for (retry = 0; retry < AUTH_CACHE_SHARED_READ_RETRIES;
+		     retry++) {
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if ((seq & 1) != 0) {
+				if (auth_cache_shared_slot_lock_stale(slot,
+						seq, &lock_seq)) {
+					auth_cache_shared_slot_unlock(slot,
+								      lock_seq);
+				}
+				continue;
+			}
+
+			found = auth_cache_shared_slot_has_key(slot, hash,
+							       key, key_len);
+			value = NULL;
+			value_len = slot->value_len;
+			if (found &&
+			    key_len + value_len <= sizeof(slot->data)) {
+				value = t_malloc(value_len + 1);
+				memcpy(value, slot->data + key_len, value_len);
+				value[value_len] = '\0';
+				*created_r = slot->created;
+				*last_success_r = slot->last_success != 0;
+			}
+			/* make sure the slot didn't change while we were
+			   reading it */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq,
+					     __ATOMIC_RELAXED) != seq)
+				continue;
+			if (!found)
+				break;
+			if (value == NULL) {
+				/* corrupted */
+				break;
+			}
+			*value_r = value;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void auth_cache_shared_insert(struct auth_cache_shared *shared,
+			      const char *key, const char *value,
+			      time_t created, bool last_success)
+{
+	struct auth_cache_shared_slot *slots, *slot = NULL;
+	size_t key_len = strlen(key), value_len = strlen(value);
+	unsigned int i;
+	uint32_t hash;
+	uint64_t seq;
+
+	if (key_len == 0 || key_len + value_len > sizeof(slots->data)) {
+		/* doesn't fit */
+		return;
+	}
+
+	/* prefer replacing the same key, then an empty slot and finally
+	   the oldest entry. the checks here are racy, but that only means
+	   that we might replace a slightly less optimal entry. */
+	slots = auth_cache_shared_get_bucket(shared, key, key_len, &hash);
+	for (i = 0; i < AUTH_CACHE_SHARED_WAYS; i++) {
+		if (auth_cache_shared_slot_has_key(&slots[i], hash,
+						   key, key_len)) {
+			slot = &slots[i];
+			break;
+		}
+		if (slots[i].key_len == 0) {
+			if (slot == NULL || slot->key_len != 0)
+				slot = &slots[i];
+		} else if (slot == NULL ||
+			   (slot->key_len != 0 &&
+			    slots[i].created < slot->created))
+			slot = &slots[i];
+	}
+
+	if (!auth_cache_shared_slot_lock(slot, &seq))
+		return;
+	slot->hash = hash;
+	slot->created = created;
+	slot->key_len = key_len;
+	slot->value_len = value_len;
+	slot->last_success = last_success ? 1 : 0;
+	memcpy(slot->data, key, key_len);
+	memcpy(slot->data + key_len, value, value_len);
+	auth_cache_shared_slot_unlock(slot, seq);
+}
+
+void auth_cache_shared_remove(struct auth_cache_shared *shared,
+			      const char *key)
+{
+	struct auth_cache_shared_slot *slots;
+	size_t key_len = strlen(key);
+	unsigned int i;
+	uint32_t hash;
+	uint64_t seq;
+
+	slots = auth_cache_shared_get_bucket(shared, key, key_len, &hash);
+	for (i = 0; i < AUTH_CACHE_SHARED_WAYS; i++) {
+		if (!auth_cache_shared_slot_lock(&slots[i], &seq))
+			continue;
+		if (auth_cache_shared_slot_has_key(&slots[i], hash,
+						   key, key_len))
+			slots[i].key_len = 0;
+		auth_cache_shared_slot_unlock(&slots[i], seq);
+	}
+}
+
+unsigned int auth_cache_shared_clear(struct auth_cache_shared *shared)
+{
+	unsigned int i, count, removed = 0;
+	uint64_t seq;
+
+	count = shared->bucket_count * AUTH_CACHE_SHARED_WAYS;
+	for (i = 0; i < count; i++) {
+		struct auth_cache_shared_slot *slot = &shared->slots[i];
+
+		if (slot->key_len == 0 ||
+		    !auth_cache_shared_slot_lock(slot, &seq))
+			continue;
+		if (slot->key_len != 0) {
+			slot->key_len = 0;
+			removed++;
+		}
+		auth_cache_shared_slot_unlock(slot, seq);
+	}
+	return removed;
+}
+
+unsigned int
+auth_cache_shared_remove_matching(struct auth_cache_shared *shared,
+				  auth_cache_shared_match_callback_t *callback,
+				  void *context)
+{
+	unsigned int i, count, removed = 0;
+	uint64_t seq;
+	bool match;
+
+	count = shared->bucket_count * AUTH_CACHE_SHARED_WAYS;
+	for (i = 0; i < count; i++) {
+		struct auth_cache_shared_slot *slot = &shared->slots[i];
+
+		if (slot->key_len == 0 ||
+		    !auth_cache_shared_slot_lock(slot, &seq))
+			continue;
+		if (slot->key_len != 0 &&
+		    slot->key_len <= sizeof(slot->data)) T_BEGIN {
+			match = callback(t_strndup(slot->data, slot->key_len),
+					 context);
+			if (match) {
+				slot->key_len = 0;
+				removed++;
+			}
+		} T_END;
+		auth_cache_shared_slot_unlock(slot, seq);
+	}
+	return removed;
+}
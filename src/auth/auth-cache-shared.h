@@ -0,0 +1,43 @@
+#ifndef AUTH_CACHE_SHARED_H
+#define AUTH_CACHE_SHARED_H
+
+/* Auth cache stored in a mmap()ed file that is shared by all auth processes.
+   The file has a fixed size, so memory usage is bounded. Lookups don't take
+   any locks, and since the file is kept across process restarts the cache
+   isn't empty after an auth process is restarted. Entries that don't fit
+   into a single slot are not cached. */
+
+struct auth_cache_shared;
+
+typedef bool auth_cache_shared_match_callback_t(const char *key,
+						 void *context);
+
+/* Open the shared cache file, or create it if it doesn't exist or it was
+   created with different parameters. config_hash identifies the
+   configuration that the cached entries depend on, so entries created with
+   a different configuration are never used. Returns NULL on failure. */
+struct auth_cache_shared *
+auth_cache_shared_open(const char *path, size_t size, uint64_t config_hash);
+void auth_cache_shared_close(struct auth_cache_shared **shared);
+
+/* Look up key. The returned value is allocated from data stack. */
+bool auth_cache_shared_lookup(struct auth_cache_shared *shared,
+			      const char *key, const char **value_r,
+			      time_t *created_r, bool *last_success_r);
+/* Insert or replace key. If the slot is currently being modified by another
+   process, the insert is silently skipped. */
+void auth_cache_shared_insert(struct auth_cache_shared *shared,
+			      const char *key, const char *value,
+			      time_t created, bool last_success);
+void auth_cache_shared_remove(struct auth_cache_shared *shared,
+			      const char *key);
+/* Remove all entries. Returns the number of removed entries. */
+unsigned int auth_cache_shared_clear(struct auth_cache_shared *shared);
+/* Remove all entries whose key matches the callback. Returns the number of
+   removed entries. */
+unsigned int
+auth_cache_shared_remove_matching(struct auth_cache_shared *shared,
+				  auth_cache_shared_match_callback_t *callback,
+				  void *context);
+
+#endif
@@ -7,6 +7,7 @@
 #include "strescape.h"
 #include "var-expand.h"
 #include "auth-request.h"
+#include "auth-cache-shared.h"
 #include "auth-cache.h"
 
 #include <time.h>
@@ -14,11 +15,12 @@
 struct auth_cache {
 	HASH_TABLE(char *, struct auth_cache_node *) hash;
 	struct auth_cache_node *head, *tail;
+	struct auth_cache_shared *shared;
 
 	size_t max_size, size_left;
 	unsigned int ttl_secs, neg_ttl_secs;
 
-	unsigned int hit_count, miss_count;
+	unsigned int hit_count, miss_count, shared_hit_count;
 	unsigned int pos_entries, neg_entries;
 	unsigned long long pos_size, neg_size;
 };
@@ -187,6 +189,8 @@ auth_cache_node_destroy(struct auth_cache *cache, struct auth_cache_node *node)
 	i_free(node);
 }
 
+static unsigned int auth_cache_clear_local(struct auth_cache *cache);
+
 static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
@@ -205,6 +209,10 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	i_info("Authentication cache hits %u/%u (%u%%)",
 	       cache->hit_count, total_count,
 	       total_count == 0 ? 100 : (cache->hit_count * 100 / total_count));
+	if (cache->shared != NULL) {
+		i_info("Authentication cache hits from shared cache: %u",
+		       cache->shared_hit_count);
+	}
 
 	i_info("Authentication cache inserts: "
 	       "positive: %u entries %llu bytes, "
@@ -219,7 +227,7 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	       (unsigned int)(cache_used * 100ULL / cache->max_size));
 
 	/* reset counters */
-	cache->hit_count = cache->miss_count = 0;
+	cache->hit_count = cache->miss_count = cache->shared_hit_count = 0;
 	cache->pos_entries = cache->neg_entries = 0;
 	cache->pos_size = cache->neg_size = 0;
 }
@@ -252,12 +260,21 @@ void auth_cache_free(struct auth_cache **_cache)
 	lib_signals_unset_handler(SIGHUP, sig_auth_cache_clear, cache);
 	lib_signals_unset_handler(SIGUSR2, sig_auth_cache_stats, cache);
 
-	auth_cache_clear(cache);
+	auth_cache_clear_local(cache);
 	hash_table_destroy(&cache->hash);
+	if (cache->shared != NULL)
+		auth_cache_shared_close(&cache->shared);
 	i_free(cache);
 }
 
-unsigned int auth_cache_clear(struct auth_cache *cache)
+void auth_cache_set_shared(struct auth_cache *cache,
+			   struct auth_cache_shared *shared)
+{
+	i_assert(cache->shared == NULL);
+	cache->shared = shared;
+}
+
+static unsigned int auth_cache_clear_local(struct auth_cache *cache)
 {
 	unsigned int ret = hash_table_count(cache->hash);
 
@@ -267,10 +284,20 @@ unsigned int auth_cache_clear(struct auth_cache *cache)
 	return ret;
 }
 
-static bool auth_cache_node_is_user(struct auth_cache_node *node,
-				    const char *username)
+unsigned int auth_cache_clear(struct auth_cache *cache)
+{
+	unsigned int ret = auth_cache_clear_local(cache);
+
+	if (cache->shared != NULL) {
+		/* the shared cache has usually more entries, and the local
+		   ones are mostly copies of them */
+		ret = I_MAX(ret, auth_cache_shared_clear(cache->shared));
+	}
+	return ret;
+}
+
+static bool auth_cache_key_is_user(const char *data, const char *username)
 {
-	const char *data = node->data;
 	unsigned int username_len;
 
 	/* The cache nodes begin with "P"/"U", passdb/userdb ID, optional
@@ -299,18 +326,26 @@ static bool auth_cache_node_is_user(struct auth_cache_node *node,
 		(data[username_len] == '\t' || data[username_len] == '\0');
 }
 
-static bool auth_cache_node_is_one_of_users(struct auth_cache_node *node,
-					    const char *const *usernames)
+static bool auth_cache_key_is_one_of_users(const char *key,
+					   const char *const *usernames)
 {
 	unsigned int i;
 
 	for (i = 0; usernames[i] != NULL; i++) {
-		if (auth_cache_node_is_user(node, usernames[i]))
+		if (auth_cache_key_is_user(key, usernames[i]))
 			return TRUE;
 	}
 	return FALSE;
 }
 
+static bool auth_cache_shared_key_is_one_of_users(const char *key,
+						  void *context)
+{
+	const char *const *usernames = context;
+
+	return auth_cache_key_is_one_of_users(key, usernames);
+}
+
 unsigned int auth_cache_clear_users(struct auth_cache *cache,
 				    const char *const *usernames)
 {
@@ -319,11 +354,16 @@ unsigned int auth_cache_clear_users(struct auth_cache *cache,
 
 	for (node = cache->tail; node != NULL; node = next) {
 		next = node->next;
-		if (auth_cache_node_is_one_of_users(node, usernames)) {
+		if (auth_cache_key_is_one_of_users(node->data, usernames)) {
 			auth_cache_node_destroy(cache, node);
 			ret++;
 		}
 	}
+	if (cache->shared != NULL) {
+		ret = I_MAX(ret, auth_cache_shared_remove_matching(
+			cache->shared, auth_cache_shared_key_is_one_of_users,
+			(void *)usernames));
+	}
 	return ret;
 }
 
@@ -354,6 +394,53 @@ auth_request_expand_cache_key(const struct auth_request *request,
 	return str_c(str);
 }
 
+static struct auth_cache_node *
+auth_cache_node_add(struct auth_cache *cache, const char *key,
+		    const char *value, time_t created, bool last_success)
+{
+        struct auth_cache_node *node;
+	size_t data_size, alloc_size, key_len, value_len = strlen(value);
+	char *hash_key;
+
+	key_len = strlen(key);
+	data_size = key_len + 1 + value_len + 1;
+	alloc_size = sizeof(struct auth_cache_node) -
+		sizeof(node->data) + data_size;
+
+	/* make sure we have enough space */
+	while (cache->size_left < alloc_size && cache->tail != NULL)
+		auth_cache_node_destroy(cache, cache->tail);
+
+	node = hash_table_lookup(cache->hash, key);
+	if (node != NULL) {
+		/* key is already in cache (probably expired), remove it */
+		auth_cache_node_destroy(cache, node);
+	}
+
+	/* @UNSAFE */
+	node = i_malloc(alloc_size);
+	node->created = created;
+	node->alloc_size = alloc_size;
+	node->last_success = last_success;
+	memcpy(node->data, key, key_len);
+	memcpy(node->data + key_len + 1, value, value_len);
+
+	auth_cache_node_link_head(cache, node);
+
+	cache->size_left -= alloc_size;
+	hash_key = node->data;
+	hash_table_insert(cache->hash, hash_key, node);
+
+	if (*value != '\0') {
+		cache->pos_entries++;
+		cache->pos_size += alloc_size;
+	} else {
+		cache->neg_entries++;
+		cache->neg_size += alloc_size;
+	}
+	return node;
+}
+
 const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
@@ -369,6 +456,18 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 
 	key = auth_request_expand_cache_key(request, key);
 	node = hash_table_lookup(cache->hash, key);
+	if (node == NULL && cache->shared != NULL) {
+		/* another auth process may have already looked it up */
+		time_t created;
+		bool last_success;
+
+		if (auth_cache_shared_lookup(cache->shared, key, &value,
+					     &created, &last_success)) {
+			node = auth_cache_node_add(cache, key, value, created,
+						   last_success);
+			cache->shared_hit_count++;
+		}
+	}
 	if (node == NULL) {
 		cache->miss_count++;
 		return NULL;
@@ -402,9 +501,8 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		       const char *key, const char *value, bool last_success)
 {
-        struct auth_cache_node *node;
-	size_t data_size, alloc_size, key_len, value_len = strlen(value);
-	char *hash_key, *current_username;
+	char *current_username;
+	time_t now;
 
 	if (*value == '\0' && cache->neg_ttl_secs == 0) {
 		/* we're not caching negative entries */
@@ -420,44 +518,14 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		request->user = t_strdup_noconst(request->translated_username);
 
 	key = auth_request_expand_cache_key(request, key);
-	key_len = strlen(key);
 
 	request->user = current_username;
 
-	data_size = key_len + 1 + value_len + 1;
-	alloc_size = sizeof(struct auth_cache_node) -
-		sizeof(node->data) + data_size;
-
-	/* make sure we have enough space */
-	while (cache->size_left < alloc_size && cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
-
-	node = hash_table_lookup(cache->hash, key);
-	if (node != NULL) {
-		/* key is already in cache (probably expired), remove it */
-		auth_cache_node_destroy(cache, node);
-	}
-
-	/* @UNSAFE */
-	node = i_malloc(alloc_size);
-	node->created = time(NULL);
-	node->alloc_size = alloc_size;
-	node->last_success = last_success;
-	memcpy(node->data, key, key_len);
-	memcpy(node->data + key_len + 1, value, value_len);
-
-	auth_cache_node_link_head(cache, node);
-
-	cache->size_left -= alloc_size;
-	hash_key = node->data;
-	hash_table_insert(cache->hash, hash_key, node);
-
-	if (*value != '\0') {
-		cache->pos_entries++;
-		cache->pos_size += alloc_size;
-	} else {
-		cache->neg_entries++;
-		cache->neg_size += alloc_size;
+	now = time(NULL);
+	(void)auth_cache_node_add(cache, key, value, now, last_success);
+	if (cache->shared != NULL) {
+		auth_cache_shared_insert(cache->shared, key, value,
+					 now, last_success);
 	}
 }
 
@@ -467,6 +535,8 @@ void auth_cache_remove(struct auth_cache *cache,
 	struct auth_cache_node *node;
 
 	key = auth_request_expand_cache_key(request, key);
+	if (cache->shared != NULL)
+		auth_cache_shared_remove(cache->shared, key);
 	node = hash_table_lookup(cache->hash, key);
 	if (node == NULL)
 		return;
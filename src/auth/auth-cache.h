@@ -14,6 +14,7 @@ struct auth_cache_node {
 };
 
 struct auth_cache;
+struct auth_cache_shared;
 struct auth_request;
 
 /* Parses all %x variables from query and compresses them into tab-separated
@@ -27,6 +28,11 @@ char *auth_cache_parse_key(pool_t pool, const char *query);
 struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 				  unsigned int neg_ttl_secs);
 void auth_cache_free(struct auth_cache **cache);
+/* Use the shared cache in addition to the process-local one. Lookups that
+   miss the local cache are tried from the shared cache, and all inserts and
+   removals are done to both. The cache takes ownership of shared. */
+void auth_cache_set_shared(struct auth_cache *cache,
+			   struct auth_cache_shared *shared);
 
 /* Clear the cache. Returns how many entries were removed. */
 unsigned int ATTR_NOWARN_UNUSED_RESULT
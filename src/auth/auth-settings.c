@@ -219,6 +219,8 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SET_SIZE, cache_size),
 	DEF(SET_TIME, cache_ttl),
 	DEF(SET_TIME, cache_negative_ttl),
+	DEF(SET_SIZE, cache_shared_size),
+	DEF(SET_STR, cache_shared_path),
 	DEF(SET_STR, username_chars),
 	DEF(SET_STR, username_translation),
 	DEF(SET_STR, username_format),
@@ -259,6 +261,8 @@ static const struct auth_settings auth_default_settings = {
 	.cache_size = 0,
 	.cache_ttl = 60*60,
 	.cache_negative_ttl = 60*60,
+	.cache_shared_size = 0,
+	.cache_shared_path = "",
 	.username_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.-_@",
 	.username_translation = "",
 	.username_format = "%Lu",
@@ -391,6 +395,22 @@ static bool auth_settings_check(void *_set, pool_t pool,
 					   set->cache_size);
 		return FALSE;
 	}
+	if (set->cache_shared_size > 0) {
+		if (set->cache_size == 0) {
+			*error_r = "auth_cache_shared_size requires auth_cache_size";
+			return FALSE;
+		}
+		if (*set->cache_shared_path == '\0') {
+			*error_r = "auth_cache_shared_size requires auth_cache_shared_path";
+			return FALSE;
+		}
+		if (set->cache_shared_size < 64*1024) {
+			*error_r = t_strdup_printf(
+				"auth_cache_shared_size value is too small "
+				"(%"PRIuUOFF_T" bytes)", set->cache_shared_size);
+			return FALSE;
+		}
+	}
 
 	if (!auth_verify_verbose_password(set, error_r))
 		return FALSE;
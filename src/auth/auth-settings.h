@@ -40,6 +40,8 @@ struct auth_settings {
 	uoff_t cache_size;
 	unsigned int cache_ttl;
 	unsigned int cache_negative_ttl;
+	uoff_t cache_shared_size;
+	const char *cache_shared_path;
 	const char *username_chars;
 	const char *username_translation;
 	const char *username_format;
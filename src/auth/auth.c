@@ -2,6 +2,8 @@
 
 #include "auth-common.h"
 #include "array.h"
+#include "str.h"
+#include "xxhash64.h"
 #include "settings-parser.h"
 #include "master-service-settings.h"
 #include "mech.h"
@@ -350,6 +352,45 @@ struct auth *auth_default_service(void)
 	return a[0];
 }
 
+static void
+auth_passdbs_append_cache_config(const struct auth_passdb *passdb,
+				 const char *type, string_t *str)
+{
+	for (; passdb != NULL; passdb = passdb->next) {
+		str_printfa(str, "%s\t%u\t%s\t%s\t%s\n", type,
+			    passdb->passdb->id, passdb->set->driver,
+			    passdb->set->args,
+			    passdb->cache_key == NULL ? "" : passdb->cache_key);
+	}
+}
+
+uint64_t auths_get_cache_config_hash(void)
+{
+	struct auth *const *authp;
+	const struct auth_userdb *userdb;
+	string_t *str = t_str_new(1024);
+
+	array_foreach(&auths, authp) {
+		const struct auth *auth = *authp;
+
+		str_printfa(str, "service\t%s\t%s\n",
+			    auth->service == NULL ? "" : auth->service,
+			    auth->set->username_format);
+		auth_passdbs_append_cache_config(auth->masterdbs, "master",
+						 str);
+		auth_passdbs_append_cache_config(auth->passdbs, "passdb", str);
+		for (userdb = auth->userdbs; userdb != NULL;
+		     userdb = userdb->next) {
+			str_printfa(str, "userdb\t%u\t%s\t%s\t%s\n",
+				    userdb->userdb->id, userdb->set->driver,
+				    userdb->set->args,
+				    userdb->cache_key == NULL ? "" :
+				    userdb->cache_key);
+		}
+	}
+	return xxh64(str_data(str), str_len(str), 0);
+}
+
 void auths_preinit(const struct auth_settings *set, pool_t pool,
 		   const struct mechanisms_register *reg,
 		   const char *const *services)
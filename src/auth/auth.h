@@ -83,6 +83,9 @@ void auths_preinit(const struct auth_settings *set, pool_t pool,
 		   const char *const *services);
 void auths_init(void);
 void auths_deinit(void);
+/* Returns a hash of the passdb and userdb configuration that affects the
+   auth cache's contents. */
+uint64_t auths_get_cache_config_hash(void);
 void auths_free(void);
 
 #endif
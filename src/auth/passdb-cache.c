@@ -5,6 +5,7 @@
 #include "auth-request-stats.h"
 #include "password-scheme.h"
 #include "passdb.h"
+#include "auth-cache-shared.h"
 #include "passdb-cache.h"
 
 struct auth_cache *passdb_cache = NULL;
@@ -158,6 +159,18 @@ void passdb_cache_init(const struct auth_settings *set)
 	}
 	passdb_cache = auth_cache_new(set->cache_size, set->cache_ttl,
 				      set->cache_negative_ttl);
+
+	if (set->cache_shared_size > 0) {
+		struct auth_cache_shared *shared;
+
+		/* on failure the error is already logged. continue with only
+		   the process-local cache. */
+		shared = auth_cache_shared_open(set->cache_shared_path,
+						set->cache_shared_size,
+						auths_get_cache_config_hash());
+		if (shared != NULL)
+			auth_cache_set_shared(passdb_cache, shared);
+	}
 }
 
 void passdb_cache_deinit(void)
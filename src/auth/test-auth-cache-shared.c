@@ -0,0 +1,280 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "auth-cache-shared.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-auth-cache-shared"
+#define TEST_PATH TEST_DIR"/auth-cache"
+#define TEST_SIZE (256*1024)
+
+static void test_auth_cache_shared_init(void)
+{
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_auth_cache_shared_deinit(void)
+{
+	if (unlink_directory(TEST_DIR, TRUE) < 0)
+		i_error("unlink_directory(%s) failed: %m", TEST_DIR);
+}
+
+static bool test_lookup(struct auth_cache_shared *shared, const char *key,
+			const char *expected_value, time_t expected_created,
+			bool expected_last_success)
+{
+	const char *value;
+	time_t created;
+	bool last_success;
+
+	if (!auth_cache_shared_lookup(shared, key, &value,
+				      &created, &last_success))
+		return expected_value == NULL;
+	return expected_value != NULL &&
+		strcmp(value, expected_value) == 0 &&
+		created == expected_created &&
+		last_success == expected_last_success;
+}
+
+static void test_auth_cache_shared_insert_lookup(void)
+{
+	struct auth_cache_shared *shared;
+
+	test_begin("auth cache shared insert and lookup");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	auth_cache_shared_insert(shared, "Pfoo", "{PLAIN}pass\tuid=1", 1000, TRUE);
+	auth_cache_shared_insert(shared, "Pbar", "", 2000, FALSE);
+	test_assert(test_lookup(shared, "Pfoo", "{PLAIN}pass\tuid=1", 1000, TRUE));
+	test_assert(test_lookup(shared, "Pbar", "", 2000, FALSE));
+	test_assert(test_lookup(shared, "Pbaz", NULL, 0, FALSE));
+
+	/* replace */
+	auth_cache_shared_insert(shared, "Pfoo", "{PLAIN}pass2", 3000, FALSE);
+	test_assert(test_lookup(shared, "Pfoo", "{PLAIN}pass2", 3000, FALSE));
+
+	/* remove */
+	auth_cache_shared_remove(shared, "Pfoo");
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	test_assert(test_lookup(shared, "Pbar", "", 2000, FALSE));
+	auth_cache_shared_remove(shared, "Pnonexistent");
+
+	auth_cache_shared_close(&shared);
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+static void test_auth_cache_shared_too_large(void)
+{
+	struct auth_cache_shared *shared;
+	string_t *value = t_str_new(1024);
+
+	test_begin("auth cache shared too large entry");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+
+	while (str_len(value) < 1000)
+		str_append(value, "0123456789");
+	auth_cache_shared_insert(shared, "Pbig", str_c(value), 1000, TRUE);
+	test_assert(test_lookup(shared, "Pbig", NULL, 0, FALSE));
+
+	auth_cache_shared_close(&shared);
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+static void test_auth_cache_shared_many(void)
+{
+	struct auth_cache_shared *shared;
+	unsigned int i, found = 0;
+
+	test_begin("auth cache shared many entries");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+
+	/* insert more entries than fit: the most recent ones must
+	   always be found */
+	for (i = 0; i < 2000; i++) T_BEGIN {
+		auth_cache_shared_insert(shared, t_strdup_printf("Puser%u", i),
+					 t_strdup_printf("value%u", i),
+					 1000 + i, TRUE);
+		test_assert_idx(test_lookup(shared,
+			t_strdup_printf("Puser%u", i),
+			t_strdup_printf("value%u", i), 1000 + i, TRUE), i);
+	} T_END;
+	for (i = 0; i < 2000; i++) T_BEGIN {
+		if (test_lookup(shared, t_strdup_printf("Puser%u", i),
+				t_strdup_printf("value%u", i), 1000 + i, TRUE))
+			found++;
+	} T_END;
+	test_assert(found > 0 && found <= TEST_SIZE / 512);
+	test_assert(auth_cache_shared_clear(shared) == found);
+	test_assert(test_lookup(shared, "Puser1999", NULL, 0, FALSE));
+
+	auth_cache_shared_close(&shared);
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+static bool test_match_user(const char *key, void *context)
+{
+	const char *username = context;
+
+	return strcmp(key + 1, username) == 0;
+}
+
+static void test_auth_cache_shared_remove_matching(void)
+{
+	struct auth_cache_shared *shared;
+
+	test_begin("auth cache shared remove matching");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+	auth_cache_shared_insert(shared, "Ufoo", "2", 1000, TRUE);
+	auth_cache_shared_insert(shared, "Pbar", "3", 1000, TRUE);
+	test_assert(auth_cache_shared_remove_matching(shared, test_match_user,
+						      (void *)"foo") == 2);
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	test_assert(test_lookup(shared, "Ufoo", NULL, 0, FALSE));
+	test_assert(test_lookup(shared, "Pbar", "3", 1000, TRUE));
+
+	auth_cache_shared_close(&shared);
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+static void test_auth_cache_shared_reopen(void)
+{
+	struct auth_cache_shared *shared, *shared2;
+	struct stat st;
+
+	test_begin("auth cache shared reopen");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+
+	/* a second user of the same file sees the changes immediately */
+	shared2 = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared2 != NULL);
+	test_assert(test_lookup(shared2, "Pfoo", "1", 1000, TRUE));
+	auth_cache_shared_insert(shared2, "Pbar", "2", 1000, TRUE);
+	test_assert(test_lookup(shared, "Pbar", "2", 1000, TRUE));
+	auth_cache_shared_close(&shared2);
+	auth_cache_shared_close(&shared);
+
+	/* the data is kept after all users have closed it */
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+	test_assert(test_lookup(shared, "Pfoo", "1", 1000, TRUE));
+	auth_cache_shared_close(&shared);
+
+	/* different size recreates the file */
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE*2, 1);
+	test_assert(shared != NULL);
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	test_assert(stat(TEST_PATH, &st) == 0 &&
+		    st.st_size > TEST_SIZE && st.st_size <= TEST_SIZE*2);
+	auth_cache_shared_close(&shared);
+
+	/* so does a corrupted file */
+	test_assert(truncate(TEST_PATH, 0) == 0);
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+	test_assert(test_lookup(shared, "Pfoo", "1", 1000, TRUE));
+	auth_cache_shared_close(&shared);
+
+	/* so does a changed configuration */
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 2);
+	test_assert(shared != NULL);
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+	auth_cache_shared_close(&shared);
+
+	/* and a file that others can access */
+	test_assert(chmod(TEST_PATH, 0640) == 0);
+	test_expect_errors(1);
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 2);
+	test_expect_no_more_errors();
+	test_assert(shared != NULL);
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	test_assert(stat(TEST_PATH, &st) == 0 && (st.st_mode & 0777) == 0600);
+	auth_cache_shared_close(&shared);
+
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+static void test_auth_cache_shared_stale_lock(void)
+{
+	struct auth_cache_shared *shared;
+	struct stat st;
+	uint64_t seq;
+	off_t offset;
+	int fd;
+
+	test_begin("auth cache shared stale lock");
+	test_auth_cache_shared_init();
+	shared = auth_cache_shared_open(TEST_PATH, TEST_SIZE, 1);
+	test_assert(shared != NULL);
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+
+	/* writers died while modifying the slots */
+	ioloop_time = 1000000;
+	seq = ((uint64_t)ioloop_time << 32) | 1;
+	fd = open(TEST_PATH, O_RDWR);
+	test_assert(fd != -1 && fstat(fd, &st) == 0);
+	for (offset = 512; offset < st.st_size; offset += 512)
+		test_assert(pwrite(fd, &seq, sizeof(seq), offset) == sizeof(seq));
+	i_close_fd(&fd);
+
+	/* they may just be slow */
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	auth_cache_shared_insert(shared, "Pbar", "2", 1000, TRUE);
+	test_assert(test_lookup(shared, "Pbar", NULL, 0, FALSE));
+
+	/* after a while the slots are taken over and the half-written
+	   entries are dropped */
+	ioloop_time += 3600;
+	test_assert(test_lookup(shared, "Pfoo", NULL, 0, FALSE));
+	auth_cache_shared_insert(shared, "Pfoo", "1", 1000, TRUE);
+	auth_cache_shared_insert(shared, "Pbar", "2", 1000, TRUE);
+	test_assert(test_lookup(shared, "Pfoo", "1", 1000, TRUE));
+	test_assert(test_lookup(shared, "Pbar", "2", 1000, TRUE));
+
+	auth_cache_shared_close(&shared);
+	test_auth_cache_shared_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_auth_cache_shared_insert_lookup,
+		test_auth_cache_shared_too_large,
+		test_auth_cache_shared_many,
+		test_auth_cache_shared_remove_matching,
+		test_auth_cache_shared_reopen,
+		test_auth_cache_shared_stale_lock,
+		NULL
+	};
+	return test_run(test_functions);
+}
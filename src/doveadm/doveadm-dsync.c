@@ -384,6 +384,10 @@ cmd_dsync_run_local(struct dsync_cmd_context *ctx, struct mail_user *user,
 	}
 
 	brain2 = dsync_brain_slave_init(user2, ibc2, TRUE, "");
+	dsync_brain_set_mail_request_window(brain2,
+		doveadm_settings->dsync_mail_request_window);
+	dsync_brain_set_copy_local_mails(brain2,
+		doveadm_settings->dsync_copy_local_mails);
 	mail_user_unref(&user2);
 
 	brain1_running = brain2_running = TRUE;
@@ -499,7 +503,8 @@ cmd_dsync_icb_stream_init(struct dsync_cmd_context *ctx,
 	i_stream_ref(ctx->input);
 	o_stream_ref(ctx->output);
 	return dsync_ibc_init_stream(ctx->input, ctx->output,
-				     name, temp_prefix, ctx->io_timeout_secs);
+				     name, temp_prefix, ctx->io_timeout_secs,
+				     doveadm_settings->dsync_send_buffer_size);
 }
 
 static void
@@ -626,6 +631,10 @@ cmd_dsync_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 	child_wait_init();
 	brain = dsync_brain_master_init(user, ibc, ctx->sync_type,
 					brain_flags, &set);
+	dsync_brain_set_mail_request_window(brain,
+		doveadm_settings->dsync_mail_request_window);
+	dsync_brain_set_copy_local_mails(brain,
+		doveadm_settings->dsync_copy_local_mails);
 
 	switch (ctx->run_type) {
 	case DSYNC_RUN_TYPE_LOCAL:
@@ -1117,6 +1126,10 @@ cmd_dsync_server_run(struct doveadm_mail_cmd_context *_ctx,
 
 	ibc = cmd_dsync_icb_stream_init(ctx, name, str_c(temp_prefix));
 	brain = dsync_brain_slave_init(user, ibc, FALSE, process_title_prefix);
+	dsync_brain_set_mail_request_window(brain,
+		doveadm_settings->dsync_mail_request_window);
+	dsync_brain_set_copy_local_mails(brain,
+		doveadm_settings->dsync_copy_local_mails);
 
 	io_loop_run(current_ioloop);
 
@@ -0,0 +1,186 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-index.h"
+#include "mail-cache.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mail-search.h"
+#include "doveadm-print.h"
+#include "doveadm-util.h"
+#include "doveadm-mail.h"
+#include "doveadm-mailbox-list-iter.h"
+
+struct cache_decision_cmd_context {
+	struct doveadm_mail_cmd_context ctx;
+	struct mail_search_args *search_args;
+};
+
+static const char *cache_decision2str(enum mail_cache_decision_type type)
+{
+	const char *str;
+
+	switch (type & ~MAIL_CACHE_DECISION_FORCED) {
+	case MAIL_CACHE_DECISION_NO:
+		str = "no";
+		break;
+	case MAIL_CACHE_DECISION_TEMP:
+		str = "temp";
+		break;
+	case MAIL_CACHE_DECISION_YES:
+		str = "yes";
+		break;
+	default:
+		return t_strdup_printf("0x%x", type);
+	}
+
+	if ((type & MAIL_CACHE_DECISION_FORCED) != 0)
+		str = t_strconcat(str, "-forced", NULL);
+	return str;
+}
+
+static const char *cache_cost2str(enum mail_cache_field_cost cost)
+{
+	switch (cost) {
+	case MAIL_CACHE_FIELD_COST_METADATA:
+		return "metadata";
+	case MAIL_CACHE_FIELD_COST_DEFAULT:
+	case MAIL_CACHE_FIELD_COST_HEADER:
+		return "header";
+	case MAIL_CACHE_FIELD_COST_BODY:
+		return "body";
+	}
+	return t_strdup_printf("%d", cost);
+}
+
+static int
+cache_decision_mailbox(struct cache_decision_cmd_context *ctx,
+		       const struct mailbox_info *info)
+{
+	struct mailbox *box;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	const struct mail_cache_field *fields;
+	struct mail_cache_field_usage *usage;
+	unsigned int i, count;
+	int ret = 0;
+
+	box = doveadm_mailbox_find(ctx->ctx.cur_mail_user, info->vname);
+	if (mailbox_open(box) < 0 || mailbox_sync(box, 0) < 0) {
+		i_error("Mailbox %s: Failed to open mailbox: %s",
+			mailbox_get_vname(box),
+			mailbox_get_last_error(box, NULL));
+		doveadm_mail_failed_mailbox(&ctx->ctx, box);
+		mailbox_free(&box);
+		return -1;
+	}
+
+	view = mail_index_view_open(box->index);
+	cache_view = mail_cache_view_open(box->cache, view);
+	fields = mail_cache_register_get_list(box->cache,
+					      pool_datastack_create(), &count);
+	usage = t_new(struct mail_cache_field_usage, count);
+	if (mail_cache_get_field_usage(cache_view, usage, count) < 0) {
+		i_error("Mailbox %s: Failed to read cache file",
+			mailbox_get_vname(box));
+		doveadm_mail_failed_error(&ctx->ctx, MAIL_ERROR_TEMP);
+		ret = -1;
+	} else {
+		for (i = 0; i < count; i++) {
+			if (fields[i].decision == MAIL_CACHE_DECISION_NO &&
+			    usage[i].messages == 0)
+				continue;
+
+			doveadm_print(mailbox_get_vname(box));
+			doveadm_print(fields[i].name);
+			doveadm_print(cache_decision2str(fields[i].decision));
+			doveadm_print(fields[i].last_used == 0 ? "" :
+				      unixdate2str(fields[i].last_used));
+			doveadm_print(cache_cost2str(fields[i].cost));
+			doveadm_print_num(usage[i].messages);
+			doveadm_print_num(usage[i].bytes);
+		}
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	mailbox_free(&box);
+	return ret;
+}
+
+static int
+cmd_mailbox_cache_decision_run(struct doveadm_mail_cmd_context *_ctx,
+			       struct mail_user *user)
+{
+	struct cache_decision_cmd_context *ctx =
+		(struct cache_decision_cmd_context *)_ctx;
+	enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct doveadm_mailbox_list_iter *iter;
+	const struct mailbox_info *info;
+	int ret = 0;
+
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, ctx->search_args,
+					      iter_flags);
+	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+		T_BEGIN {
+			if (cache_decision_mailbox(ctx, info) < 0)
+				ret = -1;
+		} T_END;
+	}
+	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static void
+cmd_mailbox_cache_decision_init(struct doveadm_mail_cmd_context *_ctx,
+				const char *const args[])
+{
+	struct cache_decision_cmd_context *ctx =
+		(struct cache_decision_cmd_context *)_ctx;
+
+	if (args[0] == NULL)
+		doveadm_mail_help_name("mailbox cache decision");
+	ctx->search_args = doveadm_mail_mailbox_search_args_build(args);
+
+	doveadm_print_header_simple("mailbox");
+	doveadm_print_header_simple("field");
+	doveadm_print_header_simple("decision");
+	doveadm_print_header_simple("last-used");
+	doveadm_print_header_simple("cost");
+	doveadm_print_header_simple("messages");
+	doveadm_print_header_simple("bytes");
+}
+
+static void
+cmd_mailbox_cache_decision_deinit(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct cache_decision_cmd_context *ctx =
+		(struct cache_decision_cmd_context *)_ctx;
+
+	if (ctx->search_args != NULL)
+		mail_search_args_unref(&ctx->search_args);
+}
+
+static struct doveadm_mail_cmd_context *cmd_mailbox_cache_decision_alloc(void)
+{
+	struct cache_decision_cmd_context *ctx;
+
+	ctx = doveadm_mail_cmd_alloc(struct cache_decision_cmd_context);
+	ctx->ctx.v.init = cmd_mailbox_cache_decision_init;
+	ctx->ctx.v.deinit = cmd_mailbox_cache_decision_deinit;
+	ctx->ctx.v.run = cmd_mailbox_cache_decision_run;
+	doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+	return &ctx->ctx;
+}
+
+struct doveadm_cmd_ver2 doveadm_cmd_mailbox_cache_decision_ver2 = {
+	.name = "mailbox cache decision",
+	.mail_cmd = cmd_mailbox_cache_decision_alloc,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"<mailbox> [...]",
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('\0', "mailbox-mask", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
+DOVEADM_CMD_PARAMS_END
+};
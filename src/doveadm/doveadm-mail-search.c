@@ -1,17 +1,46 @@
 /* Copyright (c) 2010-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "fd-set-nonblock.h"
+#include "mail-namespace.h"
 #include "mail-storage.h"
+#include "mail-storage-service.h"
 #include "doveadm-print.h"
 #include "doveadm-mailbox-list-iter.h"
 #include "doveadm-mail-iter.h"
 #include "doveadm-mail.h"
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct search_cmd_context {
+	struct doveadm_mail_cmd_context ctx;
+	unsigned int process_count;
+
+	/* parallel search state */
+	unsigned int running_count;
+};
+
+struct search_worker {
+	struct search_cmd_context *ctx;
+	pid_t pid;
+	struct istream *input;
+	struct io *io;
+};
 
 static int
 cmd_search_box(struct doveadm_mail_cmd_context *ctx,
-	       const struct mailbox_info *info)
+	       const struct mailbox_info *info, struct ostream *output)
 {
 	struct doveadm_mail_iter *iter;
 	struct mailbox *box;
@@ -34,10 +63,18 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 	} else {
 		guid_str = guid_128_to_string(metadata.guid);
 		while (doveadm_mail_iter_next(iter, &mail)) {
-			doveadm_print(guid_str);
-			T_BEGIN {
-				doveadm_print(dec2str(mail->uid));
-			} T_END;
+			if (output != NULL) {
+				/* we're a parallel search worker */
+				T_BEGIN {
+					o_stream_nsend_str(output, t_strdup_printf(
+						"%s\t%u\n", guid_str, mail->uid));
+				} T_END;
+			} else {
+				doveadm_print(guid_str);
+				T_BEGIN {
+					doveadm_print(dec2str(mail->uid));
+				} T_END;
+			}
 		}
 	}
 	if (doveadm_mail_iter_deinit(&iter) < 0)
@@ -45,27 +82,231 @@ cmd_search_box(struct doveadm_mail_cmd_context *ctx,
 	return ret;
 }
 
+static void ATTR_NORETURN
+cmd_search_worker_run(struct search_cmd_context *ctx,
+		      const ARRAY_TYPE(const_string) *vnames,
+		      unsigned int *next_idx, int fd)
+{
+	struct mail_user *user;
+	struct ostream *output;
+	struct mailbox_info info;
+	const char *const *vnamep;
+	unsigned int idx;
+	int ret = 0;
+
+	/* the parent's ioloop and mail_user may have fds and connections
+	   that we can't share, so use our own */
+	(void)io_loop_create();
+	output = o_stream_create_fd_autoclose(&fd, 0);
+	if (mail_storage_service_next(ctx->ctx.storage_service,
+				      ctx->ctx.cur_service_user, &user) < 0)
+		_exit(EX_TEMPFAIL);
+
+	while (!doveadm_is_killed()) {
+		idx = __atomic_fetch_add(next_idx, 1, __ATOMIC_RELAXED);
+		if (idx >= array_count(vnames))
+			break;
+		vnamep = array_idx(vnames, idx);
+
+		memset(&info, 0, sizeof(info));
+		info.vname = *vnamep;
+		info.ns = mail_namespace_find(user->namespaces, info.vname);
+		T_BEGIN {
+			if (cmd_search_box(&ctx->ctx, &info, output) < 0)
+				ret = -1;
+		} T_END;
+	}
+	if (o_stream_nfinish(output) < 0) {
+		i_error("write(search output) failed: %s",
+			o_stream_get_error(output));
+		ret = -1;
+	}
+	if (ctx->ctx.exit_code != 0)
+		_exit(ctx->ctx.exit_code);
+	_exit(ret < 0 ? EX_TEMPFAIL : 0);
+}
+
+static void cmd_search_worker_input(struct search_worker *worker)
+{
+	const char *line, *p;
+
+	while ((line = i_stream_read_next_line(worker->input)) != NULL) {
+		p = strchr(line, '\t');
+		if (p == NULL) {
+			i_error("Search worker sent invalid input: %s", line);
+			continue;
+		}
+		T_BEGIN {
+			doveadm_print(t_strdup_until(line, p));
+			doveadm_print(p + 1);
+		} T_END;
+	}
+	if (worker->input->stream_errno != 0) {
+		i_error("read(search worker) failed: %s",
+			i_stream_get_error(worker->input));
+	} else if (!worker->input->eof) {
+		return;
+	}
+	io_remove(&worker->io);
+	i_stream_destroy(&worker->input);
+	if (--worker->ctx->running_count == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void cmd_search_worker_wait(struct search_worker *worker)
+{
+	struct doveadm_mail_cmd_context *ctx = &worker->ctx->ctx;
+	int status;
+
+	if (waitpid(worker->pid, &status, 0) < 0) {
+		i_error("waitpid(%s) failed: %m", dec2str(worker->pid));
+		doveadm_mail_failed_error(ctx, MAIL_ERROR_TEMP);
+	} else if (WIFSIGNALED(status)) {
+		i_error("Search worker %s was killed with signal %d",
+			dec2str(worker->pid), WTERMSIG(status));
+		doveadm_mail_failed_error(ctx, MAIL_ERROR_TEMP);
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		if (ctx->exit_code == 0 || WEXITSTATUS(status) == EX_TEMPFAIL)
+			ctx->exit_code = WEXITSTATUS(status);
+	}
+}
+
 static int
-cmd_search_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
+cmd_search_run_parallel(struct search_cmd_context *ctx,
+			const ARRAY_TYPE(const_string) *vnames)
 {
+	struct search_worker *workers, *worker;
+	struct ioloop *ioloop;
+	unsigned int i, j, count, started, *next_idx;
+	int fd[2];
+	pid_t pid;
+
+	count = I_MIN(ctx->process_count, array_count(vnames));
+	/* the workers take the next mailbox from the shared index as soon
+	   as they're finished with the previous one, so a few large
+	   mailboxes don't leave the other workers idle. */
+	next_idx = mmap(NULL, sizeof(*next_idx), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next_idx == MAP_FAILED) {
+		i_error("mmap(anonymous) failed: %m");
+		return -1;
+	}
+	*next_idx = 0;
+
+	ioloop = io_loop_create();
+	workers = t_new(struct search_worker, count);
+	for (started = 0; started < count; started++) {
+		if (pipe(fd) < 0) {
+			i_error("pipe() failed: %m");
+			break;
+		}
+		if ((pid = fork()) < 0) {
+			i_error("fork() failed: %m");
+			i_close_fd(&fd[0]);
+			i_close_fd(&fd[1]);
+			break;
+		}
+		if (pid == 0) {
+			i_close_fd(&fd[0]);
+			for (j = 0; j < started; j++) {
+				if (close(i_stream_get_fd(workers[j].input)) < 0)
+					i_error("close(search worker) failed: %m");
+			}
+			cmd_search_worker_run(ctx, vnames, next_idx, fd[1]);
+		}
+		i_close_fd(&fd[1]);
+		fd_set_nonblock(fd[0], TRUE);
+
+		worker = &workers[started];
+		worker->ctx = ctx;
+		worker->pid = pid;
+		worker->input = i_stream_create_fd_autoclose(&fd[0], (size_t)-1);
+		worker->io = io_add(i_stream_get_fd(worker->input), IO_READ,
+				    cmd_search_worker_input, worker);
+	}
+	ctx->running_count = started;
+	if (started > 0)
+		io_loop_run(ioloop);
+	io_loop_destroy(&ioloop);
+
+	for (i = 0; i < started; i++)
+		cmd_search_worker_wait(&workers[i]);
+	if (munmap(next_idx, sizeof(*next_idx)) < 0)
+		i_error("munmap(anonymous) failed: %m");
+	return started == 0 ? -1 : 0;
+}
+
+static int
+cmd_search_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
 	const enum mailbox_list_iter_flags iter_flags =
 		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
 		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
 	struct doveadm_mailbox_list_iter *iter;
 	const struct mailbox_info *info;
+	ARRAY_TYPE(const_string) vnames;
+	const char *vname, *const *vnamep;
 	int ret = 0;
 
-	iter = doveadm_mailbox_list_iter_init(ctx, user, ctx->search_args,
+	iter = doveadm_mailbox_list_iter_init(_ctx, user, _ctx->search_args,
 					      iter_flags);
-	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) T_BEGIN {
-		if (cmd_search_box(ctx, info) < 0)
+	if (ctx->process_count <= 1) {
+		while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) T_BEGIN {
+			if (cmd_search_box(_ctx, info, NULL) < 0)
+				ret = -1;
+		} T_END;
+		if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
 			ret = -1;
-	} T_END;
+		return ret;
+	}
+
+	/* get the full list of mailboxes first, so the workers can
+	   share it */
+	t_array_init(&vnames, 64);
+	while ((info = doveadm_mailbox_list_iter_next(iter)) != NULL) {
+		vname = t_strdup(info->vname);
+		array_append(&vnames, &vname, 1);
+	}
 	if (doveadm_mailbox_list_iter_deinit(&iter) < 0)
 		ret = -1;
+
+	if (array_count(&vnames) > 1) {
+		if (cmd_search_run_parallel(ctx, &vnames) == 0)
+			return _ctx->exit_code != 0 ? -1 : ret;
+		/* couldn't start any workers - do it ourself */
+	}
+	array_foreach(&vnames, vnamep) T_BEGIN {
+		struct mailbox_info box_info;
+
+		memset(&box_info, 0, sizeof(box_info));
+		box_info.vname = *vnamep;
+		box_info.ns = mail_namespace_find(user->namespaces, *vnamep);
+		if (cmd_search_box(_ctx, &box_info, NULL) < 0)
+			ret = -1;
+	} T_END;
 	return ret;
 }
 
+static bool
+cmd_search_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
+{
+	struct search_cmd_context *ctx = (struct search_cmd_context *)_ctx;
+
+	switch (c) {
+	case 'p':
+		if (str_to_uint(optarg, &ctx->process_count) < 0 ||
+		    ctx->process_count == 0) {
+			i_fatal_status(EX_USAGE,
+				"Invalid -p parameter number: %s", optarg);
+		}
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static void cmd_search_init(struct doveadm_mail_cmd_context *ctx,
 			    const char *const args[])
 {
@@ -82,21 +323,25 @@ static void cmd_search_init(struct doveadm_mail_cmd_context *ctx,
 
 static struct doveadm_mail_cmd_context *cmd_search_alloc(void)
 {
-	struct doveadm_mail_cmd_context *ctx;
+	struct search_cmd_context *ctx;
 
-	ctx = doveadm_mail_cmd_alloc(struct doveadm_mail_cmd_context);
-	ctx->v.init = cmd_search_init;
-	ctx->v.run = cmd_search_run;
+	ctx = doveadm_mail_cmd_alloc(struct search_cmd_context);
+	ctx->process_count = 1;
+	ctx->ctx.getopt_args = "p:";
+	ctx->ctx.v.parse_arg = cmd_search_parse_arg;
+	ctx->ctx.v.init = cmd_search_init;
+	ctx->ctx.v.run = cmd_search_run;
 	doveadm_print_init(DOVEADM_PRINT_TYPE_FLOW);
-	return ctx;
+	return &ctx->ctx;
 }
 
 struct doveadm_cmd_ver2 doveadm_cmd_search_ver2 = {
 	.name = "search",
 	.mail_cmd = cmd_search_alloc,
-	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "<search query>",
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX "[-p <processes>] <search query>",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('p', "processes", CMD_PARAM_INT64, 0)
 DOVEADM_CMD_PARAM('\0', "query", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 };
@@ -863,6 +863,7 @@ static struct doveadm_cmd_ver2 *mail_commands_ver2[] = {
 	&doveadm_cmd_mailbox_metadata_get_ver2,
 	&doveadm_cmd_mailbox_metadata_list_ver2,
 	&doveadm_cmd_mailbox_status_ver2,
+	&doveadm_cmd_mailbox_cache_decision_ver2,
 	&doveadm_cmd_mailbox_list_ver2,
 	&doveadm_cmd_mailbox_create_ver2,
 	&doveadm_cmd_mailbox_delete_ver2,
@@ -999,7 +1000,12 @@ doveadm_cmd_ver2_to_mail_cmd_wrapper(struct doveadm_cmd_context *cctx)
 		/* Keep all named special parameters above this line */
 
 		} else if (mctx->v.parse_arg != NULL && arg->short_opt != '\0') {
-			optarg = (char*)arg->value.v_string;
+			if (arg->type == CMD_PARAM_INT64) {
+				optarg = (char *)t_strdup_printf("%lld",
+					(long long)arg->value.v_int64);
+			} else {
+				optarg = (char*)arg->value.v_string;
+			}
 			mctx->v.parse_arg(mctx, arg->short_opt);
 		} else if ((arg->flags & CMD_PARAM_FLAG_POSITIONAL) != 0) {
 			/* feed this into pargv */
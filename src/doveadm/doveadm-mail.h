@@ -178,6 +178,7 @@ extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_metadata_unset_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_metadata_get_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_metadata_list_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_status_ver2;
+extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_cache_decision_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_list_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_create_ver2;
 extern struct doveadm_cmd_ver2 doveadm_cmd_mailbox_delete_ver2;
@@ -67,6 +67,9 @@ static const struct setting_define doveadm_setting_defines[] = {
 	DEF(SET_STR, doveadm_allowed_commands),
 	DEF(SET_STR, dsync_alt_char),
 	DEF(SET_STR, dsync_remote_cmd),
+	DEF(SET_UINT, dsync_mail_request_window),
+	DEF(SET_SIZE, dsync_send_buffer_size),
+	DEF(SET_BOOL, dsync_copy_local_mails),
 	DEF(SET_STR, ssl_client_ca_dir),
 	DEF(SET_STR, ssl_client_ca_file),
 	DEF(SET_STR, director_username_hash),
@@ -92,6 +95,9 @@ const struct doveadm_settings doveadm_default_settings = {
 	.doveadm_allowed_commands = "",
 	.dsync_alt_char = "_",
 	.dsync_remote_cmd = "ssh -l%{login} %{host} doveadm dsync-server -u%u -U",
+	.dsync_mail_request_window = 100,
+	.dsync_send_buffer_size = 128*1024,
+	.dsync_copy_local_mails = FALSE,
 	.ssl_client_ca_dir = "",
 	.ssl_client_ca_file = "",
 	.director_username_hash = "%Lu",
@@ -142,6 +148,10 @@ static bool doveadm_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 		*error_r = "dsync_alt_char must not be empty";
 		return FALSE;
 	}
+	if (set->dsync_send_buffer_size == 0) {
+		*error_r = "dsync_send_buffer_size must not be 0";
+		return FALSE;
+	}
 	return TRUE;
 }
 /* </settings checks> */
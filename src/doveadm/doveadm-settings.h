@@ -18,6 +18,9 @@ struct doveadm_settings {
 	const char *doveadm_allowed_commands;
 	const char *dsync_alt_char;
 	const char *dsync_remote_cmd;
+	unsigned int dsync_mail_request_window;
+	uoff_t dsync_send_buffer_size;
+	bool dsync_copy_local_mails;
 	const char *ssl_client_ca_dir;
 	const char *ssl_client_ca_file;
 	const char *director_username_hash;
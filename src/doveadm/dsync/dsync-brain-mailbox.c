@@ -223,6 +223,7 @@ dsync_brain_sync_mailbox_init_remote(struct dsync_brain *brain,
 
 	brain->box_importer = brain->backup_send ? NULL :
 		dsync_mailbox_import_init(brain->box, brain->virtual_all_box,
+					  brain->local_guid_index,
 					  brain->log_scan,
 					  last_common_uid, last_common_modseq,
 					  last_common_pvt_modseq,
@@ -326,6 +327,7 @@ int dsync_brain_sync_mailbox_open(struct dsync_brain *brain,
 	brain->box_exporter = brain->backup_recv ? NULL :
 		dsync_mailbox_export_init(brain->box, brain->log_scan,
 					  last_common_uid,
+					  brain->mail_request_window,
 					  exporter_flags);
 	dsync_brain_sync_mailbox_init_remote(brain, remote_dsync_box);
 	return 1;
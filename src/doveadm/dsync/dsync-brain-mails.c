@@ -184,6 +184,7 @@ static bool dsync_brain_recv_mail_request(struct dsync_brain *brain)
 	if ((ret = dsync_ibc_recv_mail_request(brain->ibc, &request)) == 0)
 		return FALSE;
 	if (ret == DSYNC_IBC_RECV_RET_FINISHED) {
+		dsync_mailbox_export_mail_requests_finished(brain->box_exporter);
 		brain->box_recv_state = brain->box_importer != NULL ?
 			DSYNC_BOX_STATE_MAILS :
 			DSYNC_BOX_STATE_RECV_LAST_COMMON;
@@ -288,20 +289,21 @@ static bool dsync_brain_recv_mail(struct dsync_brain *brain)
 static bool dsync_brain_send_mail(struct dsync_brain *brain)
 {
 	const struct dsync_mail *mail;
+	int ret;
 
-	if (brain->mail_requests &&
-	    brain->box_recv_state < DSYNC_BOX_STATE_MAILS) {
-		/* wait for mail requests to finish. we could already start
-		   exporting, but then we're going to do quite a lot of
-		   separate searches. especially with pipe backend we'd do
-		   a separate search for each mail. */
-		return FALSE;
-	}
-
-	while (dsync_mailbox_export_next_mail(brain->box_exporter, &mail) > 0) {
+	/* with mail requests the mails are exported in batches while the
+	   requests are still coming, so the remote doesn't have to wait for
+	   a full round trip before it starts receiving them. */
+	while ((ret = dsync_mailbox_export_next_mail(brain->box_exporter,
+						     &mail)) > 0) {
 		if (dsync_ibc_send_mail(brain->ibc, mail) == 0)
 			return TRUE;
 	}
+	if (ret == 0 && brain->mail_requests &&
+	    brain->box_recv_state < DSYNC_BOX_STATE_MAILS) {
+		/* wait for more mail requests */
+		return FALSE;
+	}
 
 	if (dsync_brain_export_deinit(brain) < 0)
 		return TRUE;
@@ -62,6 +62,7 @@ struct dsync_brain {
 	char alt_char;
 
 	unsigned int lock_timeout;
+	unsigned int mail_request_window;
 	int lock_fd;
 	const char *lock_path;
 	struct file_lock *lock;
@@ -77,6 +78,7 @@ struct dsync_brain {
 	unsigned int proctitle_update_counter;
 
 	struct dsync_transaction_log_scan *log_scan;
+	struct dsync_guid_index *local_guid_index;
 	struct dsync_mailbox_importer *box_importer;
 	struct dsync_mailbox_exporter *box_exporter;
 
@@ -13,6 +13,7 @@
 #include "dsync-mailbox-tree.h"
 #include "dsync-ibc.h"
 #include "dsync-brain-private.h"
+#include "dsync-guid-index.h"
 #include "dsync-mailbox-import.h"
 #include "dsync-mailbox-export.h"
 
@@ -118,6 +119,7 @@ dsync_brain_common_init(struct mail_user *user, struct dsync_ibc *ibc)
 	brain->ibc = ibc;
 	brain->sync_type = DSYNC_BRAIN_SYNC_TYPE_UNKNOWN;
 	brain->lock_fd = -1;
+	brain->mail_request_window = DSYNC_BRAIN_DEFAULT_MAIL_REQUEST_WINDOW;
 	brain->verbose_proctitle = service_set->verbose_proctitle;
 	hash_table_create(&brain->mailbox_states, pool, 0,
 			  guid_128_hash, guid_128_cmp);
@@ -276,6 +278,50 @@ dsync_brain_slave_init(struct mail_user *user, struct dsync_ibc *ibc,
 	return brain;
 }
 
+void dsync_brain_set_mail_request_window(struct dsync_brain *brain,
+					 unsigned int count)
+{
+	brain->mail_request_window = count;
+}
+
+static void
+dsync_brain_fill_local_guid_index(struct dsync_guid_index *index,
+				  void *context)
+{
+	struct dsync_brain *brain = context;
+	struct dsync_mailbox_tree_iter *iter;
+	struct dsync_mailbox_node *node;
+	struct mailbox *box;
+	const char *vname, *errstr;
+	enum mail_error error;
+
+	iter = dsync_mailbox_tree_iter_init(brain->local_mailbox_tree);
+	while (dsync_mailbox_tree_iter_next(iter, &vname, &node)) {
+		if (node->existence != DSYNC_MAILBOX_NODE_EXISTS ||
+		    dsync_mailbox_node_is_dir(node))
+			continue;
+		if (dsync_brain_mailbox_alloc(brain, node->mailbox_guid,
+					      &box, &errstr, &error) <= 0) {
+			/* it'll just be skipped */
+			continue;
+		}
+		(void)dsync_guid_index_add_mailbox(index, box);
+	}
+	dsync_mailbox_tree_iter_deinit(&iter);
+}
+
+void dsync_brain_set_copy_local_mails(struct dsync_brain *brain, bool set)
+{
+	if (!set) {
+		if (brain->local_guid_index != NULL)
+			dsync_guid_index_deinit(&brain->local_guid_index);
+	} else if (brain->local_guid_index == NULL) {
+		brain->local_guid_index =
+			dsync_guid_index_init(dsync_brain_fill_local_guid_index,
+					      brain);
+	}
+}
+
 static void dsync_brain_purge(struct dsync_brain *brain)
 {
 	struct mail_namespace *ns;
@@ -320,6 +366,8 @@ int dsync_brain_deinit(struct dsync_brain **_brain, enum mail_error *error_r)
 		dsync_brain_sync_mailbox_deinit(brain);
 	if (brain->virtual_all_box != NULL)
 		mailbox_free(&brain->virtual_all_box);
+	if (brain->local_guid_index != NULL)
+		dsync_guid_index_deinit(&brain->local_guid_index);
 	if (brain->local_tree_iter != NULL)
 		dsync_mailbox_tree_iter_deinit(&brain->local_tree_iter);
 	if (brain->local_mailbox_tree != NULL)
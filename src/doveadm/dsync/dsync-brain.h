@@ -8,6 +8,8 @@ struct mail_namespace;
 struct mail_user;
 struct dsync_ibc;
 
+#define DSYNC_BRAIN_DEFAULT_MAIL_REQUEST_WINDOW 100
+
 enum dsync_brain_flags {
 	DSYNC_BRAIN_FLAG_SEND_MAIL_REQUESTS	= 0x01,
 	DSYNC_BRAIN_FLAG_BACKUP_SEND		= 0x02,
@@ -85,6 +87,18 @@ dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 struct dsync_brain *
 dsync_brain_slave_init(struct mail_user *user, struct dsync_ibc *ibc,
 		       bool local, const char *process_title_prefix);
+/* Start sending mails as soon as the remote has requested this many of them
+   (default DSYNC_BRAIN_DEFAULT_MAIL_REQUEST_WINDOW), instead of waiting for
+   the whole list of requests first. */
+void dsync_brain_set_mail_request_window(struct dsync_brain *brain,
+					 unsigned int count);
+/* Before requesting a mail from remote, look it up by its GUID from all the
+   local mailboxes and copy it from there if found. This avoids transferring
+   the mails again after they were moved to another mailbox, as long as the
+   destination mailbox is synced before the source mailbox's expunges.
+   Looking up the GUIDs requires going through all the mails in all the
+   mailboxes once. */
+void dsync_brain_set_copy_local_mails(struct dsync_brain *brain, bool set);
 /* Returns 0 if everything was successful, -1 if syncing failed in some way */
 int dsync_brain_deinit(struct dsync_brain **brain, enum mail_error *error_r);
 
@@ -0,0 +1,167 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "mail-storage.h"
+#include "mail-search-build.h"
+#include "dsync-guid-index.h"
+
+struct dsync_guid_index_mailbox {
+	struct mailbox *box;
+};
+
+struct dsync_guid_index_mail {
+	unsigned int box_idx;
+	uint32_t uid;
+};
+
+struct dsync_guid_index {
+	pool_t pool;
+	dsync_guid_index_fill_callback_t *callback;
+	void *context;
+
+	ARRAY(struct dsync_guid_index_mailbox) mailboxes;
+	/* GUID => struct dsync_guid_index_mail */
+	HASH_TABLE(char *, struct dsync_guid_index_mail *) guids;
+
+	/* Only the mailbox used by the last lookup is kept open */
+	unsigned int cur_box_idx;
+	struct mailbox_transaction_context *cur_trans;
+	struct mail *cur_mail;
+
+	unsigned int filled:1;
+};
+
+struct dsync_guid_index *
+dsync_guid_index_init(dsync_guid_index_fill_callback_t *callback,
+		      void *context)
+{
+	struct dsync_guid_index *index;
+	pool_t pool;
+
+	pool = pool_alloconly_create(MEMPOOL_GROWING"dsync guid index", 10240);
+	index = p_new(pool, struct dsync_guid_index, 1);
+	index->pool = pool;
+	index->callback = callback;
+	index->context = context;
+	p_array_init(&index->mailboxes, pool, 16);
+	hash_table_create(&index->guids, pool, 0, str_hash, strcmp);
+	return index;
+}
+
+static void dsync_guid_index_close_cur(struct dsync_guid_index *index)
+{
+	const struct dsync_guid_index_mailbox *ibox;
+
+	if (index->cur_trans == NULL)
+		return;
+
+	ibox = array_idx(&index->mailboxes, index->cur_box_idx);
+	mail_free(&index->cur_mail);
+	(void)mailbox_transaction_commit(&index->cur_trans);
+	mailbox_close(ibox->box);
+}
+
+void dsync_guid_index_deinit(struct dsync_guid_index **_index)
+{
+	struct dsync_guid_index *index = *_index;
+	struct dsync_guid_index_mailbox *ibox;
+
+	*_index = NULL;
+
+	dsync_guid_index_close_cur(index);
+	array_foreach_modifiable(&index->mailboxes, ibox)
+		mailbox_free(&ibox->box);
+	hash_table_destroy(&index->guids);
+	pool_unref(&index->pool);
+}
+
+int dsync_guid_index_add_mailbox(struct dsync_guid_index *index,
+				 struct mailbox *box)
+{
+	struct dsync_guid_index_mailbox *ibox;
+	struct dsync_guid_index_mail *imail;
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
+	struct mail *mail;
+	const char *guid;
+	unsigned int box_idx = array_count(&index->mailboxes);
+	int ret = 0;
+
+	ibox = array_append_space(&index->mailboxes);
+	ibox->box = box;
+	if (mailbox_open(box) < 0) {
+		i_error("Couldn't open mailbox %s: %s",
+			mailbox_get_vname(box),
+			mailbox_get_last_error(box, NULL));
+		return -1;
+	}
+
+	trans = mailbox_transaction_begin(box, 0);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 MAIL_FETCH_GUID, NULL);
+	mail_search_args_unref(&search_args);
+
+	while (mailbox_search_next(search_ctx, &mail)) {
+		if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) < 0 ||
+		    *guid == '\0') {
+			/* ignore errors */
+			continue;
+		}
+		if (hash_table_lookup(index->guids, guid) != NULL)
+			continue;
+
+		imail = p_new(index->pool, struct dsync_guid_index_mail, 1);
+		imail->box_idx = box_idx;
+		imail->uid = mail->uid;
+		hash_table_insert(index->guids, p_strdup(index->pool, guid),
+				  imail);
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0) {
+		i_error("Couldn't search mailbox %s: %s",
+			mailbox_get_vname(box),
+			mailbox_get_last_error(box, NULL));
+		ret = -1;
+	}
+	(void)mailbox_transaction_commit(&trans);
+	/* don't keep all the mailboxes open */
+	mailbox_close(box);
+	return ret;
+}
+
+bool dsync_guid_index_lookup(struct dsync_guid_index *index, const char *guid,
+			     struct mail **mail_r, uint32_t *uid_r)
+{
+	const struct dsync_guid_index_mailbox *ibox;
+	struct dsync_guid_index_mail *imail;
+
+	if (!index->filled) {
+		index->filled = TRUE;
+		index->callback(index, index->context);
+	}
+
+	imail = hash_table_lookup(index->guids, guid);
+	if (imail == NULL)
+		return FALSE;
+
+	if (index->cur_trans == NULL || index->cur_box_idx != imail->box_idx) {
+		dsync_guid_index_close_cur(index);
+		ibox = array_idx(&index->mailboxes, imail->box_idx);
+		if (mailbox_open(ibox->box) < 0) {
+			i_error("Couldn't open mailbox %s: %s",
+				mailbox_get_vname(ibox->box),
+				mailbox_get_last_error(ibox->box, NULL));
+			return FALSE;
+		}
+		index->cur_box_idx = imail->box_idx;
+		index->cur_trans = mailbox_transaction_begin(ibox->box, 0);
+		index->cur_mail = mail_alloc(index->cur_trans, 0, NULL);
+	}
+	*mail_r = index->cur_mail;
+	*uid_r = imail->uid;
+	return TRUE;
+}
@@ -0,0 +1,30 @@
+#ifndef DSYNC_GUID_INDEX_H
+#define DSYNC_GUID_INDEX_H
+
+struct mail;
+struct mailbox;
+struct dsync_guid_index;
+
+/* Called on the first lookup to add the mailboxes to the index. */
+typedef void dsync_guid_index_fill_callback_t(struct dsync_guid_index *index,
+					      void *context);
+
+/* Index of message GUIDs => local mailbox and UID. This allows copying mails
+   that were moved to another mailbox in remote, instead of transferring
+   them again. */
+struct dsync_guid_index *
+dsync_guid_index_init(dsync_guid_index_fill_callback_t *callback,
+		      void *context);
+void dsync_guid_index_deinit(struct dsync_guid_index **index);
+
+/* Add all the mails in the mailbox to the index. The index takes over the
+   mailbox and frees it at deinit. Returns 0 if ok, -1 if error. */
+int dsync_guid_index_add_mailbox(struct dsync_guid_index *index,
+				 struct mailbox *box);
+/* Find a mail with the given GUID. Returns TRUE and a mail that can be used
+   with mail_set_uid(uid_r) if found. The mail may have already been
+   expunged. */
+bool dsync_guid_index_lookup(struct dsync_guid_index *index, const char *guid,
+			     struct mail **mail_r, uint32_t *uid_r);
+
+#endif
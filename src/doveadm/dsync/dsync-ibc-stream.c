@@ -23,7 +23,6 @@
 #include "dsync-ibc-private.h"
 
 
-#define DSYNC_IBC_STREAM_OUTBUF_THROTTLE_SIZE (1024*128)
 
 #define DSYNC_PROTOCOL_VERSION_MAJOR 3
 #define DSYNC_PROTOCOL_VERSION_MINOR 4
@@ -142,6 +141,7 @@ struct dsync_ibc_stream {
 
 	char *name, *temp_path_prefix;
 	unsigned int timeout_secs;
+	size_t send_buffer_size;
 	struct istream *input;
 	struct ostream *output;
 	struct io *io;
@@ -1961,7 +1961,7 @@ static bool dsync_ibc_stream_is_send_queue_full(struct dsync_ibc *_ibc)
 		return TRUE;
 
 	bytes = o_stream_get_buffer_used_size(ibc->output);
-	if (bytes < DSYNC_IBC_STREAM_OUTBUF_THROTTLE_SIZE)
+	if (bytes < ibc->send_buffer_size)
 		return FALSE;
 
 	o_stream_set_flush_pending(ibc->output, TRUE);
@@ -2006,7 +2006,7 @@ static const struct dsync_ibc_vfuncs dsync_ibc_stream_vfuncs = {
 struct dsync_ibc *
 dsync_ibc_init_stream(struct istream *input, struct ostream *output,
 		      const char *name, const char *temp_path_prefix,
-		      unsigned int timeout_secs)
+		      unsigned int timeout_secs, size_t send_buffer_size)
 {
 	struct dsync_ibc_stream *ibc;
 
@@ -2017,6 +2017,7 @@ dsync_ibc_init_stream(struct istream *input, struct ostream *output,
 	ibc->name = i_strdup(name);
 	ibc->temp_path_prefix = i_strdup(temp_path_prefix);
 	ibc->timeout_secs = timeout_secs;
+	ibc->send_buffer_size = send_buffer_size;
 	ibc->ret_pool = pool_alloconly_create("ibc stream data", 2048);
 	dsync_ibc_stream_init(ibc);
 	return &ibc->ibc;
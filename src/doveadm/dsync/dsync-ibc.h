@@ -69,10 +69,13 @@ struct dsync_ibc_settings {
 
 void dsync_ibc_init_pipe(struct dsync_ibc **ibc1_r,
 			 struct dsync_ibc **ibc2_r);
+/* Stop sending more items while the output buffer has at least
+   send_buffer_size bytes. Larger values keep more data in flight over
+   high-latency links. */
 struct dsync_ibc *
 dsync_ibc_init_stream(struct istream *input, struct ostream *output,
 		      const char *name, const char *temp_path_prefix,
-		      unsigned int timeout_secs);
+		      unsigned int timeout_secs, size_t send_buffer_size);
 void dsync_ibc_deinit(struct dsync_ibc **ibc);
 
 /* I/O callback is called whenever new data is available. It's also called on
@@ -32,8 +32,13 @@ struct dsync_mailbox_exporter {
 
 	/* GUID => instances */
 	HASH_TABLE(char *, struct dsync_mail_guid_instances *) export_guids;
+	/* requested GUIDs that haven't been searched yet */
+	ARRAY(struct dsync_mail_guid_instances *) requested_instances;
 	ARRAY_TYPE(seq_range) requested_uids;
 	ARRAY_TYPE(seq_range) search_uids;
+	/* Start searching mails when this many requests are waiting */
+	unsigned int mail_request_window;
+	unsigned int pending_request_count;
 
 	ARRAY_TYPE(seq_range) expunged_seqs;
 	ARRAY_TYPE(const_string) expunged_guids;
@@ -57,7 +62,7 @@ struct dsync_mailbox_exporter {
 	const char *error;
 	enum mail_error mail_error;
 
-	unsigned int body_search_initialized:1;
+	unsigned int mail_requests_finished:1;
 	unsigned int auto_export_mails:1;
 	unsigned int mails_have_guids:1;
 	unsigned int minimal_dmail_fill:1;
@@ -266,8 +271,11 @@ export_add_mail_instance(struct dsync_mailbox_exporter *exporter,
 		hash_table_insert(exporter->export_guids,
 				  p_strdup(exporter->pool, change->guid),
 				  instances);
-		if (exporter->auto_export_mails)
+		if (exporter->auto_export_mails) {
 			instances->requested = TRUE;
+			array_append(&exporter->requested_instances,
+				     &instances, 1);
+		}
 	}
 	seq_range_array_add(&instances->seqs, seq);
 }
@@ -483,6 +491,7 @@ struct dsync_mailbox_exporter *
 dsync_mailbox_export_init(struct mailbox *box,
 			  struct dsync_transaction_log_scan *log_scan,
 			  uint32_t last_common_uid,
+			  unsigned int mail_request_window,
 			  enum dsync_mailbox_exporter_flags flags)
 {
 	struct dsync_mailbox_exporter *exporter;
@@ -505,6 +514,9 @@ dsync_mailbox_export_init(struct mailbox *box,
 		(flags & DSYNC_MAILBOX_EXPORTER_FLAG_TIMESTAMPS) != 0;
 	exporter->hdr_hash_version =
 		(flags & DSYNC_MAILBOX_EXPORTER_FLAG_HDR_HASH_V2) ? 2 : 1;
+	exporter->mail_request_window = mail_request_window;
+	exporter->mail_requests_finished = exporter->auto_export_mails;
+	p_array_init(&exporter->requested_instances, pool, 16);
 	p_array_init(&exporter->requested_uids, pool, 16);
 	p_array_init(&exporter->search_uids, pool, 16);
 	hash_table_create(&exporter->export_guids, pool, 0, str_hash, strcmp);
@@ -685,20 +697,57 @@ int dsync_mailbox_export_next(struct dsync_mailbox_exporter *exporter,
 	return 1;
 }
 
+static void
+dsync_mailbox_export_add_expunged_retries(struct dsync_mailbox_exporter *exporter,
+					  ARRAY_TYPE(seq_range) *seqset)
+{
+	struct hash_iterate_context *iter;
+	struct dsync_mail_guid_instances *instances;
+	const struct seq_range *uids;
+	char *guid;
+	const char *const_guid;
+	uint32_t seq;
+
+	/* if some instances of messages were expunged, retry fetching them
+	   with other instances */
+	iter = hash_table_iterate_init(exporter->export_guids);
+	while (hash_table_iterate(iter, exporter->export_guids,
+				  &guid, &instances)) {
+		if (!instances->searched ||
+		    array_count(&instances->seqs) == 0)
+			continue;
+
+		uids = array_idx(&instances->seqs, 0);
+		seq = uids[0].seq1;
+		if (!seq_range_exists(&exporter->expunged_seqs, seq))
+			continue;
+
+		seq_range_array_remove(&instances->seqs, seq);
+		seq_range_array_remove(&exporter->expunged_seqs, seq);
+		if (array_count(&instances->seqs) == 0) {
+			/* no instances left */
+			const_guid = guid;
+			array_append(&exporter->expunged_guids,
+				     &const_guid, 1);
+			continue;
+		}
+		uids = array_idx(&instances->seqs, 0);
+		seq_range_array_add(seqset, uids[0].seq1);
+	}
+	hash_table_iterate_deinit(&iter);
+}
+
 static int
 dsync_mailbox_export_body_search_init(struct dsync_mailbox_exporter *exporter)
 {
 	struct mail_search_args *search_args;
 	struct mail_search_arg *sarg;
-	struct hash_iterate_context *iter;
 	const struct seq_range *uids;
-	char *guid;
-	const char *const_guid;
 	enum mail_fetch_field wanted_fields;
-	struct dsync_mail_guid_instances *instances;
+	struct dsync_mail_guid_instances *const *instancesp, *instances;
 	const struct seq_range *range;
 	unsigned int i, count;
-	uint32_t seq, seq1, seq2;
+	uint32_t seq1, seq2;
 
 	i_assert(exporter->search_ctx == NULL);
 
@@ -708,36 +757,21 @@ dsync_mailbox_export_body_search_init(struct dsync_mailbox_exporter *exporter)
 
 	/* get a list of messages we want to fetch. if there are more than one
 	   instance for a GUID, use the first one. */
-	iter = hash_table_iterate_init(exporter->export_guids);
-	while (hash_table_iterate(iter, exporter->export_guids,
-				  &guid, &instances)) {
-		if (!instances->requested ||
-		    array_count(&instances->seqs) == 0)
+	array_foreach(&exporter->requested_instances, instancesp) {
+		instances = *instancesp;
+		if (array_count(&instances->seqs) == 0)
 			continue;
-
 		uids = array_idx(&instances->seqs, 0);
-		seq = uids[0].seq1;
-		if (!instances->searched) {
-			instances->searched = TRUE;
-			seq_range_array_add(&sarg->value.seqset, seq);
-		} else if (seq_range_exists(&exporter->expunged_seqs, seq)) {
-			/* we're on a second round, refetching expunged
-			   messages */
-			seq_range_array_remove(&instances->seqs, seq);
-			seq_range_array_remove(&exporter->expunged_seqs, seq);
-			if (array_count(&instances->seqs) == 0) {
-				/* no instances left */
-				const_guid = guid;
-				array_append(&exporter->expunged_guids,
-					     &const_guid, 1);
-				continue;
-			}
-			uids = array_idx(&instances->seqs, 0);
-			seq = uids[0].seq1;
-			seq_range_array_add(&sarg->value.seqset, seq);
-		}
+		instances->searched = TRUE;
+		seq_range_array_add(&sarg->value.seqset, uids[0].seq1);
+	}
+	array_clear(&exporter->requested_instances);
+
+	if (array_count(&exporter->expunged_seqs) > 0) {
+		/* we're on a second round, refetching expunged messages */
+		dsync_mailbox_export_add_expunged_retries(exporter,
+							  &sarg->value.seqset);
 	}
-	hash_table_iterate_deinit(&iter);
 
 	/* add requested UIDs */
 	range = array_get(&exporter->requested_uids, &count);
@@ -751,6 +785,7 @@ dsync_mailbox_export_body_search_init(struct dsync_mailbox_exporter *exporter)
 	array_clear(&exporter->search_uids);
 	array_append_array(&exporter->search_uids, &exporter->requested_uids);
 	array_clear(&exporter->requested_uids);
+	exporter->pending_request_count = 0;
 
 	wanted_fields = MAIL_FETCH_GUID | MAIL_FETCH_SAVE_DATE;
 	if (!exporter->minimal_dmail_fill) {
@@ -823,10 +858,12 @@ void dsync_mailbox_export_want_mail(struct dsync_mailbox_exporter *exporter,
 	struct dsync_mail_guid_instances *instances;
 
 	i_assert(!exporter->auto_export_mails);
+	i_assert(!exporter->mail_requests_finished);
 
 	if (request->guid == NULL) {
 		i_assert(request->uid > 0);
 		seq_range_array_add(&exporter->requested_uids, request->uid);
+		exporter->pending_request_count++;
 		return;
 	}
 
@@ -837,7 +874,28 @@ void dsync_mailbox_export_want_mail(struct dsync_mailbox_exporter *exporter,
 			"Remote requested unexpected GUID %s", request->guid);
 		return;
 	}
-	instances->requested = TRUE;
+	if (!instances->requested) {
+		instances->requested = TRUE;
+		array_append(&exporter->requested_instances, &instances, 1);
+		exporter->pending_request_count++;
+	}
+}
+
+void dsync_mailbox_export_mail_requests_finished(struct dsync_mailbox_exporter *exporter)
+{
+	exporter->mail_requests_finished = TRUE;
+}
+
+static bool
+dsync_mailbox_export_want_body_search(struct dsync_mailbox_exporter *exporter)
+{
+	if (exporter->mail_requests_finished)
+		return TRUE;
+	/* don't do a separate search for each requested mail, but don't wait
+	   for all the requests either. that would leave the link idle for a
+	   whole round trip per mailbox. */
+	return exporter->pending_request_count > 0 &&
+		exporter->pending_request_count >= exporter->mail_request_window;
 }
 
 int dsync_mailbox_export_next_mail(struct dsync_mailbox_exporter *exporter,
@@ -850,8 +908,9 @@ int dsync_mailbox_export_next_mail(struct dsync_mailbox_exporter *exporter,
 
 	if (exporter->error != NULL)
 		return -1;
-	if (!exporter->body_search_initialized) {
-		exporter->body_search_initialized = TRUE;
+	if (exporter->search_ctx == NULL) {
+		if (!dsync_mailbox_export_want_body_search(exporter))
+			return 0;
 		if (dsync_mailbox_export_body_search_init(exporter) < 0) {
 			i_assert(exporter->error != NULL);
 			return -1;
@@ -872,9 +931,16 @@ int dsync_mailbox_export_next_mail(struct dsync_mailbox_exporter *exporter,
 		   try sending it later. */
 		seq_range_array_add(&exporter->expunged_seqs, mail->seq);
 	}
+	dsync_mailbox_export_body_search_deinit(exporter);
+	if (!exporter->mail_requests_finished) {
+		/* more mail requests are still coming. any expunged messages
+		   are retried along with them. */
+		return dsync_mailbox_export_want_body_search(exporter) ?
+			dsync_mailbox_export_next_mail(exporter, mail_r) : 0;
+	}
+
 	/* if some instances of messages were expunged, retry fetching them
 	   with other instances */
-	dsync_mailbox_export_body_search_deinit(exporter);
 	if ((ret = dsync_mailbox_export_body_search_init(exporter)) < 0) {
 		i_assert(exporter->error != NULL);
 		return -1;
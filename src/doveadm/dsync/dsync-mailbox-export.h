@@ -13,6 +13,7 @@ struct dsync_mailbox_exporter *
 dsync_mailbox_export_init(struct mailbox *box,
 			  struct dsync_transaction_log_scan *log_scan,
 			  uint32_t last_common_uid,
+			  unsigned int mail_request_window,
 			  enum dsync_mailbox_exporter_flags flags);
 /* Returns 1 if attribute was returned, 0 if no more attributes, -1 on error */
 int dsync_mailbox_export_next_attr(struct dsync_mailbox_exporter *exporter,
@@ -23,7 +24,12 @@ int dsync_mailbox_export_next(struct dsync_mailbox_exporter *exporter,
 
 void dsync_mailbox_export_want_mail(struct dsync_mailbox_exporter *exporter,
 				    const struct dsync_mail_request *request);
-/* Returns 1 if mail was returned, 0 if no more mails, -1 on error */
+/* Called after the last dsync_mailbox_export_want_mail(). Until then mails
+   are exported in batches whenever mail_request_window requests are
+   waiting. */
+void dsync_mailbox_export_mail_requests_finished(struct dsync_mailbox_exporter *exporter);
+/* Returns 1 if mail was returned, 0 if no more mails, -1 on error. If mail
+   requests haven't finished yet, 0 means that more requests are needed. */
 int dsync_mailbox_export_next_mail(struct dsync_mailbox_exporter *exporter,
 				   const struct dsync_mail **mail_r);
 int dsync_mailbox_export_deinit(struct dsync_mailbox_exporter **exporter,
@@ -13,6 +13,7 @@
 #include "dsync-transaction-log-scan.h"
 #include "dsync-mail.h"
 #include "dsync-mailbox.h"
+#include "dsync-guid-index.h"
 #include "dsync-mailbox-import.h"
 
 struct importer_mail {
@@ -77,6 +78,8 @@ struct dsync_mailbox_importer {
 	struct mailbox_transaction_context *virtual_trans;
 	struct mail *virtual_mail;
 
+	struct dsync_guid_index *local_guid_index;
+
 	struct mail *cur_mail;
 	const char *cur_guid;
 	const char *cur_hdr_hash;
@@ -187,6 +190,7 @@ dsync_mailbox_import_transaction_begin(struct dsync_mailbox_importer *importer)
 struct dsync_mailbox_importer *
 dsync_mailbox_import_init(struct mailbox *box,
 			  struct mailbox *virtual_all_box,
+			  struct dsync_guid_index *local_guid_index,
 			  struct dsync_transaction_log_scan *log_scan,
 			  uint32_t last_common_uid,
 			  uint64_t last_common_modseq,
@@ -208,6 +212,7 @@ dsync_mailbox_import_init(struct mailbox *box,
 	importer->pool = pool;
 	importer->box = box;
 	importer->virtual_all_box = virtual_all_box;
+	importer->local_guid_index = local_guid_index;
 	importer->last_common_uid = last_common_uid;
 	importer->last_common_modseq = last_common_modseq;
 	importer->last_common_pvt_modseq = last_common_pvt_modseq;
@@ -1993,6 +1998,29 @@ dsync_mailbox_import_try_virtual_all(struct dsync_mailbox_importer *importer,
 	return FALSE;
 }
 
+static bool
+dsync_mailbox_import_try_guid_index(struct dsync_mailbox_importer *importer,
+				    struct importer_new_mail *all_newmails)
+{
+	struct dsync_mail dmail;
+	struct mail *mail;
+	uint32_t uid;
+
+	if (importer->local_guid_index == NULL || *all_newmails->guid == '\0')
+		return FALSE;
+	if (!dsync_guid_index_lookup(importer->local_guid_index,
+				     all_newmails->guid, &mail, &uid))
+		return FALSE;
+
+	if (dsync_mailbox_import_local_uid(importer, mail, uid,
+					   all_newmails->guid, &dmail) > 0) {
+		if (dsync_mailbox_save_newmails(importer, &dmail,
+						all_newmails, FALSE))
+			return TRUE;
+	}
+	return FALSE;
+}
+
 static bool
 dsync_mailbox_import_handle_mail(struct dsync_mailbox_importer *importer,
 				 struct importer_new_mail *all_newmails)
@@ -2026,7 +2054,8 @@ dsync_mailbox_import_handle_mail(struct dsync_mailbox_importer *importer,
 
 	if (!dsync_mailbox_import_try_local(importer, all_newmails,
 					    &local_uids, &wanted_uids) &&
-	    !dsync_mailbox_import_try_virtual_all(importer, all_newmails)) {
+	    !dsync_mailbox_import_try_virtual_all(importer, all_newmails) &&
+	    !dsync_mailbox_import_try_guid_index(importer, all_newmails)) {
 		/* no local instance. request from remote */
 		IMPORTER_DEBUG_CHANGE(importer);
 		if (importer->want_mail_requests) {
@@ -0,0 +1,307 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "guid.h"
+#include "mail-namespace.h"
+#include "mail-storage.h"
+#include "mail-storage-service.h"
+#include "doveadm-cmd.h"
+#include "doveadm-print.h"
+#include "doveadm-mailbox-list-iter.h"
+#include "doveadm-mail-iter.h"
+#include "doveadm-mail.h"
+#include "test-common.h"
+
+#include <unistd.h>
+
+/* mailbox N has N mails. keep the UIDs single digit so they sort
+   the same as strings. */
+#define TEST_MAILBOX_COUNT 9
+
+struct mailbox {
+	unsigned int idx;
+};
+
+struct doveadm_mail_iter {
+	struct mailbox box;
+	struct mail mail;
+};
+
+struct doveadm_mailbox_list_iter {
+	struct mailbox_info info;
+	unsigned int idx;
+};
+
+static struct mail_user test_user;
+static ARRAY(char *) test_output;
+static string_t *test_output_line;
+static unsigned int test_failing_mailbox;
+
+void doveadm_print_init(const char *name ATTR_UNUSED)
+{
+}
+
+void doveadm_print_header(const char *key ATTR_UNUSED,
+			  const char *title ATTR_UNUSED,
+			  enum doveadm_print_header_flags flags ATTR_UNUSED)
+{
+}
+
+/* the search prints the mailbox GUID and the UID. collect them into
+   "guid uid" lines. */
+void doveadm_print(const char *value)
+{
+	char *line;
+
+	if (str_len(test_output_line) == 0) {
+		str_append(test_output_line, value);
+		str_append_c(test_output_line, ' ');
+	} else {
+		str_append(test_output_line, value);
+		line = i_strdup(str_c(test_output_line));
+		array_append(&test_output, &line, 1);
+		str_truncate(test_output_line, 0);
+	}
+}
+
+struct doveadm_mail_cmd_context *doveadm_mail_cmd_alloc_size(size_t size)
+{
+	struct doveadm_mail_cmd_context *ctx;
+	pool_t pool;
+
+	pool = pool_alloconly_create("doveadm mail cmd", 1024);
+	ctx = p_malloc(pool, size);
+	ctx->pool = pool;
+	return ctx;
+}
+
+void doveadm_mail_failed_mailbox(struct doveadm_mail_cmd_context *ctx,
+				 struct mailbox *box ATTR_UNUSED)
+{
+	ctx->exit_code = EX_TEMPFAIL;
+}
+
+void doveadm_mail_failed_error(struct doveadm_mail_cmd_context *ctx,
+			       enum mail_error error ATTR_UNUSED)
+{
+	ctx->exit_code = EX_TEMPFAIL;
+}
+
+bool doveadm_is_killed(void)
+{
+	return FALSE;
+}
+
+int mail_storage_service_next(struct mail_storage_service_ctx *ctx ATTR_UNUSED,
+			      struct mail_storage_service_user *user ATTR_UNUSED,
+			      struct mail_user **mail_user_r)
+{
+	*mail_user_r = &test_user;
+	return 0;
+}
+
+struct mail_namespace *
+mail_namespace_find(struct mail_namespace *namespaces ATTR_UNUSED,
+		    const char *mailbox ATTR_UNUSED)
+{
+	return NULL;
+}
+
+struct doveadm_mailbox_list_iter *
+doveadm_mailbox_list_iter_init(struct doveadm_mail_cmd_context *ctx ATTR_UNUSED,
+			       struct mail_user *user ATTR_UNUSED,
+			       struct mail_search_args *search_args ATTR_UNUSED,
+			       enum mailbox_list_iter_flags iter_flags ATTR_UNUSED)
+{
+	return i_new(struct doveadm_mailbox_list_iter, 1);
+}
+
+const struct mailbox_info *
+doveadm_mailbox_list_iter_next(struct doveadm_mailbox_list_iter *iter)
+{
+	if (iter->idx == TEST_MAILBOX_COUNT)
+		return NULL;
+	iter->info.vname = t_strdup_printf("box%u", ++iter->idx);
+	return &iter->info;
+}
+
+int doveadm_mailbox_list_iter_deinit(struct doveadm_mailbox_list_iter **_iter)
+{
+	i_free_and_null(*_iter);
+	return 0;
+}
+
+int doveadm_mail_iter_init(struct doveadm_mail_cmd_context *ctx ATTR_UNUSED,
+			   const struct mailbox_info *info,
+			   struct mail_search_args *search_args ATTR_UNUSED,
+			   enum mail_fetch_field wanted_fields ATTR_UNUSED,
+			   const char *const *wanted_headers ATTR_UNUSED,
+			   struct doveadm_mail_iter **iter_r)
+{
+	struct doveadm_mail_iter *iter;
+
+	iter = i_new(struct doveadm_mail_iter, 1);
+	test_assert(strncmp(info->vname, "box", 3) == 0);
+	if (str_to_uint(info->vname + 3, &iter->box.idx) < 0)
+		i_unreached();
+	*iter_r = iter;
+	return 0;
+}
+
+struct mailbox *doveadm_mail_iter_get_mailbox(struct doveadm_mail_iter *iter)
+{
+	return &iter->box;
+}
+
+bool doveadm_mail_iter_next(struct doveadm_mail_iter *iter,
+			    struct mail **mail_r)
+{
+	if (iter->mail.uid == iter->box.idx)
+		return FALSE;
+	iter->mail.uid++;
+	*mail_r = &iter->mail;
+	return TRUE;
+}
+
+int doveadm_mail_iter_deinit(struct doveadm_mail_iter **_iter)
+{
+	i_free_and_null(*_iter);
+	return 0;
+}
+
+int mailbox_get_metadata(struct mailbox *box,
+			 enum mailbox_metadata_items items ATTR_UNUSED,
+			 struct mailbox_metadata *metadata_r)
+{
+	if (box->idx == test_failing_mailbox)
+		return -1;
+	memset(metadata_r, 0, sizeof(*metadata_r));
+	memset(metadata_r->guid, box->idx, sizeof(metadata_r->guid));
+	return 0;
+}
+
+const char *mailbox_get_vname(const struct mailbox *box ATTR_UNUSED)
+{
+	return "box";
+}
+
+const char *mailbox_get_last_error(struct mailbox *box ATTR_UNUSED,
+				   enum mail_error *error_r ATTR_UNUSED)
+{
+	return "error";
+}
+
+/* init isn't called by the test */
+void doveadm_mail_help_name(const char *cmd_name ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+struct mail_search_args *
+doveadm_mail_build_search_args(const char *const args[] ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static int test_output_cmp(char *const *s1, char *const *s2)
+{
+	return strcmp(*s1, *s2);
+}
+
+static int test_search(const char *process_count, int *exit_code_r)
+{
+	struct doveadm_mail_cmd_context *ctx;
+	int ret;
+
+	ctx = doveadm_cmd_search_ver2.mail_cmd();
+	if (process_count != NULL) {
+		optarg = (char *)process_count;
+		test_assert(ctx->v.parse_arg(ctx, 'p'));
+	}
+	ret = ctx->v.run(ctx, &test_user);
+	*exit_code_r = ctx->exit_code;
+	pool_unref(&ctx->pool);
+	return ret;
+}
+
+static void test_output_free(void)
+{
+	char **linep;
+
+	array_foreach_modifiable(&test_output, linep)
+		i_free(*linep);
+	array_clear(&test_output);
+}
+
+static void test_search_results(const char *process_count)
+{
+	char *const *lines;
+	unsigned int i, uid, count;
+	int exit_code;
+
+	test_assert(test_search(process_count, &exit_code) == 0);
+	test_assert(exit_code == 0);
+
+	/* the workers' output is interleaved in any order, but each mail
+	   is listed exactly once */
+	array_sort(&test_output, test_output_cmp);
+	lines = array_get(&test_output, &count);
+	test_assert(count == TEST_MAILBOX_COUNT * (TEST_MAILBOX_COUNT + 1) / 2);
+	for (i = 1; i <= TEST_MAILBOX_COUNT && count > 0; i++) {
+		guid_128_t guid;
+
+		memset(guid, i, sizeof(guid));
+		for (uid = 1; uid <= i && count > 0; uid++) {
+			test_assert(strcmp(*lines, t_strdup_printf("%s %u",
+				guid_128_to_string(guid), uid)) == 0);
+			lines++; count--;
+		}
+	}
+	test_output_free();
+}
+
+static void test_doveadm_mail_search_parallel(void)
+{
+	test_begin("doveadm search -p");
+	test_search_results(NULL);
+	test_search_results("1");
+	test_search_results("3");
+	test_search_results("20");
+	test_end();
+}
+
+static void test_doveadm_mail_search_parallel_fail(void)
+{
+	int exit_code;
+
+	test_begin("doveadm search -p with a failing mailbox");
+	/* the worker that hits the failing mailbox logs the error in its own
+	   process, and its exit code is passed on */
+	test_failing_mailbox = 5;
+	test_assert(test_search("3", &exit_code) < 0);
+	test_assert(exit_code == EX_TEMPFAIL);
+	test_assert(array_count(&test_output) ==
+		    TEST_MAILBOX_COUNT * (TEST_MAILBOX_COUNT + 1) / 2 - 5);
+	test_output_free();
+	test_failing_mailbox = 0;
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_doveadm_mail_search_parallel,
+		test_doveadm_mail_search_parallel_fail,
+		NULL
+	};
+	int ret;
+
+	i_array_init(&test_output, 64);
+	test_output_line = str_new(default_pool, 128);
+	ret = test_run(test_functions);
+	str_free(&test_output_line);
+	array_free(&test_output);
+	return ret;
+}
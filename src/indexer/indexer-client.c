@@ -129,6 +129,35 @@ indexer_client_request_optimize(struct indexer_client *client,
 	return 0;
 }
 
+static int
+indexer_client_request_status(struct indexer_client *client,
+			      const char *const *args, const char **error_r)
+{
+	unsigned int tag;
+
+	/* <tag> */
+	if (str_array_length(args) != 1) {
+		*error_r = "Wrong parameter count";
+		return -1;
+	}
+	if (str_to_uint(args[0], &tag) < 0) {
+		*error_r = "Invalid tag";
+		return -1;
+	}
+
+	/* <tag> OK <requests> <interactive> <background> <optimize> */
+	o_stream_nsend_str(client->output, t_strdup_printf(
+		"%u\tOK\t%u\t%u\t%u\t%u\n", tag,
+		indexer_queue_count(client->queue),
+		indexer_queue_count_priority(client->queue,
+			INDEXER_REQUEST_PRIORITY_INTERACTIVE),
+		indexer_queue_count_priority(client->queue,
+			INDEXER_REQUEST_PRIORITY_BACKGROUND),
+		indexer_queue_count_priority(client->queue,
+			INDEXER_REQUEST_PRIORITY_OPTIMIZE)));
+	return 0;
+}
+
 static int
 indexer_client_request(struct indexer_client *client,
 		       const char *const *args, const char **error_r)
@@ -143,6 +172,8 @@ indexer_client_request(struct indexer_client *client,
 		return indexer_client_request_queue(client, FALSE, args, error_r);
 	else if (strcmp(cmd, "OPTIMIZE") == 0)
 		return indexer_client_request_optimize(client, args, error_r);
+	else if (strcmp(cmd, "STATUS") == 0)
+		return indexer_client_request_status(client, args, error_r);
 	else {
 		*error_r = t_strconcat("Unknown command: ", cmd, NULL);
 		return -1;
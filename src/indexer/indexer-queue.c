@@ -6,13 +6,42 @@
 #include "hash.h"
 #include "indexer-queue.h"
 
+/* A user's requests with the same priority */
+struct indexer_queue_user_requests {
+	/* in indexer_queue.users_head[priority] */
+	struct indexer_queue_user_requests *prev, *next;
+	struct indexer_queue_user *user;
+
+	struct indexer_request *head, *tail;
+};
+
+struct indexer_queue_user {
+	char *username;
+	/* number of requests in indexer_queue.requests for this user */
+	unsigned int request_count;
+	/* number of requests currently being worked on */
+	unsigned int working_count;
+
+	struct indexer_queue_user_requests
+		requests[INDEXER_REQUEST_PRIORITY_COUNT];
+};
+
 struct indexer_queue {
 	indexer_status_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_queue_user */
+	HASH_TABLE(char *, struct indexer_queue_user *) users;
+
+	/* Users who have queued requests with the priority. The users take
+	   turns, so after a request is removed the user is moved to the
+	   end of the list. */
+	struct indexer_queue_user_requests
+		*users_head[INDEXER_REQUEST_PRIORITY_COUNT],
+		*users_tail[INDEXER_REQUEST_PRIORITY_COUNT];
+	unsigned int queued_counts[INDEXER_REQUEST_PRIORITY_COUNT];
 };
 
 static unsigned int
@@ -37,6 +66,7 @@ indexer_queue_init(indexer_status_callback_t *callback)
 	queue->callback = callback;
 	hash_table_create(&queue->requests, default_pool, 0,
 			  indexer_request_hash, indexer_request_cmp);
+	hash_table_create(&queue->users, default_pool, 0, str_hash, strcmp);
 	return queue;
 }
 
@@ -49,6 +79,7 @@ void indexer_queue_deinit(struct indexer_queue **_queue)
 	i_assert(indexer_queue_is_empty(queue));
 
 	hash_table_destroy(&queue->requests);
+	hash_table_destroy(&queue->users);
 	i_free(queue);
 }
 
@@ -79,8 +110,92 @@ static void request_add_context(struct indexer_request *request, void *context)
 	array_append(&request->contexts, &context, 1);
 }
 
+static struct indexer_queue_user *
+indexer_queue_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_queue_user *user;
+	unsigned int i;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user == NULL) {
+		user = i_new(struct indexer_queue_user, 1);
+		user->username = i_strdup(username);
+		for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+			user->requests[i].user = user;
+		hash_table_insert(queue->users, user->username, user);
+	}
+	return user;
+}
+
+static void indexer_queue_user_unref(struct indexer_queue *queue,
+				     struct indexer_queue_user *user)
+{
+	i_assert(user->request_count > 0);
+
+	if (--user->request_count > 0)
+		return;
+	i_assert(user->working_count == 0);
+	hash_table_remove(queue->users, user->username);
+	i_free(user->username);
+	i_free(user);
+}
+
+static void
+indexer_queue_link_request(struct indexer_queue *queue,
+			   struct indexer_request *request, bool head)
+{
+	enum indexer_request_priority priority = request->priority;
+	struct indexer_queue_user_requests *user_requests =
+		&request->user->requests[priority];
+
+	if (user_requests->head == NULL) {
+		if (head) {
+			DLLIST2_PREPEND(&queue->users_head[priority],
+					&queue->users_tail[priority],
+					user_requests);
+		} else {
+			DLLIST2_APPEND(&queue->users_head[priority],
+				       &queue->users_tail[priority],
+				       user_requests);
+		}
+	} else if (head) {
+		/* move the user to the beginning of the queue */
+		DLLIST2_REMOVE(&queue->users_head[priority],
+			       &queue->users_tail[priority], user_requests);
+		DLLIST2_PREPEND(&queue->users_head[priority],
+				&queue->users_tail[priority], user_requests);
+	}
+
+	if (head) {
+		DLLIST2_PREPEND(&user_requests->head, &user_requests->tail,
+				request);
+	} else {
+		DLLIST2_APPEND(&user_requests->head, &user_requests->tail,
+			       request);
+	}
+	queue->queued_counts[priority]++;
+}
+
+static void
+indexer_queue_unlink_request(struct indexer_queue *queue,
+			     struct indexer_request *request)
+{
+	enum indexer_request_priority priority = request->priority;
+	struct indexer_queue_user_requests *user_requests =
+		&request->user->requests[priority];
+
+	DLLIST2_REMOVE(&user_requests->head, &user_requests->tail, request);
+	if (user_requests->head == NULL) {
+		DLLIST2_REMOVE(&queue->users_head[priority],
+			       &queue->users_tail[priority], user_requests);
+	}
+	i_assert(queue->queued_counts[priority] > 0);
+	queue->queued_counts[priority]--;
+}
+
 static struct indexer_request *
 indexer_queue_append_request(struct indexer_queue *queue, bool append,
+			     enum indexer_request_priority priority,
 			     const char *username, const char *mailbox,
 			     const char *session_id,
 			     unsigned int max_recent_msgs, void *context)
@@ -90,10 +205,13 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request == NULL) {
 		request = i_new(struct indexer_request, 1);
+		request->user = indexer_queue_user_get(queue, username);
+		request->user->request_count++;
 		request->username = i_strdup(username);
 		request->mailbox = i_strdup(mailbox);
 		request->session_id = i_strdup(session_id);
 		request->max_recent_msgs = max_recent_msgs;
+		request->priority = priority;
 		request_add_context(request, context);
 		hash_table_insert(queue->requests, request, request);
 	} else {
@@ -106,20 +224,22 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 				request->reindex_tail = TRUE;
 			else
 				request->reindex_head = TRUE;
+			if (request->priority > priority)
+				request->priority = priority;
 			return request;
 		}
-		if (append) {
+		if (append && request->priority <= priority) {
 			/* keep the request in its old position */
 			return request;
 		}
-		/* move request to beginning of the queue */
-		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+		/* move request to beginning of the queue or to the
+		   higher priority queue */
+		indexer_queue_unlink_request(queue, request);
+		if (request->priority > priority)
+			request->priority = priority;
 	}
 
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	indexer_queue_link_request(queue, request, !append);
 	return request;
 }
 
@@ -137,9 +257,10 @@ void indexer_queue_append(struct indexer_queue *queue, bool append,
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, append, username, mailbox,
-					       session_id, max_recent_msgs,
-					       context);
+	request = indexer_queue_append_request(queue, append,
+		append ? INDEXER_REQUEST_PRIORITY_BACKGROUND :
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		username, mailbox, session_id, max_recent_msgs, context);
 	request->index = TRUE;
 	indexer_queue_append_finish(queue);
 }
@@ -150,24 +271,50 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, TRUE, username, mailbox,
-					       NULL, 0, context);
+	request = indexer_queue_append_request(queue, TRUE,
+		INDEXER_REQUEST_PRIORITY_OPTIMIZE, username, mailbox,
+		NULL, 0, context);
 	request->optimize = TRUE;
 	indexer_queue_append_finish(queue);
 }
 
-struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
+struct indexer_request *
+indexer_queue_request_peek(struct indexer_queue *queue,
+			   enum indexer_request_priority max_priority)
 {
-	return queue->head;
-}
+	struct indexer_queue_user_requests *user_requests;
+	unsigned int priority;
 
-void indexer_queue_request_remove(struct indexer_queue *queue)
-{
-	struct indexer_request *request = queue->head;
+	i_assert(max_priority < INDEXER_REQUEST_PRIORITY_COUNT);
 
-	i_assert(request != NULL);
+	for (priority = 0; priority <= max_priority; priority++) {
+		user_requests = queue->users_head[priority];
+		for (; user_requests != NULL; user_requests = user_requests->next) {
+			if (user_requests->user->working_count == 0)
+				return user_requests->head;
+		}
+	}
+	return NULL;
+}
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+void indexer_queue_request_remove(struct indexer_queue *queue,
+				  struct indexer_request *request)
+{
+	struct indexer_queue_user_requests *user_requests =
+		&request->user->requests[request->priority];
+
+	i_assert(!request->working);
+
+	indexer_queue_unlink_request(queue, request);
+	if (user_requests->head != NULL) {
+		/* let the other users go first next time */
+		DLLIST2_REMOVE(&queue->users_head[request->priority],
+			       &queue->users_tail[request->priority],
+			       user_requests);
+		DLLIST2_APPEND(&queue->users_head[request->priority],
+			       &queue->users_tail[request->priority],
+			       user_requests);
+	}
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -195,6 +342,7 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 void indexer_queue_request_work(struct indexer_request *request)
 {
 	request->working = TRUE;
+	request->user->working_count++;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
 		array_count(&request->contexts);
@@ -205,13 +353,19 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  bool success)
 {
 	struct indexer_request *request = *_request;
+	bool reindex_head;
 
 	*_request = NULL;
 
 	indexer_queue_request_status_int(queue, request, success ? 100 : -1);
 
+	if (request->working) {
+		i_assert(request->user->working_count > 0);
+		request->user->working_count--;
+	}
 	if (request->reindex_head || request->reindex_tail) {
 		i_assert(request->working);
+		reindex_head = request->reindex_head;
 		request->working = FALSE;
 		request->reindex_head = FALSE;
 		request->reindex_tail = FALSE;
@@ -219,18 +373,17 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		indexer_queue_link_request(queue, request, reindex_head);
 		return;
 	}
 
 	hash_table_remove(queue->requests, request);
+	indexer_queue_user_unref(queue, request->user);
 	if (array_is_created(&request->contexts))
 		array_free(&request->contexts);
 	i_free(request->username);
 	i_free(request->mailbox);
+	i_free(request->session_id);
 	i_free(request);
 
 	indexer_refresh_proctitle();
@@ -240,6 +393,7 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 {
 	struct indexer_request *request;
 	struct hash_iterate_context *iter;
+	unsigned int priority;
 
 	/* remove all reindex-markers so when the current requests finish
 	   (or are cancelled) we don't try to retry them (especially during
@@ -249,18 +403,36 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 		request->reindex_head = request->reindex_tail = FALSE;
 	hash_table_iterate_deinit(&iter);
 
-	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		indexer_queue_request_remove(queue);
-		indexer_queue_request_finish(queue, &request, FALSE);
+	for (priority = 0; priority < INDEXER_REQUEST_PRIORITY_COUNT; priority++) {
+		while (queue->users_head[priority] != NULL) {
+			request = queue->users_head[priority]->head;
+			indexer_queue_unlink_request(queue, request);
+			indexer_queue_request_finish(queue, &request, FALSE);
+		}
 	}
 }
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	unsigned int priority;
+
+	for (priority = 0; priority < INDEXER_REQUEST_PRIORITY_COUNT; priority++) {
+		if (queue->users_head[priority] != NULL)
+			return FALSE;
+	}
+	return TRUE;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
 {
 	return hash_table_count(queue->requests);
 }
+
+unsigned int
+indexer_queue_count_priority(struct indexer_queue *queue,
+			     enum indexer_request_priority priority)
+{
+	i_assert(priority < INDEXER_REQUEST_PRIORITY_COUNT);
+
+	return queue->queued_counts[priority];
+}
@@ -3,13 +3,28 @@
 
 #include "indexer.h"
 
+/* Requests are handled in this order */
+enum indexer_request_priority {
+	/* Someone is waiting for the indexing to finish (e.g. a search) */
+	INDEXER_REQUEST_PRIORITY_INTERACTIVE = 0,
+	/* Indexing new mails in the background */
+	INDEXER_REQUEST_PRIORITY_BACKGROUND,
+	/* Optimizing the indexes */
+	INDEXER_REQUEST_PRIORITY_OPTIMIZE,
+
+	INDEXER_REQUEST_PRIORITY_COUNT
+};
+
 struct indexer_request {
+	/* in the user's queue for the priority */
 	struct indexer_request *prev, *next;
+	struct indexer_queue_user *user;
 
 	char *username;
 	char *mailbox;
 	char *session_id;
 	unsigned int max_recent_msgs;
+	enum indexer_request_priority priority;
 
 	/* index messages in this mailbox */
 	unsigned int index:1;
@@ -48,12 +63,23 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
+/* Returns the number of requests waiting in the queue with the priority. */
+unsigned int
+indexer_queue_count_priority(struct indexer_queue *queue,
+			     enum indexer_request_priority priority);
 
-/* Return the next request from the queue, without removing it. */
-struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
-/* Remove the next request from the queue. You must call
-   indexer_queue_request_finish() to free its memory. */
-void indexer_queue_request_remove(struct indexer_queue *queue);
+/* Return the next request from the queue, without removing it. Only requests
+   with at least the given priority are returned. Users who already have
+   a request being worked on are skipped, and the users with the same
+   priority take turns, so a single user can't fill up the queue for
+   everyone else. */
+struct indexer_request *
+indexer_queue_request_peek(struct indexer_queue *queue,
+			   enum indexer_request_priority max_priority);
+/* Remove the request returned by indexer_queue_request_peek() from the
+   queue. You must call indexer_queue_request_finish() to free its memory. */
+void indexer_queue_request_remove(struct indexer_queue *queue,
+				  struct indexer_request *request);
 /* Give a status update about how far the indexing is going on. */
 void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
@@ -10,6 +10,10 @@
 #include "worker-pool.h"
 #include "worker-connection.h"
 
+/* Background and optimize requests can't use the last free workers when
+   other workers are busy. They're kept for the interactive requests. */
+#define INDEXER_INTERACTIVE_RESERVED_WORKERS 1
+
 struct worker_request {
 	struct worker_connection *conn;
 	struct indexer_request *request;
@@ -24,9 +28,15 @@ void indexer_refresh_proctitle(void)
 	if (!set->verbose_proctitle)
 		return;
 
-	process_title_set(t_strdup_printf("[%u clients, %u requests]",
-					  indexer_clients_get_count(),
-					  indexer_queue_count(queue)));
+	process_title_set(t_strdup_printf(
+		"[%u clients, %u requests, queued %u/%u/%u]",
+		indexer_clients_get_count(), indexer_queue_count(queue),
+		indexer_queue_count_priority(queue,
+			INDEXER_REQUEST_PRIORITY_INTERACTIVE),
+		indexer_queue_count_priority(queue,
+			INDEXER_REQUEST_PRIORITY_BACKGROUND),
+		indexer_queue_count_priority(queue,
+			INDEXER_REQUEST_PRIORITY_OPTIMIZE)));
 }
 
 static bool idle_die(void)
@@ -58,20 +68,25 @@ static void queue_try_send_more(struct indexer_queue *queue)
 {
 	struct worker_connection *conn;
 	struct indexer_request *request;
-
-	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		conn = worker_pool_find_username_connection(worker_pool,
-							    request->username);
-		if (conn != NULL) {
-			/* there is already a worker handling this user.
-			   it must be the one doing the indexing. use the same
-			   connection for sending this next request. */
-		} else {
-			/* try to find an empty worker */
-			if (!worker_pool_get_connection(worker_pool, &conn))
-				break;
-		}
-		indexer_queue_request_remove(queue);
+	enum indexer_request_priority max_priority;
+
+	for (;;) {
+		if (worker_pool_have_busy_connections(worker_pool) &&
+		    worker_pool_get_free_count(worker_pool) <=
+		    INDEXER_INTERACTIVE_RESERVED_WORKERS)
+			max_priority = INDEXER_REQUEST_PRIORITY_INTERACTIVE;
+		else
+			max_priority = INDEXER_REQUEST_PRIORITY_OPTIMIZE;
+
+		/* users who already have a worker are skipped, so each
+		   user's requests are handled one at a time in priority
+		   order. */
+		request = indexer_queue_request_peek(queue, max_priority);
+		if (request == NULL)
+			break;
+		if (!worker_pool_get_connection(worker_pool, &conn))
+			break;
+		indexer_queue_request_remove(queue, request);
 		worker_send_request(conn, request);
 	}
 }
@@ -22,6 +22,11 @@
 #define INDEXER_WORKER_HANDSHAKE "VERSION\tindexer-worker-master\t1\t0\n%u\n"
 #define INDEXER_MASTER_NAME "indexer-master-worker"
 
+/* Commit the indexed mails after this many mails or seconds, so if the
+   worker dies the next attempt continues from where this one stopped. */
+#define INDEXER_WORKER_CHUNK_MAX_MAILS 1000
+#define INDEXER_WORKER_CHUNK_MAX_SECS 30
+
 struct master_connection {
 	struct mail_storage_service_ctx *storage_service;
 
@@ -50,21 +55,90 @@ indexer_worker_refresh_proctitle(const char *username, const char *mailbox,
 	}
 }
 
+struct index_mailbox_precache_context {
+	struct master_connection *conn;
+	struct mailbox *box;
+	const char *username, *box_vname;
+	enum mail_fetch_field precache_fields;
+
+	uint32_t last_seq;
+	unsigned int counter, max, percentage_sent;
+};
+
+static void
+index_mailbox_precache_progress(struct index_mailbox_precache_context *ctx)
+{
+	char percentage_str[2+1+1];
+	unsigned int percentage;
+
+	percentage = ctx->counter*100 / ctx->max;
+	if (percentage != ctx->percentage_sent && percentage < 100) {
+		ctx->percentage_sent = percentage;
+		if (i_snprintf(percentage_str, sizeof(percentage_str), "%u\n",
+			       percentage) < 0)
+			i_unreached();
+		(void)write_full(ctx->conn->fd, percentage_str,
+				 strlen(percentage_str));
+	}
+	indexer_worker_refresh_proctitle(ctx->username, ctx->box_vname,
+					 ctx->counter, ctx->max);
+}
+
+/* Index mails starting from *seq in a single transaction until the chunk
+   is full. *seq is updated to the next mail to index. */
 static int
-index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
+index_mailbox_precache_chunk(struct index_mailbox_precache_context *ctx,
+			     uint32_t *seq)
 {
-	struct mail_storage *storage = mailbox_get_storage(box);
-	const char *username = mail_storage_get_user(storage)->username;
-	const char *box_vname = mailbox_get_vname(box);
-	struct mailbox_status status;
 	struct mailbox_transaction_context *trans;
 	struct mail_search_args *search_args;
-	struct mail_search_context *ctx;
+	struct mail_search_context *search_ctx;
 	struct mail *mail;
+	unsigned int chunk_count = 0;
+	time_t chunk_end = time(NULL) + INDEXER_WORKER_CHUNK_MAX_SECS;
+	uint32_t next_seq = ctx->last_seq + 1;
+	int ret = 0;
+
+	trans = mailbox_transaction_begin(ctx->box,
+					  MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
+	search_args = mail_search_build_init();
+	mail_search_build_add_seqset(search_args, *seq, ctx->last_seq);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 ctx->precache_fields, NULL);
+	mail_search_args_unref(&search_args);
+
+	while (mailbox_search_next(search_ctx, &mail)) {
+		mail_precache(mail);
+		if (++ctx->counter % 100 == 0)
+			index_mailbox_precache_progress(ctx);
+		if (++chunk_count >= INDEXER_WORKER_CHUNK_MAX_MAILS ||
+		    time(NULL) >= chunk_end) {
+			next_seq = mail->seq + 1;
+			break;
+		}
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0) {
+		i_error("Mailbox %s: Mail search failed: %s",
+			ctx->box_vname, mailbox_get_last_error(ctx->box, NULL));
+		ret = -1;
+	}
+	if (mailbox_transaction_commit(&trans) < 0) {
+		i_error("Mailbox %s: Transaction commit failed: %s",
+			ctx->box_vname, mailbox_get_last_error(ctx->box, NULL));
+		ret = -1;
+	}
+	*seq = next_seq;
+	return ret;
+}
+
+static int
+index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
+{
+	struct index_mailbox_precache_context ctx;
+	struct mail_storage *storage = mailbox_get_storage(box);
+	struct mailbox_status status;
 	struct mailbox_metadata metadata;
 	uint32_t seq;
-	char percentage_str[2+1+1];
-	unsigned int counter = 0, max, percentage, percentage_sent = 0;
 	int ret = 0;
 
 	if (mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS,
@@ -79,46 +153,25 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
 		return -1;
 	}
-	seq = status.last_cached_seq + 1;
 
-	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
-	search_args = mail_search_build_init();
-	mail_search_build_add_seqset(search_args, seq, status.messages);
-	ctx = mailbox_search_init(trans, search_args, NULL,
-				  metadata.precache_fields, NULL);
-	mail_search_args_unref(&search_args);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.conn = conn;
+	ctx.box = box;
+	ctx.username = mail_storage_get_user(storage)->username;
+	ctx.box_vname = mailbox_get_vname(box);
+	ctx.precache_fields = metadata.precache_fields;
+	ctx.last_seq = status.messages;
+
+	/* the mails are committed in chunks, so the mails before the
+	   last cached one have already been handled by an earlier run. */
+	seq = status.last_cached_seq + 1;
+	ctx.max = status.messages - seq + 1;
+	while (seq <= ctx.last_seq && ret == 0)
+		ret = index_mailbox_precache_chunk(&ctx, &seq);
 
-	max = status.messages - seq + 1;
-	while (mailbox_search_next(ctx, &mail)) {
-		mail_precache(mail);
-		if (++counter % 100 == 0) {
-			percentage = counter*100 / max;
-			if (percentage != percentage_sent && percentage < 100) {
-				percentage_sent = percentage;
-				if (i_snprintf(percentage_str,
-					       sizeof(percentage_str), "%u\n",
-					       percentage) < 0)
-					i_unreached();
-				(void)write_full(conn->fd, percentage_str,
-						 strlen(percentage_str));
-			}
-			indexer_worker_refresh_proctitle(username, box_vname,
-							 counter, max);
-		}
-	}
-	if (mailbox_search_deinit(&ctx) < 0) {
-		i_error("Mailbox %s: Mail search failed: %s",
-			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
-		ret = -1;
-	}
-	if (mailbox_transaction_commit(&trans) < 0) {
-		i_error("Mailbox %s: Transaction commit failed: %s",
-			mailbox_get_vname(box), mailbox_get_last_error(box, NULL));
-		ret = -1;
-	}
 	if (ret == 0) {
 		i_info("Indexed %u messages in %s",
-		       counter, mailbox_get_vname(box));
+		       ctx.counter, mailbox_get_vname(box));
 	}
 	return ret;
 }
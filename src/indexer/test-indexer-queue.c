@@ -0,0 +1,232 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "indexer-queue.h"
+
+static unsigned int test_status_count;
+static int test_status_percentage;
+
+void indexer_refresh_proctitle(void)
+{
+}
+
+static void test_status_callback(int percentage, void *context ATTR_UNUSED)
+{
+	test_status_count++;
+	test_status_percentage = percentage;
+}
+
+static bool
+test_request_is(struct indexer_request *request,
+		const char *username, const char *mailbox)
+{
+	return request != NULL && strcmp(request->username, username) == 0 &&
+		strcmp(request->mailbox, mailbox) == 0;
+}
+
+/* take the next request from the queue and start working on it */
+static struct indexer_request *
+test_request_start(struct indexer_queue *queue,
+		   enum indexer_request_priority max_priority)
+{
+	struct indexer_request *request;
+
+	request = indexer_queue_request_peek(queue, max_priority);
+	if (request != NULL) {
+		indexer_queue_request_remove(queue, request);
+		indexer_queue_request_work(request);
+	}
+	return request;
+}
+
+/* check that the next request is the expected one and finish it */
+static void
+test_request_next(struct indexer_queue *queue,
+		  const char *username, const char *mailbox)
+{
+	struct indexer_request *request;
+
+	request = test_request_start(queue, INDEXER_REQUEST_PRIORITY_OPTIMIZE);
+	test_assert(test_request_is(request, username, mailbox));
+	if (request != NULL)
+		indexer_queue_request_finish(queue, &request, TRUE);
+}
+
+static void test_indexer_queue_priorities(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue priorities");
+	queue = indexer_queue_init(test_status_callback);
+
+	indexer_queue_append_optimize(queue, "user1", "opt", NULL);
+	indexer_queue_append(queue, TRUE, "user2", "bg", NULL, 0, NULL);
+	indexer_queue_append(queue, FALSE, "user3", "int", NULL, 0, NULL);
+	test_assert(indexer_queue_count(queue) == 3);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE) == 1);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_BACKGROUND) == 1);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_OPTIMIZE) == 1);
+
+	/* lower priority classes aren't returned when they're not wanted */
+	request = indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE);
+	test_assert(test_request_is(request, "user3", "int"));
+	test_request_next(queue, "user3", "int");
+	test_assert(indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE) == NULL);
+	request = indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_BACKGROUND);
+	test_assert(test_request_is(request, "user2", "bg"));
+
+	/* the classes are handled in order, not in the order of arrival */
+	test_request_next(queue, "user2", "bg");
+	test_request_next(queue, "user1", "opt");
+	test_assert(indexer_queue_is_empty(queue));
+	test_assert(indexer_queue_count(queue) == 0);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_user_turns(void)
+{
+	struct indexer_queue *queue;
+
+	test_begin("indexer queue user turns");
+	queue = indexer_queue_init(test_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box3", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "box2", NULL, 0, NULL);
+
+	/* the users take turns, even though user1 queued first */
+	test_request_next(queue, "user1", "box1");
+	test_request_next(queue, "user2", "box1");
+	test_request_next(queue, "user3", "box1");
+	test_request_next(queue, "user1", "box2");
+	test_request_next(queue, "user3", "box2");
+	test_request_next(queue, "user1", "box3");
+	test_assert(indexer_queue_is_empty(queue));
+
+	/* a prepended request moves the user to the beginning of the
+	   class */
+	indexer_queue_append(queue, FALSE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, FALSE, "user2", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "box2", NULL, 0, NULL);
+	test_request_next(queue, "user1", "box2");
+	test_request_next(queue, "user2", "box1");
+	test_request_next(queue, "user1", "box1");
+	test_assert(indexer_queue_is_empty(queue));
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_promote(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue promote");
+	queue = indexer_queue_init(test_status_callback);
+
+	indexer_queue_append_optimize(queue, "user1", "box1", NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+
+	/* appending an optimize request to the background class moves it */
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, NULL);
+	test_assert(indexer_queue_count(queue) == 3);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_OPTIMIZE) == 0);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_BACKGROUND) == 3);
+
+	/* appending with a lower priority doesn't demote it */
+	indexer_queue_append_optimize(queue, "user2", "box1", NULL);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_BACKGROUND) == 3);
+
+	/* prepending moves it to the interactive class */
+	indexer_queue_append(queue, FALSE, "user2", "box1", NULL, 0, NULL);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE) == 1);
+	test_assert(indexer_queue_count_priority(queue,
+		INDEXER_REQUEST_PRIORITY_BACKGROUND) == 2);
+	request = indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE);
+	test_assert(test_request_is(request, "user2", "box1"));
+	test_assert(request->index && request->optimize);
+
+	test_request_next(queue, "user2", "box1");
+	test_request_next(queue, "user1", "box2");
+	test_request_next(queue, "user1", "box1");
+	test_assert(indexer_queue_is_empty(queue));
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_working_user(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request, *request2;
+	int context;
+
+	test_begin("indexer queue working user");
+	queue = indexer_queue_init(test_status_callback);
+
+	indexer_queue_append(queue, FALSE, "user1", "box1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "box2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "box1", NULL, 0, NULL);
+
+	/* user1 is skipped while their request is being worked on, even
+	   though their next request would otherwise come first */
+	request = test_request_start(queue, INDEXER_REQUEST_PRIORITY_OPTIMIZE);
+	test_assert(test_request_is(request, "user1", "box1"));
+	indexer_queue_append(queue, FALSE, "user1", "box2", NULL, 0, NULL);
+	request2 = indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_OPTIMIZE);
+	test_assert(test_request_is(request2, "user2", "box1"));
+	test_assert(indexer_queue_request_peek(queue,
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE) == NULL);
+
+	/* a request for the mailbox being worked on is queued again
+	   after the work finishes */
+	test_status_count = 0;
+	indexer_queue_append(queue, TRUE, "user1", "box1", NULL, 0, &context);
+	test_assert(indexer_queue_count(queue) == 3);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_assert(test_status_count == 0);
+	test_assert(indexer_queue_count(queue) == 3);
+
+	test_request_next(queue, "user1", "box2");
+	test_request_next(queue, "user1", "box1");
+	test_assert(test_status_count == 1 && test_status_percentage == 100);
+	test_request_next(queue, "user2", "box1");
+	test_assert(indexer_queue_is_empty(queue));
+	test_assert(indexer_queue_count(queue) == 0);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_indexer_queue_priorities,
+		test_indexer_queue_user_turns,
+		test_indexer_queue_promote,
+		test_indexer_queue_working_user,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -191,17 +191,23 @@ void worker_pool_release_connection(struct worker_pool *pool,
 	}
 }
 
-struct worker_connection *
-worker_pool_find_username_connection(struct worker_pool *pool,
-				     const char *username)
+unsigned int worker_pool_get_free_count(struct worker_pool *pool)
 {
 	struct worker_connection_list *list;
-	const char *worker_user;
-
-	for (list = pool->busy_list; list != NULL; list = list->next) {
-		worker_user = worker_connection_get_username(list->conn);
-		if (worker_user != NULL && strcmp(worker_user, username) == 0)
-			return list->conn;
+	unsigned int limit = 0, idle_count = 0, busy_count;
+
+	for (list = pool->busy_list; list != NULL && limit == 0; list = list->next)
+		(void)worker_connection_get_process_limit(list->conn, &limit);
+	for (list = pool->idle_list; list != NULL; list = list->next) {
+		if (limit == 0)
+			(void)worker_connection_get_process_limit(list->conn, &limit);
+		idle_count++;
+	}
+	if (limit == 0) {
+		/* the limit isn't known until the first worker has
+		   handshaked */
+		return pool->connection_count == 0 ? 1 : idle_count;
 	}
-	return NULL;
+	busy_count = pool->connection_count - idle_count;
+	return busy_count >= limit ? 0 : limit - busy_count;
 }
@@ -16,8 +16,7 @@ bool worker_pool_get_connection(struct worker_pool *pool,
 void worker_pool_release_connection(struct worker_pool *pool,
 				    struct worker_connection *conn);
 
-struct worker_connection *
-worker_pool_find_username_connection(struct worker_pool *pool,
-				     const char *username);
+/* Returns the number of connections that can still be taken into use. */
+unsigned int worker_pool_get_free_count(struct worker_pool *pool);
 
 #endif
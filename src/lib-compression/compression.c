@@ -5,6 +5,7 @@
 #include "istream-zlib.h"
 #include "ostream-zlib.h"
 #include "iostream-lz4.h"
+#include "iostream-zstd.h"
 #include "compression.h"
 
 #ifndef HAVE_ZLIB
@@ -25,6 +26,10 @@
 #  define i_stream_create_lz4 NULL
 #  define o_stream_create_lz4 NULL
 #endif
+#ifndef HAVE_ZSTD
+#  define i_stream_create_zstd NULL
+#  define o_stream_create_zstd NULL
+#endif
 
 static bool is_compressed_zlib(struct istream *input)
 {
@@ -80,6 +85,17 @@ static bool is_compressed_lz4(struct istream *input)
 	return memcmp(data, IOSTREAM_LZ4_MAGIC, IOSTREAM_LZ4_MAGIC_LEN) == 0;
 }
 
+static bool is_compressed_zstd(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_data(input, &data, &size,
+			       IOSTREAM_ZSTD_MAGIC_LEN - 1) <= 0)
+		return FALSE;
+	return memcmp(data, IOSTREAM_ZSTD_MAGIC, IOSTREAM_ZSTD_MAGIC_LEN) == 0;
+}
+
 const struct compression_handler *compression_lookup_handler(const char *name)
 {
 	unsigned int i;
@@ -121,6 +137,15 @@ compression_lookup_handler_from_ext(const char *path)
 	return NULL;
 }
 
+bool compression_istream_is_seekable_fast(struct istream *input ATTR_UNUSED)
+{
+#ifdef HAVE_ZSTD
+	return i_stream_zstd_is_seekable_fast(input);
+#else
+	return FALSE;
+#endif
+}
+
 const struct compression_handler compression_handlers[] = {
 	{ "gz", ".gz", is_compressed_zlib,
 	  i_stream_create_gz, o_stream_create_gz },
@@ -132,5 +157,7 @@ const struct compression_handler compression_handlers[] = {
 	  i_stream_create_lzma, o_stream_create_lzma },
 	{ "lz4", ".lz4", is_compressed_lz4,
 	  i_stream_create_lz4, o_stream_create_lz4 },
+	{ "zstd", ".zst", is_compressed_zstd,
+	  i_stream_create_zstd, o_stream_create_zstd },
 	{ NULL, NULL, NULL, NULL, NULL }
 };
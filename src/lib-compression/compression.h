@@ -20,5 +20,8 @@ compression_detect_handler(struct istream *input);
 /* Lookup handler based on filename extension in the path */
 const struct compression_handler *
 compression_lookup_handler_from_ext(const char *path);
+/* Returns TRUE if the decompressing input stream can seek to any offset
+   without having to decompress everything before it. */
+bool compression_istream_is_seekable_fast(struct istream *input);
 
 #endif
@@ -0,0 +1,38 @@
+#ifndef IOSTREAM_ZSTD_H
+#define IOSTREAM_ZSTD_H
+
+/*
+   Dovecot's zstd compressed files use the zstd seekable format, so they can
+   be read with any zstd decompressor:
+
+   n x (zstd frame containing max OSTREAM_ZSTD_FRAME_SIZE bytes of data)
+   skippable frame: (4 byte little-endian IOSTREAM_ZSTD_SKIPPABLE_MAGIC,
+     4 byte little-endian size of the rest of the frame,
+     n x (4 byte little-endian compressed frame size,
+          4 byte little-endian uncompressed frame size),
+     footer: (4 byte little-endian n, 1 byte descriptor,
+              4 byte little-endian IOSTREAM_ZSTD_SEEKABLE_MAGIC))
+
+   The seek table allows the istream to start decompression from the frame
+   containing the wanted offset. Like with .gz files, flushing the ostream
+   finishes the file by writing the last frame and the seek table, so
+   nothing more can be written after it.
+*/
+
+#define IOSTREAM_ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define IOSTREAM_ZSTD_MAGIC_LEN (sizeof(IOSTREAM_ZSTD_MAGIC)-1)
+
+#define IOSTREAM_ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE 8
+#define IOSTREAM_ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define IOSTREAM_ZSTD_SEEK_ENTRY_SIZE 8
+/* Seek table entries have an extra 4 byte checksum when this descriptor bit
+   is set. We don't write them, but we can skip over them. */
+#define IOSTREAM_ZSTD_SEEK_DESC_CHECKSUM 0x80
+#define IOSTREAM_ZSTD_SEEK_FOOTER_SIZE 9
+
+/* How much uncompressed data is put into each frame. This is also the
+   maximum amount that needs to be decompressed for a random access read. */
+#define OSTREAM_ZSTD_FRAME_SIZE (1024*128)
+
+#endif
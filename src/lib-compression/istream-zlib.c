@@ -454,12 +454,15 @@ static void i_stream_zlib_sync(struct istream_private *stream)
 	const struct stat *st;
 
 	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
-		if (memcmp(&zstream->last_parent_statbuf,
-			   st, sizeof(*st)) == 0) {
-			/* a compressed file doesn't change unexpectedly,
-			   don't clear our caches unnecessarily */
-			return;
-		}
+		/* we can't know if the file changed - clear the caches */
+		memset(&zstream->last_parent_statbuf, 0,
+		       sizeof(zstream->last_parent_statbuf));
+	} else if (memcmp(&zstream->last_parent_statbuf,
+			  st, sizeof(*st)) == 0) {
+		/* a compressed file doesn't change unexpectedly,
+		   don't clear our caches unnecessarily */
+		return;
+	} else {
 		zstream->last_parent_statbuf = *st;
 	}
 	i_stream_zlib_reset(zstream);
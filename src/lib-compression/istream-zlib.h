@@ -6,5 +6,10 @@ struct istream *i_stream_create_deflate(struct istream *input, bool log_errors);
 struct istream *i_stream_create_bz2(struct istream *input, bool log_errors);
 struct istream *i_stream_create_lzma(struct istream *input, bool log_errors);
 struct istream *i_stream_create_lz4(struct istream *input, bool log_errors);
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors);
+
+/* Returns TRUE if input is a zstd istream with a seek table, so seeking
+   needs to decompress only the frame containing the wanted offset. */
+bool i_stream_zstd_is_seekable_fast(struct istream *input);
 
 #endif
@@ -0,0 +1,529 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "array.h"
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include "iostream-zstd.h"
+#include <zstd.h>
+
+struct zstd_istream_frame {
+	uoff_t uncompressed_offset;
+	/* relative to parent_start_offset */
+	uoff_t compressed_offset;
+};
+
+struct zstd_istream {
+	struct istream_private istream;
+
+	ZSTD_DStream *dstream;
+	uoff_t eof_offset, stream_size;
+	size_t high_pos;
+	size_t chunk_size;
+	struct stat last_parent_statbuf;
+
+	/* frames from the seek table, if the stream has one */
+	ARRAY(struct zstd_istream_frame) frames;
+
+	unsigned int log_errors:1;
+	unsigned int marked:1;
+	/* the last frame was fully decoded - EOF is allowed here */
+	unsigned int frame_finished:1;
+	unsigned int seek_index_checked:1;
+};
+
+static void i_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+
+	if (zstream->dstream != NULL) {
+		(void)ZSTD_freeDStream(zstream->dstream);
+		zstream->dstream = NULL;
+	}
+	if (array_is_created(&zstream->frames))
+		array_free(&zstream->frames);
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void zstd_read_error(struct zstd_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "zstd.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    zstream->istream.abs_start_offset +
+			    zstream->istream.istream.v_offset);
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static void zstd_stream_end(struct zstd_istream *zstream)
+{
+	zstream->eof_offset = zstream->istream.istream.v_offset +
+		(zstream->istream.pos - zstream->istream.skip);
+	zstream->stream_size = zstream->eof_offset;
+}
+
+static ssize_t i_stream_zstd_read(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	const unsigned char *data;
+	uoff_t high_offset;
+	size_t size, ret;
+	int ret_parent;
+
+	high_offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (zstream->eof_offset == high_offset) {
+		i_assert(zstream->high_pos == 0 ||
+			 zstream->high_pos == stream->pos);
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	if (stream->pos < zstream->high_pos) {
+		/* we're here because we seeked back within the read buffer. */
+		size = zstream->high_pos - stream->pos;
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+
+		if (zstream->eof_offset != (uoff_t)-1) {
+			high_offset = stream->istream.v_offset +
+				(stream->pos - stream->skip);
+			i_assert(zstream->eof_offset == high_offset);
+			stream->istream.eof = TRUE;
+		}
+		return size;
+	}
+	zstream->high_pos = 0;
+
+	if (stream->pos + zstream->chunk_size > stream->buffer_size) {
+		/* try to keep at least one decoder output block available */
+		if (!zstream->marked && stream->skip > 0) {
+			/* don't try to keep anything cached if we don't
+			   have a seek mark. */
+			i_stream_compress(stream);
+		}
+		if (stream->max_buffer_size == 0 ||
+		    stream->buffer_size < stream->max_buffer_size)
+			i_stream_grow_buffer(stream, zstream->chunk_size);
+
+		if (stream->pos == stream->buffer_size) {
+			if (stream->skip > 0) {
+				/* lose our buffer cache */
+				i_stream_compress(stream);
+			}
+
+			if (stream->pos == stream->buffer_size)
+				return -2; /* buffer full */
+		}
+	}
+
+	ret_parent = i_stream_read_data(stream->parent, &data, &size, 0);
+	if (ret_parent < 0 && stream->parent->stream_errno != 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	if (size == 0 && zstream->frame_finished) {
+		if (ret_parent < 0) {
+			i_assert(stream->parent->eof);
+			zstd_stream_end(zstream);
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+		/* no more input */
+		i_assert(!stream->istream.blocking);
+		return 0;
+	}
+
+	/* even without new input the decoder may still have buffered output
+	   left from the previous call, since it stops when the output buffer
+	   gets full. */
+	in.src = data;
+	in.size = size;
+	in.pos = 0;
+	out.dst = stream->w_buffer + stream->pos;
+	out.size = stream->buffer_size - stream->pos;
+	out.pos = 0;
+
+	ret = ZSTD_decompressStream(zstream->dstream, &out, &in);
+	stream->pos += out.pos;
+	i_stream_skip(stream->parent, in.pos);
+
+	if (ZSTD_isError(ret)) {
+		zstd_read_error(zstream, ZSTD_getErrorName(ret));
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	/* ret=0 means that a frame was fully decoded and flushed. more
+	   frames may still follow, so EOF is detected only from the parent. */
+	zstream->frame_finished = ret == 0;
+
+	if (out.pos > 0)
+		return out.pos;
+	if (size == 0) {
+		if (ret_parent < 0) {
+			i_assert(stream->parent->eof);
+			zstd_read_error(zstream, "unexpected EOF");
+			stream->istream.stream_errno = EPIPE;
+			return -1;
+		}
+		/* no more input */
+		i_assert(!stream->istream.blocking);
+		return 0;
+	}
+	/* read more input */
+	return i_stream_zstd_read(stream);
+}
+
+static void i_stream_zstd_init(struct zstd_istream *zstream)
+{
+	size_t ret;
+
+	zstream->dstream = ZSTD_createDStream();
+	if (zstream->dstream == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	ret = ZSTD_initDStream(zstream->dstream);
+	if (ZSTD_isError(ret)) {
+		i_fatal("ZSTD_initDStream() failed: %s",
+			ZSTD_getErrorName(ret));
+	}
+	/* an empty input is a valid empty stream */
+	zstream->frame_finished = TRUE;
+}
+
+static void i_stream_zstd_reset(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	size_t ret;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->eof_offset = (uoff_t)-1;
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+	zstream->high_pos = 0;
+
+	ret = ZSTD_initDStream(zstream->dstream);
+	if (ZSTD_isError(ret)) {
+		i_fatal("ZSTD_initDStream() failed: %s",
+			ZSTD_getErrorName(ret));
+	}
+	zstream->frame_finished = TRUE;
+}
+
+static uint32_t zstd_le32(const unsigned char *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) |
+		((uint32_t)data[3] << 24);
+}
+
+static bool
+i_stream_zstd_read_seek_table(struct zstd_istream *zstream,
+			      uoff_t table_offset, unsigned int count,
+			      unsigned int entry_size)
+{
+	struct istream *parent = zstream->istream.parent;
+	struct zstd_istream_frame *frame;
+	const unsigned char *data;
+	uoff_t coffset = 0, uoffset = 0;
+	uint32_t csize, usize;
+	unsigned int i;
+	size_t size;
+
+	i_stream_seek(parent, table_offset + IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE);
+	for (i = 0; i < count; i++) {
+		if (i_stream_read_data(parent, &data, &size,
+				       entry_size - 1) <= 0)
+			return FALSE;
+		csize = zstd_le32(data);
+		usize = zstd_le32(data + 4);
+		i_stream_skip(parent, entry_size);
+
+		frame = array_append_space(&zstream->frames);
+		frame->uncompressed_offset = uoffset;
+		frame->compressed_offset = coffset;
+		coffset += csize;
+		uoffset += usize;
+	}
+	/* the frames must end exactly where the seek table begins */
+	if (zstream->istream.parent_start_offset + coffset != table_offset)
+		return FALSE;
+	zstream->stream_size = uoffset;
+	return TRUE;
+}
+
+static bool i_stream_zstd_have_seek_index(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const unsigned char *data;
+	uoff_t parent_size, table_size, table_offset;
+	unsigned int count, entry_size;
+	size_t size;
+
+	if (zstream->seek_index_checked)
+		return array_is_created(&zstream->frames);
+	zstream->seek_index_checked = TRUE;
+
+	if (!stream->parent->seekable ||
+	    i_stream_get_size(stream->parent, TRUE, &parent_size) <= 0)
+		return FALSE;
+	if (parent_size < stream->parent_start_offset +
+	    IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE + IOSTREAM_ZSTD_SEEK_FOOTER_SIZE)
+		return FALSE;
+
+	/* the parent's offset gets restored by the next i_stream_read() */
+	i_stream_seek(stream->parent,
+		      parent_size - IOSTREAM_ZSTD_SEEK_FOOTER_SIZE);
+	if (i_stream_read_data(stream->parent, &data, &size,
+			       IOSTREAM_ZSTD_SEEK_FOOTER_SIZE - 1) <= 0)
+		return FALSE;
+	if (zstd_le32(data + 5) != IOSTREAM_ZSTD_SEEKABLE_MAGIC)
+		return FALSE;
+	if ((data[4] & ~IOSTREAM_ZSTD_SEEK_DESC_CHECKSUM) != 0) {
+		/* reserved bits set - unknown format */
+		return FALSE;
+	}
+	count = zstd_le32(data);
+	entry_size = IOSTREAM_ZSTD_SEEK_ENTRY_SIZE +
+		((data[4] & IOSTREAM_ZSTD_SEEK_DESC_CHECKSUM) != 0 ? 4 : 0);
+	table_size = (uoff_t)count * entry_size +
+		IOSTREAM_ZSTD_SEEK_FOOTER_SIZE;
+	if (table_size + IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE >
+	    parent_size - stream->parent_start_offset)
+		return FALSE;
+	table_offset = parent_size - table_size -
+		IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE;
+
+	i_stream_seek(stream->parent, table_offset);
+	if (i_stream_read_data(stream->parent, &data, &size,
+			       IOSTREAM_ZSTD_SKIPPABLE_HEADER_SIZE - 1) <= 0)
+		return FALSE;
+	if (zstd_le32(data) != IOSTREAM_ZSTD_SKIPPABLE_MAGIC ||
+	    zstd_le32(data + 4) != table_size)
+		return FALSE;
+
+	i_array_init(&zstream->frames, count);
+	if (!i_stream_zstd_read_seek_table(zstream, table_offset,
+					   count, entry_size) ||
+	    array_count(&zstream->frames) == 0) {
+		array_free(&zstream->frames);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+i_stream_zstd_seek_frame(struct zstd_istream *zstream, uoff_t v_offset)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct zstd_istream_frame *frames;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+	uoff_t high_offset;
+	unsigned int idx, left, right, count;
+	size_t ret;
+
+	high_offset = start_offset + I_MAX(stream->pos, zstream->high_pos);
+	if (v_offset >= start_offset && v_offset <= high_offset) {
+		/* already in buffer */
+		return FALSE;
+	}
+	if (!i_stream_zstd_have_seek_index(zstream))
+		return FALSE;
+
+	/* find the last frame starting at or before v_offset */
+	frames = array_get(&zstream->frames, &count);
+	left = 0; right = count;
+	while (right - left > 1) {
+		idx = (left + right) / 2;
+		if (frames[idx].uncompressed_offset <= v_offset)
+			left = idx;
+		else
+			right = idx;
+	}
+	if (v_offset > start_offset &&
+	    frames[left].uncompressed_offset <= high_offset) {
+		/* the frame is already being decompressed,
+		   just continue reading forward */
+		return FALSE;
+	}
+
+	i_stream_seek(stream->parent, stream->parent_start_offset +
+		      frames[left].compressed_offset);
+	stream->parent_expected_offset = stream->parent->v_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = frames[left].uncompressed_offset;
+	zstream->high_pos = 0;
+
+	ret = ZSTD_initDStream(zstream->dstream);
+	if (ZSTD_isError(ret)) {
+		i_fatal("ZSTD_initDStream() failed: %s",
+			ZSTD_getErrorName(ret));
+	}
+	zstream->frame_finished = TRUE;
+	return TRUE;
+}
+
+static void
+i_stream_zstd_seek(struct istream_private *stream, uoff_t v_offset, bool mark)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+
+	if (i_stream_zstd_seek_frame(zstream, v_offset)) {
+		/* continue from the beginning of the frame */
+		start_offset = stream->istream.v_offset;
+	} else if (v_offset < start_offset) {
+		/* have to seek backwards */
+		i_stream_zstd_reset(zstream);
+		start_offset = 0;
+	} else if (zstream->high_pos != 0) {
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+	}
+
+	if (v_offset <= start_offset + stream->pos) {
+		/* seeking backwards within what's already cached */
+		stream->skip = v_offset - start_offset;
+		stream->istream.v_offset = v_offset;
+		zstream->high_pos = stream->pos;
+		stream->pos = stream->skip;
+	} else {
+		/* read and cache forward */
+		do {
+			size_t avail = stream->pos - stream->skip;
+
+			if (stream->istream.v_offset + avail >= v_offset) {
+				i_stream_skip(&stream->istream,
+					      v_offset -
+					      stream->istream.v_offset);
+				break;
+			}
+
+			i_stream_skip(&stream->istream, avail);
+		} while (i_stream_read(&stream->istream) >= 0);
+
+		if (stream->istream.v_offset != v_offset) {
+			/* some failure, we've broken it */
+			if (stream->istream.stream_errno != 0) {
+				i_error("zstd_istream.seek(%s) failed: %s",
+					i_stream_get_name(&stream->istream),
+					strerror(stream->istream.stream_errno));
+				i_stream_close(&stream->istream);
+			} else {
+				/* unexpected EOF. allow it since we may just
+				   want to check if there's anything.. */
+				i_assert(stream->istream.eof);
+			}
+		}
+	}
+
+	if (mark)
+		zstream->marked = TRUE;
+}
+
+static int
+i_stream_zstd_stat(struct istream_private *stream, bool exact)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+	size_t size;
+
+	if (i_stream_stat(stream->parent, exact, &st) < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	stream->statbuf = *st;
+
+	/* when exact=FALSE always return the parent stat's size, even if we
+	   know the exact value. this is necessary because otherwise e.g. mbox
+	   code can see two different values and think that a compressed mbox
+	   file keeps changing. */
+	if (!exact)
+		return 0;
+
+	if (zstream->stream_size == (uoff_t)-1 &&
+	    !i_stream_zstd_have_seek_index(zstream)) {
+		uoff_t old_offset = stream->istream.v_offset;
+
+		do {
+			size = i_stream_get_data_size(&stream->istream);
+			i_stream_skip(&stream->istream, size);
+		} while (i_stream_read(&stream->istream) > 0);
+
+		i_stream_seek(&stream->istream, old_offset);
+		if (zstream->stream_size == (uoff_t)-1)
+			return -1;
+	}
+	stream->statbuf.st_size = zstream->stream_size;
+	return 0;
+}
+
+static void i_stream_zstd_sync(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		/* we can't know if the file changed - clear the caches */
+		memset(&zstream->last_parent_statbuf, 0,
+		       sizeof(zstream->last_parent_statbuf));
+	} else if (memcmp(&zstream->last_parent_statbuf,
+			  st, sizeof(*st)) == 0) {
+		/* a compressed file doesn't change unexpectedly,
+		   don't clear our caches unnecessarily */
+		return;
+	} else {
+		zstream->last_parent_statbuf = *st;
+	}
+	i_stream_zstd_reset(zstream);
+	zstream->stream_size = (uoff_t)-1;
+	if (array_is_created(&zstream->frames))
+		array_free(&zstream->frames);
+	zstream->seek_index_checked = FALSE;
+}
+
+bool i_stream_zstd_is_seekable_fast(struct istream *input)
+{
+	struct zstd_istream *zstream;
+
+	if (input->real_stream->read != i_stream_zstd_read)
+		return FALSE;
+	zstream = (struct zstd_istream *)input->real_stream;
+	return i_stream_zstd_have_seek_index(zstream);
+}
+
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors)
+{
+	struct zstd_istream *zstream;
+
+	zstream = i_new(struct zstd_istream, 1);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->stream_size = (uoff_t)-1;
+	zstream->log_errors = log_errors;
+	/* the decoder flushes at most one block at a time */
+	zstream->chunk_size = ZSTD_DStreamOutSize();
+
+	i_stream_zstd_init(zstream);
+
+	zstream->istream.iostream.close = i_stream_zstd_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_zstd_read;
+	zstream->istream.seek = i_stream_zstd_seek;
+	zstream->istream.stat = i_stream_zstd_stat;
+	zstream->istream.sync = i_stream_zstd_sync;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input));
+}
+#endif
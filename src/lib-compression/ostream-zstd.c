@@ -0,0 +1,247 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "array.h"
+#include "buffer.h"
+#include "ostream-private.h"
+#include "ostream-zlib.h"
+#include "iostream-zstd.h"
+#include <zstd.h>
+
+struct zstd_ostream_frame {
+	uint32_t compressed_size;
+	uint32_t uncompressed_size;
+};
+
+struct zstd_ostream {
+	struct ostream_private ostream;
+	ZSTD_CCtx *cctx;
+	int level;
+
+	/* uncompressed data for the current frame */
+	buffer_t *inbuf;
+	/* compressed data waiting to be sent to parent */
+	buffer_t *outbuf;
+	size_t outbuf_offset;
+
+	ARRAY(struct zstd_ostream_frame) frames;
+
+	unsigned int finished:1;
+};
+
+static void o_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+
+	(void)o_stream_flush(&zstream->ostream.ostream);
+	if (close_parent)
+		o_stream_close(zstream->ostream.parent);
+}
+
+static void o_stream_zstd_destroy(struct iostream_private *stream)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+
+	(void)ZSTD_freeCCtx(zstream->cctx);
+	buffer_free(&zstream->inbuf);
+	buffer_free(&zstream->outbuf);
+	array_free(&zstream->frames);
+	o_stream_unref(&zstream->ostream.parent);
+}
+
+static void zstd_buffer_append_le32(buffer_t *buf, uint32_t num)
+{
+	unsigned char data[4];
+
+	data[0] = num & 0xff;
+	data[1] = (num >> 8) & 0xff;
+	data[2] = (num >> 16) & 0xff;
+	data[3] = (num >> 24) & 0xff;
+	buffer_append(buf, data, sizeof(data));
+}
+
+static int o_stream_zstd_send_outbuf(struct zstd_ostream *zstream)
+{
+	ssize_t ret;
+	size_t size;
+
+	if (zstream->outbuf->used == 0)
+		return 1;
+
+	size = zstream->outbuf->used - zstream->outbuf_offset;
+	i_assert(size > 0);
+	ret = o_stream_send(zstream->ostream.parent,
+			    CONST_PTR_OFFSET(zstream->outbuf->data,
+					     zstream->outbuf_offset), size);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&zstream->ostream);
+		return -1;
+	}
+	if ((size_t)ret != size) {
+		zstream->outbuf_offset += ret;
+		return 0;
+	}
+	zstream->outbuf_offset = 0;
+	buffer_set_used_size(zstream->outbuf, 0);
+	return 1;
+}
+
+static void o_stream_zstd_compress_frame(struct zstd_ostream *zstream)
+{
+	struct zstd_ostream_frame *frame;
+	size_t bound, ret, old_used = zstream->outbuf->used;
+	void *dest;
+
+	bound = ZSTD_compressBound(zstream->inbuf->used);
+	dest = buffer_append_space_unsafe(zstream->outbuf, bound);
+	ret = ZSTD_compressCCtx(zstream->cctx, dest, bound,
+				zstream->inbuf->data, zstream->inbuf->used,
+				zstream->level);
+	if (ZSTD_isError(ret)) {
+		i_panic("zstd.write(%s) failed: %s",
+			o_stream_get_name(&zstream->ostream.ostream),
+			ZSTD_getErrorName(ret));
+	}
+	buffer_set_used_size(zstream->outbuf, old_used + ret);
+
+	frame = array_append_space(&zstream->frames);
+	frame->compressed_size = ret;
+	frame->uncompressed_size = zstream->inbuf->used;
+	buffer_set_used_size(zstream->inbuf, 0);
+}
+
+static void o_stream_zstd_append_seek_table(struct zstd_ostream *zstream)
+{
+	buffer_t *buf = zstream->outbuf;
+	const struct zstd_ostream_frame *frame;
+	unsigned int count = array_count(&zstream->frames);
+
+	zstd_buffer_append_le32(buf, IOSTREAM_ZSTD_SKIPPABLE_MAGIC);
+	zstd_buffer_append_le32(buf, count * IOSTREAM_ZSTD_SEEK_ENTRY_SIZE +
+				IOSTREAM_ZSTD_SEEK_FOOTER_SIZE);
+	array_foreach(&zstream->frames, frame) {
+		zstd_buffer_append_le32(buf, frame->compressed_size);
+		zstd_buffer_append_le32(buf, frame->uncompressed_size);
+	}
+	zstd_buffer_append_le32(buf, count);
+	/* descriptor: no checksums */
+	buffer_append_c(buf, 0);
+	zstd_buffer_append_le32(buf, IOSTREAM_ZSTD_SEEKABLE_MAGIC);
+}
+
+static int o_stream_zstd_send_flush(struct zstd_ostream *zstream)
+{
+	int ret;
+
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0)
+		return ret;
+	if (zstream->finished)
+		return 1;
+
+	if ((ret = o_stream_flush_parent_if_needed(&zstream->ostream)) <= 0)
+		return ret;
+
+	/* an empty stream still gets an empty frame, so the output begins
+	   with the zstd magic and can be detected as compressed. */
+	if (zstream->inbuf->used > 0 || array_count(&zstream->frames) == 0)
+		o_stream_zstd_compress_frame(zstream);
+	/* the seek table lists all the frames, so it's written only once
+	   and the stream can't be written to after it */
+	o_stream_zstd_append_seek_table(zstream);
+	zstream->finished = TRUE;
+	return o_stream_zstd_send_outbuf(zstream);
+}
+
+static int o_stream_zstd_flush(struct ostream_private *stream)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+	int ret;
+
+	if ((ret = o_stream_zstd_send_flush(zstream)) <= 0)
+		return ret;
+
+	ret = o_stream_flush(stream->parent);
+	if (ret < 0)
+		o_stream_copy_error_from_parent(stream);
+	return ret;
+}
+
+static ssize_t
+o_stream_zstd_sendv(struct ostream_private *stream,
+		    const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+	const unsigned char *data;
+	ssize_t bytes = 0;
+	size_t size, avail;
+	unsigned int i;
+	int ret;
+
+	if (zstream->finished) {
+		i_panic("zstd.write(%s) failed: Can't write more data to .zst after flushing",
+			o_stream_get_name(&stream->ostream));
+	}
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+
+	for (i = 0; i < iov_count && ret > 0; i++) {
+		data = iov[i].iov_base;
+		size = iov[i].iov_len;
+		while (size > 0) {
+			avail = OSTREAM_ZSTD_FRAME_SIZE - zstream->inbuf->used;
+			if (avail > size)
+				avail = size;
+			buffer_append(zstream->inbuf, data, avail);
+			data += avail;
+			size -= avail;
+			bytes += avail;
+
+			if (zstream->inbuf->used == OSTREAM_ZSTD_FRAME_SIZE) {
+				o_stream_zstd_compress_frame(zstream);
+				if ((ret = o_stream_zstd_send_outbuf(zstream)) < 0)
+					return -1;
+				if (ret == 0) {
+					/* parent stream's buffer full */
+					break;
+				}
+			}
+		}
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+struct ostream *o_stream_create_zstd(struct ostream *output, int level)
+{
+	struct zstd_ostream *zstream;
+
+	/* the levels map directly to zstd's own levels. 1..9 covers the
+	   useful range for mail; higher levels are mainly for archiving. */
+	i_assert(level >= 1 && level <= ZSTD_maxCLevel());
+
+	zstream = i_new(struct zstd_ostream, 1);
+	zstream->ostream.sendv = o_stream_zstd_sendv;
+	zstream->ostream.flush = o_stream_zstd_flush;
+	zstream->ostream.iostream.close = o_stream_zstd_close;
+	zstream->ostream.iostream.destroy = o_stream_zstd_destroy;
+
+	zstream->cctx = ZSTD_createCCtx();
+	if (zstream->cctx == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	zstream->level = level;
+	zstream->inbuf = buffer_create_dynamic(default_pool,
+					       OSTREAM_ZSTD_FRAME_SIZE);
+	zstream->outbuf = buffer_create_dynamic(default_pool,
+		ZSTD_compressBound(OSTREAM_ZSTD_FRAME_SIZE));
+	i_array_init(&zstream->frames, 16);
+	return o_stream_create(&zstream->ostream, output,
+			       o_stream_get_fd(output));
+}
+#endif
@@ -1,12 +1,14 @@
 /* Copyright (c) 2014-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "istream.h"
 #include "ostream.h"
 #include "sha1.h"
 #include "randgen.h"
 #include "test-common.h"
 #include "compression.h"
+#include "iostream-zstd.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -94,6 +96,313 @@ static void test_compression(void)
 	}
 }
 
+static void
+test_compression_write_data(const struct compression_handler *handler,
+			    buffer_t *compressed, const void *data, size_t size)
+{
+	struct ostream *buf_output, *output;
+
+	buf_output = o_stream_create_buffer(compressed);
+	output = handler->create_ostream(buf_output, 1);
+	test_assert(o_stream_send(output, data, size) == (ssize_t)size);
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+}
+
+static void test_compression_detect(void)
+{
+	const char *data = "hello world";
+	buffer_t *compressed = buffer_create_dynamic(default_pool, 128);
+	struct istream *input;
+	unsigned int i;
+
+	test_begin("compression detect handler");
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		const struct compression_handler *handler =
+			&compression_handlers[i];
+
+		if (handler->is_compressed == NULL ||
+		    handler->create_ostream == NULL)
+			continue;
+
+		buffer_set_used_size(compressed, 0);
+		test_compression_write_data(handler, compressed,
+					    data, strlen(data));
+		input = i_stream_create_from_data(compressed->data,
+						  compressed->used);
+		test_assert_idx(compression_detect_handler(input) == handler, i);
+		i_stream_unref(&input);
+	}
+	buffer_free(&compressed);
+	test_end();
+}
+
+static void test_compression_seek(void)
+{
+	const struct compression_handler *handler;
+	buffer_t *compressed = buffer_create_dynamic(default_pool, 1024);
+	unsigned char *data;
+	const unsigned char *rdata;
+	struct istream *input, *file_input;
+	size_t i, size, data_size = 1024*512;
+	const uoff_t offsets[] = { 300000, 100, 500000, 0, 250000 };
+
+	handler = compression_lookup_handler("zstd");
+	if (handler == NULL || handler->create_istream == NULL)
+		return;
+
+	test_begin("compression zstd seek");
+	data = i_malloc(data_size);
+	for (i = 0; i < data_size; i++)
+		data[i] = (i * 31) ^ (i >> 11);
+	test_compression_write_data(handler, compressed, data, data_size);
+
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used);
+	input = handler->create_istream(file_input, FALSE);
+	for (i = 0; i < N_ELEMENTS(offsets); i++) {
+		i_stream_seek(input, offsets[i]);
+		test_assert_idx(i_stream_read_data(input, &rdata, &size, 0) > 0, i);
+		test_assert_idx(size > 0 && rdata[0] == data[offsets[i]], i);
+	}
+	/* seeking past EOF */
+	i_stream_seek(input, data_size + 1);
+	test_assert(i_stream_read(input) == -1 && input->stream_errno == 0);
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	/* input arriving a few bytes at a time */
+	file_input = test_istream_create_data(compressed->data,
+					      compressed->used);
+	test_istream_set_allow_eof(file_input, FALSE);
+	input = handler->create_istream(file_input, FALSE);
+	for (i = 1; i <= compressed->used; i += 7) {
+		test_istream_set_size(file_input, i);
+		while (i_stream_read_data(input, &rdata, &size, 0) > 0)
+			i_stream_skip(input, size);
+	}
+	test_istream_set_size(file_input, compressed->used);
+	test_istream_set_allow_eof(file_input, TRUE);
+	while (i_stream_read_data(input, &rdata, &size, 0) > 0)
+		i_stream_skip(input, size);
+	test_assert(input->v_offset == data_size && input->stream_errno == 0);
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	/* a truncated stream must give an error */
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used / 2);
+	input = handler->create_istream(file_input, FALSE);
+	while (i_stream_read_data(input, &rdata, &size, 0) > 0)
+		i_stream_skip(input, size);
+	test_assert(input->stream_errno != 0);
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	/* multiple frames are read as one stream */
+	buffer_set_used_size(compressed, 0);
+	test_compression_write_data(handler, compressed, "foo", 3);
+	test_compression_write_data(handler, compressed, "bar", 3);
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(i_stream_read_data(input, &rdata, &size, 5) > 0 &&
+		    size == 6 && memcmp(rdata, "foobar", 6) == 0);
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	i_free(data);
+	buffer_free(&compressed);
+	test_end();
+}
+
+static void
+test_compression_zstd_verify_seeks(struct istream *input,
+				   const unsigned char *data, size_t data_size)
+{
+	const unsigned char *rdata;
+	unsigned int i;
+	size_t size;
+	uoff_t offset;
+
+	for (i = 0; i < 100; i++) {
+		offset = rand() % data_size;
+		i_stream_seek(input, offset);
+		if (i_stream_read_data(input, &rdata, &size, 0) <= 0) {
+			test_assert_idx(FALSE, i);
+			break;
+		}
+		size = I_MIN(size, data_size - offset);
+		test_assert_idx(memcmp(rdata, data + offset, size) == 0, i);
+	}
+}
+
+static void test_compression_zstd_seek_index(void)
+{
+	const struct compression_handler *handler;
+	buffer_t *compressed = buffer_create_dynamic(default_pool, 1024);
+	struct istream *input, *file_input;
+	struct ostream *buf_output, *output;
+	unsigned char *data;
+	size_t i, flushed_size, data_size = 1024*1024 + 1234;
+	uoff_t size;
+
+	handler = compression_lookup_handler("zstd");
+	if (handler == NULL || handler->create_istream == NULL)
+		return;
+
+	test_begin("compression zstd seek index");
+	data = i_malloc(data_size);
+	for (i = 0; i < data_size; i++)
+		data[i] = (i * 31) ^ (i >> 11) ^ (rand() % 2);
+	test_compression_write_data(handler, compressed, data, data_size);
+
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(compression_istream_is_seekable_fast(input));
+	/* the size comes from the seek table without decompressing */
+	test_assert(i_stream_get_size(input, TRUE, &size) == 1 &&
+		    size == data_size);
+	test_assert(input->v_offset == 0);
+	test_compression_zstd_verify_seeks(input, data, data_size);
+
+	/* syncing doesn't reset the stream if the parent didn't change */
+	i_stream_sync(input);
+	i_stream_seek(input, 500000);
+	test_assert(i_stream_read(input) > 0);
+	i_stream_sync(input);
+	test_assert(input->v_offset == 500000);
+	test_assert(compression_istream_is_seekable_fast(input));
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	/* flushing writes the seek table. nothing more is written after
+	   it, not even when the stream is closed. */
+	buffer_set_used_size(compressed, 0);
+	buf_output = o_stream_create_buffer(compressed);
+	output = handler->create_ostream(buf_output, 1);
+	o_stream_nsend(output, data, data_size);
+	test_assert(o_stream_nfinish(output) == 0);
+	flushed_size = compressed->used;
+	test_assert(o_stream_flush(output) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+	test_assert(compressed->used == flushed_size);
+
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(compression_istream_is_seekable_fast(input));
+	test_compression_zstd_verify_seeks(input, data, data_size);
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	/* failing to write the last frame and the seek table is reported
+	   by the flush */
+	buf_output = o_stream_create_buffer(compressed);
+	output = handler->create_ostream(buf_output, 1);
+	o_stream_nsend(output, data, 1000);
+	o_stream_close(buf_output);
+	test_assert(o_stream_nfinish(output) < 0);
+	test_assert(output->stream_errno != 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+	test_assert(compressed->used == flushed_size);
+
+	/* a broken seek table isn't used */
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used - 1);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(!compression_istream_is_seekable_fast(input));
+	i_stream_unref(&input);
+	i_stream_unref(&file_input);
+
+	i_free(data);
+	buffer_free(&compressed);
+	test_end();
+}
+
+#define TEST_COMPRESSION_BENCHMARK_SEEKS 20
+
+static void
+test_compression_benchmark_handler(const struct compression_handler *handler,
+				   const unsigned char *data, size_t data_size)
+{
+	buffer_t *compressed = buffer_create_dynamic(default_pool, data_size);
+	struct istream *mem_input, *input;
+	const unsigned char *rdata;
+	struct timespec ts;
+	double write_secs, read_secs, seek_secs;
+	unsigned int i;
+	size_t size;
+
+	test_benchmark_start(&ts);
+	test_compression_write_data(handler, compressed, data, data_size);
+	write_secs = test_benchmark_secs(&ts);
+
+	test_benchmark_start(&ts);
+	mem_input = i_stream_create_from_data(compressed->data,
+					      compressed->used);
+	input = handler->create_istream(mem_input, FALSE);
+	while (i_stream_read_data(input, &rdata, &size, 0) > 0)
+		i_stream_skip(input, size);
+	read_secs = test_benchmark_secs(&ts);
+	test_assert(input->v_offset == data_size);
+
+	/* random access reads, like partial IMAP FETCHes. deflate is used
+	   only for streaming (IMAP COMPRESS), so skip it. */
+	test_benchmark_start(&ts);
+	for (i = 0; i < TEST_COMPRESSION_BENCHMARK_SEEKS &&
+	     handler->ext != NULL; i++) {
+		i_stream_seek(input, rand() % data_size);
+		(void)i_stream_read_data(input, &rdata, &size, 0);
+	}
+	seek_secs = test_benchmark_secs(&ts);
+	i_stream_unref(&input);
+	i_stream_unref(&mem_input);
+
+	test_out_reason(t_strdup_printf("compression benchmark %s",
+					handler->name), TRUE,
+		t_strdup_printf("ratio %.2f, compress %.0f MB/s, "
+				"decompress %.0f MB/s, random read %.3f ms",
+				(double)data_size / compressed->used,
+				data_size / write_secs / (1024*1024),
+				data_size / read_secs / (1024*1024),
+				seek_secs * 1000 /
+				TEST_COMPRESSION_BENCHMARK_SEEKS));
+	buffer_free(&compressed);
+}
+
+static void test_compression_benchmark(void)
+{
+	const size_t data_size = 1024*1024*32;
+	unsigned char *data;
+	unsigned int i;
+	size_t pos, len;
+
+	if (!test_benchmarks_enabled())
+		return;
+
+	/* mail-like data: text lines with plenty of repetition */
+	data = i_malloc(data_size);
+	for (pos = 0; pos < data_size; pos += len) T_BEGIN {
+		const char *line = t_strdup_printf(
+			"Line %u of some message body with text %x\r\n",
+			rand() % 1000, rand());
+		len = I_MIN(strlen(line), data_size - pos);
+		memcpy(data + pos, line, len);
+	} T_END;
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		if (compression_handlers[i].create_istream != NULL) {
+			test_compression_benchmark_handler(
+				&compression_handlers[i], data, data_size);
+		}
+	}
+	i_free(data);
+}
+
 static void test_compress_file(const char *in_path, const char *out_path)
 {
 	const struct compression_handler *handler;
@@ -159,6 +468,10 @@ int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
 		test_compression,
+		test_compression_detect,
+		test_compression_seek,
+		test_compression_zstd_seek_index,
+		test_compression_benchmark,
 		NULL
 	};
 	if (argc == 3) {
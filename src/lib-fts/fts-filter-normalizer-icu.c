@@ -3,6 +3,8 @@
 #include "lib.h"
 #include "buffer.h"
 #include "str.h"
+#include "hash.h"
+#include "llist.h"
 #include "unichar.h" /* unicode replacement char */
 #include "fts-filter-private.h"
 #include "fts-language.h"
@@ -10,6 +12,16 @@
 #ifdef HAVE_LIBICU
 #include "fts-icu.h"
 
+/* Remember this many of the most recently normalized tokens */
+#define FTS_NORMALIZER_ICU_CACHE_MAX_COUNT 1024
+
+struct fts_normalizer_icu_cache_entry {
+	struct fts_normalizer_icu_cache_entry *prev, *next;
+	char *token;
+	/* NULL if the token normalizes into an empty string */
+	char *normalized;
+};
+
 struct fts_filter_normalizer_icu {
 	struct fts_filter filter;
 	pool_t pool;
@@ -18,13 +30,64 @@ struct fts_filter_normalizer_icu {
 	UTransliterator *transliterator;
 	buffer_t *utf16_token, *trans_token;
 	string_t *utf8_token;
+
+	HASH_TABLE(char *, struct fts_normalizer_icu_cache_entry *) cache;
+	/* least recently used first */
+	struct fts_normalizer_icu_cache_entry *cache_head, *cache_tail;
+	unsigned int cache_count;
 };
 
+static void
+fts_normalizer_icu_cache_remove(struct fts_filter_normalizer_icu *np,
+				struct fts_normalizer_icu_cache_entry *entry)
+{
+	hash_table_remove(np->cache, entry->token);
+	DLLIST2_REMOVE(&np->cache_head, &np->cache_tail, entry);
+	np->cache_count--;
+	i_free(entry->token);
+	i_free(entry->normalized);
+	i_free(entry);
+}
+
+static struct fts_normalizer_icu_cache_entry *
+fts_normalizer_icu_cache_lookup(struct fts_filter_normalizer_icu *np,
+				const char *token)
+{
+	struct fts_normalizer_icu_cache_entry *entry;
+
+	entry = hash_table_lookup(np->cache, token);
+	if (entry != NULL) {
+		DLLIST2_REMOVE(&np->cache_head, &np->cache_tail, entry);
+		DLLIST2_APPEND(&np->cache_head, &np->cache_tail, entry);
+	}
+	return entry;
+}
+
+static struct fts_normalizer_icu_cache_entry *
+fts_normalizer_icu_cache_add(struct fts_filter_normalizer_icu *np,
+			     const char *token)
+{
+	struct fts_normalizer_icu_cache_entry *entry;
+
+	if (np->cache_count >= FTS_NORMALIZER_ICU_CACHE_MAX_COUNT)
+		fts_normalizer_icu_cache_remove(np, np->cache_head);
+
+	entry = i_new(struct fts_normalizer_icu_cache_entry, 1);
+	entry->token = i_strdup(token);
+	hash_table_insert(np->cache, entry->token, entry);
+	DLLIST2_APPEND(&np->cache_head, &np->cache_tail, entry);
+	np->cache_count++;
+	return entry;
+}
+
 static void fts_filter_normalizer_icu_destroy(struct fts_filter *filter)
 {
 	struct fts_filter_normalizer_icu *np =
 		(struct fts_filter_normalizer_icu *)filter;
 
+	while (np->cache_head != NULL)
+		fts_normalizer_icu_cache_remove(np, np->cache_head);
+	hash_table_destroy(&np->cache);
 	if (np->transliterator != NULL)
 		utrans_close(np->transliterator);
 	pool_unref(&np->pool);
@@ -61,6 +124,7 @@ fts_filter_normalizer_icu_create(const struct fts_language *lang ATTR_UNUSED,
 	np->utf16_token = buffer_create_dynamic(pp, 128);
 	np->trans_token = buffer_create_dynamic(pp, 128);
 	np->utf8_token = buffer_create_dynamic(pp, 128);
+	hash_table_create(&np->cache, default_pool, 0, str_hash, strcmp);
 	*filter_r = &np->filter;
 	return 0;
 }
@@ -71,6 +135,19 @@ fts_filter_normalizer_icu_filter(struct fts_filter *filter, const char **token,
 {
 	struct fts_filter_normalizer_icu *np =
 		(struct fts_filter_normalizer_icu *)filter;
+	struct fts_normalizer_icu_cache_entry *entry;
+
+	/* the same words tend to be repeated a lot (e.g. names and
+	   header values), so try to avoid translating them again */
+	entry = fts_normalizer_icu_cache_lookup(np, *token);
+	if (entry != NULL) {
+		if (entry->normalized == NULL)
+			return 0;
+		str_truncate(np->utf8_token, 0);
+		str_append(np->utf8_token, entry->normalized);
+		*token = str_c(np->utf8_token);
+		return 1;
+	}
 
 	if (np->transliterator == NULL)
 		if (fts_icu_transliterator_create(np->transliterator_id,
@@ -87,11 +164,14 @@ fts_filter_normalizer_icu_filter(struct fts_filter *filter, const char **token,
 			      np->transliterator, error_r) < 0)
 		return -1;
 
+	/* add before *token gets overwritten - it may point to utf8_token */
+	entry = fts_normalizer_icu_cache_add(np, *token);
 	if (np->trans_token->used == 0)
 		return 0;
 
 	fts_icu_utf16_to_utf8(np->utf8_token, np->trans_token->data,
 			      np->trans_token->used / sizeof(UChar));
+	entry->normalized = i_strdup(str_c(np->utf8_token));
 	*token = str_c(np->utf8_token);
 	return 1;
 }
@@ -1,6 +1,7 @@
 /* Copyright (c) 2014-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "mempool.h"
 #include "buffer.h"
 #include "str.h"
@@ -11,7 +12,16 @@
 #include <unicode/ucasemap.h>
 #include <unicode/uclean.h>
 
+struct fts_icu_transliterator {
+	char *id;
+	UTransliterator *transliterator;
+};
+
 static struct UCaseMap *icu_csm = NULL;
+/* Opening a transliterator compiles its rules, which is slow. Keep the
+   compiled ones and give out clones of them. */
+static ARRAY(struct fts_icu_transliterator) icu_transliterators =
+	ARRAY_INIT;
 
 static struct UCaseMap *fts_icu_csm(void)
 {
@@ -160,6 +170,15 @@ void fts_icu_lcase(string_t *dest_utf8, const char *src_utf8)
 
 void fts_icu_deinit(void)
 {
+	struct fts_icu_transliterator *trans;
+
+	if (array_is_created(&icu_transliterators)) {
+		array_foreach_modifiable(&icu_transliterators, trans) {
+			utrans_close(trans->transliterator);
+			i_free(trans->id);
+		}
+		array_free(&icu_transliterators);
+	}
 	if (icu_csm != NULL) {
 		ucasemap_close(icu_csm);
 		icu_csm = NULL;
@@ -167,9 +186,9 @@ void fts_icu_deinit(void)
 	u_cleanup();
 }
 
-int fts_icu_transliterator_create(const char *id,
-                                  UTransliterator **transliterator_r,
-                                  const char **error_r)
+static int fts_icu_transliterator_open(const char *id,
+				       UTransliterator **transliterator_r,
+				       const char **error_r)
 {
 	UErrorCode err = U_ZERO_ERROR;
 	UParseError perr;
@@ -197,3 +216,46 @@ int fts_icu_transliterator_create(const char *id,
 	}
 	return 0;
 }
+
+static struct fts_icu_transliterator *
+fts_icu_transliterator_find(const char *id)
+{
+	struct fts_icu_transliterator *trans;
+
+	if (!array_is_created(&icu_transliterators))
+		return NULL;
+	array_foreach_modifiable(&icu_transliterators, trans) {
+		if (strcmp(trans->id, id) == 0)
+			return trans;
+	}
+	return NULL;
+}
+
+int fts_icu_transliterator_create(const char *id,
+                                  UTransliterator **transliterator_r,
+                                  const char **error_r)
+{
+	struct fts_icu_transliterator *trans;
+	UTransliterator *transliterator;
+	UErrorCode err = U_ZERO_ERROR;
+
+	trans = fts_icu_transliterator_find(id);
+	if (trans == NULL) {
+		if (fts_icu_transliterator_open(id, &transliterator,
+						error_r) < 0)
+			return -1;
+		if (!array_is_created(&icu_transliterators))
+			i_array_init(&icu_transliterators, 4);
+		trans = array_append_space(&icu_transliterators);
+		trans->id = i_strdup(id);
+		trans->transliterator = transliterator;
+	}
+
+	*transliterator_r = utrans_clone(trans->transliterator, &err);
+	if (U_FAILURE(err)) {
+		*error_r = t_strdup_printf("LibICU utrans_clone() failed: %s",
+					   u_errorName(err));
+		return -1;
+	}
+	return 0;
+}
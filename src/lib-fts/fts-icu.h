@@ -19,6 +19,9 @@ void fts_icu_lcase(string_t *dest_utf8, const char *src_utf8);
 /* Free all the memory used by ICU functions. */
 void fts_icu_deinit(void);
 
+/* Create a transliterator for the given id. The compiled transliterators are
+   cached until fts_icu_deinit(), so creating the same id again is cheap.
+   The returned transliterator must be freed with utrans_close(). */
 int fts_icu_transliterator_create(const char *id,
                                   UTransliterator **transliterator_r,
                                   const char **error_r) ;
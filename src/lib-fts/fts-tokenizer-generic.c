@@ -27,6 +27,21 @@ static unsigned char fts_ascii_word_breaks[128] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0  /* 112-127: {|}~ */
 };
 
+/* Returns the number of bytes at the beginning of data that are ASCII
+   characters that can't end a word in the simple algorithm. */
+static size_t
+fts_ascii_word_chars_count(const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] >= 0x80 || fts_ascii_word_breaks[data[i]] != 0 ||
+		    data[i] == '\'')
+			break;
+	}
+	return i;
+}
+
 static int
 fts_tokenizer_generic_create(const char *const *settings,
 			     struct fts_tokenizer **tokenizer_r,
@@ -200,12 +215,21 @@ fts_tokenizer_generic_simple_next(struct fts_tokenizer *_tok,
 {
 	struct generic_fts_tokenizer *tok =
 		(struct generic_fts_tokenizer *)_tok;
-	size_t i, start = 0;
+	size_t i, ascii_len, start = 0;
 	int char_size;
 	unichar_t c;
 	bool apostrophe;
 
 	for (i = 0; i < size; i += char_size) {
+		ascii_len = fts_ascii_word_chars_count(data + i, size - i);
+		if (ascii_len > 0) {
+			/* plain ASCII word characters. they don't need to be
+			   decoded or looked up one by one. */
+			tok->prev_letter = LETTER_TYPE_NONE;
+			i += ascii_len;
+			if (i == size)
+				break;
+		}
 		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
 		i_assert(char_size > 0);
 
@@ -297,6 +321,34 @@ static enum letter_type letter_type(unichar_t c)
 	return LETTER_TYPE_OTHER;
 }
 
+/* letter_type() results for US-ASCII. Filled on first use, so they're
+   always consistent with the word-boundary-data.c tables. */
+static unsigned char letter_types_ascii[128];
+static bool letter_types_ascii_initialized = FALSE;
+
+static void letter_types_ascii_init(void)
+{
+	unichar_t c;
+
+	for (c = 0; c < N_ELEMENTS(letter_types_ascii); c++)
+		letter_types_ascii[c] = letter_type(c);
+	letter_types_ascii_initialized = TRUE;
+}
+
+static inline enum letter_type
+letter_type_fast(const unsigned char *data, size_t size,
+		 unichar_t *c_r, int *char_size_r)
+{
+	if (data[0] < 0x80) {
+		*c_r = data[0];
+		*char_size_r = 1;
+		return letter_types_ascii[data[0]];
+	}
+	*char_size_r = uni_utf8_get_char_n(data, size, c_r);
+	i_assert(*char_size_r > 0);
+	return letter_type(*c_r);
+}
+
 static bool letter_panic(struct generic_fts_tokenizer *tok ATTR_UNUSED)
 {
 	i_panic("Letter type should not be used.");
@@ -646,6 +698,29 @@ uni_found_word_boundary(struct generic_fts_tokenizer *tok, enum letter_type lt)
 	return FALSE;
 }
 
+/* Skip over ASCII letters and digits following a letter or a digit. There
+   are no word boundaries between them (WB5, WB8, WB9 and WB10), so only the
+   previous letter types need to be updated. Returns the position of the
+   first character that needs to go through the full rules. */
+static size_t
+tr29_skip_ascii_alnum(struct generic_fts_tokenizer *tok,
+		      const unsigned char *data, size_t i, size_t size)
+{
+	enum letter_type lt;
+
+	if (tok->prev_letter != LETTER_TYPE_ALETTER &&
+	    tok->prev_letter != LETTER_TYPE_NUMERIC)
+		return i;
+
+	for (; i < size && data[i] < 0x80; i++) {
+		lt = letter_types_ascii[data[i]];
+		if (lt != LETTER_TYPE_ALETTER && lt != LETTER_TYPE_NUMERIC)
+			break;
+		add_prev_letter(tok, lt);
+	}
+	return i;
+}
+
 static int
 fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 				const unsigned char *data, size_t size,
@@ -659,12 +734,13 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 	enum letter_type lt;
 	int char_size;
 
+	if (!letter_types_ascii_initialized)
+		letter_types_ascii_init();
+
 	for (i = 0; i < size; ) {
 		char_start_i = i;
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		lt = letter_type_fast(data + i, size - i, &c, &char_size);
 		i += char_size;
-		lt = letter_type(c);
 
 		/* The WB5a break is detected only when the "after
 		   break" char is inspected. That char needs to be
@@ -697,6 +773,8 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 					     char_start_i - start_pos);
 			tok_append_truncated(tok, &apostrophe_char, 1);
 			start_pos = i;
+		} else if (!tok->wb5a) {
+			i = tr29_skip_ascii_alnum(tok, data, i, size);
 		}
 	}
 	i_assert(i >= start_pos && size >= start_pos);
@@ -634,6 +634,44 @@ static void test_fts_filter_normalizer_baddata(void)
 	test_end();
 }
 
+static void test_fts_filter_normalizer_cache(void)
+{
+	const char * const settings[] =
+		{"id", "Any-Lower; NFKD; [: Nonspacing Mark :] Remove; [\\x20] Remove", NULL};
+	struct fts_filter *norm, *norm2;
+	const char *token, *error;
+	unsigned int i;
+
+	test_begin("fts filter normalizer cache");
+	test_assert(fts_filter_create(fts_filter_normalizer_icu, NULL, NULL, settings, &norm, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_normalizer_icu, NULL, NULL, settings, &norm2, &error) == 0);
+	for (i = 0; i < 3; i++) {
+		token = "B\xC3\x84R";
+		test_assert_idx(fts_filter_filter(norm, &token, &error) > 0 &&
+				strcmp(token, "bar") == 0, i);
+		/* the filter's own output can be its input */
+		test_assert_idx(fts_filter_filter(norm, &token, &error) > 0 &&
+				strcmp(token, "bar") == 0, i);
+		token = " ";
+		test_assert_idx(fts_filter_filter(norm, &token, &error) == 0, i);
+		token = "B\xC3\x84R";
+		test_assert_idx(fts_filter_filter(norm2, &token, &error) > 0 &&
+				strcmp(token, "bar") == 0, i);
+	}
+	/* push the first tokens out of the cache */
+	for (i = 0; i < 2000; i++) T_BEGIN {
+		token = t_strdup_printf("X%u", i);
+		test_assert_idx(fts_filter_filter(norm, &token, &error) > 0 &&
+				strcmp(token, t_strdup_printf("x%u", i)) == 0, i);
+	} T_END;
+	token = "B\xC3\x84R";
+	test_assert(fts_filter_filter(norm, &token, &error) > 0 &&
+		    strcmp(token, "bar") == 0);
+	fts_filter_unref(&norm);
+	fts_filter_unref(&norm2);
+	test_end();
+}
+
 static void test_fts_filter_normalizer_invalid_id(void)
 {
 	struct fts_filter *norm = NULL;
@@ -904,6 +942,7 @@ int main(void)
 		test_fts_filter_normalizer_french,
 		test_fts_filter_normalizer_empty,
 		test_fts_filter_normalizer_baddata,
+		test_fts_filter_normalizer_cache,
 		test_fts_filter_normalizer_invalid_id,
 #ifdef HAVE_FTS_STEMMER
 		test_fts_filter_normalizer_stopwords_stemmer_eng,
@@ -141,6 +141,37 @@ static void test_fts_icu_translate_resize(void)
 	test_end();
 }
 
+static void test_fts_icu_transliterator_cache(void)
+{
+	UTransliterator *translit1, *translit2;
+	buffer_t *dest = buffer_create_dynamic(pool_datastack_create(), 64);
+	const UChar src[] = { 'A', 'B', 'C' };
+	const UChar *data;
+	const char *error;
+
+	test_begin("fts_icu_transliterator_create cache");
+	test_assert(fts_icu_transliterator_create("Any-Lower", &translit1,
+						  &error) == 0);
+	test_assert(fts_icu_transliterator_create("Any-Lower", &translit2,
+						  &error) == 0);
+	test_assert(translit1 != translit2);
+	/* each clone works independently of the others */
+	utrans_close(translit1);
+	test_assert(fts_icu_translate(dest, src, N_ELEMENTS(src),
+				      translit2, &error) == 0);
+	data = dest->data;
+	test_assert(dest->used == sizeof(src) &&
+		    data[0] == 'a' && data[1] == 'b' && data[2] == 'c');
+	utrans_close(translit2);
+
+	/* failures aren't cached */
+	test_assert(fts_icu_transliterator_create("Any-Nonexistent",
+						  &translit1, &error) < 0);
+	test_assert(fts_icu_transliterator_create("Any-Nonexistent",
+						  &translit1, &error) < 0);
+	test_end();
+}
+
 static void test_fts_icu_lcase(void)
 {
 	const char *src = "aBcD\xC3\x84\xC3\xA4";
@@ -179,6 +210,7 @@ int main(void)
 		test_fts_icu_utf16_to_utf8_resize,
 		test_fts_icu_translate,
 		test_fts_icu_translate_resize,
+		test_fts_icu_transliterator_cache,
 		test_fts_icu_lcase,
 		test_fts_icu_lcase_resize,
 		NULL
@@ -1,12 +1,15 @@
 /* Copyright (c) 2014-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "unichar.h"
 #include "test-common.h"
 #include "fts-tokenizer.h"
 #include "fts-tokenizer-private.h"
 #include "fts-tokenizer-generic-private.h"
 
+#include <fcntl.h>
+#include <unistd.h>
 
 #define TEST_INPUT_ADDRESS \
 	"@invalid invalid@ Abc Dfg <abc.dfg@example.com>, " \
@@ -400,6 +403,94 @@ static void test_fts_tokenizer_address_search(void)
 	test_end();
 }
 
+static void
+test_tokenizer_benchmark_input(const char *name, const char *const *settings,
+			       const buffer_t *input, unsigned int rounds)
+{
+	struct fts_tokenizer *tok;
+	struct timespec start;
+	const unsigned char *data;
+	const char *token, *error;
+	unsigned int i, tokens = 0;
+	size_t pos, size;
+	double secs;
+
+	test_assert(fts_tokenizer_create(fts_tokenizer_generic, NULL, settings,
+					 &tok, &error) == 0);
+	test_benchmark_start(&start);
+	for (i = 0; i < rounds; i++) {
+		/* feed the input in blocks like fts-build-mail does */
+		for (pos = 0; pos < input->used; pos += size) {
+			data = CONST_PTR_OFFSET(input->data, pos);
+			size = I_MIN(input->used - pos, 8192);
+			while (size < input->used - pos &&
+			       !UTF8_IS_START_SEQ(data[size]))
+				size++;
+			while (fts_tokenizer_next(tok, data, size,
+						  &token, &error) > 0)
+				tokens++;
+		}
+		while (fts_tokenizer_final(tok, &token, &error) > 0)
+			tokens++;
+	}
+	secs = test_benchmark_secs(&start);
+	test_assert(tokens > 0);
+	test_out_reason(t_strdup_printf("fts tokenizer benchmark: %s", name),
+			TRUE, t_strdup_printf("%.1f MB/s, %u tokens",
+				input->used * rounds / secs / (1024*1024),
+				tokens));
+	fts_tokenizer_unref(&tok);
+}
+
+/* UDHRDIR comes from Automake AM_CPPFLAGS */
+#define UDHR_FRA_NAME "/udhr_fra.txt"
+static void test_fts_tokenizer_generic_benchmark(void)
+{
+	static const char *const words[] = {
+		"Hello", "world", "message", "attachment", "2016", "v1.2",
+		"don't", "e-mail", "user@example.com", "(quoted)", "3,14",
+		"na\xC3\xAFve", "\xE2\x80\x9Cquoted\xE2\x80\x9D", "fa\xC3\xA7""ade"
+	};
+	const char *const simple_settings[] = { NULL };
+	buffer_t *udhr, *corpus;
+	unsigned char buf[4096];
+	unsigned int i;
+	ssize_t ret;
+	int fd;
+
+	if (!test_benchmarks_enabled())
+		return;
+
+	udhr = buffer_create_dynamic(default_pool, 1024*32);
+	fd = open(UDHRDIR UDHR_FRA_NAME, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", UDHRDIR UDHR_FRA_NAME);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		buffer_append(udhr, buf, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", UDHRDIR UDHR_FRA_NAME);
+	i_close_fd(&fd);
+
+	/* synthetic mostly-ASCII mail text */
+	corpus = buffer_create_dynamic(default_pool, 1024*1024*8);
+	for (i = 0; corpus->used < 1024*1024*8; i++) {
+		buffer_append(corpus, words[(i * 5) % N_ELEMENTS(words)],
+			      strlen(words[(i * 5) % N_ELEMENTS(words)]));
+		buffer_append_c(corpus, i % 13 == 0 ? '\n' : ' ');
+	}
+
+	test_tokenizer_benchmark_input("simple, udhr_fra.txt",
+				       simple_settings, udhr, 200);
+	test_tokenizer_benchmark_input("tr29, udhr_fra.txt",
+				       tr29_settings, udhr, 200);
+	test_tokenizer_benchmark_input("simple, 8 MB synthetic",
+				       simple_settings, corpus, 1);
+	test_tokenizer_benchmark_input("tr29, 8 MB synthetic",
+				       tr29_settings, corpus, 1);
+	buffer_free(&udhr);
+	buffer_free(&corpus);
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
@@ -411,6 +502,7 @@ int main(void)
 		test_fts_tokenizer_address_parent_simple,
 		test_fts_tokenizer_address_parent_tr29,
 		test_fts_tokenizer_address_search,
+		test_fts_tokenizer_generic_benchmark,
 		NULL
 	};
 	int ret;
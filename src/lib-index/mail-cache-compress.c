@@ -19,6 +19,8 @@ struct mail_cache_copy_context {
 	buffer_t *buffer, *field_seen;
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
+	/* bytes copied for each field, indexed by field index */
+	uint64_t *field_bytes;
 
 	uint8_t field_seen_value;
 	bool new_msg;
@@ -96,6 +98,7 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 	buffer_append(ctx->buffer, field->data, field->size);
 	if ((field->size & 3) != 0)
 		buffer_append_zero(ctx->buffer, 4 - (field->size & 3));
+	ctx->field_bytes[field->field_idx] += field->size;
 }
 
 static uint32_t get_next_file_seq(struct mail_cache *cache)
@@ -148,10 +151,20 @@ mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
 		}
 
 		/* change permanent decisions to temporary decisions.
-		   if they're still permanent they'll get updated later. */
+		   if they're still permanent they'll get updated later.
+		   fields whose hits pay off for the space they use stay
+		   permanent. */
+		mail_cache_decision_stats_flush(cache, i);
 		field = &cache->fields[i].field;
-		if (field->decision == MAIL_CACHE_DECISION_YES)
+		if (field->decision == MAIL_CACHE_DECISION_YES &&
+		    !mail_cache_field_is_worth_caching(cache, i,
+						       ctx->field_bytes[i]))
 			field->decision = MAIL_CACHE_DECISION_TEMP;
+
+		/* decay the old hits, so the decisions follow the
+		   current usage */
+		cache->fields[i].file_hits /= 2;
+		cache->fields[i].file_hit_sessions /= 2;
 	}
 	i_assert(j == used_fields_count);
 
@@ -199,6 +212,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
 	ctx.field_seen_value = 0;
 	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
+	ctx.field_bytes = t_new(uint64_t, cache->fields_count + 1);
 	t_array_init(&ctx.bitmask_pos, 32);
 
 	/* @UNSAFE: drop unused fields and create a field mapping for
@@ -552,9 +566,77 @@ void mail_cache_compress_unlock(struct mail_cache_compress_lock **_lock)
 	i_free(lock);
 }
 
+static bool mail_cache_compress_is_requested(struct mail_cache *cache)
+{
+	return cache->need_compress_file_seq ==
+		cache->compress_requested_file_seq &&
+		ioloop_time - cache->compress_requested_time <
+		MAIL_CACHE_COMPRESS_DEFER_TIMEOUT_SECS;
+}
+
 bool mail_cache_need_compress(struct mail_cache *cache)
 {
 	return cache->need_compress_file_seq != 0 &&
+		!mail_cache_compress_is_requested(cache) &&
 		(cache->index->flags & MAIL_INDEX_OPEN_FLAG_SAVEONLY) == 0 &&
 		!cache->index->readonly;
 }
+
+void mail_cache_set_compress_callback(struct mail_cache *cache,
+				      mail_cache_compress_callback_t *callback,
+				      void *context)
+{
+	cache->compress_callback = callback;
+	cache->compress_context = context;
+}
+
+bool mail_cache_compress_defer(struct mail_cache *cache)
+{
+	if (cache->compress_callback == NULL)
+		return FALSE;
+	if (cache->compress_requested_file_seq ==
+	    cache->need_compress_file_seq) {
+		/* we already asked for this file to be compressed, but it
+		   wasn't done in time. maybe the compression isn't happening
+		   at all, so do it ourself. */
+		return FALSE;
+	}
+	if (!cache->compress_callback(cache, cache->compress_context))
+		return FALSE;
+
+	/* don't keep asking for the same file to be compressed. this also
+	   prevents mail_index_need_sync() from forcing syncs just to get
+	   the cache compressed. */
+	cache->compress_requested_file_seq = cache->need_compress_file_seq;
+	cache->compress_requested_time = ioloop_time;
+	return TRUE;
+}
+
+int mail_cache_compress_if_needed(struct mail_cache *cache)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+	int ret;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (cache->need_compress_file_seq == 0 ||
+	    (cache->index->flags & MAIL_INDEX_OPEN_FLAG_SAVEONLY) != 0 ||
+	    cache->index->readonly)
+		return 0;
+
+	view = mail_index_view_open(cache->index);
+	trans = mail_index_transaction_begin(view,
+					MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (mail_cache_compress(cache, trans, &lock) < 0) {
+		mail_index_transaction_rollback(&trans);
+		ret = -1;
+	} else {
+		ret = mail_index_transaction_commit(&trans);
+		if (lock != NULL)
+			mail_cache_compress_unlock(&lock);
+	}
+	mail_index_view_close(&view);
+	return ret;
+}
@@ -64,12 +64,88 @@
    months, it's changed. I picked two months because people go to at least
    one month vacations where they might still be reading mails, but with
    different clients.
+
+   The above rules don't know how expensive it is to generate the field
+   again. Looking up a date from file metadata is cheap, while generating
+   BODYSTRUCTURE requires reading and parsing the whole mail. So each field
+   also has an estimated cost, and we keep track of how many times the field
+   was found from cache. The first in-order access of a new mail doesn't
+   count, because the field would have been generated for it anyway. The
+   hits and the number of sessions that had them are stored in the cache
+   file, so they add up across sessions and processes. If an expensive
+   field keeps being found from cache in several sessions and the avoided
+   work outweighs the space it takes for all the messages, it's made
+   permanent even if the access order looks like the client has a local
+   cache. Such permanent fields also stay permanent when the cache file is
+   compressed. The stored hits are halved on each compression, so old
+   usage gradually stops counting.
 */
 
 #include "lib.h"
 #include "ioloop.h"
 #include "mail-cache-private.h"
 
+/* Don't decide anything based on fewer hits than this */
+#define MAIL_CACHE_DECISION_MIN_HITS 10
+/* The hits must have come from at least this many sessions */
+#define MAIL_CACHE_DECISION_MIN_HIT_SESSIONS 3
+
+/* Roughly how many bytes of mail need to be read to generate the field,
+   indexed by enum mail_cache_field_cost */
+static const unsigned int mail_cache_field_cost_bytes[] = {
+	1024,	/* default */
+	16,	/* metadata */
+	1024,	/* header */
+	16384	/* body */
+};
+
+void mail_cache_field_get_stats(struct mail_cache *cache,
+				unsigned int field_idx,
+				struct mail_cache_field_stats *stats_r)
+{
+	const struct mail_cache_field_private *priv;
+
+	i_assert(field_idx < cache->fields_count);
+
+	priv = &cache->fields[field_idx];
+	*stats_r = priv->stats;
+	stats_r->decision_hits = priv->file_hits + priv->unflushed_hits;
+	stats_r->decision_sessions = priv->file_hit_sessions +
+		(priv->hit_session_unflushed ? 1 : 0);
+}
+
+bool mail_cache_field_is_worth_caching(struct mail_cache *cache,
+				       unsigned int field_idx,
+				       uint64_t stored_bytes)
+{
+	struct mail_cache_field_stats stats;
+	const struct mail_cache_field_private *priv;
+	unsigned int cost;
+
+	mail_cache_field_get_stats(cache, field_idx, &stats);
+	if (stats.decision_hits < MAIL_CACHE_DECISION_MIN_HITS ||
+	    stats.decision_sessions < MAIL_CACHE_DECISION_MIN_HIT_SESSIONS)
+		return FALSE;
+
+	priv = &cache->fields[field_idx];
+	i_assert(priv->field.cost < N_ELEMENTS(mail_cache_field_cost_bytes));
+	cost = mail_cache_field_cost_bytes[priv->field.cost];
+	return (uint64_t)stats.decision_hits * cost > stored_bytes;
+}
+
+void mail_cache_decision_stats_flush(struct mail_cache *cache,
+				     unsigned int field)
+{
+	struct mail_cache_field_private *priv = &cache->fields[field];
+
+	priv->file_hits += priv->unflushed_hits;
+	priv->unflushed_hits = 0;
+	if (priv->hit_session_unflushed) {
+		priv->file_hit_sessions++;
+		priv->hit_session_unflushed = FALSE;
+	}
+}
+
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field)
 {
@@ -126,8 +202,63 @@ void mail_cache_decision_state_update(struct mail_cache_view *view,
 	}
 }
 
+void mail_cache_decision_hit(struct mail_cache_view *view, uint32_t seq,
+			     unsigned int field, size_t data_size)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_field_private *priv;
+	const struct mail_index_header *hdr;
+	uint64_t stored_bytes;
+	uint32_t uid;
+
+	i_assert(field < cache->fields_count);
+
+	if (view->no_decision_updates)
+		return;
+
+	priv = &cache->fields[field];
+	priv->stats.hits++;
+	priv->stats.hit_bytes += data_size;
+
+	mail_index_lookup_uid(view->view, seq, &uid);
+	hdr = mail_index_get_header(view->view);
+	if (uid > priv->hit_uid_highwater && uid >= hdr->day_first_uid[7]) {
+		/* in-order access of a new mail. the field would have been
+		   generated for it anyway, so caching didn't save anything
+		   yet. */
+		priv->hit_uid_highwater = uid;
+		return;
+	}
+
+	priv->unflushed_hits++;
+	if (!priv->hit_session) {
+		priv->hit_session = TRUE;
+		priv->hit_session_unflushed = TRUE;
+	}
+	if (cache->field_file_map[field] != (uint32_t)-1)
+		cache->field_header_write_pending = TRUE;
+
+	if (priv->field.decision != MAIL_CACHE_DECISION_TEMP ||
+	    priv->field.cost != MAIL_CACHE_FIELD_COST_BODY)
+		return;
+
+	/* the field is expensive to generate and it's being looked up
+	   repeatedly. even if the access order says the client caches it
+	   locally, it's cheaper to keep it permanently if it pays off for
+	   all the messages. */
+	stored_bytes = priv->stats.hit_bytes / priv->stats.hits *
+		mail_index_view_get_messages_count(view->view);
+	if (mail_cache_field_is_worth_caching(cache, field, stored_bytes)) {
+		priv->field.decision = MAIL_CACHE_DECISION_YES;
+		priv->decision_dirty = TRUE;
+
+		if (cache->field_file_map[field] != (uint32_t)-1)
+			cache->field_header_write_pending = TRUE;
+	}
+}
+
 void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
-			     unsigned int field)
+			     unsigned int field, size_t data_size)
 {
 	struct mail_cache *cache = view->cache;
 	uint32_t uid;
@@ -137,6 +268,9 @@ void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
 	if (MAIL_CACHE_IS_UNUSABLE(cache) || view->no_decision_updates)
 		return;
 
+	cache->fields[field].stats.adds++;
+	cache->fields[field].stats.added_bytes += data_size;
+
 	if (cache->fields[field].field.decision != MAIL_CACHE_DECISION_NO) {
 		/* a) forced decision
 		   b) we're already caching it, so it just wasn't in cache */
@@ -93,6 +93,8 @@ mail_cache_field_update(struct mail_cache *cache,
 	}
 	if (orig->decision_dirty)
 		cache->field_header_write_pending = TRUE;
+	if (newfield->cost != MAIL_CACHE_FIELD_COST_DEFAULT)
+		orig->field.cost = newfield->cost;
 
 	(void)field_type_verify(cache, newfield->idx,
 				newfield->type, newfield->field_size);
@@ -317,7 +319,7 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 {
 	const struct mail_cache_header_fields *field_hdr;
 	struct mail_cache_field field;
-	const uint32_t *last_used, *sizes;
+	const uint32_t *last_used, *sizes, *hits, *hit_sessions;
 	const uint8_t *types, *decisions;
 	const char *p, *names, *end;
 	char *orig_key;
@@ -325,7 +327,7 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 	unsigned int fidx, new_fields_count;
 	enum mail_cache_decision_type dec;
 	time_t max_drop_time;
-	uint32_t offset, i;
+	uint32_t offset, stats_offset, i;
 
 	if (mail_cache_header_fields_get_offset(cache, &offset, &field_hdr) < 0)
 		return -1;
@@ -368,8 +370,11 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 	i_assert(names <= end);
 
 	/* clear the old mapping */
-	for (i = 0; i < cache->fields_count; i++)
+	for (i = 0; i < cache->fields_count; i++) {
 		cache->field_file_map[i] = (uint32_t)-1;
+		cache->fields[i].file_hits = 0;
+		cache->fields[i].file_hit_sessions = 0;
+	}
 
 	max_drop_time = cache->index->map->hdr.day_stamp == 0 ? 0 :
 		cache->index->map->hdr.day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
@@ -438,6 +443,23 @@ int mail_cache_header_fields_read(struct mail_cache *cache)
 
                 names = p + 1;
 	}
+
+	/* the hit statistics are optional */
+	stats_offset = (names - (const char *)field_hdr + 3) & ~3U;
+	if (field_hdr->fields_count == 0 || stats_offset > field_hdr->size ||
+	    (field_hdr->size - stats_offset) / (sizeof(uint32_t) * 2) <
+	    field_hdr->fields_count) {
+		cache->file_field_stats_offset = 0;
+	} else {
+		cache->file_field_stats_offset = stats_offset;
+		hits = CONST_PTR_OFFSET(field_hdr, stats_offset);
+		hit_sessions = hits + field_hdr->fields_count;
+		for (i = 0; i < field_hdr->fields_count; i++) {
+			fidx = cache->file_field_map[i];
+			cache->fields[fidx].file_hits = hits[i];
+			cache->fields[fidx].file_hit_sessions = hit_sessions[i];
+		}
+	}
 	return 0;
 }
 
@@ -509,6 +531,22 @@ static int mail_cache_header_fields_update_locked(struct mail_cache *cache)
 		    sizeof(uint32_t));
 	ret = mail_cache_write(cache, buffer->data, buffer->used,
 			       offset + MAIL_CACHE_FIELD_LAST_USED());
+	if (ret == 0 && cache->file_field_stats_offset != 0) {
+		for (i = 0; i < cache->file_fields_count; i++) {
+			mail_cache_decision_stats_flush(cache,
+				cache->file_field_map[i]);
+		}
+		buffer_set_used_size(buffer, 0);
+		copy_to_buf(cache, buffer, FALSE,
+			    offsetof(struct mail_cache_field_private, file_hits),
+			    sizeof(uint32_t));
+		copy_to_buf(cache, buffer, FALSE,
+			    offsetof(struct mail_cache_field_private,
+				     file_hit_sessions),
+			    sizeof(uint32_t));
+		ret = mail_cache_write(cache, buffer->data, buffer->used,
+				offset + cache->file_field_stats_offset);
+	}
 	if (ret == 0) {
 		buffer_set_used_size(buffer, 0);
 		copy_to_buf_byte(cache, buffer, FALSE,
@@ -595,11 +633,21 @@ void mail_cache_header_fields_get(struct mail_cache *cache, buffer_t *dest)
 		}
 	}
 
+	if ((dest->used & 3) != 0)
+		buffer_append_zero(dest, 4 - (dest->used & 3));
+
+	/* add the hit statistics */
+	for (i = 0; i < cache->fields_count; i++)
+		mail_cache_decision_stats_flush(cache, i);
+	copy_to_buf(cache, dest, TRUE,
+		    offsetof(struct mail_cache_field_private, file_hits),
+		    sizeof(uint32_t));
+	copy_to_buf(cache, dest, TRUE,
+		    offsetof(struct mail_cache_field_private, file_hit_sessions),
+		    sizeof(uint32_t));
+
 	hdr.size = dest->used;
 	buffer_write(dest, 0, &hdr, sizeof(hdr));
-
-	if ((hdr.size & 3) != 0)
-		buffer_append_zero(dest, 4 - (hdr.size & 3));
 }
 
 int mail_cache_header_fields_get_next_offset(struct mail_cache *cache,
@@ -418,9 +418,14 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	mail_cache_lookup_iter_init(view, seq, &iter);
 	field_def = &view->cache->fields[field_idx].field;
 	if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
-		return mail_cache_lookup_bitmask(&iter, field_idx,
-						 field_def->field_size,
-						 dest_buf);
+		ret = mail_cache_lookup_bitmask(&iter, field_idx,
+						field_def->field_size,
+						dest_buf);
+		if (ret > 0) {
+			mail_cache_decision_hit(view, seq, field_idx,
+						field_def->field_size);
+		}
+		return ret;
 	}
 
 	/* return the first one that's found. if there are multiple
@@ -428,12 +433,91 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 		if (field.field_idx == field_idx) {
 			buffer_append(dest_buf, field.data, field.size);
+			mail_cache_decision_hit(view, seq, field_idx,
+						field.size);
 			break;
 		}
 	}
 	return ret;
 }
 
+int mail_cache_lookup_fields(struct mail_cache_view *view, uint32_t seq,
+			     const unsigned int field_idxs[],
+			     unsigned int fields_count,
+			     buffer_t *const dest_bufs[], bool found_r[])
+{
+	struct mail_cache *cache = view->cache;
+	const struct mail_cache_field *field_def;
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	const unsigned char *src;
+	unsigned char *dest;
+	unsigned int i, j, wanted_count = 0, found_count = 0;
+	bool have_bitmask = FALSE;
+	int ret;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+
+	memset(found_r, 0, sizeof(*found_r) * fields_count);
+	for (i = 0; i < fields_count; i++) {
+		mail_cache_decision_state_update(view, seq, field_idxs[i]);
+		if (mail_cache_file_has_field(cache, field_idxs[i]))
+			wanted_count++;
+		if (cache->fields[field_idxs[i]].field.type ==
+		    MAIL_CACHE_FIELD_BITMASK)
+			have_bitmask = TRUE;
+	}
+	if (wanted_count == 0)
+		return 0;
+
+	mail_cache_lookup_iter_init(view, seq, &iter);
+	while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+		for (i = 0; i < fields_count; i++) {
+			if (field_idxs[i] == field.field_idx)
+				break;
+		}
+		if (i == fields_count)
+			continue;
+
+		field_def = &cache->fields[field.field_idx].field;
+		if (field_def->type == MAIL_CACHE_FIELD_BITMASK) {
+			/* merge all bits, like mail_cache_lookup_field() */
+			if (!found_r[i]) {
+				buffer_write_zero(dest_bufs[i], 0,
+						  field_def->field_size);
+				found_r[i] = TRUE;
+				found_count++;
+			}
+			src = field.data;
+			dest = buffer_get_space_unsafe(dest_bufs[i], 0,
+						       field.size);
+			for (j = 0; j < field.size; j++)
+				dest[j] |= src[j];
+		} else if (!found_r[i]) {
+			/* the first one is enough. if there are multiple
+			   they're all identical. */
+			buffer_append(dest_bufs[i], field.data, field.size);
+			found_r[i] = TRUE;
+			mail_cache_decision_hit(view, seq, field_idxs[i],
+						field.size);
+			if (++found_count == wanted_count && !have_bitmask)
+				break;
+		}
+	}
+	if (ret < 0)
+		return -1;
+
+	for (i = 0; i < fields_count; i++) {
+		field_def = &cache->fields[field_idxs[i]].field;
+		if (found_r[i] && field_def->type == MAIL_CACHE_FIELD_BITMASK) {
+			mail_cache_decision_hit(view, seq, field_idxs[i],
+						field_def->field_size);
+		}
+	}
+	return found_count;
+}
+
 struct header_lookup_data {
 	uint32_t data_size;
 	const unsigned char *data;
@@ -506,6 +590,7 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 	struct header_lookup_line *lines;
 	const unsigned char *p, *start, *end;
 	uint8_t *field_state;
+	uint32_t *field_sizes;
 	unsigned int i, count, max_field = 0;
 	size_t hdr_size;
 	uint8_t want = HDR_FIELD_STATE_WANT;
@@ -537,6 +622,7 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 		buffer_write(buf, field_idxs[i], &want, 1);
 	}
 	field_state = buffer_get_modifiable_data(buf, NULL);
+	field_sizes = t_new(uint32_t, max_field + 1);
 
 	/* lookup the fields */
 	memset(&ctx, 0, sizeof(ctx));
@@ -551,6 +637,7 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 			/* a) don't want it, b) duplicate */
 		} else {
 			field_state[field.field_idx] = HDR_FIELD_STATE_SEEN;
+			field_sizes[field.field_idx] = field.size;
 			header_lines_save(&ctx, &field);
 		}
 
@@ -563,6 +650,10 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 		if (field_state[i] == HDR_FIELD_STATE_WANT)
 			return 0;
 	}
+	for (i = 0; i < fields_count; i++) {
+		mail_cache_decision_hit(view, seq, field_idxs[i],
+					field_sizes[field_idxs[i]]);
+	}
 
 	/* we need to return headers in the order they existed originally.
 	   we can do this by sorting the messages by their line numbers. */
@@ -609,3 +700,38 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 	} T_END;
 	return ret;
 }
+
+int mail_cache_get_field_usage(struct mail_cache_view *view,
+			       struct mail_cache_field_usage *usage_r,
+			       unsigned int usage_count)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	uint32_t seq, messages_count, *last_seqs;
+	int ret = 0;
+
+	memset(usage_r, 0, sizeof(*usage_r) * usage_count);
+
+	if (!view->cache->opened)
+		(void)mail_cache_open_and_verify(view->cache);
+
+	/* the same field may exist in multiple records of a message.
+	   count the message only once. */
+	last_seqs = i_new(uint32_t, usage_count);
+	messages_count = mail_index_view_get_messages_count(view->view);
+	for (seq = 1; seq <= messages_count && ret == 0; seq++) {
+		mail_cache_lookup_iter_init(view, seq, &iter);
+		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+			if (field.field_idx >= usage_count)
+				continue;
+
+			usage_r[field.field_idx].bytes += field.size;
+			if (last_seqs[field.field_idx] != seq) {
+				last_seqs[field.field_idx] = seq;
+				usage_r[field.field_idx].messages++;
+			}
+		}
+	}
+	i_free(last_seqs);
+	return ret;
+}
@@ -25,6 +25,10 @@
    the latest cache header. */
 #define MAIL_CACHE_HEADER_FIELD_CONTINUE_COUNT 4
 
+/* If the compression was handed off to the compress callback, but it still
+   hasn't been done after n seconds, compress the file ourself. */
+#define MAIL_CACHE_COMPRESS_DEFER_TIMEOUT_SECS (60*10)
+
 /* If cache record becomes larger than this, don't add it. */
 #define MAIL_CACHE_RECORD_MAX_SIZE (64*1024)
 
@@ -73,6 +77,12 @@ struct mail_cache_header_fields {
 	uint8_t decision[fields_count];
 	/* NUL-separated list of field names */
 	char name[fields_count][];
+
+	/* Optional, 32bit aligned. Older versions don't write these. */
+	/* number of hits that avoided regenerating the field */
+	uint32_t hits[fields_count];
+	/* number of sessions that have had hits */
+	uint32_t hit_sessions[fields_count];
 #endif
 };
 
@@ -97,11 +107,24 @@ struct mail_cache_field_private {
 	struct mail_cache_field field;
 
 	uint32_t uid_highwater;
+	/* highest UID found from cache within this session */
+	uint32_t hit_uid_highwater;
+	struct mail_cache_field_stats stats;
+
+	/* decision hits stored in the cache file's field header */
+	uint32_t file_hits;
+	uint32_t file_hit_sessions;
+	/* decision hits not yet written to the cache file */
+	unsigned int unflushed_hits;
 
 	/* Unused fields aren't written to cache file */
 	unsigned int used:1;
 	unsigned int adding:1;
 	unsigned int decision_dirty:1;
+	/* this session has had decision hits */
+	unsigned int hit_session:1;
+	/* this session hasn't yet been added to file_hit_sessions */
+	unsigned int hit_session_unflushed:1;
 };
 
 struct mail_cache {
@@ -148,9 +171,17 @@ struct mail_cache {
 	/* 0 is no need for compression, otherwise the file sequence number
 	   which we want compressed. */
 	uint32_t need_compress_file_seq;
+	/* need_compress_file_seq that was last given to compress_callback */
+	uint32_t compress_requested_file_seq;
+	time_t compress_requested_time;
+	mail_cache_compress_callback_t *compress_callback;
+	void *compress_context;
 
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
+	/* offset to hits[] relative to the field header,
+	   0 if the header doesn't have it */
+	uint32_t file_field_stats_offset;
 
 	unsigned int opened:1;
 	unsigned int locked:1;
@@ -255,13 +286,25 @@ int mail_cache_map(struct mail_cache *cache, size_t offset, size_t size,
 		   const void **data_r);
 void mail_cache_file_close(struct mail_cache *cache);
 int mail_cache_reopen(struct mail_cache *cache);
+/* Hand off the compression to the compress callback. Returns TRUE if this
+   was done, FALSE if the cache should be compressed by the caller. */
+bool mail_cache_compress_defer(struct mail_cache *cache);
 
 /* Notify the decision handling code that field was looked up for seq.
    This should be called even for fields that aren't currently in cache file */
 void mail_cache_decision_state_update(struct mail_cache_view *view,
 				      uint32_t seq, unsigned int field);
+/* Notify the decision handling code that field was found from cache for
+   seq. data_size is the size of the found value. */
+void mail_cache_decision_hit(struct mail_cache_view *view, uint32_t seq,
+			     unsigned int field, size_t data_size);
+/* Move the field's unflushed hits to file_hits, so they get written to the
+   cache file's field header. */
+void mail_cache_decision_stats_flush(struct mail_cache *cache,
+				     unsigned int field);
+/* Notify the decision handling code that field is being added to cache. */
 void mail_cache_decision_add(struct mail_cache_view *view, uint32_t seq,
-			     unsigned int field);
+			     unsigned int field, size_t data_size);
 
 int mail_cache_expunge_handler(struct mail_index_sync_map_ctx *sync_ctx,
 			       uint32_t seq, const void *data,
@@ -708,7 +708,7 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	}
 	i_assert(ctx->cache_file_seq != 0);
 
-	mail_cache_decision_add(ctx->view, seq, field_idx);
+	mail_cache_decision_add(ctx->view, seq, field_idx, data_size);
 
 	fixed_size = ctx->cache->fields[field_idx].field.field_size;
 	i_assert(fixed_size == UINT_MAX || fixed_size == data_size);
@@ -32,6 +32,18 @@ enum mail_cache_field_type {
 	MAIL_CACHE_FIELD_COUNT
 };
 
+/* Estimated cost of generating the field's value when it's not cached. */
+enum mail_cache_field_cost {
+	/* Unknown, handled the same as MAIL_CACHE_FIELD_COST_HEADER */
+	MAIL_CACHE_FIELD_COST_DEFAULT = 0,
+	/* Available without reading the mail, e.g. from its file metadata */
+	MAIL_CACHE_FIELD_COST_METADATA,
+	/* Requires reading and parsing the mail's header */
+	MAIL_CACHE_FIELD_COST_HEADER,
+	/* Requires reading and parsing the whole mail */
+	MAIL_CACHE_FIELD_COST_BODY
+};
+
 struct mail_cache_field {
 	const char *name;
 	unsigned int idx;
@@ -41,8 +53,45 @@ struct mail_cache_field {
 	enum mail_cache_decision_type decision;
 	/* If higher than the current last_used field, update it */
 	time_t last_used;
+	/* Not stored in the cache file. If non-default, replaces the
+	   existing field's cost. */
+	enum mail_cache_field_cost cost;
+};
+
+/* Statistics for a field. */
+struct mail_cache_field_stats {
+	/* Number of times the field was found from cache since the cache
+	   was opened */
+	unsigned int hits;
+	/* Total size of the found values */
+	uint64_t hit_bytes;
+	/* Number of times the field was added to cache since the cache was
+	   opened, i.e. it had to be generated */
+	unsigned int adds;
+	/* Total size of the added values */
+	uint64_t added_bytes;
+
+	/* Hits that avoided regenerating the field, i.e. excluding the first
+	   in-order access of new mails, summed over all the sessions stored
+	   in the cache file and this session. */
+	unsigned int decision_hits;
+	/* Number of sessions that have had decision_hits */
+	unsigned int decision_sessions;
 };
 
+/* Space used by a field in the cache file */
+struct mail_cache_field_usage {
+	/* Number of messages that have the field cached */
+	unsigned int messages;
+	/* Total size of the field's values */
+	uint64_t bytes;
+};
+
+/* Returns TRUE if the compression was handed off, FALSE if it should be done
+   immediately after all. */
+typedef bool mail_cache_compress_callback_t(struct mail_cache *cache,
+					    void *context);
+
 struct mail_cache *mail_cache_open_or_create(struct mail_index *index);
 void mail_cache_free(struct mail_cache **cache);
 
@@ -65,6 +114,19 @@ mail_cache_register_get_list(struct mail_cache *cache, pool_t pool,
 
 /* Returns TRUE if cache should be compressed. */
 bool mail_cache_need_compress(struct mail_cache *cache);
+/* If callback is set, it's called instead of compressing the cache file when
+   syncing the index. The callback is expected to get the compression done in
+   some other process, which calls mail_cache_compress_if_needed(). The
+   callback is called while the index is sync-locked, so it shouldn't block.
+   After a successful hand-off it's not called again for the same cache file.
+   If the file still hasn't been compressed after a while, or if the cache
+   can't otherwise be written to, it's compressed immediately. */
+void mail_cache_set_compress_callback(struct mail_cache *cache,
+				      mail_cache_compress_callback_t *callback,
+				      void *context);
+/* Compress the cache file if it needs to be compressed, ignoring the compress
+   callback. Returns 0 if ok, -1 if error. */
+int mail_cache_compress_if_needed(struct mail_cache *cache);
 /* Compress cache file. Offsets are updated to given transaction. The cache
    compression lock should be kept until the transaction is committed.
    mail_cache_compress_unlock() needs to be called afterwards. The lock doesn't
@@ -119,11 +181,37 @@ bool mail_cache_field_exists_any(struct mail_cache_view *view, uint32_t seq);
 /* Returns current caching decision for given field. */
 enum mail_cache_decision_type
 mail_cache_field_get_decision(struct mail_cache *cache, unsigned int field_idx);
+/* Returns the field's lookup/add statistics. */
+void mail_cache_field_get_stats(struct mail_cache *cache,
+				unsigned int field_idx,
+				struct mail_cache_field_stats *stats_r);
+/* Returns TRUE if the field's statistics show that the work avoided by
+   keeping it cached outweighs stored_bytes, which is the space it uses
+   (or would use) in the cache file for all the messages. */
+bool mail_cache_field_is_worth_caching(struct mail_cache *cache,
+				       unsigned int field_idx,
+				       uint64_t stored_bytes);
+/* Go through all the messages in the view and sum up the space each field
+   uses in the cache file. usage_r[] is indexed by field index and must have
+   room for usage_count fields. Fields with a higher index are skipped.
+   Returns 0 if ok, -1 if cache is broken. */
+int mail_cache_get_field_usage(struct mail_cache_view *view,
+			       struct mail_cache_field_usage *usage_r,
+			       unsigned int usage_count);
 
 /* Set data_r and size_r to point to wanted field in cache file.
    Returns 1 if field was found, 0 if not, -1 if error. */
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx);
+/* Look up multiple fields with a single pass over the message's cache
+   records. This is faster than calling mail_cache_lookup_field() for each
+   field. The data for field_idxs[i] is added to dest_bufs[i] the same way as
+   mail_cache_lookup_field() does, and found_r[i] is set to whether it was
+   found. Returns the number of found fields, or -1 if error. */
+int mail_cache_lookup_fields(struct mail_cache_view *view, uint32_t seq,
+			     const unsigned int field_idxs[],
+			     unsigned int fields_count,
+			     buffer_t *const dest_bufs[], bool found_r[]);
 
 /* Return specified cached headers. Returns 1 if all fields were found,
    0 if not, -1 if error. dest is updated only if all fields were found. */
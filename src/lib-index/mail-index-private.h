@@ -257,6 +257,9 @@ int mail_index_create_tmp_file(struct mail_index *index,
 int mail_index_try_open_only(struct mail_index *index);
 void mail_index_close_file(struct mail_index *index);
 int mail_index_reopen_if_changed(struct mail_index *index);
+/* Returns TRUE if the index file hasn't been replaced since we opened it.
+   Errors are ignored and cause FALSE to be returned. */
+bool mail_index_is_file_unchanged(struct mail_index *index);
 /* Update/rewrite the main index file from index->map */
 void mail_index_write(struct mail_index *index, bool want_rotate);
 
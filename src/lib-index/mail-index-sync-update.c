@@ -900,6 +900,25 @@ void mail_index_map_check(struct mail_index_map *map)
 }
 #endif
 
+static bool
+mail_index_sync_map_is_newer_than_file(struct mail_index_map *map,
+				       uoff_t start_offset)
+{
+	struct mail_index *index = map->index;
+
+	/* If nobody has rewritten the index file since we last read it, our
+	   map already contains everything in it. Reading it again would only
+	   give us an older map and more of the same log to replay, so it's
+	   always cheaper to continue from our current position. This is
+	   common with many concurrent sessions in a mailbox where nobody
+	   happens to write the index for a while. */
+	if (LOG_IS_BEFORE(map->hdr.log_file_seq, start_offset,
+			  index->last_read_log_file_seq,
+			  index->last_read_log_file_tail_offset))
+		return FALSE;
+	return mail_index_is_file_unchanged(index);
+}
+
 int mail_index_sync_map(struct mail_index_map **_map,
 			enum mail_index_sync_handler_type type, bool force)
 {
@@ -946,7 +965,8 @@ int mail_index_sync_map(struct mail_index_map **_map,
 		   close enough */
 		log_size = index->log->head->last_size;
 		if (log_size > start_offset &&
-		    log_size - start_offset > index_size)
+		    log_size - start_offset > index_size &&
+		    !mail_index_sync_map_is_newer_than_file(map, start_offset))
 			return 0;
 	}
 
@@ -846,7 +846,8 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 	}
 
 	mail_index_sync_update_mailbox_offset(ctx);
-	if (mail_cache_need_compress(index->cache)) {
+	if (mail_cache_need_compress(index->cache) &&
+	    !mail_cache_compress_defer(index->cache)) {
 		/* if cache compression fails, we don't really care.
 		   the cache offsets are updated only if the compression was
 		   successful. */
@@ -727,6 +727,24 @@ int mail_index_reopen_if_changed(struct mail_index *index)
 	return mail_index_try_open_only(index);
 }
 
+bool mail_index_is_file_unchanged(struct mail_index *index)
+{
+	struct stat st1, st2;
+
+	if (index->fd == -1 || MAIL_INDEX_IS_IN_MEMORY(index))
+		return FALSE;
+
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_NFS_FLUSH) != 0)
+		nfs_flush_file_handle_cache(index->filepath);
+	if (nfs_safe_stat(index->filepath, &st2) < 0 ||
+	    fstat(index->fd, &st1) < 0) {
+		/* let the reopen handle the errors */
+		return FALSE;
+	}
+	return st1.st_ino == st2.st_ino &&
+		CMP_DEV_T(st1.st_dev, st2.st_dev);
+}
+
 int mail_index_refresh(struct mail_index *index)
 {
 	int ret;
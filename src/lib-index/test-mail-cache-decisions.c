@@ -0,0 +1,218 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "mail-cache-private.h"
+
+static struct mail_index_header test_hdr;
+static uint32_t test_messages_count;
+
+void mail_index_lookup_uid(struct mail_index_view *view ATTR_UNUSED,
+			   uint32_t seq, uint32_t *uid_r)
+{
+	*uid_r = seq;
+}
+const struct mail_index_header *
+mail_index_get_header(struct mail_index_view *view ATTR_UNUSED)
+{
+	return &test_hdr;
+}
+uint32_t mail_index_view_get_messages_count(struct mail_index_view *view ATTR_UNUSED)
+{
+	return test_messages_count;
+}
+
+static void
+test_cache_init(struct mail_cache *cache, struct mail_cache_view *view,
+		enum mail_cache_field_cost cost)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->fields_count = 1;
+	cache->fields = t_new(struct mail_cache_field_private, 1);
+	cache->fields[0].field.name = "test";
+	cache->fields[0].field.decision = MAIL_CACHE_DECISION_TEMP;
+	cache->fields[0].field.cost = cost;
+	cache->fields[0].used = TRUE;
+	cache->field_file_map = t_new(uint32_t, 1);
+	cache->field_file_map[0] = 0;
+
+	memset(view, 0, sizeof(*view));
+	view->cache = cache;
+
+	memset(&test_hdr, 0, sizeof(test_hdr));
+	test_hdr.day_first_uid[7] = 1;
+	test_messages_count = 100;
+}
+
+static void test_cache_new_session(struct mail_cache *cache)
+{
+	/* the header was written and a new process opened the cache */
+	mail_cache_decision_stats_flush(cache, 0);
+	cache->fields[0].hit_session = FALSE;
+	cache->fields[0].hit_uid_highwater = 0;
+	memset(&cache->fields[0].stats, 0, sizeof(cache->fields[0].stats));
+}
+
+static void
+test_cache_hits(struct mail_cache_view *view, uint32_t seq1, uint32_t seq2,
+		size_t data_size)
+{
+	uint32_t seq;
+
+	for (seq = seq1; seq <= seq2; seq++)
+		mail_cache_decision_hit(view, seq, 0, data_size);
+}
+
+static void test_mail_cache_decision_hit_in_order(void)
+{
+	struct mail_cache cache;
+	struct mail_cache_view view;
+	struct mail_cache_field_stats stats;
+	unsigned int i;
+
+	test_begin("mail cache decision hit in order");
+	test_cache_init(&cache, &view, MAIL_CACHE_FIELD_COST_BODY);
+
+	/* fetching new mails in ascending order in many sessions doesn't
+	   count, since the fields would have been generated anyway */
+	for (i = 0; i < 5; i++) {
+		test_cache_hits(&view, 1, 100, 100);
+		test_cache_new_session(&cache);
+	}
+	test_cache_hits(&view, 1, 100, 100);
+	mail_cache_field_get_stats(&cache, 0, &stats);
+	test_assert(stats.hits == 100);
+	test_assert(stats.hit_bytes == 100*100);
+	test_assert(stats.decision_hits == 0);
+	test_assert(stats.decision_sessions == 0);
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+	test_assert(!cache.field_header_write_pending);
+
+	/* accessing old mails does count */
+	test_hdr.day_first_uid[7] = 50;
+	test_cache_hits(&view, 1, 20, 100);
+	mail_cache_field_get_stats(&cache, 0, &stats);
+	test_assert(stats.decision_hits == 20);
+	test_assert(stats.decision_sessions == 1);
+	test_assert(cache.field_header_write_pending);
+
+	/* no updates with decision updates disabled */
+	view.no_decision_updates = TRUE;
+	test_cache_hits(&view, 1, 20, 100);
+	mail_cache_field_get_stats(&cache, 0, &stats);
+	test_assert(stats.hits == 120);
+	test_assert(stats.decision_hits == 20);
+	test_end();
+}
+
+static void test_mail_cache_decision_hit_promote(void)
+{
+	struct mail_cache cache;
+	struct mail_cache_view view;
+	struct mail_cache_field_stats stats;
+
+	test_begin("mail cache decision hit promote");
+	test_cache_init(&cache, &view, MAIL_CACHE_FIELD_COST_BODY);
+
+	/* a single session re-reading the mails many times isn't enough */
+	test_cache_hits(&view, 1, 100, 1000);
+	test_cache_hits(&view, 1, 100, 1000);
+	test_cache_hits(&view, 1, 100, 1000);
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+	test_cache_new_session(&cache);
+
+	test_cache_hits(&view, 1, 100, 1000);
+	test_cache_hits(&view, 1, 10, 1000);
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+	test_cache_new_session(&cache);
+
+	/* the third session makes it pay off */
+	test_cache_hits(&view, 1, 100, 1000);
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+	test_cache_hits(&view, 1, 1, 1000);
+	mail_cache_field_get_stats(&cache, 0, &stats);
+	test_assert(stats.decision_hits == 211);
+	test_assert(stats.decision_sessions == 3);
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_YES);
+	test_assert(cache.fields[0].decision_dirty);
+	test_end();
+}
+
+static void test_mail_cache_decision_hit_large(void)
+{
+	struct mail_cache cache;
+	struct mail_cache_view view;
+	unsigned int i;
+
+	test_begin("mail cache decision hit large values");
+	test_cache_init(&cache, &view, MAIL_CACHE_FIELD_COST_BODY);
+	test_messages_count = 10000;
+
+	/* the few hits don't pay off for caching large values for all
+	   the messages */
+	for (i = 0; i < 3; i++) {
+		test_cache_hits(&view, 1, 100, 1);
+		test_cache_hits(&view, 1, 100, 100000);
+		test_cache_new_session(&cache);
+	}
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+
+	/* cheap fields aren't promoted by hits */
+	test_cache_init(&cache, &view, MAIL_CACHE_FIELD_COST_HEADER);
+	for (i = 0; i < 3; i++) {
+		test_cache_hits(&view, 1, 100, 1);
+		test_cache_hits(&view, 1, 100, 1);
+		test_cache_new_session(&cache);
+	}
+	test_assert(cache.fields[0].field.decision == MAIL_CACHE_DECISION_TEMP);
+	test_end();
+}
+
+static void test_mail_cache_field_is_worth_caching(void)
+{
+	struct mail_cache cache;
+	struct mail_cache_view view;
+
+	test_begin("mail cache field is worth caching");
+	test_cache_init(&cache, &view, MAIL_CACHE_FIELD_COST_HEADER);
+	cache.fields[0].file_hits = 100;
+	cache.fields[0].file_hit_sessions = 2;
+	test_assert(!mail_cache_field_is_worth_caching(&cache, 0, 1));
+
+	cache.fields[0].file_hit_sessions = 3;
+	test_assert(mail_cache_field_is_worth_caching(&cache, 0, 1));
+	test_assert(mail_cache_field_is_worth_caching(&cache, 0, 100*1024 - 1));
+	test_assert(!mail_cache_field_is_worth_caching(&cache, 0, 100*1024));
+
+	cache.fields[0].field.cost = MAIL_CACHE_FIELD_COST_METADATA;
+	test_assert(!mail_cache_field_is_worth_caching(&cache, 0, 100*16));
+
+	/* unflushed hits and the current session are counted */
+	cache.fields[0].file_hits = 9;
+	cache.fields[0].file_hit_sessions = 2;
+	test_assert(!mail_cache_field_is_worth_caching(&cache, 0, 1));
+	cache.fields[0].unflushed_hits = 1;
+	test_assert(!mail_cache_field_is_worth_caching(&cache, 0, 1));
+	cache.fields[0].hit_session_unflushed = TRUE;
+	test_assert(mail_cache_field_is_worth_caching(&cache, 0, 1));
+
+	mail_cache_decision_stats_flush(&cache, 0);
+	test_assert(cache.fields[0].file_hits == 10);
+	test_assert(cache.fields[0].file_hit_sessions == 3);
+	test_assert(cache.fields[0].unflushed_hits == 0);
+	test_assert(!cache.fields[0].hit_session_unflushed);
+	test_assert(mail_cache_field_is_worth_caching(&cache, 0, 1));
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_decision_hit_in_order,
+		test_mail_cache_decision_hit_promote,
+		test_mail_cache_decision_hit_large,
+		test_mail_cache_field_is_worth_caching,
+		NULL
+	};
+	return test_run(test_functions);
+}
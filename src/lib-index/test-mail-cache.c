@@ -0,0 +1,316 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index.h"
+#include "mail-cache-private.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-cache"
+
+enum test_field {
+	TEST_FIELD_FIXED,
+	TEST_FIELD_VARIABLE,
+	TEST_FIELD_BITMASK,
+	TEST_FIELD_NEVER_ADDED,
+
+	TEST_FIELD_COUNT
+};
+
+static struct mail_cache_field test_fields[TEST_FIELD_COUNT] = {
+	{ .name = "fixed", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = 4, .decision = MAIL_CACHE_DECISION_YES },
+	{ .name = "variable", .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .decision = MAIL_CACHE_DECISION_YES },
+	{ .name = "bitmask", .type = MAIL_CACHE_FIELD_BITMASK,
+	  .field_size = 1, .decision = MAIL_CACHE_DECISION_YES },
+	{ .name = "never-added", .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .decision = MAIL_CACHE_DECISION_YES }
+};
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	/* the index ID is taken from ioloop_time */
+	io_loop_time_refresh();
+	index = mail_index_alloc(TEST_DIR, "test.dovecot.index");
+	test_assert(mail_index_open_or_create(index,
+		MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	mail_cache_register_fields(mail_index_get_cache(index),
+				   test_fields, TEST_FIELD_COUNT);
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) == 1);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	mail_index_append(trans, 1, &seq);
+	mail_index_append(trans, 2, &seq);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+	return index;
+}
+
+static void test_index_close(struct mail_index **_index)
+{
+	struct mail_index *index = *_index;
+
+	*_index = NULL;
+	mail_index_close(index);
+	mail_index_free(&index);
+	if (unlink_directory(TEST_DIR, TRUE) < 0)
+		i_error("unlink_directory(%s) failed: %m", TEST_DIR);
+}
+
+static void test_cache_add(struct mail_index *index, uint32_t seq,
+			   enum test_field field, const void *data,
+			   size_t data_size)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, seq, test_fields[field].idx,
+		       data, data_size);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_cache_lookup_fields(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	unsigned int field_idxs[TEST_FIELD_COUNT];
+	buffer_t *bufs[TEST_FIELD_COUNT];
+	bool found[TEST_FIELD_COUNT];
+	const uint32_t fixed_value = 0x12345678;
+	unsigned char bits;
+	unsigned int i;
+
+	test_begin("mail cache lookup fields");
+	index = test_index_open();
+
+	test_cache_add(index, 1, TEST_FIELD_FIXED,
+		       &fixed_value, sizeof(fixed_value));
+	test_cache_add(index, 1, TEST_FIELD_VARIABLE, "hello", 6);
+	/* bitmask fields are merged from all the records */
+	bits = 0x01;
+	test_cache_add(index, 1, TEST_FIELD_BITMASK, &bits, sizeof(bits));
+	bits = 0x84;
+	test_cache_add(index, 1, TEST_FIELD_BITMASK, &bits, sizeof(bits));
+	test_cache_add(index, 2, TEST_FIELD_BITMASK, &bits, sizeof(bits));
+
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(mail_index_get_cache(index), view);
+
+	/* ask the fields in a different order than they were added */
+	for (i = 0; i < TEST_FIELD_COUNT; i++) {
+		field_idxs[i] = test_fields[TEST_FIELD_COUNT-1 - i].idx;
+		bufs[i] = buffer_create_dynamic(default_pool, 16);
+	}
+	test_assert(mail_cache_lookup_fields(cache_view, 1, field_idxs,
+					     TEST_FIELD_COUNT, bufs,
+					     found) == 3);
+	test_assert(!found[0] && bufs[0]->used == 0);
+	test_assert(found[1] && bufs[1]->used == 1 &&
+		    ((const unsigned char *)bufs[1]->data)[0] == 0x85);
+	test_assert(found[2] && bufs[2]->used == 6 &&
+		    memcmp(bufs[2]->data, "hello", 6) == 0);
+	test_assert(found[3] && bufs[3]->used == sizeof(fixed_value) &&
+		    memcmp(bufs[3]->data, &fixed_value,
+			   sizeof(fixed_value)) == 0);
+
+	/* the results are the same as with mail_cache_lookup_field() */
+	for (i = 0; i < TEST_FIELD_COUNT; i++) {
+		buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 16);
+
+		test_assert_idx(mail_cache_lookup_field(cache_view, buf, 1,
+							field_idxs[i]) ==
+				(found[i] ? 1 : 0), i);
+		test_assert_idx(buffer_cmp(buf, bufs[i]), i);
+		buffer_set_used_size(bufs[i], 0);
+	}
+
+	/* only some of the fields exist for the second mail */
+	test_assert(mail_cache_lookup_fields(cache_view, 2, field_idxs,
+					     TEST_FIELD_COUNT, bufs,
+					     found) == 1);
+	test_assert(!found[0] && !found[2] && !found[3]);
+	test_assert(found[1] && bufs[1]->used == 1 &&
+		    ((const unsigned char *)bufs[1]->data)[0] == 0x84);
+	test_assert(bufs[0]->used == 0 && bufs[2]->used == 0 &&
+		    bufs[3]->used == 0);
+
+	for (i = 0; i < TEST_FIELD_COUNT; i++)
+		buffer_free(&bufs[i]);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	test_index_close(&index);
+	test_end();
+}
+
+static unsigned int test_compress_callback_count;
+static bool test_compress_callback_ret;
+
+static bool
+test_compress_callback(struct mail_cache *cache ATTR_UNUSED,
+		       void *context ATTR_UNUSED)
+{
+	test_compress_callback_count++;
+	return test_compress_callback_ret;
+}
+
+static void test_index_sync(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) == 1);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+/* open the index with something in the cache file, and pretend that the
+   file needs to be compressed. returns the cache file's sequence. */
+static struct mail_index *test_cache_open_need_compress(uint32_t *file_seq_r)
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+
+	index = test_index_open();
+	cache = mail_index_get_cache(index);
+	test_cache_add(index, 1, TEST_FIELD_VARIABLE, "hello", 6);
+	test_assert(cache->hdr != NULL);
+	*file_seq_r = cache->hdr->file_seq;
+	cache->need_compress_file_seq = *file_seq_r;
+
+	mail_cache_set_compress_callback(cache, test_compress_callback, NULL);
+	test_compress_callback_count = 0;
+	return index;
+}
+
+static bool test_cache_is_compressed(struct mail_cache *cache,
+				     uint32_t old_file_seq)
+{
+	return cache->hdr != NULL && cache->hdr->file_seq != old_file_seq &&
+		cache->need_compress_file_seq == 0;
+}
+
+static void test_mail_cache_compress_defer(void)
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+	uint32_t file_seq;
+
+	test_begin("mail cache compress defer");
+	index = test_cache_open_need_compress(&file_seq);
+	cache = mail_index_get_cache(index);
+	test_compress_callback_ret = TRUE;
+
+	/* the sync hands off the compression instead of doing it */
+	test_assert(mail_cache_need_compress(cache));
+	test_index_sync(index);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(cache->hdr->file_seq == file_seq);
+	test_assert(!mail_cache_need_compress(cache));
+
+	/* the same file isn't handed off again */
+	test_index_sync(index);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	/* the other process compresses it, ignoring the callback */
+	test_assert(mail_cache_compress_if_needed(cache) == 0);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(test_cache_is_compressed(cache, file_seq));
+	test_assert(!mail_cache_need_compress(cache));
+
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_mail_cache_compress_defer_expire(void)
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+	uint32_t file_seq;
+
+	test_begin("mail cache compress defer expire");
+	index = test_cache_open_need_compress(&file_seq);
+	cache = mail_index_get_cache(index);
+	test_compress_callback_ret = TRUE;
+
+	test_index_sync(index);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(!mail_cache_need_compress(cache));
+
+	/* nobody compressed it in time, so the next sync does it inline */
+	cache->compress_requested_time -=
+		MAIL_CACHE_COMPRESS_DEFER_TIMEOUT_SECS;
+	test_assert(mail_cache_need_compress(cache));
+	test_index_sync(index);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(test_cache_is_compressed(cache, file_seq));
+
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_mail_cache_compress_defer_fail(void)
+{
+	struct mail_index *index;
+	struct mail_cache *cache;
+	uint32_t file_seq;
+
+	test_begin("mail cache compress defer fail");
+	index = test_cache_open_need_compress(&file_seq);
+	cache = mail_index_get_cache(index);
+
+	/* the hand-off failed, so the sync compresses inline */
+	test_compress_callback_ret = FALSE;
+	test_index_sync(index);
+	test_assert(test_compress_callback_count == 1);
+	test_assert(test_cache_is_compressed(cache, file_seq));
+
+	/* nothing to do anymore */
+	file_seq = cache->hdr->file_seq;
+	test_assert(mail_cache_compress_if_needed(cache) == 0);
+	test_assert(cache->hdr->file_seq == file_seq);
+
+	test_index_close(&index);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_cache_lookup_fields,
+		test_mail_cache_compress_defer,
+		test_mail_cache_compress_defer_expire,
+		test_mail_cache_compress_defer_fail,
+		NULL
+	};
+	return test_run(test_functions);
+}
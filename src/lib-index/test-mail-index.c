@@ -0,0 +1,207 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "write-full.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-index"
+#define TEST_INDEX_FNAME "test.dovecot.index"
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TEST_DIR, TEST_INDEX_FNAME);
+	test_assert(mail_index_open_or_create(index,
+		MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	return index;
+}
+
+static void test_index_close(struct mail_index **_index)
+{
+	struct mail_index *index = *_index;
+
+	*_index = NULL;
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static void test_index_append(struct mail_index *index, uint32_t uid)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) == 1);
+	if (uid == 1) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static struct mail_index *test_index_create(void)
+{
+	struct mail_index *index;
+
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	/* the index ID is taken from ioloop_time */
+	io_loop_time_refresh();
+	index = test_index_open();
+	test_index_append(index, 1);
+	/* make the sync write the index file, and then open it again */
+	index->need_recreate = TRUE;
+	test_index_append(index, 2);
+	test_index_close(&index);
+
+	index = test_index_open();
+	test_assert(index->fd != -1);
+	return index;
+}
+
+static void test_index_replace_file(struct mail_index *index)
+{
+	const char *temp_path = t_strconcat(index->filepath, ".tmp", NULL);
+	struct stat st1, st2;
+	char buf[1024];
+	ssize_t ret;
+	int fd_in, fd_out;
+
+	/* copy the index file with the exact same contents and rename it
+	   over the original. only the inode changes. */
+	fd_in = open(index->filepath, O_RDONLY);
+	if (fd_in == -1)
+		i_fatal("open(%s) failed: %m", index->filepath);
+	fd_out = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd_out == -1)
+		i_fatal("open(%s) failed: %m", temp_path);
+	while ((ret = read(fd_in, buf, sizeof(buf))) > 0) {
+		if (write_full(fd_out, buf, ret) < 0)
+			i_fatal("write(%s) failed: %m", temp_path);
+	}
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", index->filepath);
+	if (fstat(fd_in, &st1) < 0)
+		i_fatal("fstat(%s) failed: %m", index->filepath);
+	i_close_fd(&fd_in);
+	i_close_fd(&fd_out);
+
+	if (rename(temp_path, index->filepath) < 0)
+		i_fatal("rename(%s, %s) failed: %m", temp_path, index->filepath);
+	if (stat(index->filepath, &st2) < 0)
+		i_fatal("stat(%s) failed: %m", index->filepath);
+	test_assert(st1.st_size == st2.st_size);
+	test_assert(st1.st_ino != st2.st_ino);
+}
+
+static void test_index_mark_file(struct mail_index *index, uint32_t mark)
+{
+	int fd;
+
+	/* write to a header field that nothing else uses, so we can see
+	   whether the file was read again */
+	fd = open(index->filepath, O_WRONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", index->filepath);
+	if (pwrite_full(fd, &mark, sizeof(mark),
+			offsetof(struct mail_index_header,
+				 unused_old_sync_stamp)) < 0)
+		i_fatal("pwrite(%s) failed: %m", index->filepath);
+	i_close_fd(&fd);
+}
+
+static void test_mail_index_file_unchanged(void)
+{
+	struct mail_index *index;
+
+	test_begin("mail index file unchanged");
+	index = test_index_create();
+	test_assert(mail_index_is_file_unchanged(index));
+
+	/* replaced by a file with the same size but a different inode */
+	test_index_replace_file(index);
+	test_assert(!mail_index_is_file_unchanged(index));
+
+	/* reopening the index picks up the new file */
+	test_assert(mail_index_reopen_if_changed(index) == 1);
+	test_assert(mail_index_is_file_unchanged(index));
+
+	test_index_close(&index);
+	(void)unlink_directory(TEST_DIR, TRUE);
+	test_end();
+}
+
+static void test_mail_index_refresh_long_log(bool replace_file)
+{
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	uint32_t uid;
+
+	index = test_index_create();
+
+	/* another process appends more to the transaction log than the
+	   index file's size, but doesn't rewrite the index file */
+	index2 = test_index_open();
+	for (uid = 3; uid <= 100; uid++)
+		test_index_append(index2, uid);
+	test_index_close(&index2);
+
+	if (replace_file)
+		test_index_replace_file(index);
+	test_index_mark_file(index, 0x12345678);
+
+	/* syncing reads the whole log, which is now longer than the index */
+	test_index_append(index, 101);
+	test_assert(mail_index_refresh(index) == 0);
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == 101);
+	mail_index_view_close(&view);
+
+	/* the index file is read again only if it was replaced */
+	test_assert(mail_index_is_file_unchanged(index));
+	test_assert((index->map->hdr.unused_old_sync_stamp == 0x12345678) ==
+		    replace_file);
+
+	test_index_close(&index);
+	(void)unlink_directory(TEST_DIR, TRUE);
+}
+
+static void test_mail_index_refresh_long_log_unchanged(void)
+{
+	test_begin("mail index refresh long log with unchanged file");
+	test_mail_index_refresh_long_log(FALSE);
+	test_end();
+}
+
+static void test_mail_index_refresh_long_log_replaced(void)
+{
+	test_begin("mail index refresh long log with replaced file");
+	test_mail_index_refresh_long_log(TRUE);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_mail_index_file_unchanged,
+		test_mail_index_refresh_long_log_unchanged,
+		test_mail_index_refresh_long_log_replaced,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -2,7 +2,6 @@
 
 #include "lib.h"
 #include "buffer.h"
-#include "hex-binary.h"
 #include "qp-decoder.h"
 
 /* quoted-printable lines can be max 76 characters. if we've seen more than
@@ -12,6 +11,11 @@
 
 #define QP_IS_TRAILING_WHITESPACE(c) \
 	((c) == ' ' || (c) == '\t')
+/* lowercase hex isn't strictly valid, but allow */
+#define QP_IS_HEX(c) \
+	(((c) >= '0' && (c) <= '9') || \
+	 ((c) >= 'A' && (c) <= 'F') || \
+	 ((c) >= 'a' && (c) <= 'f'))
 
 enum qp_state {
 	STATE_TEXT = 0,
@@ -48,6 +52,14 @@ void qp_decoder_deinit(struct qp_decoder **_qp)
 	i_free(qp);
 }
 
+static inline unsigned char qp_hex_value(unsigned char c)
+{
+	if (c <= '9')
+		return c - '0';
+	/* 'A'..'F' or 'a'..'f' */
+	return (c | 0x20) - 'a' + 10;
+}
+
 static size_t
 qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		     size_t src_size)
@@ -61,6 +73,17 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		}
 		switch (src[i]) {
 		case '=':
+			if (i+2 < src_size &&
+			    QP_IS_HEX(src[i+1]) && QP_IS_HEX(src[i+2])) {
+				/* fast path: =<hex><hex> */
+				buffer_append(qp->dest, src+start, i-start);
+				buffer_append_c(qp->dest,
+					(qp_hex_value(src[i+1]) << 4) |
+					qp_hex_value(src[i+2]));
+				i += 2;
+				start = i+1;
+				continue;
+			}
 			qp->state = STATE_EQUALS;
 			break;
 		case '\r':
@@ -74,6 +97,13 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 			continue;
 		case ' ':
 		case '\t':
+			if (i+1 < src_size &&
+			    !QP_IS_TRAILING_WHITESPACE(src[i+1]) &&
+			    src[i+1] != '\r' && src[i+1] != '\n') {
+				/* fast path: this can't be trailing
+				   whitespace, so it's just text */
+				continue;
+			}
 			i_assert(qp->whitespace->used == 0);
 			qp->state = STATE_WHITESPACE;
 			buffer_append_c(qp->whitespace, src[i]);
@@ -175,10 +205,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_EQUALS:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    /* lowercase hex isn't strictly valid, but allow */
-			    (src[i] >= 'a' && src[i] <= 'f')) {
+			if (QP_IS_HEX(src[i])) {
 				qp->hexchar = src[i];
 				qp->state = STATE_HEX2;
 			} else if (QP_IS_TRAILING_WHITESPACE(src[i])) {
@@ -200,16 +227,10 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_HEX2:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    (src[i] >= 'a' && src[i] <= 'f')) {
-				char data[3];
-
-				data[0] = qp->hexchar;
-				data[1] = src[i];
-				data[2] = '\0';
-				if (hex_to_binary(data, qp->dest) < 0)
-					i_unreached();
+			if (QP_IS_HEX(src[i])) {
+				buffer_append_c(qp->dest,
+					(qp_hex_value(qp->hexchar) << 4) |
+					qp_hex_value(src[i]));
 				qp->state = STATE_TEXT;
 			} else {
 				/* invalid input */
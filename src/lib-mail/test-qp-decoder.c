@@ -27,6 +27,8 @@ static void test_qp_decoder(void)
 		{ "foo_bar", "foo_bar", 0, 0 },
 		{ "\n\n", "\r\n\r\n", 0, 0 },
 		{ "\r\n\n\n\r\n", "\r\n\r\n\r\n\r\n", 0, 0 },
+		{ "=41=42 =43\t=4a ", "AB C\tJ", 0, 0 },
+		{ "a b\tc  d \te \r\n", "a b\tc  d \te\r\n", 0, 0 },
 
 		{ "foo=", "foo=", 4, -1 },
 		{ "foo= \t", "foo= \t", 6, -1 },
@@ -85,10 +87,51 @@ static void test_qp_decoder(void)
 	test_end();
 }
 
+static void test_qp_decoder_benchmark(void)
+{
+#define BENCHMARK_SIZE (1024*1024*16)
+	static const char line[] =
+		"Hyv=C3=A4=C3=A4 p=C3=A4iv=C3=A4=C3=A4, this is some quoted-=\r\n"
+		"printable text with =3D signs and trailing whitespace  \r\n";
+	struct timespec start;
+	struct qp_decoder *qp;
+	string_t *input, *output;
+	size_t error_pos;
+	const char *error;
+	double secs;
+
+	test_begin("qp-decoder benchmark");
+	input = str_new(default_pool, BENCHMARK_SIZE + sizeof(line));
+	while (str_len(input) < BENCHMARK_SIZE)
+		str_append(input, line);
+	output = str_new(default_pool, BENCHMARK_SIZE);
+
+	qp = qp_decoder_init(output);
+	test_benchmark_start(&start);
+	test_assert(qp_decoder_more(qp, str_data(input), str_len(input),
+				    &error_pos, &error) == 0);
+	test_assert(qp_decoder_finish(qp, &error) == 0);
+	secs = test_benchmark_secs(&start);
+	qp_decoder_deinit(&qp);
+
+	test_out_reason("decode 16MB", TRUE,
+		t_strdup_printf("%.0f MB/s", str_len(input) / secs / 1e6));
+	str_free(&input);
+	str_free(&output);
+	test_end();
+}
+
+static void test_qp_decoder_benchmarks(void)
+{
+	if (test_benchmarks_enabled())
+		test_qp_decoder_benchmark();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_qp_decoder,
+		test_qp_decoder_benchmarks,
 		NULL
 	};
 	return test_run(test_functions);
@@ -955,16 +955,23 @@ static void master_service_listen(struct master_service_listener *l)
 
 void master_service_io_listeners_add(struct master_service *service)
 {
+	enum io_condition cond = IO_READ;
 	unsigned int i;
 
 	if (service->stopping)
 		return;
 
+	/* Processes handling multiple clients are typically all listening
+	   on the same sockets at the same time. Wake up only one of them
+	   per new connection to avoid a thundering herd. */
+	if (service->total_available_count > 1)
+		cond |= IO_EXCLUSIVE;
+
 	for (i = 0; i < service->socket_count; i++) {
 		struct master_service_listener *l = &service->listeners[i];
 
 		if (l->io == NULL && l->fd != -1) {
-			l->io = io_add(MASTER_LISTEN_FD_FIRST + i, IO_READ,
+			l->io = io_add(MASTER_LISTEN_FD_FIRST + i, cond,
 				       master_service_listen, l);
 		}
 	}
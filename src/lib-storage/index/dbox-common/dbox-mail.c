@@ -175,9 +175,8 @@ dbox_get_cached_metadata(struct dbox_mail *mail, enum dbox_metadata_key key,
 	uint32_t order;
 
 	str = str_new(imail->mail.data_pool, 64);
-	if (mail_cache_lookup_field(imail->mail.mail.transaction->cache_view,
-				    str, imail->mail.mail.seq,
-				    ibox->cache_fields[cache_field].idx) > 0) {
+	if (index_mail_cache_lookup_field(imail, str,
+			ibox->cache_fields[cache_field].idx) > 0) {
 		if (cache_field == MAIL_CACHE_POP3_ORDER) {
 			i_assert(str_len(str) == sizeof(order));
 			memcpy(&order, str_data(str), sizeof(order));
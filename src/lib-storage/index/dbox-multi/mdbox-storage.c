@@ -159,6 +159,8 @@ mdbox_mailbox_alloc(struct mail_storage *storage, struct mailbox_list *list,
 	ibox = INDEX_STORAGE_CONTEXT(&mbox->box);
 	ibox->index_flags |= MAIL_INDEX_OPEN_FLAG_KEEP_BACKUPS |
 		MAIL_INDEX_OPEN_FLAG_NEVER_IN_MEMORY;
+	/* save dates come from the mdbox index records */
+	ibox->cache_prefetch_skip_fields = MAIL_FETCH_SAVE_DATE;
 
 	mbox->storage = (struct mdbox_storage *)storage;
 	return &mbox->box;
@@ -16,6 +16,7 @@
 #include "mail-cache.h"
 #include "mail-index-modseq.h"
 #include "index-storage.h"
+#include "index-sort.h"
 #include "istream-mail.h"
 #include "index-mail.h"
 
@@ -27,54 +28,101 @@
 struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "flags",
 	  .type = MAIL_CACHE_FIELD_BITMASK,
-	  .field_size = sizeof(uint32_t) },
+	  .field_size = sizeof(uint32_t),
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "date.sent",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(struct mail_sent_date) },
+	  .field_size = sizeof(struct mail_sent_date),
+	  .cost = MAIL_CACHE_FIELD_COST_HEADER },
 	{ .name = "date.received",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(uint32_t) },
+	  .field_size = sizeof(uint32_t),
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "date.save",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(uint32_t) },
+	  .field_size = sizeof(uint32_t),
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "size.virtual",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(uoff_t) },
+	  .field_size = sizeof(uoff_t),
+	  .cost = MAIL_CACHE_FIELD_COST_BODY },
 	{ .name = "size.physical",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(uoff_t) },
+	  .field_size = sizeof(uoff_t),
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "imap.body",
-	  .type = MAIL_CACHE_FIELD_STRING },
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .cost = MAIL_CACHE_FIELD_COST_BODY },
 	{ .name = "imap.bodystructure",
-	  .type = MAIL_CACHE_FIELD_STRING },
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .cost = MAIL_CACHE_FIELD_COST_BODY },
 	{ .name = "imap.envelope",
-	  .type = MAIL_CACHE_FIELD_STRING },
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .cost = MAIL_CACHE_FIELD_COST_HEADER },
 	{ .name = "pop3.uidl",
-	  .type = MAIL_CACHE_FIELD_STRING },
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .cost = MAIL_CACHE_FIELD_COST_HEADER },
 	{ .name = "pop3.order",
 	  .type = MAIL_CACHE_FIELD_FIXED_SIZE,
-	  .field_size = sizeof(uint32_t) },
+	  .field_size = sizeof(uint32_t),
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "guid",
-	  .type = MAIL_CACHE_FIELD_STRING },
+	  .type = MAIL_CACHE_FIELD_STRING,
+	  .cost = MAIL_CACHE_FIELD_COST_METADATA },
 	{ .name = "mime.parts",
-	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .cost = MAIL_CACHE_FIELD_COST_BODY },
 	{ .name = "binary.parts",
-	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .cost = MAIL_CACHE_FIELD_COST_BODY },
 	{ .name = "body.snippet",
-	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .cost = MAIL_CACHE_FIELD_COST_BODY }
 	/* FIXME: for now need to update get_metadata_precache_fields() in
 	   index-status.c when adding more fields. those fields should probably
 	   just be moved here to the same struct. */
 };
 
+static const struct {
+	enum mail_fetch_field fetch_field;
+	enum index_cache_field cache_field;
+} index_mail_prefetch_cache_fields[] = {
+	{ MAIL_FETCH_DATE, MAIL_CACHE_SENT_DATE },
+	{ MAIL_FETCH_RECEIVED_DATE, MAIL_CACHE_RECEIVED_DATE },
+	{ MAIL_FETCH_SAVE_DATE, MAIL_CACHE_SAVE_DATE },
+	{ MAIL_FETCH_VIRTUAL_SIZE, MAIL_CACHE_VIRTUAL_FULL_SIZE },
+	{ MAIL_FETCH_PHYSICAL_SIZE, MAIL_CACHE_PHYSICAL_FULL_SIZE },
+	{ MAIL_FETCH_IMAP_BODY, MAIL_CACHE_IMAP_BODY },
+	{ MAIL_FETCH_IMAP_BODYSTRUCTURE, MAIL_CACHE_IMAP_BODYSTRUCTURE },
+	{ MAIL_FETCH_IMAP_ENVELOPE, MAIL_CACHE_IMAP_ENVELOPE },
+	{ MAIL_FETCH_MESSAGE_PARTS, MAIL_CACHE_MESSAGE_PARTS },
+	{ MAIL_FETCH_GUID, MAIL_CACHE_GUID },
+	{ MAIL_FETCH_BODY_SNIPPET, MAIL_CACHE_BODY_SNIPPET }
+};
+
 static int index_mail_parse_body(struct index_mail *mail,
 				 enum index_cache_field field);
 
 int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 				  unsigned int field_idx)
 {
+	const struct index_mail_cache_value *value;
 	int ret;
 
+	if (array_is_created(&mail->data.cache_values)) {
+		array_foreach(&mail->data.cache_values, value) {
+			if (value->field_idx != field_idx)
+				continue;
+			if (value->buf == NULL) {
+				/* already known not to be cached */
+				return 0;
+			}
+			buffer_append_buf(buf, value->buf, 0, (size_t)-1);
+			mail->mail.mail.transaction->stats.cache_hit_count++;
+			return 1;
+		}
+	}
+
 	ret = mail_cache_lookup_field(mail->mail.mail.transaction->cache_view,
 				      buf, mail->data.seq, field_idx);
 	if (ret > 0)
@@ -82,6 +130,72 @@ int index_mail_cache_lookup_field(struct index_mail *mail, buffer_t *buf,
 	return ret;
 }
 
+static void index_mail_cache_prefetch_fields(struct index_mail *mail)
+{
+	struct index_mail_data *data = &mail->data;
+	const struct mail_cache_field *cache_fields = mail->ibox->cache_fields;
+	struct index_mail_cache_value *value;
+	enum mail_fetch_field fetch_field;
+	unsigned int i, count = 0;
+	unsigned int field_idxs[N_ELEMENTS(index_mail_prefetch_cache_fields)];
+	buffer_t *bufs[N_ELEMENTS(index_mail_prefetch_cache_fields)];
+	bool found[N_ELEMENTS(index_mail_prefetch_cache_fields)];
+
+	if (array_is_created(&data->cache_values)) {
+		/* already done for this mail */
+		return;
+	}
+
+	for (i = 0; i < N_ELEMENTS(index_mail_prefetch_cache_fields); i++) {
+		fetch_field = index_mail_prefetch_cache_fields[i].fetch_field;
+		if ((data->wanted_fields & fetch_field) != 0 &&
+		    (mail->ibox->cache_prefetch_skip_fields & fetch_field) == 0) {
+			field_idxs[count++] = cache_fields[
+				index_mail_prefetch_cache_fields[i].cache_field].idx;
+		}
+	}
+	if (count < 2) {
+		/* a single lookup is just as fast without copying */
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		bufs[i] = buffer_create_dynamic(mail->mail.data_pool, 64);
+	p_array_init(&data->cache_values, mail->mail.data_pool, count);
+	if (mail_cache_lookup_fields(mail->mail.mail.transaction->cache_view,
+				     data->seq, field_idxs, count,
+				     bufs, found) < 0) {
+		/* let the individual lookups handle the error */
+		return;
+	}
+
+	/* remember also the fields that weren't found, so they don't need
+	   to be looked up again */
+	for (i = 0; i < count; i++) {
+		value = array_append_space(&data->cache_values);
+		value->field_idx = field_idxs[i];
+		value->buf = found[i] ? bufs[i] : NULL;
+	}
+}
+
+static void
+index_mail_cache_values_forget(struct index_mail *mail, unsigned int field_idx)
+{
+	const struct index_mail_cache_value *values;
+	unsigned int i, count;
+
+	if (!array_is_created(&mail->data.cache_values))
+		return;
+
+	values = array_get(&mail->data.cache_values, &count);
+	for (i = 0; i < count; i++) {
+		if (values[i].field_idx == field_idx) {
+			array_delete(&mail->data.cache_values, i, 1);
+			break;
+		}
+	}
+}
+
 static int get_serialized_parts(struct index_mail *mail, buffer_t **part_buf_r)
 {
 	const unsigned int field_idx =
@@ -565,6 +679,8 @@ void index_mail_cache_add_idx(struct index_mail *mail, unsigned int field_idx,
 	    !_mail->box->mail_cache_disabled) {
 		mail_cache_add(_mail->transaction->cache_trans, _mail->seq,
 			       field_idx, data, data_size);
+		/* the next lookup needs to see the added value */
+		index_mail_cache_values_forget(mail, field_idx);
 	}
 }
 
@@ -1613,6 +1729,8 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 	const struct mail_cache_field *cache_fields = mail->ibox->cache_fields;
 	struct mail_cache_view *cache_view = _mail->transaction->cache_view;
 
+	index_mail_cache_prefetch_fields(mail);
+
 	if ((data->wanted_fields & (MAIL_FETCH_NUL_STATE |
 				    MAIL_FETCH_IMAP_BODY |
 				    MAIL_FETCH_IMAP_BODYSTRUCTURE)) != 0 &&
@@ -2156,12 +2274,14 @@ void index_mail_set_cache_corrupted_reason(struct mail *mail,
 		imail->data.physical_size = (uoff_t)-1;
 		imail->data.virtual_size = (uoff_t)-1;
 		imail->data.parts = NULL;
+		index_sort_forget_size(mail);
 		break;
 	case MAIL_FETCH_VIRTUAL_SIZE:
 		field_name = "virtual size";
 		imail->data.physical_size = (uoff_t)-1;
 		imail->data.virtual_size = (uoff_t)-1;
 		imail->data.parts = NULL;
+		index_sort_forget_size(mail);
 		break;
 	case MAIL_FETCH_MESSAGE_PARTS:
 		field_name = "MIME parts";
@@ -71,6 +71,12 @@ struct index_mail_line {
 	uint32_t line_num;
 };
 
+struct index_mail_cache_value {
+	unsigned int field_idx;
+	/* NULL if the field isn't cached */
+	buffer_t *buf;
+};
+
 struct message_header_line;
 
 struct index_mail_data {
@@ -98,6 +104,9 @@ struct index_mail_data {
 	struct mailbox_header_lookup_ctx *wanted_headers;
 
 	buffer_t *search_results;
+	/* Wanted cache fields that were looked up with a single cache lookup
+	   by index_mail_cache_prefetch_fields() */
+	ARRAY(struct index_mail_cache_value) cache_values;
 
 	struct istream *stream, *filter_stream;
 	struct tee_istream *tee_stream;
@@ -3,10 +3,21 @@
 
 #include "index-sort.h"
 
+enum index_sort_num_ext {
+	INDEX_SORT_NUM_EXT_ARRIVAL,
+	INDEX_SORT_NUM_EXT_DATE,
+	INDEX_SORT_NUM_EXT_SIZE,
+
+	INDEX_SORT_NUM_EXT_COUNT
+};
+
 struct mail_search_sort_program {
 	struct mailbox_transaction_context *t;
 	enum mail_sort_type sort_program[MAX_SORT_PROGRAM_SIZE];
 	struct mail *temp_mail;
+	/* extensions containing the numeric sort keys,
+	   (uint32_t)-1 if not registered yet */
+	uint32_t num_ext_ids[INDEX_SORT_NUM_EXT_COUNT];
 
 	void (*sort_list_add)(struct mail_search_sort_program *program,
 			      struct mail *mail);
@@ -19,7 +30,7 @@ struct mail_search_sort_program {
 
 int index_sort_header_get(struct mail *mail, uint32_t seq,
 			  enum mail_sort_type sort_type, string_t *dest);
-int index_sort_node_cmp_type(struct mail *mail,
+int index_sort_node_cmp_type(struct mail_search_sort_program *program,
 			     const enum mail_sort_type *sort_program,
 			     uint32_t seq1, uint32_t seq2);
 
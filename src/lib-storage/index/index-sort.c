@@ -31,12 +31,151 @@ ARRAY_DEFINE_TYPE(mail_sort_node_float, struct mail_sort_node_float);
 
 struct sort_cmp_context {
 	struct mail_search_sort_program *program;
-	struct mail *mail;
 	bool reverse;
 };
 
+/* The arrival date, date and size sort keys are stored to index as 32bit
+   numbers (value+1, 0 = not stored yet), so the following SORTs don't need
+   to look them up from cache or parse the messages. Since these values never
+   change for a message, the records never need to be updated. New messages
+   get their keys added the first time they're sorted and expunged messages'
+   records are dropped along with the messages. Values that don't fit into
+   32 bits aren't stored. */
+static const char *index_sort_num_ext_names[INDEX_SORT_NUM_EXT_COUNT] = {
+	"sort-arrival", "sort-date", "sort-size"
+};
+
 static struct sort_cmp_context static_node_cmp_context;
 
+static uint32_t
+index_sort_num_ext_get_id(struct mail_search_sort_program *program,
+			  enum index_sort_num_ext ext)
+{
+	if (program->num_ext_ids[ext] == (uint32_t)-1) {
+		program->num_ext_ids[ext] =
+			mail_index_ext_register(program->t->box->index,
+						index_sort_num_ext_names[ext],
+						0, sizeof(uint32_t),
+						sizeof(uint32_t));
+	}
+	return program->num_ext_ids[ext];
+}
+
+static bool
+index_sort_num_ext_lookup(struct mail_search_sort_program *program,
+			  enum index_sort_num_ext ext, uint32_t seq,
+			  uoff_t *value_r)
+{
+	const void *data;
+	uint32_t num;
+	bool expunged;
+
+	mail_index_lookup_ext(program->t->view, seq,
+			      index_sort_num_ext_get_id(program, ext),
+			      &data, &expunged);
+	if (data == NULL)
+		return FALSE;
+	memcpy(&num, data, sizeof(num));
+	if (num == 0)
+		return FALSE;
+	*value_r = num - 1;
+	return TRUE;
+}
+
+static void
+index_sort_num_ext_update(struct mail_search_sort_program *program,
+			  enum index_sort_num_ext ext, uint32_t seq,
+			  uoff_t value)
+{
+	uint32_t num;
+
+	if (value >= (uint32_t)-1)
+		return;
+	num = value + 1;
+	mail_index_update_ext(program->t->itrans, seq,
+			      index_sort_num_ext_get_id(program, ext),
+			      &num, NULL);
+}
+
+static time_t
+index_sort_get_arrival(struct mail_search_sort_program *program,
+		       struct mail *mail, uint32_t seq)
+{
+	time_t date;
+	uoff_t num;
+
+	if (index_sort_num_ext_lookup(program, INDEX_SORT_NUM_EXT_ARRIVAL,
+				      seq, &num))
+		return num;
+
+	if (mail->seq != seq)
+		mail_set_seq(mail, seq);
+	if (mail_get_received_date(mail, &date) < 0)
+		return 0;
+	if (date >= 0) {
+		index_sort_num_ext_update(program, INDEX_SORT_NUM_EXT_ARRIVAL,
+					  seq, date);
+	}
+	return date;
+}
+
+static time_t
+index_sort_get_date(struct mail_search_sort_program *program,
+		    struct mail *mail, uint32_t seq)
+{
+	time_t date;
+	uoff_t num;
+	int tz;
+
+	if (index_sort_num_ext_lookup(program, INDEX_SORT_NUM_EXT_DATE,
+				      seq, &num))
+		return num;
+
+	if (mail->seq != seq)
+		mail_set_seq(mail, seq);
+	if (mail_get_date(mail, &date, &tz) < 0)
+		return 0;
+	if (date == 0) {
+		if (mail_get_received_date(mail, &date) < 0)
+			return 0;
+	}
+	if (date >= 0) {
+		index_sort_num_ext_update(program, INDEX_SORT_NUM_EXT_DATE,
+					  seq, date);
+	}
+	return date;
+}
+
+static uoff_t
+index_sort_get_size(struct mail_search_sort_program *program,
+		    struct mail *mail, uint32_t seq)
+{
+	uoff_t size;
+
+	if (index_sort_num_ext_lookup(program, INDEX_SORT_NUM_EXT_SIZE,
+				      seq, &size))
+		return size;
+
+	if (mail->seq != seq)
+		mail_set_seq(mail, seq);
+	if (mail_get_virtual_size(mail, &size) < 0)
+		return 0;
+	index_sort_num_ext_update(program, INDEX_SORT_NUM_EXT_SIZE, seq, size);
+	return size;
+}
+
+void index_sort_forget_size(struct mail *mail)
+{
+	uint32_t ext_id, num = 0;
+
+	if (mail_index_ext_lookup(mail->box->index,
+				  index_sort_num_ext_names[INDEX_SORT_NUM_EXT_SIZE],
+				  &ext_id)) {
+		mail_index_update_ext(mail->transaction->itrans, mail->seq,
+				      ext_id, &num, NULL);
+	}
+}
+
 static void
 index_sort_list_add_arrival(struct mail_search_sort_program *program,
 			    struct mail *mail)
@@ -46,8 +185,7 @@ index_sort_list_add_arrival(struct mail_search_sort_program *program,
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
-		node->date = 0;
+	node->date = index_sort_get_arrival(program, mail, mail->seq);
 }
 
 static void
@@ -56,16 +194,10 @@ index_sort_list_add_date(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
-	int tz;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_date(mail, &node->date, &tz) < 0)
-		node->date = 0;
-	else if (node->date == 0) {
-		if (mail_get_received_date(mail, &node->date) < 0)
-			node->date = 0;
-	}
+	node->date = index_sort_get_date(program, mail, mail->seq);
 }
 
 static void
@@ -77,8 +209,7 @@ index_sort_list_add_size(struct mail_search_sort_program *program,
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_virtual_size(mail, &node->size) < 0)
-		node->size = 0;
+	node->size = index_sort_get_size(program, mail, mail->seq);
 }
 
 static uoff_t index_sort_get_pop3_order(struct mail *mail)
@@ -147,7 +278,7 @@ static int sort_node_date_cmp(const struct mail_sort_node_date *n1,
 	if (n1->date > n2->date)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
+	return index_sort_node_cmp_type(ctx->program,
 					ctx->program->sort_program + 1,
 					n1->seq, n2->seq);
 }
@@ -173,7 +304,7 @@ static int sort_node_size_cmp(const struct mail_sort_node_size *n1,
 	if (n1->size > n2->size)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
+	return index_sort_node_cmp_type(ctx->program,
 					ctx->program->sort_program + 1,
 					n1->seq, n2->seq);
 }
@@ -199,7 +330,7 @@ static int sort_node_float_cmp(const struct mail_sort_node_float *n1,
 	if (n1->num > n2->num)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
+	return index_sort_node_cmp_type(ctx->program,
 					ctx->program->sort_program + 1,
 					n1->seq, n2->seq);
 }
@@ -224,7 +355,6 @@ void index_sort_list_finish(struct mail_search_sort_program *program)
 {
 	memset(&static_node_cmp_context, 0, sizeof(static_node_cmp_context));
 	static_node_cmp_context.program = program;
-	static_node_cmp_context.mail = program->temp_mail;
 	static_node_cmp_context.reverse =
 		(program->sort_program[0] & MAIL_SORT_FLAG_REVERSE) != 0;
 
@@ -258,6 +388,8 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 	program = i_new(struct mail_search_sort_program, 1);
 	program->t = t;
 	program->temp_mail = mail_alloc(t, 0, NULL);
+	for (i = 0; i < INDEX_SORT_NUM_EXT_COUNT; i++)
+		program->num_ext_ids[i] = (uint32_t)-1;
 
 	for (i = 0; i < MAX_SORT_PROGRAM_SIZE; i++) {
 		program->sort_program[i] = sort_program[i];
@@ -446,15 +578,16 @@ int index_sort_header_get(struct mail *mail, uint32_t seq,
 	return ret;
 }
 
-int index_sort_node_cmp_type(struct mail *mail,
+int index_sort_node_cmp_type(struct mail_search_sort_program *program,
 			     const enum mail_sort_type *sort_program,
 			     uint32_t seq1, uint32_t seq2)
 {
+	struct mail *mail = program->temp_mail;
 	enum mail_sort_type sort_type;
 	time_t time1, time2;
 	uoff_t size1, size2;
 	float float1, float2;
-	int tz, ret = 0;
+	int ret = 0;
 
 	sort_type = *sort_program & MAIL_SORT_MASK;
 	switch (sort_type) {
@@ -476,45 +609,22 @@ int index_sort_node_cmp_type(struct mail *mail,
 		} T_END;
 		break;
 	case MAIL_SORT_ARRIVAL:
-		mail_set_seq(mail, seq1);
-		if (mail_get_received_date(mail, &time1) < 0)
-			time1 = 0;
-
-		mail_set_seq(mail, seq2);
-		if (mail_get_received_date(mail, &time2) < 0)
-			time1 = 0;
+		time1 = index_sort_get_arrival(program, mail, seq1);
+		time2 = index_sort_get_arrival(program, mail, seq2);
 
 		ret = time1 < time2 ? -1 :
 			(time1 > time2 ? 1 : 0);
 		break;
 	case MAIL_SORT_DATE:
-		mail_set_seq(mail, seq1);
-		if (mail_get_date(mail, &time1, &tz) < 0)
-			time1 = 0;
-		else if (time1 == 0) {
-			if (mail_get_received_date(mail, &time1) < 0)
-				time1 = 0;
-		}
-
-		mail_set_seq(mail, seq2);
-		if (mail_get_date(mail, &time2, &tz) < 0)
-			time2 = 0;
-		else if (time2 == 0) {
-			if (mail_get_received_date(mail, &time2) < 0)
-				time2 = 0;
-		}
+		time1 = index_sort_get_date(program, mail, seq1);
+		time2 = index_sort_get_date(program, mail, seq2);
 
 		ret = time1 < time2 ? -1 :
 			(time1 > time2 ? 1 : 0);
 		break;
 	case MAIL_SORT_SIZE:
-		mail_set_seq(mail, seq1);
-		if (mail_get_virtual_size(mail, &size1) < 0)
-			size1 = 0;
-
-		mail_set_seq(mail, seq2);
-		if (mail_get_virtual_size(mail, &size2) < 0)
-			size2 = 0;
+		size1 = index_sort_get_size(program, mail, seq1);
+		size2 = index_sort_get_size(program, mail, seq2);
 
 		ret = size1 < size2 ? -1 :
 			(size1 > size2 ? 1 : 0);
@@ -550,7 +660,7 @@ int index_sort_node_cmp_type(struct mail *mail,
 	}
 
 	if (ret == 0) {
-		return index_sort_node_cmp_type(mail, sort_program+1,
+		return index_sort_node_cmp_type(program, sort_program+1,
 						seq1, seq2);
 	}
 
@@ -15,4 +15,8 @@ void index_sort_list_finish(struct mail_search_sort_program *program);
 bool index_sort_list_next(struct mail_search_sort_program *program,
 			  uint32_t *seq_r);
 
+/* The message's size was found to be wrong. Drop its size sort key from
+   index, so it gets looked up again. */
+void index_sort_forget_size(struct mail *mail);
+
 #endif
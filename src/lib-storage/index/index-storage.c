@@ -13,6 +13,7 @@
 #include "mailbox-log.h"
 #include "mailbox-list-private.h"
 #include "mail-search-build.h"
+#include "mail-indexer.h"
 #include "index-storage.h"
 #include "index-mail.h"
 #include "index-attachment.h"
@@ -234,6 +235,37 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 	return 0;
 }
 
+static bool
+index_storage_cache_compress_callback(struct mail_cache *cache ATTR_UNUSED,
+				      void *context)
+{
+	struct mailbox *box = context;
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
+
+	/* we're called while the index is sync-locked, so don't talk to
+	   indexer yet. index_storage_cache_compress_request() is called
+	   after the sync. */
+	ibox->cache_compress_pending = TRUE;
+	return TRUE;
+}
+
+void index_storage_cache_compress_request(struct mailbox *box)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
+
+	if (!ibox->cache_compress_pending)
+		return;
+	ibox->cache_compress_pending = FALSE;
+
+	/* ask indexer to compress the cache in the background. it's done
+	   when indexer-worker syncs the mailbox with
+	   MAILBOX_SYNC_FLAG_OPTIMIZE. if indexer can't be reached, do it
+	   ourself now that the index isn't locked. */
+	if (mail_indexer_optimize(box->storage->user, box->vname) < 0 &&
+	    mail_cache_compress_if_needed(box->cache) < 0)
+		mailbox_set_index_error(box);
+}
+
 int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 {
 	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
@@ -286,6 +318,10 @@ int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory)
 	}
 
 	box->cache = mail_index_get_cache(box->index);
+	if (box->storage->set->mail_cache_compress_background) {
+		mail_cache_set_compress_callback(box->cache,
+			index_storage_cache_compress_callback, box);
+	}
 	index_cache_register_defaults(box);
 	box->view = mail_index_view_open(box->index);
 	ibox->keyword_names = mail_index_get_keywords(box->index);
@@ -358,6 +394,11 @@ void index_storage_mailbox_close(struct mailbox *box)
 	if (box->input != NULL)
 		i_stream_unref(&box->input);
 
+	if (box->cache != NULL) {
+		index_storage_cache_compress_request(box);
+		/* the index may still be used by others after we're gone */
+		mail_cache_set_compress_callback(box->cache, NULL, NULL);
+	}
 	if (box->view_pvt != NULL)
 		mail_index_view_close(&box->view_pvt);
 	if (box->index_pvt != NULL)
@@ -27,6 +27,10 @@ struct index_mailbox_context {
 
 	const ARRAY_TYPE(keywords) *keyword_names;
 	struct mail_cache_field *cache_fields;
+	/* Fetch fields that the backend normally gets from elsewhere than the
+	   cache. These aren't prefetched from cache, because that would only
+	   make the caching decisions think they're being used. */
+	enum mail_fetch_field cache_prefetch_skip_fields;
 
 	struct mailbox_vsize_update *vsize_update;
 
@@ -34,6 +38,10 @@ struct index_mailbox_context {
 
 	time_t sync_last_check;
 	uint32_t list_index_sync_ext_id;
+
+	/* cache compression was handed off, but indexer hasn't been asked
+	   to do it yet */
+	unsigned int cache_compress_pending:1;
 };
 
 #define INDEX_STORAGE_CONTEXT(obj) \
@@ -59,6 +67,9 @@ int index_storage_mailbox_open(struct mailbox *box, bool move_to_memory);
 int index_storage_mailbox_enable(struct mailbox *box,
 				 enum mailbox_feature feature);
 void index_storage_mailbox_close(struct mailbox *box);
+/* Ask indexer to compress the cache file if compressing it was handed off
+   during an index sync. */
+void index_storage_cache_compress_request(struct mailbox *box);
 void index_storage_mailbox_free(struct mailbox *box);
 int index_storage_mailbox_update(struct mailbox *box,
 				 const struct mailbox_update *update);
@@ -4,6 +4,7 @@
 #include "seq-range-array.h"
 #include "ioloop.h"
 #include "array.h"
+#include "mail-cache.h"
 #include "index-mailbox-size.h"
 #include "index-sync-private.h"
 
@@ -338,6 +339,23 @@ int index_mailbox_sync_deinit(struct mailbox_sync_context *_ctx,
 	/* update vsize header if wanted */
 	if (ret == 0)
 		index_mailbox_vsize_update_appends(_ctx->box);
+	if ((_ctx->flags & MAILBOX_SYNC_FLAG_OPTIMIZE) != 0 &&
+	    _ctx->box->cache != NULL) {
+		struct index_mailbox_context *ibox =
+			INDEX_STORAGE_CONTEXT(_ctx->box);
+
+		/* we're compressing the cache below, so there's no need to
+		   ask indexer to do it. */
+		ibox->cache_compress_pending = FALSE;
+		/* cache compression may have been handed off to us */
+		if (ret == 0 &&
+		    mail_cache_compress_if_needed(_ctx->box->cache) < 0) {
+			mailbox_set_index_error(_ctx->box);
+			ret = -1;
+		}
+	} else {
+		index_storage_cache_compress_request(_ctx->box);
+	}
 	i_free(ctx);
 	return ret;
 }
@@ -270,6 +270,7 @@ maildir_mailbox_alloc(struct mail_storage *storage, struct mailbox_list *list,
 		      const char *vname, enum mailbox_flags flags)
 {
 	struct maildir_mailbox *mbox;
+	struct index_mailbox_context *ibox;
 	pool_t pool;
 
 	pool = pool_alloconly_create("maildir mailbox", 1024*3);
@@ -283,6 +284,12 @@ maildir_mailbox_alloc(struct mail_storage *storage, struct mailbox_list *list,
 
 	index_storage_mailbox_alloc(&mbox->box, vname, flags, MAIL_INDEX_PREFIX);
 
+	/* GUIDs come from the filenames and sizes usually from the filenames
+	   or uidlist */
+	ibox = INDEX_STORAGE_CONTEXT(&mbox->box);
+	ibox->cache_prefetch_skip_fields = MAIL_FETCH_GUID |
+		MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE;
+
 	mbox->storage = (struct maildir_storage *)storage;
 	return &mbox->box;
 }
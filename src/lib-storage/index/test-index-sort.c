@@ -0,0 +1,415 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "message-address.h"
+#include "message-header-decode.h"
+#include "imap-base-subject.h"
+#include "test-common.h"
+#include "index-storage.h"
+#include "index-sort-private.h"
+
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-index-sort"
+#define TEST_MAIL_COUNT 5
+
+struct test_mail_data {
+	time_t received_date;
+	time_t date;
+	uoff_t size;
+};
+
+static struct test_mail_data test_mails[TEST_MAIL_COUNT+1];
+static unsigned int test_received_date_lookups;
+static unsigned int test_date_lookups, test_size_lookups;
+
+/* mail stubs: the messages' data comes from test_mails[seq] and each
+   lookup is counted */
+struct mail *mail_alloc(struct mailbox_transaction_context *t,
+			enum mail_fetch_field wanted_fields ATTR_UNUSED,
+			struct mailbox_header_lookup_ctx *wanted_headers ATTR_UNUSED)
+{
+	struct mail *mail = i_new(struct mail, 1);
+
+	mail->box = t->box;
+	mail->transaction = t;
+	return mail;
+}
+
+void mail_free(struct mail **mail)
+{
+	i_free_and_null(*mail);
+}
+
+void mail_set_seq(struct mail *mail, uint32_t seq)
+{
+	i_assert(seq >= 1 && seq <= TEST_MAIL_COUNT);
+	mail->seq = seq;
+}
+
+int mail_get_received_date(struct mail *mail, time_t *date_r)
+{
+	test_received_date_lookups++;
+	*date_r = test_mails[mail->seq].received_date;
+	return 0;
+}
+
+int mail_get_date(struct mail *mail, time_t *date_r, int *timezone_r)
+{
+	test_date_lookups++;
+	*date_r = test_mails[mail->seq].date;
+	*timezone_r = 0;
+	return 0;
+}
+
+int mail_get_virtual_size(struct mail *mail, uoff_t *size_r)
+{
+	test_size_lookups++;
+	*size_r = test_mails[mail->seq].size;
+	return 0;
+}
+
+/* the rest isn't used by the test */
+int mail_get_special(struct mail *mail ATTR_UNUSED,
+		     enum mail_fetch_field field ATTR_UNUSED,
+		     const char **value_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+int mail_get_first_header(struct mail *mail ATTR_UNUSED,
+			  const char *field ATTR_UNUSED,
+			  const char **value_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+struct message_address *
+message_address_parse(pool_t pool ATTR_UNUSED,
+		      const unsigned char *data ATTR_UNUSED,
+		      size_t size ATTR_UNUSED,
+		      unsigned int max_addresses ATTR_UNUSED,
+		      bool fill_missing ATTR_UNUSED)
+{
+	i_unreached();
+}
+void message_header_decode_utf8(const unsigned char *data ATTR_UNUSED,
+				size_t size ATTR_UNUSED,
+				buffer_t *dest ATTR_UNUSED,
+				normalizer_func_t *normalizer ATTR_UNUSED)
+{
+	i_unreached();
+}
+const char *
+imap_get_base_subject_cased(pool_t pool ATTR_UNUSED,
+			    const char *subject ATTR_UNUSED,
+			    bool *is_reply_or_forward_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+void index_sort_list_init_string(struct mail_search_sort_program *program ATTR_UNUSED)
+{
+	i_unreached();
+}
+void index_sort_list_add_string(struct mail_search_sort_program *program ATTR_UNUSED,
+				struct mail *mail ATTR_UNUSED)
+{
+	i_unreached();
+}
+void index_sort_list_finish_string(struct mail_search_sort_program *program ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	/* the index ID is taken from ioloop_time */
+	io_loop_time_refresh();
+	index = mail_index_alloc(TEST_DIR, "test.dovecot.index");
+	test_assert(mail_index_open_or_create(index,
+		MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) == 1);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (seq = 1; seq <= TEST_MAIL_COUNT; seq++)
+		mail_index_append(trans, seq, &seq);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+	return index;
+}
+
+static void test_index_close(struct mail_index **_index)
+{
+	struct mail_index *index = *_index;
+
+	*_index = NULL;
+	mail_index_close(index);
+	mail_index_free(&index);
+	if (unlink_directory(TEST_DIR, TRUE) < 0)
+		i_error("unlink_directory(%s) failed: %m", TEST_DIR);
+}
+
+static void test_lookups_reset(void)
+{
+	test_received_date_lookups = 0;
+	test_date_lookups = 0;
+	test_size_lookups = 0;
+}
+
+static void
+test_transaction_begin(struct mail_index *index, struct mailbox *box,
+		       struct mailbox_transaction_context *t)
+{
+	memset(box, 0, sizeof(*box));
+	box->index = index;
+	memset(t, 0, sizeof(*t));
+	t->box = box;
+
+	test_assert(mail_index_refresh(index) == 0);
+	t->itrans = mail_index_transaction_begin(mail_index_view_open(index),
+						 0);
+	t->view = mail_index_transaction_open_updated_view(t->itrans);
+}
+
+static void test_transaction_commit(struct mailbox_transaction_context *t)
+{
+	struct mail_index_view *view = mail_index_transaction_get_view(t->itrans);
+
+	mail_index_view_close(&t->view);
+	test_assert(mail_index_transaction_commit(&t->itrans) == 0);
+	mail_index_view_close(&view);
+}
+
+/* sort all the messages, and commit the sort keys that were added to
+   the index. returns the sorted sequences as a string. */
+static const char *
+test_sort(struct mail_index *index, const enum mail_sort_type *sort_program)
+{
+	struct mailbox box;
+	struct mailbox_transaction_context t;
+	struct mail_search_sort_program *program;
+	struct mail *mail;
+	string_t *str = t_str_new(32);
+	uint32_t seq;
+
+	test_transaction_begin(index, &box, &t);
+	program = index_sort_program_init(&t, sort_program);
+	mail = mail_alloc(&t, 0, NULL);
+	for (seq = 1; seq <= TEST_MAIL_COUNT; seq++) {
+		mail_set_seq(mail, seq);
+		index_sort_list_add(program, mail);
+	}
+	index_sort_list_finish(program);
+	while (index_sort_list_next(program, &seq))
+		str_printfa(str, "%u", seq);
+	index_sort_program_deinit(&program);
+	mail_free(&mail);
+	test_transaction_commit(&t);
+	return str_c(str);
+}
+
+/* returns TRUE if the sort key is stored in the index for the message */
+static bool
+test_sort_key_is_stored(struct mail_index *index, const char *ext_name,
+			uint32_t seq)
+{
+	struct mail_index_view *view;
+	const void *data;
+	uint32_t ext_id, num = 0;
+	bool expunged;
+
+	test_assert(mail_index_refresh(index) == 0);
+	if (!mail_index_ext_lookup(index, ext_name, &ext_id))
+		return FALSE;
+	view = mail_index_view_open(index);
+	mail_index_lookup_ext(view, seq, ext_id, &data, &expunged);
+	if (data != NULL)
+		memcpy(&num, data, sizeof(num));
+	mail_index_view_close(&view);
+	return num != 0;
+}
+
+static void test_mails_init(void)
+{
+	memset(test_mails, 0, sizeof(test_mails));
+	test_mails[1].received_date = 1000;
+	test_mails[1].date = 400;
+	test_mails[1].size = 300;
+	test_mails[2].received_date = 500;
+	test_mails[2].date = 0;
+	test_mails[2].size = 100;
+	test_mails[3].received_date = 3000;
+	test_mails[3].date = 100;
+	test_mails[3].size = 300;
+	test_mails[4].received_date = 2000;
+	test_mails[4].date = 200;
+	test_mails[4].size = 200;
+	test_mails[5].received_date = 4000;
+	test_mails[5].date = 300;
+	test_mails[5].size = 300;
+}
+
+static void test_index_sort_num_keys(void)
+{
+	const enum mail_sort_type arrival_program[] = {
+		MAIL_SORT_ARRIVAL, MAIL_SORT_END
+	};
+	const enum mail_sort_type date_program[] = {
+		MAIL_SORT_DATE | MAIL_SORT_FLAG_REVERSE, MAIL_SORT_END
+	};
+	const enum mail_sort_type size_program[] = {
+		MAIL_SORT_SIZE, MAIL_SORT_END
+	};
+	struct mail_index *index;
+	unsigned int i;
+
+	test_begin("index sort num keys");
+	test_mails_init();
+	index = test_index_open();
+
+	for (i = 0; i < 2; i++) {
+		/* the first sort looks up the keys and stores them to the
+		   index. the second sort uses the stored keys. */
+		test_lookups_reset();
+		test_assert_idx(strcmp(test_sort(index, arrival_program),
+				       "21435") == 0, i);
+		test_assert_idx(test_received_date_lookups ==
+				(i == 0 ? TEST_MAIL_COUNT : 0), i);
+
+		/* message 2 has no Date: header, so the received date
+		   is used for it */
+		test_lookups_reset();
+		test_assert_idx(strcmp(test_sort(index, date_program),
+				       "21543") == 0, i);
+		test_assert_idx(test_date_lookups ==
+				(i == 0 ? TEST_MAIL_COUNT : 0), i);
+		test_assert_idx(test_received_date_lookups ==
+				(i == 0 ? 1 : 0), i);
+
+		/* equal sizes are sorted by sequence */
+		test_lookups_reset();
+		test_assert_idx(strcmp(test_sort(index, size_program),
+				       "24135") == 0, i);
+		test_assert_idx(test_size_lookups ==
+				(i == 0 ? TEST_MAIL_COUNT : 0), i);
+	}
+
+	/* the stored keys are used even if the messages would now give
+	   different values */
+	test_mails[2].size = 1000;
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_program), "24135") == 0);
+	test_assert(test_size_lookups == 0);
+
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_index_sort_secondary_keys(void)
+{
+	const enum mail_sort_type size_date_program[] = {
+		MAIL_SORT_SIZE, MAIL_SORT_DATE, MAIL_SORT_END
+	};
+	const enum mail_sort_type date_program[] = {
+		MAIL_SORT_DATE, MAIL_SORT_END
+	};
+	struct mail_index *index;
+	uint32_t seq;
+
+	test_begin("index sort secondary keys");
+	test_mails_init();
+	index = test_index_open();
+
+	/* messages 1, 3 and 5 have the same size, so they're compared by
+	   their dates. the dates are looked up only once, since the
+	   comparison stores them to the index. */
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_date_program), "24351") == 0);
+	test_assert(test_size_lookups == TEST_MAIL_COUNT);
+	test_assert(test_date_lookups == 3);
+	for (seq = 1; seq <= TEST_MAIL_COUNT; seq++) {
+		test_assert_idx(test_sort_key_is_stored(index, "sort-date",
+				seq) == (seq % 2 == 1), seq);
+	}
+
+	/* the dates stored by the comparison are used by a date sort */
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, date_program), "34512") == 0);
+	test_assert(test_date_lookups == 2);
+	test_assert(test_received_date_lookups == 1);
+
+	/* nothing is looked up anymore */
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_date_program), "24351") == 0);
+	test_assert(test_size_lookups == 0 && test_date_lookups == 0);
+
+	test_index_close(&index);
+	test_end();
+}
+
+static void test_index_sort_not_stored(void)
+{
+	const enum mail_sort_type size_program[] = {
+		MAIL_SORT_SIZE, MAIL_SORT_END
+	};
+	struct mail_index *index;
+	struct mailbox box;
+	struct mailbox_transaction_context t;
+	struct mail *mail;
+
+	test_begin("index sort keys not stored");
+	test_mails_init();
+	index = test_index_open();
+
+	/* values that don't fit into 32 bits aren't stored */
+	test_mails[3].size = (uint32_t)-1;
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_program), "24153") == 0);
+	test_assert(test_size_lookups == TEST_MAIL_COUNT);
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_program), "24153") == 0);
+	test_assert(test_size_lookups == 1);
+	test_assert(!test_sort_key_is_stored(index, "sort-size", 3));
+
+	/* a forgotten size is looked up again */
+	test_mails[4].size = 1000;
+	test_transaction_begin(index, &box, &t);
+	mail = mail_alloc(&t, 0, NULL);
+	mail_set_seq(mail, 4);
+	index_sort_forget_size(mail);
+	mail_free(&mail);
+	test_transaction_commit(&t);
+	test_assert(!test_sort_key_is_stored(index, "sort-size", 4));
+
+	test_lookups_reset();
+	test_assert(strcmp(test_sort(index, size_program), "21543") == 0);
+	test_assert(test_size_lookups == 2);
+	test_assert(test_sort_key_is_stored(index, "sort-size", 4));
+
+	test_index_close(&index);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_index_sort_num_keys,
+		test_index_sort_secondary_keys,
+		test_index_sort_not_stored,
+		NULL
+	};
+	return test_run(test_functions);
+}
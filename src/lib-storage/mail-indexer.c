@@ -0,0 +1,51 @@
+/* Copyright (c) 2011-2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "net.h"
+#include "write-full.h"
+#include "strescape.h"
+#include "mail-user.h"
+#include "mail-indexer.h"
+
+#define INDEXER_SOCKET_NAME "indexer"
+#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
+
+int mail_indexer_cmd(struct mail_user *user, const char *cmd,
+		     unsigned int retry_msecs, const char **path_r)
+{
+	const char *path;
+	int fd;
+
+	path = t_strconcat(user->set->base_dir,
+			   "/"INDEXER_SOCKET_NAME, NULL);
+	fd = retry_msecs == 0 ? net_connect_unix(path) :
+		net_connect_unix_with_retries(path, retry_msecs);
+	if (fd == -1) {
+		i_error("net_connect_unix(%s) failed: %m", path);
+		return -1;
+	}
+
+	cmd = t_strconcat(INDEXER_HANDSHAKE, cmd, NULL);
+	if (write_full(fd, cmd, strlen(cmd)) < 0) {
+		i_error("write(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	*path_r = path;
+	return fd;
+}
+
+int mail_indexer_optimize(struct mail_user *user, const char *vname)
+{
+	const char *cmd, *path;
+	int fd;
+
+	cmd = t_strdup_printf("OPTIMIZE\t0\t%s\t%s\n",
+			      str_tabescape(user->username),
+			      str_tabescape(vname));
+	fd = mail_indexer_cmd(user, cmd, 0, &path);
+	if (fd == -1)
+		return -1;
+	i_close_fd(&fd);
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef MAIL_INDEXER_H
+#define MAIL_INDEXER_H
+
+struct mail_user;
+
+/* Connect to the indexer service and send cmd after the handshake. cmd must
+   be a full LF-terminated command line. If retry_msecs is non-zero and the
+   indexer is busy, the connect is retried for that long. Returns fd, which
+   you can either read the reply from or close. Returns -1 and logs an error
+   if the command couldn't be sent. */
+int mail_indexer_cmd(struct mail_user *user, const char *cmd,
+		     unsigned int retry_msecs, const char **path_r);
+/* Ask the indexer to optimize the mailbox in the background without waiting
+   for a reply. Returns 0 if the request was sent, -1 if not. */
+int mail_indexer_optimize(struct mail_user *user, const char *vname);
+
+#endif
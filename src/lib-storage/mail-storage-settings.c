@@ -38,6 +38,7 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_STR, mail_server_comment),
 	DEF(SET_STR, mail_server_admin),
 	DEF(SET_UINT, mail_cache_min_mail_count),
+	DEF(SET_BOOL, mail_cache_compress_background),
 	DEF(SET_TIME, mailbox_idle_check_interval),
 	DEF(SET_UINT, mail_max_keyword_length),
 	DEF(SET_TIME, mail_max_lock_timeout),
@@ -78,6 +79,7 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_server_comment = "",
 	.mail_server_admin = "",
 	.mail_cache_min_mail_count = 0,
+	.mail_cache_compress_background = FALSE,
 	.mailbox_idle_check_interval = 30,
 	.mail_max_keyword_length = 50,
 	.mail_max_lock_timeout = 0,
@@ -204,7 +204,8 @@ enum mailbox_sync_flags {
 	/* Force doing a full resync of indexes. */
 	MAILBOX_SYNC_FLAG_FORCE_RESYNC		= 0x100,
 	/* FIXME: kludge until something better comes along:
-	   Request full text search index optimization */
+	   Request full text search index optimization. This also compresses
+	   the cache file if it's wanted. */
 	MAILBOX_SYNC_FLAG_OPTIMIZE		= 0x400
 };
 
@@ -5,6 +5,7 @@
 #include "test-common.h"
 
 #include <stdio.h>
+#include <time.h>
 
 #include <setjmp.h> /* for fatal tests */
 
@@ -315,6 +316,26 @@ test_fatal_handler(const struct failure_context *ctx,
 	default_fatal_handler(ctx, format, args);
 }
 
+bool test_benchmarks_enabled(void)
+{
+	return getenv("DOVECOT_TEST_BENCHMARK") != NULL;
+}
+
+void test_benchmark_start(struct timespec *start_r)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, start_r) < 0)
+		i_fatal("clock_gettime() failed: %m");
+}
+
+double test_benchmark_secs(const struct timespec *start)
+{
+	struct timespec end;
+
+	test_benchmark_start(&end);
+	return (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 static void test_init(void)
 {
 	test_prefix = NULL;
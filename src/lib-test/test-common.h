@@ -31,6 +31,15 @@ void test_out_quiet(const char *name, bool success); /* only prints failures */
 void test_out_reason(const char *name, bool success, const char *reason)
 	ATTR_NULL(3);
 
+/* Returns TRUE if benchmarks should be run. They're slow, so they're run
+   only when DOVECOT_TEST_BENCHMARK environment variable is set. The results
+   are reported with test_out_reason(). */
+bool test_benchmarks_enabled(void);
+/* Start timing a benchmark. */
+void test_benchmark_start(struct timespec *start_r);
+/* Returns the number of seconds since test_benchmark_start(). */
+double test_benchmark_secs(const struct timespec *start);
+
 int test_run(void (*test_functions[])(void));
 
 enum fatal_test_state {
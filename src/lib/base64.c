@@ -46,50 +46,101 @@ static const unsigned char b64dec[256] = {
 void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 {
 	const unsigned char *src_c = src;
-	unsigned char tmp[4];
-	size_t src_pos;
-
-	for (src_pos = 0; src_pos < src_size; ) {
-		tmp[0] = b64enc[src_c[src_pos] >> 2];
-		switch (src_size - src_pos) {
-		case 1:
-			tmp[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
-			tmp[2] = '=';
-			tmp[3] = '=';
-			src_pos++;
-			break;
-		case 2:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
-			tmp[3] = '=';
-			src_pos += 2;
-			break;
-		default:
-			tmp[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
-					(src_c[src_pos+1] >> 4)];
-			tmp[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2) |
-					((src_c[src_pos+2] & 0xc0) >> 6)];
-			tmp[3] = b64enc[src_c[src_pos+2] & 0x3f];
-			src_pos += 3;
-			break;
-		}
-		buffer_append(dest, tmp, 4);
+	unsigned char *out;
+	size_t src_pos, full_size;
+
+	if (src_size == 0)
+		return;
+
+	/* @UNSAFE: allocate the whole output at once */
+	out = buffer_append_space_unsafe(dest, (src_size + 2) / 3 * 4);
+	full_size = src_size - src_size % 3;
+	for (src_pos = 0; src_pos < full_size; src_pos += 3) {
+		out[0] = b64enc[src_c[src_pos] >> 2];
+		out[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
+				(src_c[src_pos+1] >> 4)];
+		out[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2) |
+				((src_c[src_pos+2] & 0xc0) >> 6)];
+		out[3] = b64enc[src_c[src_pos+2] & 0x3f];
+		out += 4;
+	}
+
+	switch (src_size - src_pos) {
+	case 0:
+		break;
+	case 1:
+		out[0] = b64enc[src_c[src_pos] >> 2];
+		out[1] = b64enc[(src_c[src_pos] & 0x03) << 4];
+		out[2] = '=';
+		out[3] = '=';
+		break;
+	case 2:
+		out[0] = b64enc[src_c[src_pos] >> 2];
+		out[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
+				(src_c[src_pos+1] >> 4)];
+		out[2] = b64enc[((src_c[src_pos+1] & 0x0f) << 2)];
+		out[3] = '=';
+		break;
+	default:
+		i_unreached();
 	}
 }
 
 #define IS_EMPTY(c) \
 	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
 
+/* Number of 4 byte input blocks decoded at once by base64_decode_blocks() */
+#define BASE64_DECODE_BLOCK_COUNT 64
+
+/* Decode as many complete 4 byte blocks as possible, stopping at the first
+   block that contains any non-base64 characters (whitespace, '=' or invalid
+   input). Returns the number of src bytes decoded. */
+static size_t
+base64_decode_blocks(const unsigned char *src, size_t src_size,
+		     unsigned char *output, size_t *output_size_r)
+{
+	unsigned char in0, in1, in2, in3;
+	size_t src_pos, out_pos = 0;
+
+	for (src_pos = 0; src_pos + 4 <= src_size; src_pos += 4) {
+		in0 = b64dec[src[src_pos]];
+		in1 = b64dec[src[src_pos+1]];
+		in2 = b64dec[src[src_pos+2]];
+		in3 = b64dec[src[src_pos+3]];
+		/* invalid characters are 0xff, valid ones are <0x40 */
+		if (((in0 | in1 | in2 | in3) & 0x80) != 0)
+			break;
+
+		output[out_pos++] = (in0 << 2) | (in1 >> 4);
+		output[out_pos++] = (in1 << 4) | (in2 >> 2);
+		output[out_pos++] = ((in2 << 6) & 0xc0) | in3;
+	}
+	*output_size_r = out_pos;
+	return src_pos;
+}
+
 int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
 	const unsigned char *src_c = src;
-	size_t src_pos;
+	size_t src_pos, size, output_size;
 	unsigned char input[4], output[3];
+	unsigned char blocks_output[BASE64_DECODE_BLOCK_COUNT * 3];
 	int ret = 1;
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
+		/* fast path: decode blocks without any whitespace. the
+		   output goes to a temporary buffer first, since dest may
+		   point to the same buffer as src. */
+		size = I_MIN(src_size - src_pos, BASE64_DECODE_BLOCK_COUNT * 4);
+		size = base64_decode_blocks(src_c + src_pos, size,
+					    blocks_output, &output_size);
+		if (size > 0) {
+			buffer_append(dest, blocks_output, output_size);
+			src_pos += size;
+			continue;
+		}
+
 		input[0] = b64dec[src_c[src_pos]];
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
@@ -63,11 +63,52 @@ uint32_t crc32_data(const void *data, size_t size)
 	return crc32_data_more(0, data, size);
 }
 
+/* Slicing-by-8 tables: crc32tab_slices[k][i] is the CRC of byte i followed
+   by k zero bytes. They're derived from crc32tab on first use. */
+static uint32_t crc32tab_slices[8][256];
+static bool crc32tab_slices_initialized = FALSE;
+
+static void crc32_init_slices(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32tab_slices[0][i] = crc32tab[i];
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			uint32_t prev = crc32tab_slices[k-1][i];
+			crc32tab_slices[k][i] =
+				(prev >> 8) ^ crc32tab[prev & 0xff];
+		}
+	}
+	crc32tab_slices_initialized = TRUE;
+}
+
+static inline uint32_t crc32_read32le(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size)
 {
+	const uint32_t (*t)[256] = crc32tab_slices;
 	const uint8_t *p = data, *end = p + size;
+	uint32_t one, two;
 
 	crc ^= 0xffffffff;
+	if (size >= 16) {
+		if (!crc32tab_slices_initialized)
+			crc32_init_slices();
+		for (; end - p >= 8; p += 8) {
+			one = crc ^ crc32_read32le(p);
+			two = crc32_read32le(p + 4);
+			crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+				t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+				t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+				t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		}
+	}
 	for (; p != end; p++)
 		crc = (crc >> 8) ^ crc32tab[((crc ^ *p) & 0xff)];
 	crc ^= 0xffffffff;
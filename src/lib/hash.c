@@ -4,11 +4,31 @@
 
 #include "lib.h"
 #include "hash.h"
-#include "primes.h"
+#include "bits.h"
 
 #include <ctype.h>
 
-#define HASH_TABLE_MIN_SIZE 67
+/* The table consists of two arrays:
+
+   - entries[] contains the key/value pairs in insertion order. Removed
+     entries are left as holes (key=NULL) until the table is compressed.
+   - slots[] is an open addressing index (linear probing, power of two size)
+     into entries[]. Each slot contains the full hash of its key, so most
+     non-matching probes are skipped without calling key_compare_cb or
+     touching the entry at all.
+
+   Since iteration goes through entries[] by index, slots[] can be rebuilt
+   at any time - even while the table is frozen. Only the compression of
+   entries[] has to wait until the table is thawed. */
+
+#define HASH_TABLE_MIN_SLOTS 16
+/* slots[] is rebuilt once more than 3/4 of it is used or deleted */
+#define HASH_TABLE_MAX_LOAD_NUM 3
+#define HASH_TABLE_MAX_LOAD_DENOM 4
+
+#define HASH_SLOT_EMPTY 0
+#define HASH_SLOT_DELETED 1
+#define HASH_SLOT_IDX_OFFSET 2
 
 #undef hash_table_create
 #undef hash_table_create_direct
@@ -20,27 +40,39 @@
 #undef hash_table_update
 #undef hash_table_try_remove
 #undef hash_table_count
+#undef hash_table_get_memory_usage
 #undef hash_table_iterate_init
 #undef hash_table_iterate
 #undef hash_table_freeze
 #undef hash_table_thaw
 #undef hash_table_copy
 
-struct hash_node {
-	struct hash_node *next;
+struct hash_slot {
+	unsigned int hash;
+	/* HASH_SLOT_EMPTY, HASH_SLOT_DELETED or
+	   entries[] index + HASH_SLOT_IDX_OFFSET */
+	unsigned int idx;
+};
+
+struct hash_entry {
 	void *key;
 	void *value;
+	unsigned int hash;
 };
 
 struct hash_table {
 	pool_t node_pool;
 
 	int frozen;
-	unsigned int initial_size, nodes_count, removed_count;
+	unsigned int initial_size, nodes_count;
+
+	/* slots[] size is always a power of two */
+	unsigned int slots_count, slots_bits, slots_deleted_count;
+	struct hash_slot *slots;
 
-	unsigned int size;
-	struct hash_node *nodes;
-	struct hash_node *free_nodes;
+	/* entries_count includes removed entries */
+	unsigned int entries_count, entries_alloc_count;
+	struct hash_entry *entries;
 
 	hash_callback_t *hash_cb;
 	hash_cmp_callback_t *key_compare_cb;
@@ -48,11 +80,57 @@ struct hash_table {
 
 struct hash_iterate_context {
 	struct hash_table *table;
-	struct hash_node *next;
 	unsigned int pos;
 };
 
-static bool hash_table_resize(struct hash_table *table, bool grow);
+static unsigned int hash_table_slots_count_for(unsigned int count)
+{
+	unsigned int slots_count = HASH_TABLE_MIN_SLOTS;
+
+	while (slots_count / HASH_TABLE_MAX_LOAD_DENOM *
+	       HASH_TABLE_MAX_LOAD_NUM <= count)
+		slots_count <<= 1;
+	return slots_count;
+}
+
+static inline unsigned int
+hash_table_slot_first(const struct hash_table *table, unsigned int hash)
+{
+	/* many of the hash functions (especially direct_hash()) have poor
+	   low bits, so use Fibonacci hashing to pick the upper bits */
+	return (unsigned int)((hash * 2654435769U) >>
+			      (32 - table->slots_bits));
+}
+
+static void hash_table_rebuild_slots(struct hash_table *table)
+{
+	struct hash_slot *slot;
+	unsigned int i, pos, mask, slots_count;
+
+	slots_count = hash_table_slots_count_for(table->nodes_count + 1);
+	if (slots_count != table->slots_count) {
+		i_free(table->slots);
+		table->slots_count = slots_count;
+		table->slots_bits = bits_required32(slots_count) - 1;
+		table->slots = i_new(struct hash_slot, slots_count);
+	} else {
+		memset(table->slots, 0, sizeof(*table->slots) * slots_count);
+	}
+	table->slots_deleted_count = 0;
+
+	mask = table->slots_count - 1;
+	for (i = 0; i < table->entries_count; i++) {
+		if (table->entries[i].key == NULL)
+			continue;
+
+		pos = hash_table_slot_first(table, table->entries[i].hash);
+		while (table->slots[pos].idx != HASH_SLOT_EMPTY)
+			pos = (pos + 1) & mask;
+		slot = &table->slots[pos];
+		slot->hash = table->entries[i].hash;
+		slot->idx = i + HASH_SLOT_IDX_OFFSET;
+	}
+}
 
 void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size, hash_callback_t *hash_cb,
@@ -63,14 +141,17 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 	pool_ref(node_pool);
 	table = i_new(struct hash_table, 1);
 	table->node_pool = node_pool;
-	table->initial_size =
-		I_MAX(primes_closest(initial_size), HASH_TABLE_MIN_SIZE);
+	table->initial_size = initial_size;
 
 	table->hash_cb = hash_cb;
 	table->key_compare_cb = key_compare_cb;
 
-	table->size = table->initial_size;
-	table->nodes = i_new(struct hash_node, table->size);
+	table->slots_count = hash_table_slots_count_for(initial_size);
+	table->slots_bits = bits_required32(table->slots_count) - 1;
+	table->slots = i_new(struct hash_slot, table->slots_count);
+
+	table->entries_alloc_count = I_MAX(initial_size, 8);
+	table->entries = i_new(struct hash_entry, table->entries_alloc_count);
 	*table_r = table;
 }
 
@@ -92,258 +173,220 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
-static void free_node(struct hash_table *table, struct hash_node *node)
-{
-	if (!table->node_pool->alloconly_pool)
-		p_free(table->node_pool, node);
-	else {
-		node->next = table->free_nodes;
-		table->free_nodes = node;
-	}
-}
-
-static void destroy_node_list(struct hash_table *table, struct hash_node *node)
-{
-	struct hash_node *next;
-
-	while (node != NULL) {
-		next = node->next;
-		p_free(table->node_pool, node);
-		node = next;
-	}
-}
-
-static void hash_table_destroy_nodes(struct hash_table *table)
-{
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++) {
-		if (table->nodes[i].next != NULL)
-			destroy_node_list(table, table->nodes[i].next);
-	}
-}
-
 void hash_table_destroy(struct hash_table **_table)
 {
 	struct hash_table *table = *_table;
 
 	*_table = NULL;
 
-	if (!table->node_pool->alloconly_pool) {
-		hash_table_destroy_nodes(table);
-		destroy_node_list(table, table->free_nodes);
-	}
-
 	pool_unref(&table->node_pool);
-	i_free(table->nodes);
+	i_free(table->slots);
+	i_free(table->entries);
 	i_free(table);
 }
 
 void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
-	if (!table->node_pool->alloconly_pool)
-		hash_table_destroy_nodes(table);
-
-	if (free_nodes) {
-		if (!table->node_pool->alloconly_pool)
-			destroy_node_list(table, table->free_nodes);
-                table->free_nodes = NULL;
+	if (free_nodes && table->frozen == 0 &&
+	    table->entries_alloc_count > I_MAX(table->initial_size, 8)) {
+		table->entries_alloc_count = I_MAX(table->initial_size, 8);
+		i_free(table->entries);
+		table->entries = i_new(struct hash_entry,
+				       table->entries_alloc_count);
+	}
+	if (table->frozen == 0)
+		table->entries_count = 0;
+	else {
+		/* iteration is ongoing. just leave holes. */
+		memset(table->entries, 0,
+		       sizeof(struct hash_entry) * table->entries_count);
 	}
-
-	memset(table->nodes, 0, sizeof(struct hash_node) * table->size);
-
 	table->nodes_count = 0;
-	table->removed_count = 0;
+	hash_table_rebuild_slots(table);
 }
 
-static struct hash_node *
-hash_table_lookup_node(const struct hash_table *table,
+static struct hash_slot *
+hash_table_lookup_slot(const struct hash_table *table,
 		       const void *key, unsigned int hash)
 {
-	struct hash_node *node;
-
-	node = &table->nodes[hash % table->size];
+	struct hash_slot *slot;
+	unsigned int pos, mask = table->slots_count - 1;
+
+	pos = hash_table_slot_first(table, hash);
+	for (;; pos = (pos + 1) & mask) {
+		slot = &table->slots[pos];
+		if (slot->idx == HASH_SLOT_EMPTY)
+			return NULL;
+		if (slot->hash == hash && slot->idx != HASH_SLOT_DELETED &&
+		    table->key_compare_cb(table->entries[slot->idx -
+				HASH_SLOT_IDX_OFFSET].key, key) == 0)
+			return slot;
+	}
+}
 
-	do {
-		if (node->key != NULL) {
-			if (table->key_compare_cb(node->key, key) == 0)
-				return node;
-		}
-		node = node->next;
-	} while (node != NULL);
+static struct hash_entry *
+hash_table_lookup_entry(const struct hash_table *table,
+			const void *key, unsigned int hash)
+{
+	struct hash_slot *slot;
 
-	return NULL;
+	slot = hash_table_lookup_slot(table, key, hash);
+	return slot == NULL ? NULL :
+		&table->entries[slot->idx - HASH_SLOT_IDX_OFFSET];
 }
 
 void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
-	struct hash_node *node;
+	struct hash_entry *entry;
 
-	node = hash_table_lookup_node(table, key, table->hash_cb(key));
-	return node != NULL ? node->value : NULL;
+	entry = hash_table_lookup_entry(table, key, table->hash_cb(key));
+	return entry != NULL ? entry->value : NULL;
 }
 
 bool hash_table_lookup_full(const struct hash_table *table,
 			    const void *lookup_key,
 			    void **orig_key, void **value)
 {
-	struct hash_node *node;
+	struct hash_entry *entry;
 
-	node = hash_table_lookup_node(table, lookup_key,
-				      table->hash_cb(lookup_key));
-	if (node == NULL)
+	entry = hash_table_lookup_entry(table, lookup_key,
+					table->hash_cb(lookup_key));
+	if (entry == NULL)
 		return FALSE;
 
-	*orig_key = node->key;
-	*value = node->value;
+	*orig_key = entry->key;
+	*value = entry->value;
 	return TRUE;
 }
 
-static struct hash_node * ATTR_NOWARN_UNUSED_RESULT
-hash_table_insert_node(struct hash_table *table, void *key, void *value,
-		       bool check_existing)
+static void hash_table_compress(struct hash_table *table)
 {
-	struct hash_node *node, *prev;
-	unsigned int hash;
-
-	i_assert(key != NULL);
+	unsigned int src, dest = 0;
 
-	hash = table->hash_cb(key);
-
-	if (check_existing && table->removed_count > 0) {
-		/* there may be holes, have to check everything */
-		node = hash_table_lookup_node(table, key, hash);
-		if (node != NULL) {
-			node->value = value;
-			return node;
-		}
+	i_assert(table->frozen == 0);
 
-                check_existing = FALSE;
+	for (src = 0; src < table->entries_count; src++) {
+		if (table->entries[src].key != NULL)
+			table->entries[dest++] = table->entries[src];
 	}
-
-	/* a) primary node */
-	node = &table->nodes[hash % table->size];
-	if (node->key == NULL) {
-		table->nodes_count++;
-
-		node->key = key;
-		node->value = value;
-		return node;
-	}
-
-	if (check_existing) {
-		if (table->key_compare_cb(node->key, key) == 0) {
-			node->value = value;
-			return node;
-		}
+	table->entries_count = dest;
+	i_assert(dest == table->nodes_count);
+
+	if (table->entries_alloc_count / 4 > table->nodes_count &&
+	    table->entries_alloc_count > I_MAX(table->initial_size, 8)) {
+		table->entries_alloc_count =
+			I_MAX(I_MAX(table->nodes_count * 2,
+				    table->initial_size), 8);
+		table->entries = i_realloc(table->entries,
+			sizeof(struct hash_entry) * table->entries_count,
+			sizeof(struct hash_entry) * table->entries_alloc_count);
 	}
+	hash_table_rebuild_slots(table);
+}
 
-	/* b) collisions list */
-	prev = node; node = node->next;
-	while (node != NULL) {
-		if (node->key == NULL)
-			break;
-
-		if (check_existing) {
-			if (table->key_compare_cb(node->key, key) == 0) {
-				node->value = value;
-				return node;
-			}
-		}
+static bool hash_table_want_compress(const struct hash_table *table)
+{
+	unsigned int removed_count = table->entries_count - table->nodes_count;
 
-		prev = node;
-		node = node->next;
-	}
+	return removed_count > 0 && removed_count >= table->nodes_count &&
+		table->frozen == 0;
+}
 
-	if (node == NULL) {
-		if (table->frozen == 0 && hash_table_resize(table, TRUE)) {
-			/* resized table, try again */
-			return hash_table_insert_node(table, key, value, FALSE);
-		}
+static void
+hash_table_insert_new(struct hash_table *table, void *key, void *value,
+		      unsigned int hash)
+{
+	struct hash_entry *entry;
+	struct hash_slot *slot;
+	unsigned int pos, mask, old_alloc_count;
 
-		if (table->free_nodes == NULL)
-			node = p_new(table->node_pool, struct hash_node, 1);
-		else {
-			node = table->free_nodes;
-			table->free_nodes = node->next;
-			node->next = NULL;
-		}
-		prev->next = node;
+	if (table->entries_count == table->entries_alloc_count) {
+		if (hash_table_want_compress(table))
+			hash_table_compress(table);
 	}
-
-	node->key = key;
-	node->value = value;
-
+	if (table->entries_count == table->entries_alloc_count) {
+		old_alloc_count = table->entries_alloc_count;
+		table->entries_alloc_count *= 2;
+		table->entries = i_realloc(table->entries,
+			sizeof(struct hash_entry) * old_alloc_count,
+			sizeof(struct hash_entry) * table->entries_alloc_count);
+	}
+	entry = &table->entries[table->entries_count];
+	entry->key = key;
+	entry->value = value;
+	entry->hash = hash;
+	table->entries_count++;
 	table->nodes_count++;
-	return node;
-}
 
-void hash_table_insert(struct hash_table *table, void *key, void *value)
-{
-	struct hash_node *node;
-
-	node = hash_table_insert_node(table, key, value, TRUE);
-	node->key = key;
-}
+	if ((table->nodes_count + table->slots_deleted_count) *
+	    HASH_TABLE_MAX_LOAD_DENOM >=
+	    table->slots_count * HASH_TABLE_MAX_LOAD_NUM) {
+		/* this also adds the new entry */
+		hash_table_rebuild_slots(table);
+		return;
+	}
 
-void hash_table_update(struct hash_table *table, void *key, void *value)
-{
-	hash_table_insert_node(table, key, value, TRUE);
+	mask = table->slots_count - 1;
+	pos = hash_table_slot_first(table, hash);
+	while (table->slots[pos].idx != HASH_SLOT_EMPTY &&
+	       table->slots[pos].idx != HASH_SLOT_DELETED)
+		pos = (pos + 1) & mask;
+	slot = &table->slots[pos];
+	if (slot->idx == HASH_SLOT_DELETED)
+		table->slots_deleted_count--;
+	slot->hash = hash;
+	slot->idx = table->entries_count - 1 + HASH_SLOT_IDX_OFFSET;
 }
 
 static void
-hash_table_compress(struct hash_table *table, struct hash_node *root)
+hash_table_insert_node(struct hash_table *table, void *key, void *value,
+		       bool replace_key)
 {
-	struct hash_node *node, *next;
-
-	/* remove deleted nodes from the list */
-	for (node = root; node->next != NULL; ) {
-		next = node->next;
+	struct hash_entry *entry;
+	unsigned int hash;
 
-		if (next->key == NULL) {
-			node->next = next->next;
-			free_node(table, next);
-		} else {
-			node = next;
-		}
-	}
+	i_assert(key != NULL);
 
-	/* update root */
-	if (root->key == NULL && root->next != NULL) {
-		next = root->next;
-		*root = *next;
-		free_node(table, next);
+	hash = table->hash_cb(key);
+	entry = hash_table_lookup_entry(table, key, hash);
+	if (entry == NULL) {
+		hash_table_insert_new(table, key, value, hash);
+		return;
 	}
+	if (replace_key)
+		entry->key = key;
+	entry->value = value;
 }
 
-static void hash_table_compress_removed(struct hash_table *table)
+void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
-	unsigned int i;
-
-	for (i = 0; i < table->size; i++)
-		hash_table_compress(table, &table->nodes[i]);
+	hash_table_insert_node(table, key, value, TRUE);
+}
 
-        table->removed_count = 0;
+void hash_table_update(struct hash_table *table, void *key, void *value)
+{
+	hash_table_insert_node(table, key, value, FALSE);
 }
 
 bool hash_table_try_remove(struct hash_table *table, const void *key)
 {
-	struct hash_node *node;
-	unsigned int hash;
-
-	hash = table->hash_cb(key);
+	struct hash_slot *slot;
+	struct hash_entry *entry;
 
-	node = hash_table_lookup_node(table, key, hash);
-	if (unlikely(node == NULL))
+	slot = hash_table_lookup_slot(table, key, table->hash_cb(key));
+	if (unlikely(slot == NULL))
 		return FALSE;
 
-	node->key = NULL;
+	entry = &table->entries[slot->idx - HASH_SLOT_IDX_OFFSET];
+	entry->key = NULL;
+	entry->value = NULL;
+	slot->idx = HASH_SLOT_DELETED;
+	table->slots_deleted_count++;
 	table->nodes_count--;
 
-	if (table->frozen != 0)
-		table->removed_count++;
-	else if (!hash_table_resize(table, FALSE))
-		hash_table_compress(table, &table->nodes[hash % table->size]);
+	if (hash_table_want_compress(table) &&
+	    table->entries_count - table->nodes_count >= HASH_TABLE_MIN_SLOTS)
+		hash_table_compress(table);
 	return TRUE;
 }
 
@@ -352,6 +395,13 @@ unsigned int hash_table_count(const struct hash_table *table)
 	return table->nodes_count;
 }
 
+size_t hash_table_get_memory_usage(const struct hash_table *table)
+{
+	return sizeof(*table) +
+		sizeof(struct hash_slot) * table->slots_count +
+		sizeof(struct hash_entry) * table->entries_alloc_count;
+}
+
 struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 {
 	struct hash_iterate_context *ctx;
@@ -360,45 +410,24 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
 	return ctx;
 }
 
-static struct hash_node *
-hash_table_iterate_next(struct hash_iterate_context *ctx,
-			struct hash_node *node)
-{
-	do {
-		node = node->next;
-		if (node == NULL) {
-			if (++ctx->pos == ctx->table->size) {
-				ctx->pos--;
-				return NULL;
-			}
-			node = &ctx->table->nodes[ctx->pos];
-		}
-	} while (node->key == NULL);
-
-	return node;
-}
-
 bool hash_table_iterate(struct hash_iterate_context *ctx,
 			void **key_r, void **value_r)
 {
-	struct hash_node *node;
-
-	node = ctx->next;
-	if (node != NULL && node->key == NULL)
-		node = hash_table_iterate_next(ctx, node);
-	if (node == NULL) {
-		*key_r = *value_r = NULL;
-		return FALSE;
+	struct hash_table *table = ctx->table;
+
+	for (; ctx->pos < table->entries_count; ctx->pos++) {
+		if (table->entries[ctx->pos].key != NULL) {
+			*key_r = table->entries[ctx->pos].key;
+			*value_r = table->entries[ctx->pos].value;
+			ctx->pos++;
+			return TRUE;
+		}
 	}
-	*key_r = node->key;
-	*value_r = node->value;
-
-	ctx->next = hash_table_iterate_next(ctx, node);
-	return TRUE;
+	*key_r = *value_r = NULL;
+	return FALSE;
 }
 
 void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
@@ -422,65 +451,8 @@ void hash_table_thaw(struct hash_table *table)
 	if (--table->frozen > 0)
 		return;
 
-	if (table->removed_count > 0) {
-		if (!hash_table_resize(table, FALSE))
-			hash_table_compress_removed(table);
-	}
-}
-
-static bool hash_table_resize(struct hash_table *table, bool grow)
-{
-	struct hash_node *old_nodes, *node, *next;
-	unsigned int next_size, old_size, i;
-	float nodes_per_list;
-
-        nodes_per_list = (float) table->nodes_count / (float) table->size;
-	if (nodes_per_list > 0.3 && nodes_per_list < 2.0)
-		return FALSE;
-
-	next_size = I_MAX(primes_closest(table->nodes_count+1),
-			  table->initial_size);
-	if (next_size == table->size)
-		return FALSE;
-
-	if (grow && table->size >= next_size)
-		return FALSE;
-
-	/* recreate primary table */
-	old_size = table->size;
-	old_nodes = table->nodes;
-
-	table->size = I_MAX(next_size, HASH_TABLE_MIN_SIZE);
-	table->nodes = i_new(struct hash_node, table->size);
-
-	table->nodes_count = 0;
-	table->removed_count = 0;
-
-	table->frozen++;
-
-	/* move the data */
-	for (i = 0; i < old_size; i++) {
-		node = &old_nodes[i];
-		if (node->key != NULL) {
-			hash_table_insert_node(table, node->key,
-					       node->value, FALSE);
-		}
-
-		for (node = node->next; node != NULL; node = next) {
-			next = node->next;
-
-			if (node->key != NULL) {
-				hash_table_insert_node(table, node->key,
-						       node->value, FALSE);
-			}
-			free_node(table, node);
-		}
-	}
-
-	table->frozen--;
-
-	i_free(old_nodes);
-	return TRUE;
+	if (hash_table_want_compress(table))
+		hash_table_compress(table);
 }
 
 void hash_table_copy(struct hash_table *dest, struct hash_table *src)
@@ -6,17 +6,46 @@
 #include "ioloop-private.h"
 #include "ioloop-iolist.h"
 
-#ifdef IOLOOP_EPOLL
+#if defined(IOLOOP_EPOLL) || defined(IOLOOP_URING)
 
 #include <sys/epoll.h>
 #include <unistd.h>
 
+#ifdef IOLOOP_URING
+/* ioloop-uring.c falls back to these if io_uring isn't usable */
+#  define io_loop_handler_init io_loop_epoll_handler_init
+#  define io_loop_handler_deinit io_loop_epoll_handler_deinit
+#  define io_loop_handle_add io_loop_epoll_handle_add
+#  define io_loop_handle_remove io_loop_epoll_handle_remove
+#  define io_loop_handler_run_internal io_loop_epoll_handler_run_internal
+#endif
+
+#ifndef EPOLLEXCLUSIVE
+/* Linux v4.5+ */
+#  define EPOLLEXCLUSIVE 0
+#endif
+
+struct epoll_io_list {
+	struct io_list list;
+	int fd;
+
+	/* events currently registered to the kernel, 0 if none */
+	uint32_t registered_events;
+	/* list is in ctx->changes waiting for epoll_ctl() */
+	bool change_pending;
+};
+
 struct ioloop_handler_context {
 	int epfd;
 
 	unsigned int deleted_count;
-	ARRAY(struct io_list *) fd_index;
+	ARRAY(struct epoll_io_list *) fd_index;
 	ARRAY(struct epoll_event) events;
+	/* fds whose event mask has changed since the last epoll_wait().
+	   These are applied all at once before the next epoll_wait(), so
+	   e.g. adding and removing an IO_WRITE handler within the same
+	   ioloop run doesn't cause any epoll_ctl() calls. */
+	ARRAY(struct epoll_io_list *) changes;
 };
 
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
@@ -27,6 +56,7 @@ void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
 
 	i_array_init(&ctx->events, initial_fd_count);
 	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->changes, 32);
 
 	ctx->epfd = epoll_create(initial_fd_count);
 	if (ctx->epfd < 0) {
@@ -43,7 +73,7 @@ void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
 void io_loop_handler_deinit(struct ioloop *ioloop)
 {
 	struct ioloop_handler_context *ctx = ioloop->handler_context;
-	struct io_list **list;
+	struct epoll_io_list **list;
 	unsigned int i, count;
 
 	list = array_get_modifiable(&ctx->fd_index, &count);
@@ -54,6 +84,7 @@ void io_loop_handler_deinit(struct ioloop *ioloop)
 		i_error("close(epoll) failed: %m");
 	array_free(&ioloop->handler_context->fd_index);
 	array_free(&ioloop->handler_context->events);
+	array_free(&ioloop->handler_context->changes);
 	i_free(ioloop->handler_context);
 }
 
@@ -61,10 +92,20 @@ void io_loop_handler_deinit(struct ioloop *ioloop)
 #define IO_EPOLL_INPUT (EPOLLIN | EPOLLPRI | IO_EPOLL_ERROR)
 #define IO_EPOLL_OUTPUT	(EPOLLOUT | IO_EPOLL_ERROR)
 
-static int epoll_event_mask(struct io_list *list)
+static uint32_t epoll_event_mask(struct epoll_io_list *elist)
 {
-	int events = 0, i;
+	struct io_list *list = &elist->list;
+	uint32_t events = 0;
 	struct io_file *io;
+	int i;
+
+	/* EPOLLEXCLUSIVE can't be combined with EPOLLPRI and the mask can't
+	   be modified afterwards, so use it only for a plain listener */
+	if (list->ios[IOLOOP_IOLIST_INPUT] != NULL &&
+	    list->ios[IOLOOP_IOLIST_OUTPUT] == NULL &&
+	    list->ios[IOLOOP_IOLIST_ERROR] == NULL &&
+	    (list->ios[IOLOOP_IOLIST_INPUT]->io.condition & IO_EXCLUSIVE) != 0)
+		return EPOLLIN | IO_EPOLL_ERROR | EPOLLEXCLUSIVE;
 
 	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
 		io = list->ios[i];
@@ -83,37 +124,119 @@ static int epoll_event_mask(struct io_list *list)
 	return events;
 }
 
-void io_loop_handle_add(struct io_file *io)
+static const char *epoll_op_name(int op)
+{
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		return "add";
+	case EPOLL_CTL_MOD:
+		return "mod";
+	case EPOLL_CTL_DEL:
+		return "del";
+	}
+	i_unreached();
+}
+
+static void ATTR_NORETURN epoll_ctl_failed(int op, int fd)
+{
+	if (errno == EPERM && op == EPOLL_CTL_ADD) {
+		i_fatal("epoll_ctl(add, %d) failed: %m "
+			"(fd doesn't support epoll%s)", fd,
+			fd != STDIN_FILENO ? "" :
+			" - instead of '<file', try 'cat file|'");
+	}
+	i_panic("epoll_ctl(%s, %d) failed: %m", epoll_op_name(op), fd);
+}
+
+static int epoll_ctl_list(struct ioloop_handler_context *ctx, int op,
+			  struct epoll_io_list *elist, uint32_t events)
 {
-	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
-	struct io_list **list;
 	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.data.ptr = elist;
+	event.events = events;
+	return epoll_ctl(ctx->epfd, op, elist->fd, &event);
+}
+
+static void
+epoll_apply_change(struct ioloop_handler_context *ctx,
+		   struct epoll_io_list *elist)
+{
+	uint32_t events = epoll_event_mask(elist);
 	int op;
-	bool first;
 
-	list = array_idx_modifiable(&ctx->fd_index, io->fd);
-	if (*list == NULL)
-		*list = i_new(struct io_list, 1);
+	if (events == elist->registered_events)
+		return;
 
-	first = ioloop_iolist_add(*list, io);
+	if (elist->registered_events == 0)
+		op = EPOLL_CTL_ADD;
+	else if ((elist->registered_events & EPOLLEXCLUSIVE) != 0 ||
+		 (events & EPOLLEXCLUSIVE) != 0) {
+		/* EPOLLEXCLUSIVE can only be given with EPOLL_CTL_ADD */
+		if (epoll_ctl_list(ctx, EPOLL_CTL_DEL, elist, 0) < 0 &&
+		    errno != ENOENT)
+			i_error("epoll_ctl(del, %d) failed: %m", elist->fd);
+		op = EPOLL_CTL_ADD;
+	} else {
+		op = EPOLL_CTL_MOD;
+	}
 
-	memset(&event, 0, sizeof(event));
-	event.data.ptr = *list;
-	event.events = epoll_event_mask(*list);
+	if (epoll_ctl_list(ctx, op, elist, events) < 0) {
+		/* the fd may have been closed and reopened or dup()ed since
+		   we last updated it. */
+		if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else
+			epoll_ctl_failed(op, elist->fd);
+		if (epoll_ctl_list(ctx, op, elist, events) < 0)
+			epoll_ctl_failed(op, elist->fd);
+	}
+	elist->registered_events = events;
+}
+
+static void epoll_apply_changes(struct ioloop_handler_context *ctx)
+{
+	struct epoll_io_list *const *elistp;
 
-	op = first ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	array_foreach(&ctx->changes, elistp) {
+		struct epoll_io_list *elist = *elistp;
 
-	if (epoll_ctl(ctx->epfd, op, io->fd, &event) < 0) {
-		if (errno == EPERM && op == EPOLL_CTL_ADD) {
-			i_fatal("epoll_ctl(add, %d) failed: %m "
-				"(fd doesn't support epoll%s)", io->fd,
-				io->fd != STDIN_FILENO ? "" :
-				" - instead of '<file', try 'cat file|'");
-		}
-		i_panic("epoll_ctl(%s, %d) failed: %m",
-			op == EPOLL_CTL_ADD ? "add" : "mod", io->fd);
+		if (!elist->change_pending)
+			continue;
+		elist->change_pending = FALSE;
+		epoll_apply_change(ctx, elist);
+	}
+	array_clear(&ctx->changes);
+}
+
+static void
+epoll_queue_change(struct ioloop_handler_context *ctx,
+		   struct epoll_io_list *elist)
+{
+	if (elist->change_pending)
+		return;
+	elist->change_pending = TRUE;
+	array_append(&ctx->changes, &elist, 1);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct epoll_io_list **list;
+	bool first;
+
+	list = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (*list == NULL) {
+		*list = i_new(struct epoll_io_list, 1);
+		(*list)->fd = io->fd;
 	}
 
+	first = ioloop_iolist_add(&(*list)->list, io);
+	epoll_queue_change(ctx, *list);
+
 	if (first) {
 		/* allow epoll_wait() to return the maximum number of events
 		   by keeping space allocated for each file descriptor */
@@ -127,30 +250,33 @@ void io_loop_handle_add(struct io_file *io)
 void io_loop_handle_remove(struct io_file *io, bool closed)
 {
 	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
-	struct io_list **list;
-	struct epoll_event event;
-	int op;
+	struct epoll_io_list **list;
 	bool last;
 
 	list = array_idx_modifiable(&ctx->fd_index, io->fd);
-	last = ioloop_iolist_del(*list, io);
-
-	if (!closed) {
-		memset(&event, 0, sizeof(event));
-		event.data.ptr = *list;
-		event.events = epoll_event_mask(*list);
-
-		op = last ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-
-		if (epoll_ctl(ctx->epfd, op, io->fd, &event) < 0) {
+	last = ioloop_iolist_del(&(*list)->list, io);
+
+	if (closed) {
+		/* closing the fd already removed it from epoll */
+		(*list)->registered_events = 0;
+		(*list)->change_pending = FALSE;
+	} else if (!last) {
+		epoll_queue_change(ctx, *list);
+	} else {
+		/* the caller is likely to close the fd next, so the removal
+		   can't be delayed. if the fd was dup()ed, the kernel would
+		   otherwise keep reporting events for it. */
+		(*list)->change_pending = FALSE;
+		if ((*list)->registered_events != 0 &&
+		    epoll_ctl_list(ctx, EPOLL_CTL_DEL, *list, 0) < 0) {
 			const char *errstr = t_strdup_printf(
-				"epoll_ctl(%s, %d) failed: %m",
-				op == EPOLL_CTL_DEL ? "del" : "mod", io->fd);
+				"epoll_ctl(del, %d) failed: %m", io->fd);
 			if (errno == EBADF)
 				i_panic("%s", errstr);
 			else
 				i_error("%s", errstr);
 		}
+		(*list)->registered_events = 0;
 	}
 	if (last) {
 		/* since we're not freeing memory in any case, just increase
@@ -166,7 +292,7 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 	struct ioloop_handler_context *ctx = ioloop->handler_context;
 	struct epoll_event *events;
 	const struct epoll_event *event;
-	struct io_list *list;
+	struct epoll_io_list *elist;
 	struct io_file *io;
 	struct timeval tv;
 	unsigned int events_count;
@@ -176,6 +302,9 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
         /* get the time left for next timeout task */
 	msecs = io_loop_get_wait_time(ioloop, &tv);
 
+	/* update the kernel's view of the fds we're waiting on */
+	epoll_apply_changes(ctx);
+
 	events = array_get_modifiable(&ctx->events, &events_count);
 	if (ioloop->io_files != NULL && events_count > ctx->deleted_count) {
 		ret = epoll_wait(ctx->epfd, events, events_count, msecs);
@@ -199,10 +328,10 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 		/* io_loop_handle_add() may cause events array reallocation,
 		   so we have use array_idx() */
 		event = array_idx(&ctx->events, i);
-		list = event->data.ptr;
+		elist = event->data.ptr;
 
 		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
-			io = list->ios[j];
+			io = elist->list.ios[j];
 			if (io == NULL)
 				continue;
 
@@ -222,4 +351,4 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 	}
 }
 
-#endif	/* IOLOOP_EPOLL */
+#endif	/* IOLOOP_EPOLL || IOLOOP_URING */
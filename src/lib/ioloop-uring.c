@@ -0,0 +1,593 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "llist.h"
+#include "fd-close-on-exec.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Linux io_uring based ioloop handler. File descriptors are waited on with
+   one-shot IORING_OP_POLL_ADD requests, which are re-armed after their
+   callbacks are called. All the poll requests, cancellations and the
+   ioloop's timeout are submitted with a single io_uring_enter() call.
+
+   Only the waiting for fds is done with io_uring. File reads and writes
+   done by istreams and ostreams are still synchronous and can block the
+   process on slow storage just like with the other handlers.
+
+   If io_uring isn't usable at runtime (old kernel, seccomp filters, etc.)
+   the epoll handler is used instead for the whole process.
+
+   The ring's memory is shared with a forked child process, so a child
+   that keeps using the ioloop creates a new ring and re-arms its polls
+   there before touching the ring. */
+
+#define IO_URING_INPUT (POLLIN | POLLPRI)
+#define IO_URING_OUTPUT POLLOUT
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+
+/* user_data for requests whose completions we don't care about */
+#define IO_URING_USER_DATA_IGNORE 0
+
+struct uring_io_list;
+
+struct uring_poll_request {
+	struct uring_poll_request *prev, *next;
+
+	/* NULL if the request has been cancelled */
+	struct uring_io_list *list;
+	unsigned int events;
+};
+
+struct uring_io_list {
+	struct io_list list;
+	int fd;
+
+	/* currently submitted poll request, or NULL */
+	struct uring_poll_request *request;
+	/* list is in ctx->changes waiting for the poll to be (re-)armed */
+	bool change_pending;
+};
+
+struct uring_event {
+	struct uring_io_list *list;
+	unsigned int revents;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	/* process that created the ring */
+	pid_t pid;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_mask, sq_entries;
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* locally queued, but not yet published sq_tail */
+	unsigned int sqe_tail;
+	unsigned int to_submit;
+	struct __kernel_timespec timeout;
+
+	ARRAY(struct uring_io_list *) fd_index;
+	ARRAY(struct uring_io_list *) changes;
+	ARRAY(struct uring_event) events;
+	/* all poll requests not yet completed by the kernel */
+	struct uring_poll_request *requests;
+};
+
+/* -1 = unknown, 0 = falling back to epoll, 1 = io_uring works */
+static int uring_usable = -1;
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		   unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static void *
+uring_mmap(struct ioloop_handler_context *ctx, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ctx->ring_fd, offset);
+	if (ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring) failed: %m");
+	return ptr;
+}
+
+static int
+uring_init(struct ioloop_handler_context *ctx, unsigned int initial_fd_count)
+{
+	struct io_uring_params params;
+	unsigned char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	ctx->ring_fd = sys_io_uring_setup(I_MAX(initial_fd_count, 64), &params);
+	if (ctx->ring_fd < 0) {
+		if (errno == EMFILE || errno == ENFILE)
+			i_fatal("io_uring_setup() failed: %m");
+		return -1;
+	}
+	if ((params.features & IORING_FEAT_NODROP) == 0) {
+		/* kernel is too old to keep completions on CQ overflow */
+		i_close_fd(&ctx->ring_fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	ctx->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ctx->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ctx->sq_ring_size = ctx->cq_ring_size =
+			I_MAX(ctx->sq_ring_size, ctx->cq_ring_size);
+	}
+	ctx->sq_ring = uring_mmap(ctx, ctx->sq_ring_size, IORING_OFF_SQ_RING);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ctx->cq_ring = ctx->sq_ring;
+	else {
+		ctx->cq_ring = uring_mmap(ctx, ctx->cq_ring_size,
+					  IORING_OFF_CQ_RING);
+	}
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = uring_mmap(ctx, ctx->sqes_size, IORING_OFF_SQES);
+
+	sq = ctx->sq_ring;
+	ctx->sq_head = (void *)(sq + params.sq_off.head);
+	ctx->sq_tail = (void *)(sq + params.sq_off.tail);
+	ctx->sq_array = (void *)(sq + params.sq_off.array);
+	ctx->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	ctx->sq_entries = params.sq_entries;
+	ctx->sqe_tail = *ctx->sq_tail;
+
+	cq = ctx->cq_ring;
+	ctx->cq_head = (void *)(cq + params.cq_off.head);
+	ctx->cq_tail = (void *)(cq + params.cq_off.tail);
+	ctx->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	ctx->cqes = (void *)(cq + params.cq_off.cqes);
+	ctx->to_submit = 0;
+	ctx->pid = getpid();
+	return 0;
+}
+
+static void uring_deinit(struct ioloop_handler_context *ctx)
+{
+	struct uring_poll_request *req;
+
+	/* closing the ring cancels all the pending requests, unless it's
+	   still used by another process */
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	while (ctx->requests != NULL) {
+		req = ctx->requests;
+		DLLIST_REMOVE(&ctx->requests, req);
+		i_free(req);
+	}
+
+	if (munmap(ctx->sqes, ctx->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (ctx->cq_ring != ctx->sq_ring &&
+	    munmap(ctx->cq_ring, ctx->cq_ring_size) < 0)
+		i_error("munmap(io_uring cq) failed: %m");
+	if (munmap(ctx->sq_ring, ctx->sq_ring_size) < 0)
+		i_error("munmap(io_uring sq) failed: %m");
+}
+
+static void uring_io_list_reset(struct ioloop_handler_context *ctx,
+				struct uring_io_list *ulist);
+
+static void uring_check_fork(struct ioloop_handler_context *ctx)
+{
+	struct uring_io_list **list;
+	unsigned int i, count;
+
+	if (ctx->pid == getpid())
+		return;
+
+	/* we're a forked child. the parent's requests must not be touched,
+	   so leave the old ring to it and re-arm all polls in a new ring. */
+	uring_deinit(ctx);
+	if (uring_init(ctx, array_count(&ctx->fd_index)) < 0)
+		i_fatal("io_uring_setup() failed after fork: %m");
+
+	array_clear(&ctx->changes);
+	list = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++) {
+		if (list[i] != NULL)
+			uring_io_list_reset(ctx, list[i]);
+	}
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+
+	if (uring_usable == 0) {
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+		return;
+	}
+
+	ctx = i_new(struct ioloop_handler_context, 1);
+	if (uring_init(ctx, initial_fd_count) < 0) {
+		if (uring_usable == 1)
+			i_fatal("io_uring_setup() failed: %m");
+		/* use epoll for the rest of this process */
+		uring_usable = 0;
+		i_free(ctx);
+		io_loop_epoll_handler_init(ioloop, initial_fd_count);
+		return;
+	}
+	uring_usable = 1;
+	ioloop->handler_context = ctx;
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->changes, 32);
+	i_array_init(&ctx->events, initial_fd_count);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct uring_io_list **list;
+	unsigned int i, count;
+
+	if (uring_usable == 0) {
+		io_loop_epoll_handler_deinit(ioloop);
+		return;
+	}
+
+	uring_deinit(ctx);
+
+	list = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(list[i]);
+
+	array_free(&ctx->fd_index);
+	array_free(&ctx->changes);
+	array_free(&ctx->events);
+	i_free(ioloop->handler_context);
+}
+
+static int uring_submit(struct ioloop_handler_context *ctx,
+			unsigned int min_complete)
+{
+	unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	__atomic_store_n(ctx->sq_tail, ctx->sqe_tail, __ATOMIC_RELEASE);
+	ret = sys_io_uring_enter(ctx->ring_fd, ctx->to_submit,
+				 min_complete, flags);
+	if (ret < 0)
+		return -1;
+	i_assert((unsigned int)ret <= ctx->to_submit);
+	ctx->to_submit -= ret;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	while (ctx->sqe_tail -
+	       __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE) >=
+	       ctx->sq_entries) {
+		/* submission queue is full */
+		if (uring_submit(ctx, 0) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter() failed: %m");
+	}
+
+	idx = ctx->sqe_tail & ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ctx->sq_array[idx] = idx;
+	ctx->sqe_tail++;
+	ctx->to_submit++;
+	return sqe;
+}
+
+static unsigned int uring_poll_mask(struct uring_io_list *ulist)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = ulist->list.ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if (io->io.condition & IO_READ)
+			events |= IO_URING_INPUT | IO_URING_ERROR;
+		if (io->io.condition & IO_WRITE)
+			events |= IO_URING_OUTPUT | IO_URING_ERROR;
+		if (io->io.condition & IO_ERROR)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void
+uring_poll_cancel(struct ioloop_handler_context *ctx,
+		  struct uring_io_list *ulist)
+{
+	struct uring_poll_request *req = ulist->request;
+	struct io_uring_sqe *sqe;
+
+	/* the request is freed once its (cancelled) completion arrives */
+	req->list = NULL;
+	ulist->request = NULL;
+
+	sqe = uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)req;
+	sqe->user_data = IO_URING_USER_DATA_IGNORE;
+}
+
+static void
+uring_poll_add(struct ioloop_handler_context *ctx,
+	       struct uring_io_list *ulist, unsigned int events)
+{
+	struct uring_poll_request *req;
+	struct io_uring_sqe *sqe;
+
+	req = i_new(struct uring_poll_request, 1);
+	req->list = ulist;
+	req->events = events;
+	DLLIST_PREPEND(&ctx->requests, req);
+	ulist->request = req;
+
+	sqe = uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ulist->fd;
+	sqe->poll_events = events;
+	sqe->user_data = (uintptr_t)req;
+}
+
+static void
+uring_apply_change(struct ioloop_handler_context *ctx,
+		   struct uring_io_list *ulist)
+{
+	unsigned int events = uring_poll_mask(ulist);
+
+	if (ulist->request != NULL) {
+		if (ulist->request->events == events)
+			return;
+		uring_poll_cancel(ctx, ulist);
+	}
+	if (events != 0)
+		uring_poll_add(ctx, ulist, events);
+}
+
+static void uring_apply_changes(struct ioloop_handler_context *ctx)
+{
+	struct uring_io_list *const *ulistp;
+
+	array_foreach(&ctx->changes, ulistp) {
+		struct uring_io_list *ulist = *ulistp;
+
+		if (!ulist->change_pending)
+			continue;
+		ulist->change_pending = FALSE;
+		uring_apply_change(ctx, ulist);
+	}
+	array_clear(&ctx->changes);
+}
+
+static void
+uring_queue_change(struct ioloop_handler_context *ctx,
+		   struct uring_io_list *ulist)
+{
+	if (ulist->change_pending)
+		return;
+	ulist->change_pending = TRUE;
+	array_append(&ctx->changes, &ulist, 1);
+}
+
+static void uring_io_list_reset(struct ioloop_handler_context *ctx,
+				struct uring_io_list *ulist)
+{
+	/* the request was freed along with the old ring */
+	ulist->request = NULL;
+	ulist->change_pending = FALSE;
+	uring_queue_change(ctx, ulist);
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_io_list **list;
+
+	if (uring_usable == 0) {
+		io_loop_epoll_handle_add(io);
+		return;
+	}
+
+	list = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (*list == NULL) {
+		*list = i_new(struct uring_io_list, 1);
+		(*list)->fd = io->fd;
+	}
+
+	(void)ioloop_iolist_add(&(*list)->list, io);
+	uring_queue_change(ctx, *list);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct uring_io_list **list;
+
+	if (uring_usable == 0) {
+		io_loop_epoll_handle_remove(io, closed);
+		return;
+	}
+	uring_check_fork(ctx);
+
+	list = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (!ioloop_iolist_del(&(*list)->list, io))
+		uring_queue_change(ctx, *list);
+	else if ((*list)->request != NULL) {
+		/* a pending poll keeps a reference to the file, so it must be
+		   cancelled immediately for close() to actually release it */
+		(*list)->change_pending = FALSE;
+		uring_poll_cancel(ctx, *list);
+		if (uring_submit(ctx, 0) < 0 && errno != EINTR)
+			i_error("io_uring_enter() failed: %m");
+	}
+	i_free(io);
+}
+
+static void uring_reap_completions(struct ioloop_handler_context *ctx)
+{
+	struct uring_event *event;
+	struct uring_poll_request *req;
+	const struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+
+	head = *ctx->cq_head;
+	tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ctx->cqes[head & ctx->cq_mask];
+		if (cqe->user_data == IO_URING_USER_DATA_IGNORE)
+			continue;
+
+		req = (struct uring_poll_request *)(uintptr_t)cqe->user_data;
+		DLLIST_REMOVE(&ctx->requests, req);
+		if (req->list != NULL) {
+			/* poll requests are one-shot. re-arm it after the
+			   callbacks have been called. */
+			i_assert(req->list->request == req);
+			req->list->request = NULL;
+			uring_queue_change(ctx, req->list);
+
+			event = array_append_space(&ctx->events);
+			event->list = req->list;
+			event->revents = cqe->res < 0 ? POLLERR : cqe->res;
+		}
+		i_free(req);
+	}
+	__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+uring_add_timeout(struct ioloop_handler_context *ctx, const struct timeval *tv)
+{
+	struct io_uring_sqe *sqe;
+
+	/* the timeout completes either when it expires or when any
+	   other request completes, so it never stays pending. */
+	ctx->timeout.tv_sec = tv->tv_sec;
+	ctx->timeout.tv_nsec = tv->tv_usec * 1000;
+	sqe = uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&ctx->timeout;
+	sqe->len = 1;
+	sqe->off = 1;
+	sqe->user_data = IO_URING_USER_DATA_IGNORE;
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	const struct uring_event *event;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, j, count;
+	int msecs, ret;
+	bool call;
+
+	if (uring_usable == 0) {
+		io_loop_epoll_handler_run_internal(ioloop);
+		return;
+	}
+
+	uring_check_fork(ctx);
+
+        /* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+
+	uring_apply_changes(ctx);
+	if (ioloop->io_files == NULL) {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		i_assert(msecs >= 0);
+		if (ctx->to_submit > 0 && uring_submit(ctx, 0) < 0 &&
+		    errno != EINTR)
+			i_error("io_uring_enter() failed: %m");
+		usleep(msecs*1000);
+	} else {
+		if (msecs > 0)
+			uring_add_timeout(ctx, &tv);
+		ret = uring_submit(ctx, msecs == 0 ? 0 : 1);
+		if (ret < 0 && errno != EINTR && errno != ETIME)
+			i_fatal("io_uring_enter(): %m");
+	}
+	uring_reap_completions(ctx);
+
+	/* execute timeout handlers */
+        io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running) {
+		array_clear(&ctx->events);
+		return;
+	}
+
+	count = array_count(&ctx->events);
+	for (i = 0; i < count; i++) {
+		/* io_loop_handle_add() can't add new events, but use
+		   array_idx() to be safe */
+		event = array_idx(&ctx->events, i);
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			io = event->list->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((event->revents & IO_URING_ERROR) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (event->revents & IO_URING_INPUT) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (event->revents & IO_URING_OUTPUT) != 0;
+
+			if (call)
+				io_loop_call_io(&io->io);
+		}
+	}
+	array_clear(&ctx->events);
+}
+
+#endif	/* IOLOOP_URING */
@@ -17,7 +17,13 @@ enum io_condition {
 	IO_ERROR	= 0x04,
 	
 	/* internal */
-	IO_NOTIFY	= 0x08
+	IO_NOTIFY	= 0x08,
+
+	/* Can be used with IO_READ for a listener fd that is shared by
+	   multiple processes. Only one of the waiting processes is woken up
+	   for a new connection instead of all of them. Ignored by ioloop
+	   backends that don't support it (only epoll does currently). */
+	IO_EXCLUSIVE	= 0x10
 };
 
 enum io_notify_result {
@@ -1,6 +1,7 @@
 /* Copyright (c) 2007-2016 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "buffer.h"
 #include "str.h"
 #include "base64.h"
 
@@ -101,9 +102,83 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static void test_base64_random_lines(void)
+{
+	string_t *str, *wrapped, *dest;
+	unsigned char buf[1024];
+	unsigned int i, j, max, line_len;
+	size_t pos;
+
+	str = t_str_new(2048);
+	wrapped = t_str_new(2048);
+	dest = t_str_new(1024);
+
+	test_begin("base64 decode with random line lengths");
+	for (i = 0; i < 1000; i++) {
+		max = rand() % sizeof(buf);
+		for (j = 0; j < max; j++)
+			buf[j] = rand();
+		/* line lengths must be multiples of 4 */
+		line_len = (rand() % 40 + 1) * 4;
+
+		str_truncate(str, 0);
+		str_truncate(wrapped, 0);
+		str_truncate(dest, 0);
+		base64_encode(buf, max, str);
+		for (pos = 0; pos < str_len(str); pos += line_len) {
+			str_append_n(wrapped, str_c(str) + pos, line_len);
+			str_append(wrapped, rand() % 2 == 0 ? "\r\n" : "\n");
+		}
+		test_assert_idx(base64_decode(str_data(wrapped), str_len(wrapped),
+					      &pos, dest) >= 0, i);
+		test_assert_idx(pos == str_len(wrapped), i);
+		test_assert_idx(str_len(dest) == max &&
+				memcmp(buf, str_data(dest), max) == 0, i);
+	}
+	test_end();
+}
+
+static void test_base64_benchmark(void)
+{
+#define BENCHMARK_SIZE (1024*1024*16)
+	struct timespec start;
+	unsigned char *data;
+	buffer_t *encoded, *decoded;
+	unsigned int i;
+	double secs;
+
+	data = i_malloc(BENCHMARK_SIZE);
+	for (i = 0; i < BENCHMARK_SIZE; i++)
+		data[i] = rand();
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(BENCHMARK_SIZE));
+	decoded = buffer_create_dynamic(default_pool, BENCHMARK_SIZE);
+
+	test_benchmark_start(&start);
+	base64_encode(data, BENCHMARK_SIZE, encoded);
+	secs = test_benchmark_secs(&start);
+	test_out_reason("base64 benchmark: encode 16MB", TRUE,
+		t_strdup_printf("%.0f MB/s", BENCHMARK_SIZE / secs / 1e6));
+
+	test_benchmark_start(&start);
+	(void)base64_decode(encoded->data, encoded->used, NULL, decoded);
+	secs = test_benchmark_secs(&start);
+	test_assert(decoded->used == BENCHMARK_SIZE &&
+		    memcmp(decoded->data, data, BENCHMARK_SIZE) == 0);
+	test_out_reason("base64 benchmark: decode 16MB", TRUE,
+		t_strdup_printf("%.0f MB/s", BENCHMARK_SIZE / secs / 1e6));
+
+	buffer_free(&encoded);
+	buffer_free(&decoded);
+	i_free(data);
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
 	test_base64_decode();
 	test_base64_random();
+	test_base64_random_lines();
+	if (test_benchmarks_enabled())
+		test_base64_benchmark();
 }
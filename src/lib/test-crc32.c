@@ -3,6 +3,63 @@
 #include "test-lib.h"
 #include "crc32.h"
 
+
+static uint32_t crc32_data_bytewise(const unsigned char *data, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	unsigned int bit;
+
+	for (; size > 0; size--, data++) {
+		crc ^= *data;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return crc ^ 0xffffffff;
+}
+
+static void test_crc32_random(void)
+{
+	unsigned char buf[256];
+	unsigned int i, offset, len, split;
+	uint32_t crc;
+
+	test_begin("crc32 random");
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() % 256;
+	for (i = 0; i < 1000; i++) {
+		offset = rand() % 16;
+		len = rand() % (sizeof(buf) - offset);
+		split = len == 0 ? 0 : rand() % len;
+
+		crc = crc32_data(buf + offset, len);
+		test_assert_idx(crc == crc32_data_bytewise(buf + offset, len), i);
+		crc = crc32_data_more(crc32_data(buf + offset, split),
+				      buf + offset + split, len - split);
+		test_assert_idx(crc == crc32_data_bytewise(buf + offset, len), i);
+	}
+	test_end();
+}
+
+static void test_crc32_benchmark(void)
+{
+	const size_t size = 64*1024*1024;
+	struct timespec start;
+	unsigned char *buf;
+	uint32_t crc;
+	double secs;
+	size_t i;
+
+	buf = i_malloc(size);
+	for (i = 0; i < size; i++)
+		buf[i] = i * 7;
+	test_benchmark_start(&start);
+	crc = crc32_data(buf, size);
+	secs = test_benchmark_secs(&start);
+	test_out_reason("crc32 benchmark: 64MB", crc != 0,
+		t_strdup_printf("%.0f MB/s", size / secs / (1024*1024)));
+	i_free(buf);
+}
+
 void test_crc32(void)
 {
 	const char str[] = "foo\0bar";
@@ -11,4 +68,8 @@ void test_crc32(void)
 	test_assert(crc32_str(str) == 0x8c736521);
 	test_assert(crc32_data(str, sizeof(str)) == 0x32c9723d);
 	test_end();
+
+	test_crc32_random();
+	if (test_benchmarks_enabled())
+		test_crc32_benchmark();
 }
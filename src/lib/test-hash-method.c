@@ -3,6 +3,7 @@
 #include "test-lib.h"
 #include "mmap-util.h"
 #include "hash-method.h"
+#include "xxhash64.h"
 
 #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
 #  define MAP_ANONYMOUS MAP_ANON
@@ -32,6 +33,81 @@ static void test_hash_method_one(const struct hash_method *method)
 	test_end();
 }
 
+static void test_hash_method_xxh64(void)
+{
+	static const struct {
+		const char *input;
+		uint64_t hash;
+	} tests[] = {
+		{ "", 0xEF46DB3751D8E999ULL },
+		{ "a", 0xD24EC4F1A98C6E5BULL },
+		{ "abc", 0x44BC2CF5AD770999ULL },
+		{ "The quick brown fox jumps over the lazy dog",
+		  0x0B242D361FDA71BCULL },
+		/* 32 bytes, 64 bytes and 87 bytes go through the 32 byte
+		   stripe loop with different amounts of tail data */
+		{ "0123456789abcdef0123456789abcdef", 0x642A94958E71E6C5ULL },
+		{ "0123456789abcdef0123456789abcdef"
+		  "0123456789abcdef0123456789abcdef", 0x1AF3AC4760FE2F85ULL },
+		{ "0123456789abcdef0123456789abcdef"
+		  "0123456789abcdef0123456789abcdef"
+		  "0123456789abcdef0123456", 0x9670E8B775EC8CC1ULL },
+	};
+	/* xxh64(data, len, 1234) */
+	static const struct {
+		unsigned int len;
+		uint64_t hash;
+	} data_tests[] = {
+		{ 31, 0x6AF8E41A08EA1927ULL },
+		{ 32, 0xA4DF8984F9F5067CULL },
+		{ 33, 0x436E90B310F0DD88ULL },
+		{ 63, 0xE0F48D835D3CD842ULL },
+		{ 64, 0x719CE741F19AF152ULL },
+		{ 65, 0xEACCA740A1BFC43BULL },
+		{ 100, 0xFA43F9646C255BE7ULL },
+	};
+	const struct hash_method *method;
+	struct xxh64_context ctx;
+	unsigned char data[100], digest[XXH64_RESULTLEN];
+	unsigned int i, j;
+	uint64_t hash;
+
+	test_begin("hash method xxh64 values");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(xxh64(tests[i].input, strlen(tests[i].input), 0) ==
+				tests[i].hash, i);
+	}
+
+	/* hash_method returns the hash in big endian */
+	method = hash_method_lookup("xxh64");
+	test_assert(method != NULL);
+	if (method != NULL) {
+		method->init(&ctx);
+		method->loop(&ctx, "abc", 3);
+		method->result(&ctx, digest);
+		test_assert(digest[0] == 0x44 && digest[7] == 0x99);
+	}
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 13;
+	for (i = 0; i < N_ELEMENTS(data_tests); i++) {
+		test_assert_idx(xxh64(data, data_tests[i].len, 1234) ==
+				data_tests[i].hash, i);
+	}
+
+	/* feeding the data in pieces must give the same result */
+	for (i = 0; i <= sizeof(data); i++) {
+		hash = xxh64(data, i, 1234);
+		for (j = 0; j <= i; j += 7) {
+			xxh64_init(&ctx, 1234);
+			xxh64_update(&ctx, data, j);
+			xxh64_update(&ctx, data + j, i - j);
+			test_assert_idx(xxh64_final(&ctx) == hash, i * 1000 + j);
+		}
+	}
+	test_end();
+}
+
 void test_hash_method(void)
 {
 	unsigned int i;
@@ -48,4 +124,5 @@ void test_hash_method(void)
 
 	for (i = 0; hash_methods[i] != NULL; i++)
 		test_hash_method_one(hash_methods[i]);
+	test_hash_method_xxh64();
 }
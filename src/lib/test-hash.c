@@ -1,6 +1,7 @@
 /* Copyright (c) 2014-2016 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "primes.h"
 #include "hash.h"
 
 
@@ -35,6 +36,246 @@ static void test_hash_random_pool(pool_t pool)
 	i_free(keys);
 }
 
+static void test_hash_iterate_remove(void)
+{
+#define ITER_KEYMAX 1000
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	unsigned char seen[ITER_KEYMAX+1];
+	void *key, *value;
+	unsigned int i, k;
+
+	test_begin("hash iterate and remove");
+	hash_table_create_direct(&hash, default_pool, 0);
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		hash_table_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+
+	/* remove the current key and a later key during iteration */
+	memset(seen, 0, sizeof(seen));
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		k = POINTER_CAST_TO(key, unsigned int);
+		test_assert(key == value);
+		test_assert(seen[k] == 0);
+		seen[k]++;
+		hash_table_remove(hash, key);
+		if (k % 2 == 0 && k + 1 <= ITER_KEYMAX &&
+		    seen[k+1] == 0)
+			hash_table_remove(hash, POINTER_CAST(k+1));
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(hash_table_count(hash) == 0);
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		test_assert_idx(seen[i] == 1 || (i % 2 == 1 && seen[i-1] == 1), i);
+
+	/* table must still work after thawing */
+	for (i = 1; i <= ITER_KEYMAX; i++)
+		hash_table_insert(hash, POINTER_CAST(i), POINTER_CAST(i+1));
+	for (i = 1; i <= ITER_KEYMAX; i++) {
+		test_assert(hash_table_lookup(hash, POINTER_CAST(i)) ==
+			    POINTER_CAST(i+1));
+	}
+	test_assert(hash_table_count(hash) == ITER_KEYMAX);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_insert_update(void)
+{
+	HASH_TABLE(char *, char *) hash;
+	char *key1, *key2, *value, *orig_key, *orig_value;
+
+	test_begin("hash insert and update");
+	key1 = t_strdup_noconst("foo");
+	key2 = t_strdup_noconst("foo");
+	value = t_strdup_noconst("value");
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	hash_table_insert(hash, key1, value);
+	hash_table_update(hash, key2, value);
+	test_assert(hash_table_lookup_full(hash, key1, &orig_key, &orig_value));
+	test_assert(orig_key == key1);
+	hash_table_insert(hash, key2, value);
+	test_assert(hash_table_lookup_full(hash, key1, &orig_key, &orig_value));
+	test_assert(orig_key == key2);
+	test_assert(hash_table_count(hash) == 1);
+
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_lookup(hash, key1) == NULL);
+	test_assert(hash_table_count(hash) == 0);
+	hash_table_destroy(&hash);
+	test_end();
+}
+
+/* The chained hash table that hash.c used before, for comparing the
+   benchmark results. Only inserting string keys and looking them up is
+   supported. */
+struct test_chained_node {
+	struct test_chained_node *next;
+	void *key, *value;
+};
+
+struct test_chained_table {
+	unsigned int size, nodes_count, extra_nodes_count;
+	struct test_chained_node *nodes;
+};
+
+static void
+test_chained_insert(struct test_chained_table *table, void *key, void *value);
+
+static void test_chained_init(struct test_chained_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	table->size = 67;
+	table->nodes = i_new(struct test_chained_node, table->size);
+}
+
+static void test_chained_free_nodes(struct test_chained_node *nodes,
+				    unsigned int size)
+{
+	struct test_chained_node *node, *next;
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		for (node = nodes[i].next; node != NULL; node = next) {
+			next = node->next;
+			i_free(node);
+		}
+	}
+	i_free(nodes);
+}
+
+static bool test_chained_resize(struct test_chained_table *table)
+{
+	struct test_chained_node *old_nodes, *node;
+	unsigned int old_size, next_size, i;
+
+	if ((float)table->nodes_count / (float)table->size < 2.0)
+		return FALSE;
+	next_size = primes_closest(table->nodes_count+1);
+	if (next_size <= table->size)
+		return FALSE;
+
+	old_size = table->size;
+	old_nodes = table->nodes;
+	table->size = next_size;
+	table->nodes = i_new(struct test_chained_node, table->size);
+	table->nodes_count = 0;
+	table->extra_nodes_count = 0;
+	for (i = 0; i < old_size; i++) {
+		for (node = &old_nodes[i]; node != NULL; node = node->next) {
+			if (node->key != NULL)
+				test_chained_insert(table, node->key,
+						    node->value);
+		}
+	}
+	test_chained_free_nodes(old_nodes, old_size);
+	return TRUE;
+}
+
+static void
+test_chained_insert(struct test_chained_table *table, void *key, void *value)
+{
+	struct test_chained_node *node;
+
+	node = &table->nodes[str_hash(key) % table->size];
+	if (node->key != NULL) {
+		if (test_chained_resize(table)) {
+			test_chained_insert(table, key, value);
+			return;
+		}
+		while (node->next != NULL)
+			node = node->next;
+		node->next = i_new(struct test_chained_node, 1);
+		node = node->next;
+		table->extra_nodes_count++;
+	}
+	node->key = key;
+	node->value = value;
+	table->nodes_count++;
+}
+
+static void *
+test_chained_lookup(const struct test_chained_table *table, const char *key)
+{
+	const struct test_chained_node *node;
+
+	node = &table->nodes[str_hash(key) % table->size];
+	for (; node != NULL; node = node->next) {
+		if (node->key != NULL && strcmp(node->key, key) == 0)
+			return node->value;
+	}
+	return NULL;
+}
+
+static void test_hash_benchmark(void)
+{
+#define BENCHMARK_KEYS 1000000
+#define BENCHMARK_LOOKUP_KEY(i) keys[((i) * 7919) % BENCHMARK_KEYS]
+	HASH_TABLE(char *, void *) hash;
+	struct test_chained_table chained;
+	struct timespec start;
+	char **keys;
+	unsigned int i, found = 0, chained_found = 0;
+	size_t mem_used, chained_mem_used;
+	double secs, chained_secs;
+	pool_t pool;
+
+	pool = pool_alloconly_create("hash benchmark keys", 1024*1024*16);
+	keys = i_new(char *, BENCHMARK_KEYS);
+	for (i = 0; i < BENCHMARK_KEYS; i++)
+		keys[i] = p_strdup_printf(pool, "user%u@example.com", i);
+
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	test_benchmark_start(&start);
+	for (i = 0; i < BENCHMARK_KEYS; i++)
+		hash_table_insert(hash, keys[i], POINTER_CAST(i+1));
+	secs = test_benchmark_secs(&start);
+	mem_used = hash_table_get_memory_usage(hash);
+
+	test_chained_init(&chained);
+	test_benchmark_start(&start);
+	for (i = 0; i < BENCHMARK_KEYS; i++)
+		test_chained_insert(&chained, keys[i], POINTER_CAST(i+1));
+	chained_secs = test_benchmark_secs(&start);
+	chained_mem_used = sizeof(struct test_chained_node) *
+		(chained.size + chained.extra_nodes_count);
+
+	test_out_reason("hash benchmark: 1M string keys insert", TRUE,
+		t_strdup_printf("%.1f ns/insert (chained %.1f), "
+				"%.1f bytes/entry (chained %.1f)",
+				secs * 1e9 / BENCHMARK_KEYS,
+				chained_secs * 1e9 / BENCHMARK_KEYS,
+				(double)mem_used / BENCHMARK_KEYS,
+				(double)chained_mem_used / BENCHMARK_KEYS));
+
+	/* access in a cache-unfriendly order */
+	test_benchmark_start(&start);
+	for (i = 0; i < BENCHMARK_KEYS; i++) {
+		if (hash_table_lookup(hash, BENCHMARK_LOOKUP_KEY(i)) != NULL)
+			found++;
+	}
+	secs = test_benchmark_secs(&start);
+
+	test_benchmark_start(&start);
+	for (i = 0; i < BENCHMARK_KEYS; i++) {
+		if (test_chained_lookup(&chained,
+					BENCHMARK_LOOKUP_KEY(i)) != NULL)
+			chained_found++;
+	}
+	chained_secs = test_benchmark_secs(&start);
+	test_assert(found == BENCHMARK_KEYS);
+	test_assert(chained_found == BENCHMARK_KEYS);
+	test_out_reason("hash benchmark: 1M string keys lookup", TRUE,
+		t_strdup_printf("%.1f ns/lookup (chained %.1f)",
+				secs * 1e9 / BENCHMARK_KEYS,
+				chained_secs * 1e9 / BENCHMARK_KEYS));
+
+	test_chained_free_nodes(chained.nodes, chained.size);
+	hash_table_destroy(&hash);
+	i_free(keys);
+	pool_unref(&pool);
+}
+
 void test_hash(void)
 {
 	pool_t pool;
@@ -44,4 +285,9 @@ void test_hash(void)
 	pool = pool_alloconly_create("test hash", 1024);
 	test_hash_random_pool(pool);
 	pool_unref(&pool);
+
+	test_hash_iterate_remove();
+	test_hash_insert_update();
+	if (test_benchmarks_enabled())
+		test_hash_benchmark();
 }
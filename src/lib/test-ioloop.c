@@ -6,6 +6,7 @@
 #include "ioloop.h"
 
 #include <unistd.h>
+#include <sys/wait.h>
 
 static void timeout_callback(struct timeval *tv)
 {
@@ -98,8 +99,139 @@ static void test_ioloop_find_fd_conditions(void)
 	test_end();
 }
 
+static void io_callback_stop(bool *called)
+{
+	*called = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_io_changes(void)
+{
+	struct ioloop *ioloop;
+	struct io *io_read, *io_write;
+	struct timeout *to;
+	int fd[2], fd2[2];
+	bool called = FALSE, timed_out = FALSE;
+
+	test_begin("ioloop io changes");
+
+	ioloop = io_loop_create();
+	to = timeout_add(5000, io_callback_stop, &timed_out);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+
+	/* add+remove+add before the ioloop runs */
+	io_read = io_add(fd[0], IO_READ, io_callback, (void *)NULL);
+	io_write = io_add(fd[0], IO_WRITE, io_callback, (void *)NULL);
+	io_remove(&io_write);
+	io_write = io_add(fd[0], IO_WRITE, io_callback_stop, &called);
+	io_loop_run(ioloop);
+	test_assert(called && !timed_out);
+
+	/* remove the write io, and then the whole fd as closed before the
+	   ioloop runs again. the same fd number gets reused. */
+	io_remove(&io_write);
+	io_remove_closed(&io_read);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd2) < 0)
+		i_fatal("socketpair() failed: %m");
+	called = FALSE;
+	io_write = io_add(fd2[0], IO_WRITE, io_callback_stop, &called);
+	io_loop_run(ioloop);
+	test_assert(called && !timed_out);
+
+	/* exclusive listener: readable only after the peer writes */
+	io_remove(&io_write);
+	called = FALSE;
+	io_read = io_add(fd2[0], IO_READ | IO_EXCLUSIVE,
+			 io_callback_stop, &called);
+	if (write(fd2[1], "x", 1) != 1)
+		i_fatal("write() failed: %m");
+	io_loop_run(ioloop);
+	test_assert(called && !timed_out);
+	io_remove(&io_read);
+
+	i_close_fd(&fd2[0]);
+	i_close_fd(&fd2[1]);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
+static void test_ioloop_fork(void)
+{
+	struct ioloop *ioloop;
+	struct io *io;
+	struct timeout *to, *to_armed;
+	int fd[2], status;
+	bool called = FALSE, armed = FALSE, timed_out = FALSE;
+	pid_t pid;
+
+	test_begin("ioloop fork");
+
+	ioloop = io_loop_create();
+	to = timeout_add(5000, io_callback_stop, &timed_out);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	io = io_add(fd[0], IO_READ, io_callback_stop, &called);
+
+	/* make sure the io is being waited on before forking */
+	to_armed = timeout_add_short(1, io_callback_stop, &armed);
+	io_loop_run(ioloop);
+	timeout_remove(&to_armed);
+	test_assert(armed && !called);
+
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		/* the child can keep using the ioloop */
+		if (write(fd[1], "x", 1) != 1)
+			i_fatal("write() failed: %m");
+		io_loop_run(ioloop);
+		_exit(called && !timed_out ? 0 : 1);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* the child didn't steal the parent's events */
+	io_loop_run(ioloop);
+	test_assert(called && !timed_out);
+
+	io_remove(&io);
+	i_close_fd(&fd[0]);
+	i_close_fd(&fd[1]);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
+static void test_ioloop_timeout_only(void)
+{
+	struct ioloop *ioloop;
+	struct timeout *to;
+	bool called = FALSE;
+
+	test_begin("ioloop timeout without ios");
+
+	ioloop = io_loop_create();
+	to = timeout_add_short(10, io_callback_stop, &called);
+	io_loop_run(ioloop);
+	test_assert(called);
+	timeout_remove(&to);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
 void test_ioloop(void)
 {
 	test_ioloop_timeout();
+	test_ioloop_timeout_only();
 	test_ioloop_find_fd_conditions();
+	test_ioloop_io_changes();
+	test_ioloop_fork();
 }
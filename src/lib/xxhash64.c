@@ -0,0 +1,172 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* Based on the xxHash algorithm specification by Yann Collet. */
+
+#include "lib.h"
+#include "xxhash64.h"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH_ROTL64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_init(struct xxh64_context *ctx, uint64_t seed)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->seed = seed;
+	ctx->v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	ctx->v2 = seed + XXH_PRIME64_2;
+	ctx->v3 = seed;
+	ctx->v4 = seed - XXH_PRIME64_1;
+}
+
+static const unsigned char *
+xxh64_update_stripes(struct xxh64_context *ctx, const unsigned char *p,
+		     const unsigned char *end)
+{
+	uint64_t v1 = ctx->v1, v2 = ctx->v2, v3 = ctx->v3, v4 = ctx->v4;
+
+	for (; p + 32 <= end; p += 32) {
+		v1 = xxh64_round(v1, xxh_read64(p));
+		v2 = xxh64_round(v2, xxh_read64(p + 8));
+		v3 = xxh64_round(v3, xxh_read64(p + 16));
+		v4 = xxh64_round(v4, xxh_read64(p + 24));
+	}
+	ctx->v1 = v1; ctx->v2 = v2; ctx->v3 = v3; ctx->v4 = v4;
+	return p;
+}
+
+void xxh64_update(struct xxh64_context *ctx, const void *data, size_t size)
+{
+	const unsigned char *p = data, *end = p + size;
+	size_t n;
+
+	ctx->total_len += size;
+
+	if (ctx->buffer_size > 0) {
+		/* fill the partial stripe first */
+		n = I_MIN(size, sizeof(ctx->buffer) - ctx->buffer_size);
+		memcpy(ctx->buffer + ctx->buffer_size, p, n);
+		ctx->buffer_size += n;
+		p += n;
+		if (ctx->buffer_size < sizeof(ctx->buffer))
+			return;
+		(void)xxh64_update_stripes(ctx, ctx->buffer,
+					   ctx->buffer + sizeof(ctx->buffer));
+		ctx->buffer_size = 0;
+	}
+
+	p = xxh64_update_stripes(ctx, p, end);
+	if (p < end) {
+		memcpy(ctx->buffer, p, end - p);
+		ctx->buffer_size = end - p;
+	}
+}
+
+uint64_t xxh64_final(struct xxh64_context *ctx)
+{
+	const unsigned char *p = ctx->buffer, *end = p + ctx->buffer_size;
+	uint64_t h;
+
+	if (ctx->total_len >= 32) {
+		h = XXH_ROTL64(ctx->v1, 1) + XXH_ROTL64(ctx->v2, 7) +
+			XXH_ROTL64(ctx->v3, 12) + XXH_ROTL64(ctx->v4, 18);
+		h = xxh64_merge_round(h, ctx->v1);
+		h = xxh64_merge_round(h, ctx->v2);
+		h = xxh64_merge_round(h, ctx->v3);
+		h = xxh64_merge_round(h, ctx->v4);
+	} else {
+		h = ctx->seed + XXH_PRIME64_5;
+	}
+	h += ctx->total_len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh64_round(0, xxh_read64(p));
+		h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+		h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed)
+{
+	struct xxh64_context ctx;
+
+	xxh64_init(&ctx, seed);
+	xxh64_update(&ctx, data, size);
+	return xxh64_final(&ctx);
+}
+
+static void hash_method_init_xxh64(void *context)
+{
+	xxh64_init(context, 0);
+}
+
+static void
+hash_method_loop_xxh64(void *context, const void *data, size_t size)
+{
+	xxh64_update(context, data, size);
+}
+
+static void hash_method_result_xxh64(void *context, unsigned char *result_r)
+{
+	uint64_t h = xxh64_final(context);
+	unsigned int i;
+
+	for (i = 0; i < XXH64_RESULTLEN; i++)
+		result_r[i] = (h >> (8 * (XXH64_RESULTLEN - 1 - i))) & 0xff;
+}
+
+const struct hash_method hash_method_xxh64 = {
+	"xxh64",
+	sizeof(struct xxh64_context),
+	XXH64_RESULTLEN,
+
+	hash_method_init_xxh64,
+	hash_method_loop_xxh64,
+	hash_method_result_xxh64
+};
@@ -0,0 +1,30 @@
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+#include "hash-method.h"
+
+/* xxHash64 - a fast non-cryptographic 64bit hash function. Don't use it for
+   anything where hash collisions could be triggered by an attacker to cause
+   harm, unless a secret random seed is used. */
+
+#define XXH64_RESULTLEN 8
+
+struct xxh64_context {
+	uint64_t v1, v2, v3, v4;
+	uint64_t seed;
+	uint64_t total_len;
+	unsigned char buffer[32];
+	unsigned int buffer_size;
+};
+
+void xxh64_init(struct xxh64_context *ctx, uint64_t seed);
+void xxh64_update(struct xxh64_context *ctx, const void *data, size_t size);
+uint64_t xxh64_final(struct xxh64_context *ctx) ATTR_PURE;
+
+uint64_t xxh64(const void *data, size_t size, uint64_t seed) ATTR_PURE;
+
+/* hash_method's digest is the hash in big endian, which is xxHash's
+   canonical representation. */
+extern const struct hash_method hash_method_xxh64;
+
+#endif
@@ -4,13 +4,12 @@
 #include "array.h"
 #include "hash.h"
 #include "hex-binary.h"
-#include "strescape.h"
 #include "message-part.h"
 #include "mail-namespace.h"
 #include "mail-storage-private.h"
+#include "mail-indexer.h"
 #include "fts-expunge-log.h"
 #include "lucene-wrapper.h"
-#include "fts-indexer.h"
 #include "fts-lucene-plugin.h"
 
 #include <wchar.h>
@@ -275,18 +274,10 @@ fts_backend_lucene_update_deinit(struct fts_backend_update_context *_ctx)
 		if (ctx->lucene_opened)
 			(void)fts_backend_optimize(_ctx->backend);
 		else if (ctx->first_box_vname != NULL) {
-			struct mail_user *user = backend->backend.ns->user;
-			const char *cmd, *path;
-			int fd;
-
 			/* the optimize affects all mailboxes within namespace,
 			   so just use any mailbox name in it */
-			cmd = t_strdup_printf("OPTIMIZE\t0\t%s\t%s\n",
-				str_tabescape(user->username),
-				str_tabescape(ctx->first_box_vname));
-			fd = fts_indexer_cmd(user, cmd, &path);
-			if (fd != -1)
-				i_close_fd(&fd);
+			(void)mail_indexer_optimize(backend->backend.ns->user,
+						    ctx->first_box_vname);
 		}
 	}
 
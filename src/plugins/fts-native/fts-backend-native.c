@@ -0,0 +1,957 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mailbox-list-iter.h"
+#include "mail-indexer.h"
+#include "mail-search.h"
+#include "fts-expunge-log.h"
+#include "fts-native-index.h"
+#include "fts-native-plugin.h"
+
+#define FTS_NATIVE_FILE_PREFIX "dovecot.index.native"
+#define FTS_NATIVE_USER_FILE_NAME "dovecot-native-user.index"
+#define FTS_NATIVE_EXPUNGE_LOG_NAME "dovecot-native-expunges.log"
+/* Request optimization after this many expunges */
+#define FTS_NATIVE_OPTIMIZE_EXPUNGES_COUNT 1000
+
+/* Terms are prefixed with the field they were found from: "b:" for body,
+   "h:" for any header and "h<name>:" for the headers that are indexed
+   separately.
+
+   With user_index all the mailboxes share the same index, and the terms
+   are additionally prefixed with the mailbox's box key (GUID and
+   UIDVALIDITY in hex). The mailbox's last indexed UID is then the highest
+   UID of its "u:<box key>" term. The field comes first there, so the
+   mailbox's expunged UIDs are never removed from it. */
+#define FTS_NATIVE_FIELD_BODY "b:"
+#define FTS_NATIVE_FIELD_HEADER "h:"
+#define FTS_NATIVE_FIELD_LAST_UID "u:"
+#define FTS_NATIVE_BOX_KEY_LEN (MAILBOX_GUID_HEX_LENGTH + 8)
+
+struct native_fts_backend {
+	struct fts_backend backend;
+
+	struct mailbox *box;
+	guid_128_t box_guid;
+	/* prefix for the box's terms. empty without user_index. */
+	string_t *box_key;
+	/* the current mailbox's index, or with user_index the shared one */
+	struct fts_native_index *index;
+	struct fts_expunge_log *expunge_log;
+
+	bool refresh;
+	bool user_index;
+};
+
+struct native_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+	struct fts_native_segment_builder *builder;
+	struct fts_expunge_log_append_ctx *expunge_ctx;
+	char *first_box_vname;
+
+	uint32_t uid, last_uid;
+	/* field prefixes for the current build key. hdr_field is empty if
+	   the header isn't indexed separately. */
+	const char *field;
+	string_t *hdr_field;
+	string_t *token, *term;
+
+	bool failed;
+	bool need_optimize;
+};
+
+static struct fts_backend *fts_backend_native_alloc(void)
+{
+	struct native_fts_backend *backend;
+
+	backend = i_new(struct native_fts_backend, 1);
+	backend->backend = fts_backend_native;
+	backend->box_key = str_new(default_pool, FTS_NATIVE_BOX_KEY_LEN + 1);
+	return &backend->backend;
+}
+
+static void
+fts_backend_native_get_index_settings(struct native_fts_backend *backend,
+				      const struct mailbox_permissions *perm,
+				      struct mail_storage *storage,
+				      struct fts_native_index_settings *set_r)
+{
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT(backend->backend.ns->user);
+
+	memset(set_r, 0, sizeof(*set_r));
+	set_r->file.mode = perm->file_create_mode;
+	set_r->file.gid = perm->file_create_gid;
+	set_r->file.gid_origin = perm->file_create_gid_origin;
+	set_r->file.fsync_mode = storage->set->parsed_fsync_mode;
+	set_r->file.mmap_disable = storage->set->mmap_disable;
+	set_r->nfs_flush = storage->set->mail_nfs_index;
+	set_r->dotlock_use_excl = storage->set->dotlock_use_excl;
+	set_r->merge_factor = fuser->set.merge_factor;
+	set_r->max_segments = fuser->set.max_segments;
+	if (fuser->set.user_index)
+		set_r->expunge_prefix_len = FTS_NATIVE_BOX_KEY_LEN;
+}
+
+static int
+fts_backend_native_init(struct fts_backend *_backend, const char **error_r)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT(_backend->ns->user);
+	struct mailbox_permissions perm;
+	struct fts_native_index_settings set;
+	const char *path;
+
+	if (fuser == NULL) {
+		*error_r = "Invalid fts_native setting";
+		return -1;
+	}
+	path = mailbox_list_get_root_forced(_backend->ns->list,
+					    MAILBOX_LIST_PATH_TYPE_INDEX);
+	backend->expunge_log = fts_expunge_log_init(
+		t_strconcat(path, "/"FTS_NATIVE_EXPUNGE_LOG_NAME, NULL));
+
+	if (fuser->set.user_index) {
+		mailbox_list_get_root_permissions(_backend->ns->list, &perm);
+		fts_backend_native_get_index_settings(backend, &perm,
+						      _backend->ns->storage,
+						      &set);
+		backend->index = fts_native_index_init(
+			t_strconcat(path, "/"FTS_NATIVE_USER_FILE_NAME, NULL),
+			0, &set);
+		backend->user_index = TRUE;
+		backend->refresh = TRUE;
+	}
+	return 0;
+}
+
+static void
+fts_backend_native_unset_box(struct native_fts_backend *backend)
+{
+	if (backend->index != NULL && !backend->user_index)
+		fts_native_index_deinit(&backend->index);
+	backend->box = NULL;
+}
+
+static void fts_backend_native_deinit(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	fts_backend_native_unset_box(backend);
+	if (backend->index != NULL)
+		fts_native_index_deinit(&backend->index);
+	if (backend->expunge_log != NULL)
+		fts_expunge_log_deinit(&backend->expunge_log);
+	str_free(&backend->box_key);
+	i_free(backend);
+}
+
+static void
+fts_backend_native_set_box(struct native_fts_backend *backend,
+			   struct mailbox *box)
+{
+	struct mailbox_status status;
+	struct mailbox_metadata metadata;
+	struct fts_native_index_settings set;
+	const char *path;
+
+	if (backend->box == box)
+		return;
+	fts_backend_native_unset_box(backend);
+	if (box == NULL)
+		return;
+
+	mailbox_get_open_status(box, STATUS_UIDVALIDITY, &status);
+	if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID, &metadata) < 0) {
+		/* expunges just can't be written to the log */
+		guid_128_empty(backend->box_guid);
+	} else {
+		memcpy(backend->box_guid, metadata.guid,
+		       sizeof(backend->box_guid));
+	}
+	backend->box = box;
+
+	if (backend->user_index) {
+		str_truncate(backend->box_key, 0);
+		if (guid_128_is_empty(backend->box_guid)) {
+			i_error("fts-native: Couldn't get GUID for mailbox %s: %s",
+				box->vname, mailbox_get_last_error(box, NULL));
+		} else {
+			str_printfa(backend->box_key, "%s%08x",
+				    guid_128_to_string(backend->box_guid),
+				    status.uidvalidity);
+		}
+		return;
+	}
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+		i_unreached(); /* fts already checked this */
+	fts_backend_native_get_index_settings(backend,
+					      mailbox_get_permissions(box),
+					      mailbox_get_storage(box), &set);
+	backend->index = fts_native_index_init(
+		t_strconcat(path, "/"FTS_NATIVE_FILE_PREFIX, NULL),
+		status.uidvalidity, &set);
+	backend->refresh = TRUE;
+}
+
+static int
+fts_backend_native_refresh_box(struct native_fts_backend *backend,
+			       struct mailbox *box)
+{
+	fts_backend_native_set_box(backend, box);
+	if (backend->user_index && str_len(backend->box_key) == 0)
+		return -1;
+	if (backend->refresh) {
+		if (fts_native_index_refresh(backend->index) < 0)
+			return -1;
+		backend->refresh = FALSE;
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_get_box_last_uid(struct native_fts_backend *backend,
+				    uint32_t *last_uid_r)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const struct seq_range *range;
+	unsigned int count;
+	int ret;
+
+	if (!backend->user_index) {
+		*last_uid_r = fts_native_index_get_last_uid(backend->index);
+		return 0;
+	}
+
+	i_array_init(&uids, 8);
+	ret = fts_native_index_lookup(backend->index,
+		t_strconcat(FTS_NATIVE_FIELD_LAST_UID,
+			    str_c(backend->box_key), NULL), &uids);
+	range = array_get(&uids, &count);
+	*last_uid_r = count == 0 ? 0 : range[count-1].seq2;
+	array_free(&uids);
+	return ret;
+}
+
+static int
+fts_backend_native_get_last_uid(struct fts_backend *_backend,
+				struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	backend->refresh = TRUE;
+	if (fts_backend_native_refresh_box(backend, box) < 0)
+		return -1;
+	return fts_backend_native_get_box_last_uid(backend, last_uid_r);
+}
+
+static struct fts_backend_update_context *
+fts_backend_native_update_init(struct fts_backend *_backend)
+{
+	struct native_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct native_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	ctx->builder = fts_native_segment_builder_init();
+	ctx->hdr_field = str_new(default_pool, 64);
+	ctx->token = str_new(default_pool, 128);
+	ctx->term = str_new(default_pool, 128);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_native_commit(struct native_fts_backend_update_context *ctx,
+			  uint32_t last_uid)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+	uint32_t indexed_uid;
+	int ret;
+
+	if (backend->box == NULL ||
+	    (backend->user_index && str_len(backend->box_key) == 0))
+		return 0;
+
+	if (backend->user_index) {
+		/* the last indexed UID is written to the same segment
+		   as the box's terms, so they're committed atomically */
+		if (fts_backend_native_get_box_last_uid(backend,
+							&indexed_uid) < 0)
+			return -1;
+		if (last_uid > indexed_uid) {
+			fts_native_segment_builder_add(ctx->builder,
+				t_strconcat(FTS_NATIVE_FIELD_LAST_UID,
+					    str_c(backend->box_key), NULL),
+				last_uid);
+		}
+		last_uid = 0;
+	}
+	ret = fts_native_index_commit(backend->index, ctx->builder, last_uid);
+	if (ret == 0 && !ctx->need_optimize)
+		ctx->need_optimize = fts_native_index_need_optimize(backend->index);
+	return ret;
+}
+
+static void
+fts_backend_native_request_optimize(struct native_fts_backend_update_context *ctx)
+{
+	/* the optimize affects all mailboxes within namespace,
+	   so just use any mailbox name in it */
+	(void)mail_indexer_optimize(ctx->ctx.backend->ns->user,
+				    ctx->first_box_vname);
+}
+
+static int
+fts_backend_native_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_ctx->backend;
+	unsigned int expunges;
+	int ret = ctx->failed ? -1 : 0;
+
+	if (fts_backend_native_commit(ctx, ctx->last_uid) < 0)
+		ret = -1;
+	if (ctx->expunge_ctx != NULL) {
+		if (fts_expunge_log_append_commit(&ctx->expunge_ctx) < 0)
+			ret = -1;
+	}
+	if (!ctx->need_optimize &&
+	    fts_expunge_log_uid_count(backend->expunge_log, &expunges) == 0)
+		ctx->need_optimize = expunges >= FTS_NATIVE_OPTIMIZE_EXPUNGES_COUNT;
+	if (ctx->need_optimize && ctx->first_box_vname != NULL)
+		fts_backend_native_request_optimize(ctx);
+
+	fts_native_segment_builder_deinit(&ctx->builder);
+	i_free(ctx->first_box_vname);
+	str_free(&ctx->hdr_field);
+	str_free(&ctx->token);
+	str_free(&ctx->term);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_native_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				      struct mailbox *box)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+
+	if (fts_backend_native_commit(ctx, ctx->last_uid) < 0)
+		ctx->failed = TRUE;
+	fts_backend_native_set_box(backend, box);
+	if (box != NULL && backend->user_index &&
+	    str_len(backend->box_key) == 0)
+		ctx->failed = TRUE;
+	if (ctx->first_box_vname == NULL && box != NULL)
+		ctx->first_box_vname = i_strdup(box->vname);
+	ctx->uid = ctx->last_uid = 0;
+}
+
+static void
+fts_backend_native_update_expunge(struct fts_backend_update_context *_ctx,
+				  uint32_t uid)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_ctx->backend;
+	uint32_t last_uid;
+
+	/* the expunged UIDs are written to the index only by the next
+	   optimization. until then lookups may return them, but since they
+	   don't map to any existing messages they're just ignored. */
+	if (guid_128_is_empty(backend->box_guid))
+		return;
+	if (fts_backend_native_refresh_box(backend, backend->box) < 0 ||
+	    fts_backend_native_get_box_last_uid(backend, &last_uid) < 0) {
+		ctx->failed = TRUE;
+		return;
+	}
+	if (uid > last_uid) {
+		/* not indexed */
+		return;
+	}
+
+	if (ctx->expunge_ctx == NULL) {
+		ctx->expunge_ctx =
+			fts_expunge_log_append_begin(backend->expunge_log);
+	}
+	fts_expunge_log_append_next(ctx->expunge_ctx, backend->box_guid, uid);
+}
+
+static bool
+fts_backend_native_update_set_build_key(struct fts_backend_update_context *_ctx,
+					const struct fts_backend_build_key *key)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	if (ctx->failed)
+		return FALSE;
+
+	str_truncate(ctx->hdr_field, 0);
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+		if (key->hdr_name[0] == '\0') {
+			/* header name itself - not useful */
+			return FALSE;
+		}
+		ctx->field = FTS_NATIVE_FIELD_HEADER;
+		if (fts_header_want_indexed(key->hdr_name)) {
+			str_append_c(ctx->hdr_field, 'h');
+			str_append(ctx->hdr_field, t_str_lcase(key->hdr_name));
+			str_append_c(ctx->hdr_field, ':');
+		}
+		break;
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+		if (key->hdr_name[0] == '\0')
+			return FALSE;
+		/* MIME part headers are part of the message body */
+		ctx->field = FTS_NATIVE_FIELD_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		ctx->field = FTS_NATIVE_FIELD_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	ctx->uid = key->uid;
+	if (key->uid > ctx->last_uid)
+		ctx->last_uid = key->uid;
+	return TRUE;
+}
+
+static void
+fts_backend_native_update_unset_build_key(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	ctx->field = NULL;
+	str_truncate(ctx->hdr_field, 0);
+}
+
+static void
+fts_backend_native_add_term(struct native_fts_backend_update_context *ctx,
+			    const char *field)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+
+	str_truncate(ctx->term, 0);
+	str_append_str(ctx->term, backend->box_key);
+	str_append(ctx->term, field);
+	str_append_str(ctx->term, ctx->token);
+	fts_native_segment_builder_add(ctx->builder, str_c(ctx->term),
+				       ctx->uid);
+}
+
+static int
+fts_backend_native_update_build_more(struct fts_backend_update_context *_ctx,
+				     const unsigned char *data, size_t size)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT(_ctx->backend->ns->user);
+	struct mail_user *user = _ctx->backend->ns->user;
+
+	i_assert(ctx->field != NULL);
+
+	if (ctx->failed)
+		return -1;
+
+	/* the input is a single token */
+	str_truncate(ctx->token, 0);
+	if (user->default_normalizer(data, size, ctx->token) < 0 ||
+	    str_len(ctx->token) == 0)
+		return 0;
+
+	fts_backend_native_add_term(ctx, ctx->field);
+	if (str_len(ctx->hdr_field) > 0)
+		fts_backend_native_add_term(ctx, str_c(ctx->hdr_field));
+
+	if (fts_native_segment_builder_get_memory_usage(ctx->builder) >=
+	    fuser->set.buffer_size) {
+		/* the current message isn't finished yet */
+		if (fts_backend_native_commit(ctx, ctx->uid - 1) < 0) {
+			ctx->failed = TRUE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int fts_backend_native_refresh(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	backend->refresh = TRUE;
+	return 0;
+}
+
+static int
+fts_backend_native_foreach_box(struct native_fts_backend *backend,
+			       int (*callback)(struct native_fts_backend *backend,
+					       void *context),
+			       void *context)
+{
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(backend->backend.ns->list, "*",
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NONEXISTENT | MAILBOX_NOSELECT)) != 0)
+			continue;
+
+		box = mailbox_alloc(info->ns->list, info->vname, 0);
+		if (mailbox_open(box) == 0) {
+			fts_backend_native_set_box(backend, box);
+			if (callback(backend, context) < 0)
+				ret = -1;
+			fts_backend_native_set_box(backend, NULL);
+		} else if (mailbox_get_last_mail_error(box) != MAIL_ERROR_NOTFOUND) {
+			i_error("fts-native: Couldn't open mailbox %s: %s",
+				box->vname, mailbox_get_last_error(box, NULL));
+			ret = -1;
+		}
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int
+fts_backend_native_reset_box(struct native_fts_backend *backend,
+			     void *context ATTR_UNUSED)
+{
+	return fts_native_index_reset(backend->index);
+}
+
+static int fts_backend_native_rescan(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	/* we can't know which mails are missing from the index, so just
+	   rebuild everything */
+	if (backend->user_index)
+		return fts_native_index_reset(backend->index);
+	return fts_backend_native_foreach_box(backend,
+					      fts_backend_native_reset_box,
+					      NULL);
+}
+
+struct native_fts_optimize_context {
+	pool_t pool;
+	/* mailbox GUID -> expunged UIDs */
+	HASH_TABLE(uint8_t *, ARRAY_TYPE(seq_range) *) expunges;
+	struct fts_expunge_log_append_ctx *failed_ctx;
+
+	/* with user_index the box keys of all the existing mailboxes */
+	HASH_TABLE(char *, char *) box_keys;
+	/* the previous term's box key, and whether it exists */
+	char last_box_key[FTS_NATIVE_BOX_KEY_LEN + 1];
+	bool last_box_key_exists;
+};
+
+static int
+fts_backend_native_optimize_box(struct native_fts_backend *backend,
+				void *context)
+{
+	struct native_fts_optimize_context *ctx = context;
+	const uint8_t *guid_p = backend->box_guid;
+	ARRAY_TYPE(seq_range) *uids;
+	const struct seq_range *range;
+
+	uids = hash_table_lookup(ctx->expunges, guid_p);
+	if (uids != NULL)
+		fts_native_index_expunge(backend->index, "", uids);
+	if (fts_native_index_refresh(backend->index) == 0 &&
+	    fts_native_index_optimize(backend->index, NULL, NULL) == 0)
+		return 0;
+
+	if (uids != NULL) {
+		/* put the expunges back to the log, so they get
+		   retried later */
+		if (ctx->failed_ctx == NULL) {
+			ctx->failed_ctx =
+				fts_expunge_log_append_begin(backend->expunge_log);
+		}
+		array_foreach(uids, range) {
+			fts_expunge_log_append_range(ctx->failed_ctx,
+						     backend->box_guid, range);
+		}
+	}
+	return -1;
+}
+
+static int
+fts_backend_native_optimize_user_box(struct native_fts_backend *backend,
+				     void *context)
+{
+	struct native_fts_optimize_context *ctx = context;
+	const uint8_t *guid_p = backend->box_guid;
+	ARRAY_TYPE(seq_range) *uids;
+	char *box_key;
+
+	if (str_len(backend->box_key) == 0)
+		return -1;
+	box_key = p_strdup(ctx->pool, str_c(backend->box_key));
+	hash_table_insert(ctx->box_keys, box_key, box_key);
+
+	uids = hash_table_lookup(ctx->expunges, guid_p);
+	if (uids != NULL)
+		fts_native_index_expunge(backend->index, box_key, uids);
+	return 0;
+}
+
+static bool
+fts_backend_native_filter_term(const char *term, void *context)
+{
+	struct native_fts_optimize_context *ctx = context;
+	const char *box_key = term, *last_box_key = ctx->last_box_key;
+
+	if (strncmp(term, FTS_NATIVE_FIELD_LAST_UID,
+		    strlen(FTS_NATIVE_FIELD_LAST_UID)) == 0)
+		box_key += strlen(FTS_NATIVE_FIELD_LAST_UID);
+	if (strlen(box_key) < FTS_NATIVE_BOX_KEY_LEN)
+		return TRUE;
+
+	/* the terms are sorted, so the same box key is usually repeated */
+	if (memcmp(box_key, ctx->last_box_key, FTS_NATIVE_BOX_KEY_LEN) != 0) {
+		memcpy(ctx->last_box_key, box_key, FTS_NATIVE_BOX_KEY_LEN);
+		ctx->last_box_key_exists =
+			hash_table_lookup(ctx->box_keys, last_box_key) != NULL;
+	}
+	/* mailbox is deleted or its UIDVALIDITY changed */
+	return ctx->last_box_key_exists;
+}
+
+static int
+fts_backend_native_optimize_user(struct native_fts_backend *backend,
+				 struct native_fts_optimize_context *ctx)
+{
+	struct hash_iterate_context *iter;
+	struct fts_expunge_log_append_ctx *append_ctx;
+	ARRAY_TYPE(seq_range) *uids;
+	const struct seq_range *range;
+	uint8_t *guid_p;
+	bool all_boxes;
+	int ret;
+
+	/* the expunged UIDs are kept in the shared index separately for each
+	   box key, so only the merged segments need to be rewritten. the
+	   terms of the mailboxes that no longer exist are dropped while
+	   merging, but only if all the mailboxes could be listed. */
+	if (fts_native_index_refresh(backend->index) < 0)
+		ret = -1;
+	else {
+		all_boxes = fts_backend_native_foreach_box(backend,
+				fts_backend_native_optimize_user_box, ctx) == 0;
+		ret = fts_native_index_optimize(backend->index,
+			all_boxes ? fts_backend_native_filter_term : NULL, ctx);
+	}
+	if (ret == 0 || hash_table_count(ctx->expunges) == 0)
+		return ret;
+
+	/* put the expunges back to the log, so they get retried later */
+	append_ctx = fts_expunge_log_append_begin(backend->expunge_log);
+	iter = hash_table_iterate_init(ctx->expunges);
+	while (hash_table_iterate(iter, ctx->expunges, &guid_p, &uids)) {
+		array_foreach(uids, range)
+			fts_expunge_log_append_range(append_ctx, guid_p, range);
+	}
+	hash_table_iterate_deinit(&iter);
+	(void)fts_expunge_log_append_commit(&append_ctx);
+	return -1;
+}
+
+static int
+fts_backend_native_read_expunges(struct native_fts_backend *backend,
+				 struct native_fts_optimize_context *ctx)
+{
+	struct fts_expunge_log_read_ctx *read_ctx;
+	const struct fts_expunge_log_read_record *rec;
+	ARRAY_TYPE(seq_range) *uids;
+	const uint8_t *rec_guid_p;
+	uint8_t *guid_p;
+
+	read_ctx = fts_expunge_log_read_begin(backend->expunge_log);
+	while ((rec = fts_expunge_log_read_next(read_ctx)) != NULL) {
+		rec_guid_p = rec->mailbox_guid;
+		uids = hash_table_lookup(ctx->expunges, rec_guid_p);
+		if (uids == NULL) {
+			guid_p = p_malloc(ctx->pool, GUID_128_SIZE);
+			memcpy(guid_p, rec->mailbox_guid, GUID_128_SIZE);
+			uids = p_new(ctx->pool, ARRAY_TYPE(seq_range), 1);
+			p_array_init(uids, ctx->pool, 32);
+			hash_table_insert(ctx->expunges, guid_p, uids);
+		}
+		seq_range_array_merge(uids, &rec->uids);
+	}
+	/* a corrupted log only means that some expunged messages stay in
+	   the segments for longer. they're never returned as matches. */
+	return fts_expunge_log_read_end(&read_ctx) < 0 ? -1 : 0;
+}
+
+static int fts_backend_native_optimize(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	struct native_fts_optimize_context ctx;
+	int ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pool = pool_alloconly_create("fts native optimize", 1024);
+	hash_table_create(&ctx.expunges, ctx.pool, 0,
+			  guid_128_hash, guid_128_cmp);
+	hash_table_create(&ctx.box_keys, ctx.pool, 0, str_hash, strcmp);
+
+	/* the expunge log is unlinked after it's fully read. expunges for
+	   mailboxes that no longer exist are simply dropped. */
+	ret = fts_backend_native_read_expunges(backend, &ctx);
+	if (backend->user_index) {
+		if (fts_backend_native_optimize_user(backend, &ctx) < 0)
+			ret = -1;
+	} else if (fts_backend_native_foreach_box(backend,
+						  fts_backend_native_optimize_box,
+						  &ctx) < 0)
+		ret = -1;
+	if (ctx.failed_ctx != NULL)
+		(void)fts_expunge_log_append_commit(&ctx.failed_ctx);
+
+	hash_table_destroy(&ctx.expunges);
+	hash_table_destroy(&ctx.box_keys);
+	pool_unref(&ctx.pool);
+	return ret;
+}
+
+static int
+native_lookup_arg(struct native_fts_backend *backend,
+		  const struct mail_search_arg *arg, bool and_args,
+		  enum fts_lookup_flags flags,
+		  ARRAY_TYPE(seq_range) *definite_uids,
+		  ARRAY_TYPE(seq_range) *maybe_uids)
+{
+	ARRAY_TYPE(seq_range) uids, tmp_definite_uids, tmp_maybe_uids;
+	const char *fields[3];
+	string_t *token, *prefix;
+	uint32_t last_uid;
+	unsigned int i;
+	bool maybe = (flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) != 0;
+	int ret = 0;
+
+	memset(fields, 0, sizeof(fields));
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		fields[0] = FTS_NATIVE_FIELD_HEADER;
+		fields[1] = FTS_NATIVE_FIELD_BODY;
+		break;
+	case SEARCH_BODY:
+		fields[0] = FTS_NATIVE_FIELD_BODY;
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		if (fts_header_want_indexed(arg->hdr_field_name)) {
+			fields[0] = t_strdup_printf("h%s:",
+				t_str_lcase(arg->hdr_field_name));
+		} else {
+			/* this only tells which mails have the token in
+			   some header */
+			fields[0] = FTS_NATIVE_FIELD_HEADER;
+			maybe = TRUE;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	token = t_str_new(128);
+	if (backend->backend.ns->user->default_normalizer(arg->value.str,
+			strlen(arg->value.str), token) < 0 ||
+	    str_len(token) == 0) {
+		/* let the regular search handle it */
+		return 0;
+	}
+
+	i_array_init(&uids, 128);
+	prefix = t_str_new(128);
+	for (i = 0; fields[i] != NULL && ret == 0; i++) {
+		str_truncate(prefix, 0);
+		str_append_str(prefix, backend->box_key);
+		str_append(prefix, fields[i]);
+		str_append_str(prefix, token);
+		ret = fts_native_index_lookup(backend->index, str_c(prefix),
+					      &uids);
+	}
+	if (ret == 0 && arg->match_not &&
+	    fts_backend_native_get_box_last_uid(backend, &last_uid) < 0)
+		ret = -1;
+	if (ret < 0) {
+		array_free(&uids);
+		return -1;
+	}
+
+	i_array_init(&tmp_definite_uids, 128);
+	i_array_init(&tmp_maybe_uids, 128);
+	if (!arg->match_not) {
+		seq_range_array_merge(maybe ? &tmp_maybe_uids :
+				      &tmp_definite_uids, &uids);
+	} else {
+		/* matches -> non-match (or maybe)
+		   non-matches -> definite */
+		if (last_uid > 0) {
+			seq_range_array_add_range(&tmp_definite_uids,
+						  1, last_uid);
+		}
+		seq_range_array_remove_seq_range(&tmp_definite_uids, &uids);
+		if (maybe)
+			seq_range_array_merge(&tmp_maybe_uids, &uids);
+	}
+	array_free(&uids);
+
+	if (and_args) {
+		/* AND:
+		   definite && definite -> definite
+		   definite && maybe -> maybe
+		   maybe && maybe -> maybe */
+
+		/* put definites among maybies, so they can be intersected */
+		seq_range_array_merge(maybe_uids, definite_uids);
+		seq_range_array_merge(&tmp_maybe_uids, &tmp_definite_uids);
+
+		seq_range_array_intersect(maybe_uids, &tmp_maybe_uids);
+		seq_range_array_intersect(definite_uids, &tmp_definite_uids);
+		/* remove duplicate maybies that are also definites */
+		seq_range_array_remove_seq_range(maybe_uids, definite_uids);
+	} else {
+		/* OR:
+		   definite || definite -> definite
+		   definite || maybe -> definite
+		   maybe || maybe -> maybe */
+
+		/* remove maybies that are now definites */
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 definite_uids);
+		seq_range_array_remove_seq_range(maybe_uids,
+						 &tmp_definite_uids);
+
+		seq_range_array_merge(definite_uids, &tmp_definite_uids);
+		seq_range_array_merge(maybe_uids, &tmp_maybe_uids);
+	}
+
+	array_free(&tmp_definite_uids);
+	array_free(&tmp_maybe_uids);
+	return 1;
+}
+
+static int
+fts_backend_native_lookup(struct fts_backend *_backend, struct mailbox *box,
+			  struct mail_search_arg *args,
+			  enum fts_lookup_flags flags,
+			  struct fts_result *result)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool first = TRUE;
+	int ret;
+
+	if (fts_backend_native_refresh_box(backend, box) < 0)
+		return -1;
+
+	for (; args != NULL; args = args->next) {
+		T_BEGIN {
+			ret = native_lookup_arg(backend, args,
+						first ? FALSE : and_args,
+						flags, &result->definite_uids,
+						&result->maybe_uids);
+		} T_END;
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			args->match_always = TRUE;
+			first = FALSE;
+		}
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_lookup_multi(struct fts_backend *_backend,
+				struct mailbox *const boxes[],
+				struct mail_search_arg *args,
+				enum fts_lookup_flags flags,
+				struct fts_multi_result *result)
+{
+	struct fts_result *box_result;
+	unsigned int i, count;
+
+	/* with user_index all the mailboxes are looked up from the same
+	   index, which is refreshed only once */
+	for (count = 0; boxes[count] != NULL; count++) ;
+	result->box_results = p_new(result->pool, struct fts_result, count+1);
+
+	for (i = 0; i < count; i++) {
+		box_result = &result->box_results[i];
+		box_result->box = boxes[i];
+		p_array_init(&box_result->definite_uids, result->pool, 32);
+		p_array_init(&box_result->maybe_uids, result->pool, 32);
+		p_array_init(&box_result->scores, result->pool, 32);
+		if (fts_backend_native_lookup(_backend, boxes[i], args,
+					      flags, box_result) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct fts_backend fts_backend_native = {
+	.name = "native",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+
+	{
+		fts_backend_native_alloc,
+		fts_backend_native_init,
+		fts_backend_native_deinit,
+		fts_backend_native_get_last_uid,
+		fts_backend_native_update_init,
+		fts_backend_native_update_deinit,
+		fts_backend_native_update_set_mailbox,
+		fts_backend_native_update_expunge,
+		fts_backend_native_update_set_build_key,
+		fts_backend_native_update_unset_build_key,
+		fts_backend_native_update_build_more,
+		fts_backend_native_refresh,
+		fts_backend_native_rescan,
+		fts_backend_native_optimize,
+		fts_backend_default_can_lookup,
+		fts_backend_native_lookup,
+		fts_backend_native_lookup_multi,
+		NULL
+	}
+};
@@ -0,0 +1,1394 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "strnum.h"
+#include "bsearch-insert-pos.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "file-dotlock.h"
+#include "nfs-workarounds.h"
+#include "fts-native-index.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define FTS_NATIVE_LIST_MAGIC 0x494e5446
+#define FTS_NATIVE_LIST_VERSION 2
+
+#define FTS_NATIVE_INDEX_LOCK_TIMEOUT 60
+#define FTS_NATIVE_INDEX_DOTLOCK_STALE_TIMEOUT (15*60)
+
+/* Segments up to this size are on the lowest merge level. Each following
+   level contains segments that are merge_factor times larger. */
+#define FTS_NATIVE_MERGE_MIN_SIZE (64*1024)
+/* Rewrite a segment during optimization if at least this many percent of
+   the UIDs in its range have been expunged. */
+#define FTS_NATIVE_EXPUNGED_REWRITE_PERCENT 20
+
+struct fts_native_list_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t uidvalidity;
+	uint32_t last_uid;
+	uint32_t next_segment_id;
+	uint32_t segment_count;
+	/* number of term prefixes with expunged UIDs */
+	uint32_t expunged_count;
+	/* uint32_t segment_ids[segment_count];
+	   expunged_count times:
+	     uint32_t prefix_len, range_count;
+	     char prefix[prefix_len], padded to 32bit alignment with NULs;
+	     struct seq_range uids[range_count]; */
+};
+
+struct fts_native_expunged {
+	/* the UIDs are expunged from the terms beginning with this prefix */
+	char *prefix;
+	ARRAY_TYPE(seq_range) uids;
+};
+ARRAY_DEFINE_TYPE(fts_native_expunged, struct fts_native_expunged);
+
+struct fts_native_list {
+	uint32_t uidvalidity;
+	uint32_t last_uid;
+	uint32_t next_segment_id;
+	/* oldest segment first */
+	ARRAY_TYPE(uint32_t) segment_ids;
+	/* sorted by prefix */
+	ARRAY_TYPE(fts_native_expunged) expunged;
+
+	/* set if reading the list failed because it was corrupted */
+	bool corrupted;
+};
+
+struct fts_native_index_segment {
+	uint32_t id;
+	struct fts_native_segment *segment;
+};
+ARRAY_DEFINE_TYPE(fts_native_index_segment, struct fts_native_index_segment);
+
+struct fts_native_segment_info {
+	uoff_t size;
+	/* 0 if the segment is empty */
+	uint32_t first_uid, last_uid;
+};
+ARRAY_DEFINE_TYPE(fts_native_segment_info, struct fts_native_segment_info);
+
+struct fts_native_index {
+	char *path;
+	uint32_t uidvalidity;
+	struct fts_native_index_settings set;
+	char *gid_origin;
+	struct dotlock_settings dotlock_set;
+
+	bool exists;
+	uint32_t last_uid;
+	ARRAY_TYPE(fts_native_index_segment) segments;
+	ARRAY_TYPE(fts_native_expunged) expunged;
+	/* added by fts_native_index_expunge(), not written yet */
+	ARRAY_TYPE(fts_native_expunged) pending_expunged;
+
+	/* set while fts_native_index_optimize() is running */
+	fts_native_index_filter_callback_t *filter_callback;
+	void *filter_context;
+};
+
+static int
+fts_native_expunged_cmp(const char *prefix,
+			const struct fts_native_expunged *expunged)
+{
+	return strcmp(prefix, expunged->prefix);
+}
+
+static struct fts_native_expunged *
+fts_native_expunged_find(ARRAY_TYPE(fts_native_expunged) *expunged,
+			 const char *prefix)
+{
+	return array_bsearch(expunged, prefix, fts_native_expunged_cmp);
+}
+
+static ARRAY_TYPE(seq_range) *
+fts_native_expunged_get(ARRAY_TYPE(fts_native_expunged) *expunged,
+			const char *prefix)
+{
+	struct fts_native_expunged *exp;
+	unsigned int idx;
+
+	if (array_bsearch_insert_pos(expunged, prefix,
+				     fts_native_expunged_cmp, &idx)) {
+		exp = array_idx_modifiable(expunged, idx);
+		return &exp->uids;
+	}
+
+	exp = array_insert_space(expunged, idx);
+	exp->prefix = i_strdup(prefix);
+	i_array_init(&exp->uids, 8);
+	return &exp->uids;
+}
+
+static void
+fts_native_expunged_delete(ARRAY_TYPE(fts_native_expunged) *expunged,
+			   unsigned int idx)
+{
+	struct fts_native_expunged *exp =
+		array_idx_modifiable(expunged, idx);
+
+	i_free(exp->prefix);
+	array_free(&exp->uids);
+	array_delete(expunged, idx, 1);
+}
+
+static void
+fts_native_expunged_clear(ARRAY_TYPE(fts_native_expunged) *expunged)
+{
+	while (array_count(expunged) > 0)
+		fts_native_expunged_delete(expunged, array_count(expunged)-1);
+}
+
+static void
+fts_native_expunged_merge(ARRAY_TYPE(fts_native_expunged) *dest,
+			  const ARRAY_TYPE(fts_native_expunged) *src)
+{
+	const struct fts_native_expunged *exp;
+
+	array_foreach(src, exp) {
+		seq_range_array_merge(fts_native_expunged_get(dest, exp->prefix),
+				      &exp->uids);
+	}
+}
+
+struct fts_native_index *
+fts_native_index_init(const char *path, uint32_t uidvalidity,
+		      const struct fts_native_index_settings *set)
+{
+	struct fts_native_index *index;
+
+	index = i_new(struct fts_native_index, 1);
+	index->path = i_strdup(path);
+	index->uidvalidity = uidvalidity;
+	index->set = *set;
+	index->gid_origin = i_strdup(set->file.gid_origin);
+	index->set.file.gid_origin = index->gid_origin;
+
+	index->dotlock_set.use_excl_lock = set->dotlock_use_excl;
+	index->dotlock_set.nfs_flush = set->nfs_flush;
+	index->dotlock_set.timeout = FTS_NATIVE_INDEX_LOCK_TIMEOUT;
+	index->dotlock_set.stale_timeout =
+		FTS_NATIVE_INDEX_DOTLOCK_STALE_TIMEOUT;
+
+	i_array_init(&index->segments, 8);
+	i_array_init(&index->expunged, 8);
+	i_array_init(&index->pending_expunged, 8);
+	return index;
+}
+
+static void fts_native_index_close_segments(struct fts_native_index *index)
+{
+	struct fts_native_index_segment *seg;
+
+	array_foreach_modifiable(&index->segments, seg) {
+		/* NULL if it was moved to a new list */
+		if (seg->segment != NULL)
+			fts_native_segment_close(&seg->segment);
+	}
+	array_clear(&index->segments);
+	fts_native_expunged_clear(&index->expunged);
+	index->exists = FALSE;
+	index->last_uid = 0;
+}
+
+void fts_native_index_deinit(struct fts_native_index **_index)
+{
+	struct fts_native_index *index = *_index;
+
+	*_index = NULL;
+	fts_native_index_close_segments(index);
+	fts_native_expunged_clear(&index->pending_expunged);
+	array_free(&index->segments);
+	array_free(&index->expunged);
+	array_free(&index->pending_expunged);
+	i_free(index->gid_origin);
+	i_free(index->path);
+	i_free(index);
+}
+
+static const char *
+fts_native_index_segment_path(struct fts_native_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s.%u", index->path, id);
+}
+
+static void
+fts_native_list_init(struct fts_native_index *index,
+		     struct fts_native_list *list)
+{
+	memset(list, 0, sizeof(*list));
+	list->uidvalidity = index->uidvalidity;
+	list->next_segment_id = 1;
+	i_array_init(&list->segment_ids, 8);
+	i_array_init(&list->expunged, 8);
+}
+
+static void fts_native_list_deinit(struct fts_native_list *list)
+{
+	fts_native_expunged_clear(&list->expunged);
+	array_free(&list->segment_ids);
+	array_free(&list->expunged);
+}
+
+static void
+fts_native_list_set_corrupted(struct fts_native_index *index,
+			      struct fts_native_list *list, const char *reason)
+{
+	list->corrupted = TRUE;
+	i_error("fts-native: Corrupted index %s: %s", index->path, reason);
+}
+
+static int
+fts_native_list_parse(struct fts_native_index *index,
+		      struct fts_native_list *list,
+		      const unsigned char *data, size_t size)
+{
+	const struct fts_native_list_header *hdr = (const void *)data;
+	const unsigned char *end = data + size;
+	const uint32_t *segment_ids, *counts;
+	const struct seq_range *ranges;
+	const char *prefix, *last_prefix = NULL;
+	ARRAY_TYPE(seq_range) *uids;
+	uint32_t prefix_len, range_count;
+	size_t prefix_size;
+	unsigned int i, j;
+
+	if (size < sizeof(*hdr) || hdr->magic != FTS_NATIVE_LIST_MAGIC ||
+	    hdr->version != FTS_NATIVE_LIST_VERSION) {
+		fts_native_list_set_corrupted(index, list, "Invalid header");
+		return -1;
+	}
+	if (hdr->segment_count > (size - sizeof(*hdr)) / sizeof(uint32_t)) {
+		fts_native_list_set_corrupted(index, list,
+					      "Invalid file size");
+		return -1;
+	}
+	list->uidvalidity = hdr->uidvalidity;
+	list->last_uid = hdr->last_uid;
+	list->next_segment_id = hdr->next_segment_id;
+
+	data += sizeof(*hdr);
+	if (hdr->segment_count > 0) {
+		segment_ids = (const void *)data;
+		array_append(&list->segment_ids, segment_ids,
+			     hdr->segment_count);
+		data += hdr->segment_count * sizeof(uint32_t);
+	}
+	for (i = 0; i < hdr->expunged_count; i++) {
+		if ((size_t)(end - data) < sizeof(uint32_t) * 2) {
+			fts_native_list_set_corrupted(index, list,
+						      "Invalid file size");
+			return -1;
+		}
+		counts = (const void *)data;
+		prefix_len = counts[0];
+		range_count = counts[1];
+		data += sizeof(uint32_t) * 2;
+
+		prefix_size = (prefix_len + sizeof(uint32_t) - 1) &
+			~(sizeof(uint32_t) - 1);
+		if (prefix_len != index->set.expunge_prefix_len ||
+		    (size_t)(end - data) < prefix_size ||
+		    range_count > (end - data - prefix_size) /
+		    sizeof(struct seq_range)) {
+			fts_native_list_set_corrupted(index, list,
+				"Invalid expunged UIDs header");
+			return -1;
+		}
+		prefix = t_strndup(data, prefix_len);
+		ranges = (const void *)(data + prefix_size);
+		data += prefix_size + range_count * sizeof(struct seq_range);
+
+		if (strlen(prefix) != prefix_len || range_count == 0 ||
+		    (last_prefix != NULL && strcmp(last_prefix, prefix) >= 0)) {
+			fts_native_list_set_corrupted(index, list,
+				"Invalid expunged UIDs prefix");
+			return -1;
+		}
+		for (j = 0; j < range_count; j++) {
+			if (ranges[j].seq1 > ranges[j].seq2 ||
+			    (j > 0 && ranges[j].seq1 <= ranges[j-1].seq2)) {
+				fts_native_list_set_corrupted(index, list,
+					"Invalid expunged UIDs");
+				return -1;
+			}
+		}
+		uids = fts_native_expunged_get(&list->expunged, prefix);
+		array_append(uids, ranges, range_count);
+		last_prefix = prefix;
+	}
+	if (data != end) {
+		fts_native_list_set_corrupted(index, list,
+					      "Invalid file size");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 1 if ok, 0 if list doesn't exist, -1 if error. list->corrupted is
+   set if the error was caused by a corrupted list. */
+static int
+fts_native_list_read(struct fts_native_index *index,
+		     struct fts_native_list *list)
+{
+	struct stat st;
+	void *data;
+	int fd, ret;
+
+	if (index->set.nfs_flush)
+		nfs_flush_file_handle_cache(index->path);
+	fd = open(index->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("open(%s) failed: %m", index->path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", index->path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_size > 1024*1024*16) {
+		fts_native_list_set_corrupted(index, list, "File too large");
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	data = i_malloc(st.st_size + 1);
+	ret = read_full(fd, data, st.st_size);
+	if (ret < 0)
+		i_error("read(%s) failed: %m", index->path);
+	else if (ret == 0) {
+		fts_native_list_set_corrupted(index, list, "File truncated");
+		ret = -1;
+	} else {
+		ret = fts_native_list_parse(index, list, data, st.st_size);
+	}
+	i_free(data);
+	i_close_fd(&fd);
+	return ret < 0 ? -1 : 1;
+}
+
+static int
+fts_native_list_write(struct fts_native_index *index, int fd,
+		      const struct fts_native_list *list)
+{
+	struct fts_native_list_header hdr;
+	const struct fts_native_expunged *exp;
+	uint32_t counts[2];
+	buffer_t *buf;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FTS_NATIVE_LIST_MAGIC;
+	hdr.version = FTS_NATIVE_LIST_VERSION;
+	hdr.uidvalidity = list->uidvalidity;
+	hdr.last_uid = list->last_uid;
+	hdr.next_segment_id = list->next_segment_id;
+	hdr.segment_count = array_count(&list->segment_ids);
+	array_foreach(&list->expunged, exp) {
+		if (array_count(&exp->uids) > 0)
+			hdr.expunged_count++;
+	}
+
+	buf = buffer_create_dynamic(default_pool, 256);
+	buffer_append(buf, &hdr, sizeof(hdr));
+	if (hdr.segment_count > 0) {
+		buffer_append(buf, array_idx(&list->segment_ids, 0),
+			      hdr.segment_count * sizeof(uint32_t));
+	}
+	array_foreach(&list->expunged, exp) {
+		if (array_count(&exp->uids) == 0)
+			continue;
+		counts[0] = strlen(exp->prefix);
+		counts[1] = array_count(&exp->uids);
+		buffer_append(buf, counts, sizeof(counts));
+		buffer_append(buf, exp->prefix, counts[0]);
+		if ((buf->used % sizeof(uint32_t)) != 0) {
+			buffer_append_zero(buf, sizeof(uint32_t) -
+					   buf->used % sizeof(uint32_t));
+		}
+		buffer_append(buf, array_idx(&exp->uids, 0),
+			      counts[1] * sizeof(struct seq_range));
+	}
+	if (write_full(fd, buf->data, buf->used) < 0) {
+		i_error("write(%s) failed: %m", index->path);
+		ret = -1;
+	} else if (index->set.file.fsync_mode != FSYNC_MODE_NEVER &&
+		   fdatasync(fd) < 0) {
+		i_error("fdatasync(%s) failed: %m", index->path);
+		ret = -1;
+	}
+	buffer_free(&buf);
+	return ret;
+}
+
+/* Write the list and replace the old one with it. The dotlock is released
+   in any case. Returns 0 if ok, -1 if error. */
+static int
+fts_native_list_replace(struct fts_native_index *index,
+			struct dotlock **dotlock, int fd,
+			const struct fts_native_list *list)
+{
+	if (fts_native_list_write(index, fd, list) < 0) {
+		file_dotlock_delete(dotlock);
+		return -1;
+	}
+	if (file_dotlock_replace(dotlock, 0) < 0) {
+		i_error("file_dotlock_replace(%s) failed: %m", index->path);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+fts_native_index_unlink_segments(struct fts_native_index *index,
+				 const ARRAY_TYPE(uint32_t) *ids)
+{
+	const uint32_t *idp;
+	const char *path;
+
+	array_foreach(ids, idp) {
+		path = fts_native_index_segment_path(index, *idp);
+		if (unlink(path) < 0 && errno != ENOENT)
+			i_error("unlink(%s) failed: %m", path);
+	}
+}
+
+static struct fts_native_segment *
+fts_native_index_find_segment(struct fts_native_index *index, uint32_t id)
+{
+	struct fts_native_index_segment *seg;
+	struct fts_native_segment *segment;
+
+	array_foreach_modifiable(&index->segments, seg) {
+		if (seg->id == id) {
+			segment = seg->segment;
+			seg->segment = NULL;
+			return segment;
+		}
+	}
+	return NULL;
+}
+
+/* Open the segments in the list, reusing the already opened ones.
+   Returns 1 if ok, 0 if some segment no longer exists, -1 if error.
+   If the error was caused by a corrupted segment, *corrupted_id_r is set to
+   its ID. */
+static int
+fts_native_index_set_list(struct fts_native_index *index,
+			  const struct fts_native_list *list,
+			  uint32_t *corrupted_id_r)
+{
+	ARRAY_TYPE(fts_native_index_segment) segments;
+	struct fts_native_index_segment *seg;
+	const uint32_t *idp;
+	bool corrupted;
+	int ret = 1;
+
+	*corrupted_id_r = 0;
+	i_array_init(&segments, array_count(&list->segment_ids) + 1);
+	array_foreach(&list->segment_ids, idp) {
+		seg = array_append_space(&segments);
+		seg->id = *idp;
+		seg->segment = fts_native_index_find_segment(index, *idp);
+		if (seg->segment != NULL &&
+		    fts_native_segment_is_replaced(seg->segment)) {
+			/* the index was recreated by someone else */
+			fts_native_segment_close(&seg->segment);
+		}
+		if (seg->segment == NULL) {
+			ret = fts_native_segment_open(
+				fts_native_index_segment_path(index, *idp),
+				index->set.file.mmap_disable, &seg->segment,
+				&corrupted);
+			if (ret <= 0) {
+				if (corrupted)
+					*corrupted_id_r = *idp;
+				array_delete(&segments,
+					     array_count(&segments)-1, 1);
+				break;
+			}
+		}
+	}
+	fts_native_index_close_segments(index);
+	array_free(&index->segments);
+	index->segments = segments;
+
+	if (ret <= 0) {
+		fts_native_index_close_segments(index);
+		return ret;
+	}
+	fts_native_expunged_merge(&index->expunged, &list->expunged);
+	index->last_uid = list->last_uid;
+	index->exists = TRUE;
+	return 1;
+}
+
+static int
+fts_native_index_drop_corrupted(struct fts_native_index *index, uint32_t id);
+
+int fts_native_index_refresh(struct fts_native_index *index)
+{
+	struct fts_native_list list;
+	uint32_t corrupted_id = 0;
+	bool list_corrupted = FALSE;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < 2; i++) {
+		fts_native_list_init(index, &list);
+		ret = fts_native_list_read(index, &list);
+		if (ret == 0 ||
+		    (ret > 0 && list.uidvalidity != index->uidvalidity)) {
+			/* doesn't exist or it's for an old UIDVALIDITY */
+			fts_native_index_close_segments(index);
+			ret = 1;
+		} else if (ret > 0) {
+			ret = fts_native_index_set_list(index, &list,
+							&corrupted_id);
+		} else {
+			list_corrupted = list.corrupted;
+		}
+		fts_native_list_deinit(&list);
+		if (ret != 0)
+			break;
+		/* a segment was just merged away - the list was
+		   already replaced, so try again */
+	}
+	if (ret == 0) {
+		i_error("fts-native: Segments listed in %s don't exist",
+			index->path);
+		return -1;
+	}
+	/* plain I/O errors are just returned. only the corrupted parts of
+	   the index are rebuilt. */
+	if (list_corrupted)
+		(void)fts_native_index_reset(index);
+	else if (corrupted_id != 0)
+		(void)fts_native_index_drop_corrupted(index, corrupted_id);
+	return ret < 0 ? -1 : 0;
+}
+
+bool fts_native_index_exists(struct fts_native_index *index)
+{
+	return index->exists;
+}
+
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index)
+{
+	return index->exists ? index->last_uid : 0;
+}
+
+int fts_native_index_lookup(struct fts_native_index *index, const char *prefix,
+			    ARRAY_TYPE(seq_range) *uids)
+{
+	struct fts_native_index_segment *seg;
+	struct fts_native_expunged *expunged;
+	ARRAY_TYPE(seq_range) seg_uids;
+	uint32_t corrupted_id = 0;
+	int ret = 0;
+
+	i_assert(strlen(prefix) >= index->set.expunge_prefix_len);
+
+	i_array_init(&seg_uids, 32);
+	array_foreach_modifiable(&index->segments, seg) {
+		if (fts_native_segment_lookup_prefix(seg->segment, prefix,
+						     &seg_uids) < 0) {
+			if (fts_native_segment_is_corrupted(seg->segment))
+				corrupted_id = seg->id;
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == 0) {
+		expunged = fts_native_expunged_find(&index->expunged,
+			t_strndup(prefix, index->set.expunge_prefix_len));
+		if (expunged != NULL) {
+			seq_range_array_remove_seq_range(&seg_uids,
+							 &expunged->uids);
+		}
+		seq_range_array_merge(uids, &seg_uids);
+	}
+	array_free(&seg_uids);
+
+	if (corrupted_id != 0)
+		(void)fts_native_index_drop_corrupted(index, corrupted_id);
+	return ret;
+}
+
+static int
+fts_native_index_lock(struct fts_native_index *index,
+		      struct dotlock **dotlock_r)
+{
+	int fd;
+
+	fd = file_dotlock_open_group(&index->dotlock_set, index->path, 0,
+				     index->set.file.mode, index->set.file.gid,
+				     index->set.file.gid_origin, dotlock_r);
+	if (fd == -1) {
+		if (errno == EAGAIN) {
+			i_error("fts-native: Timeout while waiting for lock "
+				"for index %s", index->path);
+		} else {
+			i_error("file_dotlock_open(%s) failed: %m",
+				index->path);
+		}
+	}
+	return fd;
+}
+
+/* Add to ids all the segment files that exist for the index. */
+static int
+fts_native_index_find_segment_files(struct fts_native_index *index,
+				    ARRAY_TYPE(uint32_t) *ids)
+{
+	const char *p, *dir_path, *prefix;
+	size_t prefix_len;
+	DIR *dir;
+	struct dirent *d;
+	uint32_t id;
+	int ret = 0;
+
+	p = strrchr(index->path, '/');
+	if (p == NULL) {
+		dir_path = ".";
+		prefix = t_strconcat(index->path, ".", NULL);
+	} else {
+		dir_path = t_strdup_until(index->path, p);
+		prefix = t_strconcat(p + 1, ".", NULL);
+	}
+	prefix_len = strlen(prefix);
+
+	dir = opendir(dir_path);
+	if (dir == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("opendir(%s) failed: %m", dir_path);
+		return -1;
+	}
+	errno = 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, prefix, prefix_len) == 0 &&
+		    str_to_uint32(d->d_name + prefix_len, &id) == 0 && id != 0)
+			array_append(ids, &id, 1);
+		errno = 0;
+	}
+	if (errno != 0) {
+		i_error("readdir(%s) failed: %m", dir_path);
+		ret = -1;
+	}
+	if (closedir(dir) < 0)
+		i_error("closedir(%s) failed: %m", dir_path);
+	return ret;
+}
+
+/* Read the list for updating it. Old segments that can't be used anymore
+   are added to obsolete_ids. Returns 1 if ok, 0 if the list didn't exist or
+   was corrupted and the list was started from scratch, -1 if error. */
+static int
+fts_native_list_read_locked(struct fts_native_index *index,
+			    struct fts_native_list *list,
+			    ARRAY_TYPE(uint32_t) *obsolete_ids)
+{
+	ARRAY_TYPE(uint32_t) ids;
+	const uint32_t *idp;
+	int ret;
+
+	ret = fts_native_list_read(index, list);
+	if (ret < 0 && !list->corrupted)
+		return -1;
+	if (ret > 0) {
+		if (list->uidvalidity != index->uidvalidity) {
+			array_append_array(obsolete_ids, &list->segment_ids);
+			array_clear(&list->segment_ids);
+			fts_native_expunged_clear(&list->expunged);
+			list->uidvalidity = index->uidvalidity;
+			list->last_uid = 0;
+		}
+		return 1;
+	}
+
+	/* start from scratch. other processes may still have the old
+	   segments open, so their IDs must never be reused. continue after
+	   the highest existing segment file and delete the files, since
+	   they're no longer referenced by anything. */
+	fts_native_list_deinit(list);
+	fts_native_list_init(index, list);
+	i_array_init(&ids, 8);
+	if (fts_native_index_find_segment_files(index, &ids) < 0) {
+		array_free(&ids);
+		return -1;
+	}
+	array_foreach(&ids, idp) {
+		if (*idp >= list->next_segment_id)
+			list->next_segment_id = *idp + 1;
+	}
+	array_append_array(obsolete_ids, &ids);
+	array_free(&ids);
+	return 0;
+}
+
+static void
+fts_native_segment_info_get(struct fts_native_segment *segment,
+			    struct fts_native_segment_info *info_r)
+{
+	const struct fts_native_segment_header *hdr =
+		fts_native_segment_get_header(segment);
+
+	info_r->size = fts_native_segment_get_size(segment);
+	info_r->first_uid = hdr->term_count == 0 ? 0 : hdr->first_uid;
+	info_r->last_uid = hdr->term_count == 0 ? 0 : hdr->last_uid;
+}
+
+static int
+fts_native_index_get_segment_info(struct fts_native_index *index, uint32_t id,
+				  struct fts_native_segment_info *info_r)
+{
+	const struct fts_native_index_segment *seg;
+	struct fts_native_segment *segment;
+	bool corrupted;
+	int ret;
+
+	array_foreach(&index->segments, seg) {
+		if (seg->id == id) {
+			fts_native_segment_info_get(seg->segment, info_r);
+			return 0;
+		}
+	}
+
+	ret = fts_native_segment_open(fts_native_index_segment_path(index, id),
+				      index->set.file.mmap_disable, &segment,
+				      &corrupted);
+	if (ret <= 0) {
+		if (ret == 0) {
+			i_error("fts-native: Segment %u of %s doesn't exist",
+				id, index->path);
+		}
+		return -1;
+	}
+	fts_native_segment_info_get(segment, info_r);
+	fts_native_segment_close(&segment);
+	return 0;
+}
+
+static int
+fts_native_index_get_segment_infos(struct fts_native_index *index,
+				   const struct fts_native_list *list,
+				   ARRAY_TYPE(fts_native_segment_info) *infos)
+{
+	struct fts_native_segment_info *info;
+	const uint32_t *idp;
+
+	array_foreach(&list->segment_ids, idp) {
+		info = array_append_space(infos);
+		if (fts_native_index_get_segment_info(index, *idp, info) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Forget the expunged UIDs that can't exist in any of the segments anymore.
+   The segment at skip_idx is ignored. */
+static void
+fts_native_list_drop_expunged(struct fts_native_list *list,
+			      const ARRAY_TYPE(fts_native_segment_info) *infos,
+			      unsigned int skip_idx)
+{
+	const struct fts_native_segment_info *info;
+	struct fts_native_expunged *exp;
+	ARRAY_TYPE(seq_range) uid_ranges;
+	unsigned int i, count;
+
+	if (array_count(&list->expunged) == 0)
+		return;
+
+	info = array_get(infos, &count);
+	i_array_init(&uid_ranges, count + 1);
+	for (i = 0; i < count; i++) {
+		if (i != skip_idx && info[i].first_uid != 0) {
+			seq_range_array_add_range(&uid_ranges,
+				info[i].first_uid, info[i].last_uid);
+		}
+	}
+	for (i = 0; i < array_count(&list->expunged); ) {
+		exp = array_idx_modifiable(&list->expunged, i);
+		seq_range_array_intersect(&exp->uids, &uid_ranges);
+		if (array_count(&exp->uids) == 0)
+			fts_native_expunged_delete(&list->expunged, i);
+		else
+			i++;
+	}
+	array_free(&uid_ranges);
+}
+
+/* Drop the corrupted segment and all the segments newer than it from the
+   list. Segments are only merged with their neighbours, so the remaining
+   ones contain exactly the messages that were committed before the
+   corrupted one. With user_index this also includes the mailboxes' last
+   UID terms, so the dropped messages simply get indexed again. */
+static int
+fts_native_index_drop_corrupted(struct fts_native_index *index, uint32_t id)
+{
+	struct fts_native_list list;
+	struct dotlock *dotlock;
+	ARRAY_TYPE(uint32_t) obsolete_ids;
+	ARRAY_TYPE(fts_native_segment_info) infos;
+	const struct fts_native_segment_info *info;
+	const uint32_t *ids;
+	unsigned int i, count;
+	uint32_t last_uid = 0;
+	int fd, ret;
+
+	fd = fts_native_index_lock(index, &dotlock);
+	if (fd == -1)
+		return -1;
+
+	i_array_init(&obsolete_ids, 8);
+	fts_native_list_init(index, &list);
+	ret = fts_native_list_read_locked(index, &list, &obsolete_ids);
+	ids = array_get(&list.segment_ids, &count);
+	for (i = 0; i < count; i++) {
+		if (ids[i] == id)
+			break;
+	}
+	if (ret < 0 || (i == count && array_count(&obsolete_ids) == 0)) {
+		/* error, or someone else already got rid of it */
+		file_dotlock_delete(&dotlock);
+		fts_native_list_deinit(&list);
+		array_free(&obsolete_ids);
+		return ret < 0 ? -1 : 0;
+	}
+
+	if (i < count) {
+		i_error("fts-native: Dropping corrupted segment %u "
+			"and %u newer segments from index %s",
+			id, count - i - 1, index->path);
+		array_append(&obsolete_ids, ids + i, count - i);
+		array_delete(&list.segment_ids, i, count - i);
+	}
+
+	i_array_init(&infos, array_count(&list.segment_ids) + 1);
+	if (fts_native_index_get_segment_infos(index, &list, &infos) < 0) {
+		/* the older segments are broken as well */
+		array_append_array(&obsolete_ids, &list.segment_ids);
+		array_clear(&list.segment_ids);
+		fts_native_expunged_clear(&list.expunged);
+		list.last_uid = 0;
+	} else {
+		array_foreach(&infos, info) {
+			if (info->last_uid > last_uid)
+				last_uid = info->last_uid;
+		}
+		if (list.last_uid > last_uid)
+			list.last_uid = last_uid;
+		fts_native_list_drop_expunged(&list, &infos, UINT_MAX);
+	}
+	array_free(&infos);
+
+	ret = fts_native_list_replace(index, &dotlock, fd, &list);
+	if (ret == 0)
+		fts_native_index_unlink_segments(index, &obsolete_ids);
+	fts_native_list_deinit(&list);
+	array_free(&obsolete_ids);
+	fts_native_index_close_segments(index);
+	return ret;
+}
+
+static unsigned int
+fts_native_segment_level(uoff_t size, unsigned int merge_factor)
+{
+	uoff_t limit = FTS_NATIVE_MERGE_MIN_SIZE;
+	unsigned int level = 0;
+
+	while (size > limit) {
+		limit *= merge_factor;
+		level++;
+	}
+	return level;
+}
+
+/* Find the next segments that should be merged. If there are too many
+   segments, the adjacent segments with the smallest total size are merged.
+   Otherwise with optimize=TRUE the oldest run of merge_factor adjacent
+   segments on the same level is merged. Returns TRUE if something should be
+   merged. */
+static bool
+fts_native_index_find_merge(struct fts_native_index *index,
+			    const ARRAY_TYPE(fts_native_segment_info) *infos,
+			    bool optimize,
+			    unsigned int *start_r, unsigned int *count_r)
+{
+	const struct fts_native_segment_info *info;
+	unsigned int i, j, count, level, merge_count;
+	unsigned int merge_factor = index->set.merge_factor;
+	uoff_t size, min_size = (uoff_t)-1;
+
+	info = array_get(infos, &count);
+	if (count > index->set.max_segments) {
+		merge_count = I_MIN(I_MAX(merge_factor,
+					  count - index->set.max_segments + 1),
+				    count);
+		for (i = 0; i + merge_count <= count; i++) {
+			size = 0;
+			for (j = i; j < i + merge_count; j++)
+				size += info[j].size;
+			if (size < min_size) {
+				min_size = size;
+				*start_r = i;
+			}
+		}
+		*count_r = merge_count;
+		return TRUE;
+	}
+	if (!optimize)
+		return FALSE;
+
+	for (i = 0; i + merge_factor <= count; i = j) {
+		level = fts_native_segment_level(info[i].size, merge_factor);
+		for (j = i + 1; j < count; j++) {
+			if (fts_native_segment_level(info[j].size,
+						     merge_factor) != level)
+				break;
+		}
+		if (j - i >= merge_factor) {
+			*start_r = i;
+			*count_r = merge_factor;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static bool
+fts_native_segment_want_rewrite(const struct fts_native_segment_info *info,
+				const ARRAY_TYPE(seq_range) *expunged)
+{
+	const struct seq_range *range;
+	uint64_t expunged_count = 0;
+
+	if (info->first_uid == 0)
+		return FALSE;
+
+	array_foreach(expunged, range) {
+		if (range->seq2 < info->first_uid)
+			continue;
+		if (range->seq1 > info->last_uid)
+			break;
+		expunged_count += I_MIN(range->seq2, info->last_uid) -
+			I_MAX(range->seq1, info->first_uid) + 1;
+	}
+	return expunged_count > 0 &&
+		expunged_count * 100 >=
+		((uint64_t)info->last_uid - info->first_uid + 1) *
+		FTS_NATIVE_EXPUNGED_REWRITE_PERCENT;
+}
+
+/* Returns the expunged UIDs for the term. cur_prefix and cur_expunged
+   cache the previous term's, since the terms are sorted. They must be
+   initialized to the empty prefix's. */
+static const ARRAY_TYPE(seq_range) *
+fts_native_list_get_term_expunged(struct fts_native_list *list,
+				  const char *term, size_t prefix_len,
+				  string_t *cur_prefix,
+				  struct fts_native_expunged **cur_expunged)
+{
+	if (strlen(term) < prefix_len)
+		return NULL;
+	if (str_len(cur_prefix) != prefix_len ||
+	    strncmp(term, str_c(cur_prefix), prefix_len) != 0) {
+		str_truncate(cur_prefix, 0);
+		str_append_data(cur_prefix, term, prefix_len);
+		*cur_expunged = fts_native_expunged_find(&list->expunged,
+							 str_c(cur_prefix));
+	}
+	return *cur_expunged == NULL ? NULL : &(*cur_expunged)->uids;
+}
+
+/* Merge count segments beginning from start into a single new segment.
+   Expunged UIDs are dropped from it. The infos are updated to match the
+   new list. */
+static int
+fts_native_index_merge(struct fts_native_index *index,
+		       struct fts_native_list *list,
+		       ARRAY_TYPE(fts_native_segment_info) *infos,
+		       unsigned int start, unsigned int count,
+		       ARRAY_TYPE(uint32_t) *obsolete_ids)
+{
+	struct fts_native_segment_info new_info;
+	struct fts_native_segment **segments;
+	struct fts_native_segment_iter **iters;
+	struct fts_native_segment_writer *writer;
+	const char **terms;
+	const uint32_t *ids;
+	const ARRAY_TYPE(seq_range) *expunged_uids;
+	ARRAY_TYPE(seq_range) uids;
+	struct fts_native_expunged *cur_expunged;
+	string_t *min_term, *cur_prefix;
+	unsigned int i, opened;
+	uint32_t new_id;
+	bool corrupted;
+	int ret = 0;
+
+	i_assert(start + count <= array_count(&list->segment_ids));
+	ids = array_idx(&list->segment_ids, start);
+
+	segments = i_new(struct fts_native_segment *, count);
+	for (opened = 0; opened < count; opened++) {
+		ret = fts_native_segment_open(
+			fts_native_index_segment_path(index, ids[opened]),
+			index->set.file.mmap_disable, &segments[opened],
+			&corrupted);
+		if (ret <= 0) {
+			if (ret == 0) {
+				i_error("fts-native: Segment %u of %s "
+					"doesn't exist", ids[opened],
+					index->path);
+			}
+			ret = -1;
+			break;
+		}
+		ret = 0;
+	}
+
+	new_id = list->next_segment_id;
+	writer = ret < 0 ? NULL : fts_native_segment_writer_init(
+		fts_native_index_segment_path(index, new_id), &index->set.file);
+	if (writer == NULL) {
+		for (i = 0; i < opened; i++)
+			fts_native_segment_close(&segments[i]);
+		i_free(segments);
+		return -1;
+	}
+
+	iters = i_new(struct fts_native_segment_iter *, count);
+	terms = i_new(const char *, count);
+	for (i = 0; i < count; i++) {
+		iters[i] = fts_native_segment_iter_init(segments[i]);
+		terms[i] = fts_native_segment_iter_next(iters[i]);
+	}
+
+	/* n-way merge of the sorted term lists */
+	i_array_init(&uids, 128);
+	min_term = str_new(default_pool, 128);
+	cur_prefix = str_new(default_pool, index->set.expunge_prefix_len + 1);
+	cur_expunged = fts_native_expunged_find(&list->expunged, "");
+	for (;;) {
+		const char *min = NULL;
+
+		for (i = 0; i < count; i++) {
+			if (terms[i] != NULL &&
+			    (min == NULL || strcmp(terms[i], min) < 0))
+				min = terms[i];
+		}
+		if (min == NULL)
+			break;
+		str_truncate(min_term, 0);
+		str_append(min_term, min);
+
+		array_clear(&uids);
+		for (i = 0; i < count; i++) {
+			if (terms[i] != NULL &&
+			    strcmp(terms[i], str_c(min_term)) == 0) {
+				fts_native_segment_iter_get_uids(iters[i], &uids);
+				terms[i] = fts_native_segment_iter_next(iters[i]);
+			}
+		}
+		if (index->filter_callback != NULL &&
+		    !index->filter_callback(str_c(min_term),
+					    index->filter_context))
+			continue;
+		expunged_uids = fts_native_list_get_term_expunged(list,
+			str_c(min_term), index->set.expunge_prefix_len,
+			cur_prefix, &cur_expunged);
+		if (expunged_uids != NULL)
+			seq_range_array_remove_seq_range(&uids, expunged_uids);
+		fts_native_segment_writer_add(writer, str_c(min_term), &uids);
+	}
+	array_free(&uids);
+	str_free(&min_term);
+	str_free(&cur_prefix);
+
+	for (i = 0; i < count; i++) {
+		if (fts_native_segment_iter_deinit(&iters[i]) < 0)
+			ret = -1;
+		fts_native_segment_close(&segments[i]);
+	}
+	i_free(iters);
+	i_free(terms);
+	i_free(segments);
+
+	if (ret < 0) {
+		fts_native_segment_writer_abort(&writer);
+		return -1;
+	}
+	if (fts_native_segment_writer_finish(&writer) < 0)
+		return -1;
+
+	list->next_segment_id++;
+	if (fts_native_index_get_segment_info(index, new_id, &new_info) < 0) {
+		i_unlink(fts_native_index_segment_path(index, new_id));
+		return -1;
+	}
+	array_append(obsolete_ids, ids, count);
+	array_delete(&list->segment_ids, start, count);
+	array_delete(infos, start, count);
+	if (new_info.first_uid == 0) {
+		/* everything was expunged */
+		array_append(obsolete_ids, &new_id, 1);
+		fts_native_list_drop_expunged(list, infos, UINT_MAX);
+		return 0;
+	}
+	array_insert(&list->segment_ids, start, &new_id, 1);
+	array_insert(infos, start, &new_info, 1);
+	/* the new segment no longer has any of the expunged UIDs */
+	fts_native_list_drop_expunged(list, infos, start);
+	return 0;
+}
+
+/* Forget the expunged UIDs of the prefixes that the filter drops. */
+static void
+fts_native_list_filter_expunged(struct fts_native_index *index,
+				struct fts_native_list *list)
+{
+	const struct fts_native_expunged *exp;
+	unsigned int i = 0;
+
+	while (i < array_count(&list->expunged)) {
+		exp = array_idx(&list->expunged, i);
+		if (!index->filter_callback(exp->prefix, index->filter_context))
+			fts_native_expunged_delete(&list->expunged, i);
+		else
+			i++;
+	}
+}
+
+static void
+fts_native_index_merge_segments(struct fts_native_index *index,
+				struct fts_native_list *list, bool optimize,
+				ARRAY_TYPE(uint32_t) *obsolete_ids)
+{
+	ARRAY_TYPE(fts_native_segment_info) infos;
+	const struct fts_native_segment_info *info;
+	struct fts_native_expunged *expunged;
+	unsigned int i, start, count;
+
+	if (!optimize &&
+	    array_count(&list->segment_ids) <= index->set.max_segments)
+		return;
+
+	/* a failed merge isn't fatal. the segments are just left
+	   unmerged. */
+	i_array_init(&infos, array_count(&list->segment_ids) + 1);
+	if (fts_native_index_get_segment_infos(index, list, &infos) < 0) {
+		array_free(&infos);
+		return;
+	}
+	fts_native_list_drop_expunged(list, &infos, UINT_MAX);
+	if (index->filter_callback != NULL)
+		fts_native_list_filter_expunged(index, list);
+
+	while (fts_native_index_find_merge(index, &infos, optimize,
+					   &start, &count)) {
+		if (fts_native_index_merge(index, list, &infos, start, count,
+					   obsolete_ids) < 0)
+			break;
+	}
+	if (optimize && index->set.expunge_prefix_len == 0) {
+		/* get rid of the expunged messages in segments that
+		   aren't going to be merged anytime soon. with per-prefix
+		   expunges the prefixes share the segments' UID ranges, so
+		   the expunged percentage can't be known. those segments get
+		   cleaned up only by the tiered merges. */
+		i = 0;
+		while (i < array_count(&infos)) {
+			info = array_idx(&infos, i);
+			expunged = fts_native_expunged_find(&list->expunged, "");
+			if (expunged == NULL ||
+			    !fts_native_segment_want_rewrite(info,
+							     &expunged->uids)) {
+				i++;
+				continue;
+			}
+			count = array_count(&infos);
+			if (fts_native_index_merge(index, list, &infos, i, 1,
+						   obsolete_ids) < 0)
+				break;
+			/* the segment is gone if all of it was expunged */
+			if (array_count(&infos) == count)
+				i++;
+		}
+	}
+	array_free(&infos);
+}
+
+static int
+fts_native_index_update(struct fts_native_index *index,
+			struct fts_native_segment_builder *builder,
+			uint32_t last_uid, bool optimize)
+{
+	struct fts_native_list list;
+	struct dotlock *dotlock;
+	ARRAY_TYPE(uint32_t) obsolete_ids;
+	uint32_t id, corrupted_id;
+	int fd, ret = 0;
+
+	fd = fts_native_index_lock(index, &dotlock);
+	if (fd == -1)
+		return -1;
+
+	i_array_init(&obsolete_ids, 8);
+	fts_native_list_init(index, &list);
+	if (fts_native_list_read_locked(index, &list, &obsolete_ids) < 0)
+		ret = -1;
+
+	if (ret == 0 && builder != NULL &&
+	    !fts_native_segment_builder_is_empty(builder)) {
+		id = list.next_segment_id++;
+		if (fts_native_segment_builder_write(builder,
+				fts_native_index_segment_path(index, id),
+				&index->set.file) < 0)
+			ret = -1;
+		else
+			array_append(&list.segment_ids, &id, 1);
+	}
+	if (ret == 0 && optimize) {
+		fts_native_expunged_merge(&list.expunged,
+					  &index->pending_expunged);
+	}
+	if (ret == 0 && last_uid > list.last_uid)
+		list.last_uid = last_uid;
+
+	if (ret == 0) {
+		fts_native_index_merge_segments(index, &list, optimize,
+						&obsolete_ids);
+	}
+
+	if (ret < 0)
+		file_dotlock_delete(&dotlock);
+	else
+		ret = fts_native_list_replace(index, &dotlock, fd, &list);
+	if (ret == 0) {
+		fts_native_index_unlink_segments(index, &obsolete_ids);
+		ret = fts_native_index_set_list(index, &list, &corrupted_id);
+		if (ret == 0) {
+			/* someone else already merged the segments */
+			ret = fts_native_index_refresh(index);
+		} else if (ret > 0) {
+			ret = 0;
+		} else if (corrupted_id != 0) {
+			(void)fts_native_index_drop_corrupted(index,
+							      corrupted_id);
+		}
+	}
+	fts_native_list_deinit(&list);
+	array_free(&obsolete_ids);
+	return ret;
+}
+
+int fts_native_index_commit(struct fts_native_index *index,
+			    struct fts_native_segment_builder *builder,
+			    uint32_t last_uid)
+{
+	if (fts_native_segment_builder_is_empty(builder) &&
+	    last_uid <= fts_native_index_get_last_uid(index))
+		return 0;
+	return fts_native_index_update(index, builder, last_uid, FALSE);
+}
+
+bool fts_native_index_need_optimize(struct fts_native_index *index)
+{
+	ARRAY_TYPE(fts_native_segment_info) infos;
+	struct fts_native_segment_info *info;
+	const struct fts_native_index_segment *seg;
+	unsigned int start, count;
+	bool ret;
+
+	i_array_init(&infos, array_count(&index->segments) + 1);
+	array_foreach(&index->segments, seg) {
+		info = array_append_space(&infos);
+		fts_native_segment_info_get(seg->segment, info);
+	}
+	ret = fts_native_index_find_merge(index, &infos, TRUE, &start, &count);
+	array_free(&infos);
+	return ret;
+}
+
+void fts_native_index_expunge(struct fts_native_index *index,
+			      const char *prefix,
+			      const ARRAY_TYPE(seq_range) *uids)
+{
+	i_assert(strlen(prefix) == index->set.expunge_prefix_len);
+
+	if (array_count(uids) > 0) {
+		seq_range_array_merge(fts_native_expunged_get(
+			&index->pending_expunged, prefix), uids);
+	}
+}
+
+int fts_native_index_optimize(struct fts_native_index *index,
+			      fts_native_index_filter_callback_t *callback,
+			      void *context)
+{
+	int ret;
+
+	if (!index->exists) {
+		/* nothing to expunge from */
+		fts_native_expunged_clear(&index->pending_expunged);
+		return 0;
+	}
+
+	index->filter_callback = callback;
+	index->filter_context = context;
+	ret = fts_native_index_update(index, NULL, 0, TRUE);
+	index->filter_callback = NULL;
+	index->filter_context = NULL;
+	fts_native_expunged_clear(&index->pending_expunged);
+	return ret;
+}
+
+int fts_native_index_reset(struct fts_native_index *index)
+{
+	struct fts_native_list list;
+	struct dotlock *dotlock;
+	ARRAY_TYPE(uint32_t) obsolete_ids;
+	int fd, ret;
+
+	fd = fts_native_index_lock(index, &dotlock);
+	if (fd == -1)
+		return -1;
+
+	i_array_init(&obsolete_ids, 8);
+	fts_native_list_init(index, &list);
+	ret = fts_native_list_read_locked(index, &list, &obsolete_ids);
+	if (ret < 0 || (ret == 0 && array_count(&obsolete_ids) == 0)) {
+		/* error, or there's no index */
+		file_dotlock_delete(&dotlock);
+	} else {
+		/* an empty list is left behind, so the segment IDs continue
+		   from where they were */
+		array_append_array(&obsolete_ids, &list.segment_ids);
+		array_clear(&list.segment_ids);
+		fts_native_expunged_clear(&list.expunged);
+		list.last_uid = 0;
+		ret = fts_native_list_replace(index, &dotlock, fd, &list);
+		if (ret == 0)
+			fts_native_index_unlink_segments(index, &obsolete_ids);
+	}
+	fts_native_list_deinit(&list);
+	array_free(&obsolete_ids);
+	fts_native_index_close_segments(index);
+	return ret < 0 ? -1 : 0;
+}
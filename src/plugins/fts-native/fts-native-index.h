@@ -0,0 +1,91 @@
+#ifndef FTS_NATIVE_INDEX_H
+#define FTS_NATIVE_INDEX_H
+
+#include "seq-range-array.h"
+#include "fts-native-segment.h"
+
+/* Index consisting of a list file and a set of immutable segments. It's
+   normally used for a single mailbox, but it can also be shared by all of
+   the user's mailboxes by prefixing the terms with a mailbox identifier
+   (UIDVALIDITY and the last UID are then unused, and the expunged UIDs are
+   kept separately for each identifier). The list file contains the segment
+   IDs, the expunged UIDs and the last indexed UID. It's replaced atomically whenever segments are
+   added or merged, so readers don't need any locks. Writers are serialized
+   with a dotlock.
+
+   Segments are merged in tiers: new messages are always written to a new
+   small segment, and optimization merges merge_factor adjacent segments of
+   similar size into a larger one. This way each message gets rewritten
+   only a logarithmic number of times, while lookups need to go through
+   only a few segments. Expunged UIDs are filtered out of the lookup results
+   until they get dropped from the segments by merging. */
+
+struct fts_native_index_settings {
+	struct fts_native_file_settings file;
+
+	bool nfs_flush;
+	bool dotlock_use_excl;
+	/* Optimization merges this many similarly sized segments together */
+	unsigned int merge_factor;
+	/* Merge the smallest segments whenever there are more than this many */
+	unsigned int max_segments;
+	/* Expunged UIDs are kept separately for each term prefix of this
+	   length. With 0 they apply to all the terms. */
+	unsigned int expunge_prefix_len;
+};
+
+struct fts_native_index *
+fts_native_index_init(const char *path, uint32_t uidvalidity,
+		      const struct fts_native_index_settings *set);
+void fts_native_index_deinit(struct fts_native_index **index);
+
+/* Read the latest list file and open any new segments. Returns 0 if ok,
+   -1 if error. If the list is corrupted the index is reset, and if a segment
+   is corrupted it's dropped along with all the newer segments. */
+int fts_native_index_refresh(struct fts_native_index *index);
+/* Returns TRUE if the index exists for the current UIDVALIDITY. This is
+   valid only after a successful refresh. */
+bool fts_native_index_exists(struct fts_native_index *index);
+/* Returns the last UID that has been indexed, or 0 if the index doesn't
+   exist. */
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index);
+
+/* Add to uids the non-expunged UIDs of all the terms beginning with prefix.
+   The prefix must be at least expunge_prefix_len long. Terms shorter than
+   that never have expunged UIDs. Returns 0 if ok, -1 if error. */
+int fts_native_index_lookup(struct fts_native_index *index, const char *prefix,
+			    ARRAY_TYPE(seq_range) *uids);
+
+/* Write builder's contents as a new segment (if it's not empty) and update
+   the last indexed UID. The builder is emptied. If there are now more than
+   max_segments segments, the smallest ones are merged. Returns 0 if ok,
+   -1 if error. */
+int fts_native_index_commit(struct fts_native_index *index,
+			    struct fts_native_segment_builder *builder,
+			    uint32_t last_uid);
+/* Returns TRUE if optimizing would merge some of the currently opened
+   segments. */
+bool fts_native_index_need_optimize(struct fts_native_index *index);
+/* Add expunged UIDs for the terms beginning with the expunge_prefix_len
+   long prefix. They're written by the next fts_native_index_optimize(). */
+void fts_native_index_expunge(struct fts_native_index *index,
+			      const char *prefix,
+			      const ARRAY_TYPE(seq_range) *uids);
+/* Called for each term in the segments being merged, and for each prefix
+   that has expunged UIDs. Returns FALSE if the term or the prefix's
+   expunged UIDs should be dropped. */
+typedef bool
+fts_native_index_filter_callback_t(const char *term, void *context);
+/* Write the added expunged UIDs and do all the pending segment merges.
+   Without expunge_prefix_len segments with a lot of expunged messages are
+   also rewritten. The callback (if not NULL) is used while merging.
+   Returns 0 if ok, -1 if error. The added expunged UIDs are forgotten in
+   any case. */
+int fts_native_index_optimize(struct fts_native_index *index,
+			      fts_native_index_filter_callback_t *callback,
+			      void *context);
+/* Delete the whole index. An empty list is left behind, so the segment IDs
+   are never reused. */
+int fts_native_index_reset(struct fts_native_index *index);
+
+#endif
@@ -0,0 +1,110 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "settings-parser.h"
+#include "mail-storage-hooks.h"
+#include "fts-user.h"
+#include "fts-native-plugin.h"
+
+#define FTS_NATIVE_DEFAULT_BUFFER_SIZE (32*1024*1024)
+#define FTS_NATIVE_DEFAULT_MERGE_FACTOR 4
+#define FTS_NATIVE_DEFAULT_MAX_SEGMENTS 20
+
+const char *fts_native_plugin_version = DOVECOT_ABI_VERSION;
+
+struct fts_native_user_module fts_native_user_module =
+	MODULE_CONTEXT_INIT(&mail_user_module_register);
+
+static int
+fts_native_plugin_init_settings(struct fts_native_settings *set,
+				const char *str)
+{
+	const char *const *tmp, *error;
+
+	set->buffer_size = FTS_NATIVE_DEFAULT_BUFFER_SIZE;
+	set->merge_factor = FTS_NATIVE_DEFAULT_MERGE_FACTOR;
+	set->max_segments = FTS_NATIVE_DEFAULT_MAX_SEGMENTS;
+
+	for (tmp = t_strsplit_spaces(str, " "); *tmp != NULL; tmp++) {
+		if (strncmp(*tmp, "buffer_size=", 12) == 0) {
+			if (settings_get_size(*tmp + 12, &set->buffer_size,
+					      &error) < 0) {
+				i_error("fts_native: Invalid buffer_size: %s",
+					error);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "merge_factor=", 13) == 0) {
+			if (str_to_uint(*tmp + 13, &set->merge_factor) < 0 ||
+			    set->merge_factor < 2) {
+				i_error("fts_native: Invalid merge_factor: %s",
+					*tmp + 13);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "max_segments=", 13) == 0) {
+			if (str_to_uint(*tmp + 13, &set->max_segments) < 0 ||
+			    set->max_segments == 0) {
+				i_error("fts_native: Invalid max_segments: %s",
+					*tmp + 13);
+				return -1;
+			}
+		} else if (strcmp(*tmp, "user_index") == 0) {
+			set->user_index = TRUE;
+		} else {
+			i_error("fts_native: Invalid setting: %s", *tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void fts_native_mail_user_deinit(struct mail_user *user)
+{
+	struct fts_native_user *fuser = FTS_NATIVE_USER_CONTEXT(user);
+
+	fts_mail_user_deinit(user);
+	fuser->module_ctx.super.deinit(user);
+}
+
+static void fts_native_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_native_user *fuser;
+	const char *env, *error;
+
+	fuser = p_new(user->pool, struct fts_native_user, 1);
+	env = mail_user_plugin_getenv(user, "fts_native");
+	if (env == NULL)
+		env = "";
+
+	if (fts_native_plugin_init_settings(&fuser->set, env) < 0) {
+		/* invalid settings, disabling */
+		return;
+	}
+	if (fts_mail_user_init(user, &error) < 0) {
+		i_error("fts_native: %s", error);
+		return;
+	}
+
+	fuser->module_ctx.super = *v;
+	user->vlast = &fuser->module_ctx.super;
+	v->deinit = fts_native_mail_user_deinit;
+	MODULE_CONTEXT_SET(user, fts_native_user_module, fuser);
+}
+
+static struct mail_storage_hooks fts_native_mail_storage_hooks = {
+	.mail_user_created = fts_native_mail_user_created
+};
+
+void fts_native_plugin_init(struct module *module)
+{
+	fts_backend_register(&fts_backend_native);
+	mail_storage_hooks_add(module, &fts_native_mail_storage_hooks);
+}
+
+void fts_native_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_native.name);
+	mail_storage_hooks_remove(&fts_native_mail_storage_hooks);
+}
+
+const char *fts_native_plugin_dependencies[] = { "fts", NULL };
@@ -0,0 +1,731 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+#include "sort.h"
+#include "numpack.h"
+#include "mmap-util.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "eacces-error.h"
+#include "ostream.h"
+#include "fts-native-segment.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct fts_native_builder_term {
+	ARRAY_TYPE(seq_range) uids;
+};
+
+struct fts_native_segment_builder {
+	pool_t pool;
+	HASH_TABLE(char *, struct fts_native_builder_term *) terms;
+	size_t memory_used;
+};
+
+struct fts_native_segment_writer {
+	char *path, *temp_path;
+	enum fsync_mode fsync_mode;
+	int fd;
+	struct ostream *output;
+
+	buffer_t *dict, *postings;
+	ARRAY(uint32_t) block_offsets;
+	string_t *prev_term;
+	struct fts_native_segment_header hdr;
+};
+
+struct fts_native_segment {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+
+	void *mmap_base, *data_buf;
+	const unsigned char *data;
+	size_t size;
+
+	const struct fts_native_segment_header *hdr;
+	const unsigned char *dict;
+	size_t dict_size;
+	const uint32_t *block_offsets;
+
+	bool corrupted;
+};
+
+struct fts_native_segment_iter {
+	struct fts_native_segment *segment;
+
+	uint32_t term_idx;
+	const unsigned char *p, *end;
+	string_t *term;
+	uint32_t postings_offset, postings_size, next_postings_offset;
+
+	bool failed;
+};
+
+static void fts_native_builder_terms_free(struct fts_native_segment_builder *builder)
+{
+	struct hash_iterate_context *iter;
+	char *term;
+	struct fts_native_builder_term *value;
+
+	iter = hash_table_iterate_init(builder->terms);
+	while (hash_table_iterate(iter, builder->terms, &term, &value))
+		array_free(&value->uids);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&builder->terms);
+}
+
+struct fts_native_segment_builder *fts_native_segment_builder_init(void)
+{
+	struct fts_native_segment_builder *builder;
+
+	builder = i_new(struct fts_native_segment_builder, 1);
+	builder->pool = pool_alloconly_create("fts native builder", 1024*64);
+	hash_table_create(&builder->terms, default_pool, 0, str_hash, strcmp);
+	return builder;
+}
+
+void fts_native_segment_builder_deinit(struct fts_native_segment_builder **_builder)
+{
+	struct fts_native_segment_builder *builder = *_builder;
+
+	*_builder = NULL;
+	fts_native_builder_terms_free(builder);
+	pool_unref(&builder->pool);
+	i_free(builder);
+}
+
+void fts_native_segment_builder_add(struct fts_native_segment_builder *builder,
+				    const char *term, uint32_t uid)
+{
+	struct fts_native_builder_term *value;
+	unsigned int count;
+	char *key;
+
+	value = hash_table_lookup(builder->terms, term);
+	if (value == NULL) {
+		key = p_strdup(builder->pool, term);
+		value = p_new(builder->pool, struct fts_native_builder_term, 1);
+		i_array_init(&value->uids, 4);
+		hash_table_insert(builder->terms, key, value);
+		/* key, value, hash node and the initial array */
+		builder->memory_used += strlen(key) + 1 + sizeof(*value) +
+			sizeof(void *) * 4 + sizeof(struct seq_range) * 4;
+	}
+	count = array_count(&value->uids);
+	seq_range_array_add(&value->uids, uid);
+	if (array_count(&value->uids) > count)
+		builder->memory_used += sizeof(struct seq_range);
+}
+
+size_t
+fts_native_segment_builder_get_memory_usage(struct fts_native_segment_builder *builder)
+{
+	return builder->memory_used;
+}
+
+bool fts_native_segment_builder_is_empty(struct fts_native_segment_builder *builder)
+{
+	return hash_table_count(builder->terms) == 0;
+}
+
+static void fts_native_segment_builder_reset(struct fts_native_segment_builder *builder)
+{
+	fts_native_builder_terms_free(builder);
+	p_clear(builder->pool);
+	hash_table_create(&builder->terms, default_pool, 0, str_hash, strcmp);
+	builder->memory_used = 0;
+}
+
+int fts_native_segment_builder_write(struct fts_native_segment_builder *builder,
+				     const char *path,
+				     const struct fts_native_file_settings *set)
+{
+	struct fts_native_segment_writer *writer;
+	struct hash_iterate_context *iter;
+	ARRAY_TYPE(const_string) terms;
+	const char *const *termp;
+	char *term;
+	struct fts_native_builder_term *value;
+	int ret;
+
+	i_array_init(&terms, hash_table_count(builder->terms));
+	iter = hash_table_iterate_init(builder->terms);
+	while (hash_table_iterate(iter, builder->terms, &term, &value)) {
+		const char *const_term = term;
+		array_append(&terms, &const_term, 1);
+	}
+	hash_table_iterate_deinit(&iter);
+	array_sort(&terms, i_strcmp_p);
+
+	writer = fts_native_segment_writer_init(path, set);
+	if (writer == NULL)
+		ret = -1;
+	else {
+		array_foreach(&terms, termp) {
+			value = hash_table_lookup(builder->terms, *termp);
+			fts_native_segment_writer_add(writer, *termp,
+						      &value->uids);
+		}
+		ret = fts_native_segment_writer_finish(&writer);
+	}
+	array_free(&terms);
+	fts_native_segment_builder_reset(builder);
+	return ret;
+}
+
+struct fts_native_segment_writer *
+fts_native_segment_writer_init(const char *path,
+			       const struct fts_native_file_settings *set)
+{
+	struct fts_native_segment_writer *writer;
+	mode_t old_mask;
+	int fd;
+
+	writer = i_new(struct fts_native_segment_writer, 1);
+	writer->path = i_strdup(path);
+	writer->temp_path = i_strconcat(path, ".tmp", NULL);
+
+	old_mask = umask(0);
+	fd = open(writer->temp_path, O_RDWR | O_CREAT | O_TRUNC, set->mode);
+	umask(old_mask);
+	if (fd == -1) {
+		if (errno == EACCES) {
+			i_error("%s", eacces_error_get_creating("open",
+							writer->temp_path));
+		} else {
+			i_error("open(%s, O_CREAT) failed: %m",
+				writer->temp_path);
+		}
+		i_free(writer->temp_path);
+		i_free(writer->path);
+		i_free(writer);
+		return NULL;
+	}
+	if (set->gid != (gid_t)-1 && fchown(fd, (uid_t)-1, set->gid) < 0) {
+		if (errno == EPERM) {
+			i_error("%s", eperm_error_get_chgrp("fchown",
+				writer->temp_path, set->gid, set->gid_origin));
+		} else {
+			i_error("fchown(%s, -1, %ld) failed: %m",
+				writer->temp_path, (long)set->gid);
+		}
+	}
+
+	writer->fd = fd;
+	writer->fsync_mode = set->fsync_mode;
+	writer->output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(writer->output);
+	writer->dict = buffer_create_dynamic(default_pool, 4096);
+	writer->postings = buffer_create_dynamic(default_pool, 256);
+	writer->prev_term = str_new(default_pool, 128);
+	i_array_init(&writer->block_offsets, 64);
+
+	writer->hdr.magic = FTS_NATIVE_SEGMENT_MAGIC;
+	writer->hdr.version = FTS_NATIVE_SEGMENT_VERSION;
+	/* the header is rewritten at the end */
+	o_stream_nsend(writer->output, &writer->hdr, sizeof(writer->hdr));
+	return writer;
+}
+
+static void fts_native_segment_writer_free(struct fts_native_segment_writer *writer)
+{
+	o_stream_destroy(&writer->output);
+	i_close_fd(&writer->fd);
+	buffer_free(&writer->dict);
+	buffer_free(&writer->postings);
+	str_free(&writer->prev_term);
+	array_free(&writer->block_offsets);
+	i_free(writer->temp_path);
+	i_free(writer->path);
+	i_free(writer);
+}
+
+static void
+fts_native_postings_encode(buffer_t *buf, const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct seq_range *range;
+	uint32_t prev = 0;
+
+	numpack_encode(buf, array_count(uids));
+	array_foreach(uids, range) {
+		numpack_encode(buf, range->seq1 - prev);
+		numpack_encode(buf, range->seq2 - range->seq1);
+		prev = range->seq2;
+	}
+}
+
+void fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+				   const char *term,
+				   const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct seq_range *range;
+	unsigned int count, shared = 0, len = strlen(term);
+	const char *prev = str_c(writer->prev_term);
+	uint32_t block_offset;
+
+	i_assert(writer->hdr.term_count == 0 || strcmp(prev, term) < 0);
+
+	range = array_get(uids, &count);
+	if (count == 0)
+		return;
+	if (writer->hdr.first_uid == 0 || range[0].seq1 < writer->hdr.first_uid)
+		writer->hdr.first_uid = range[0].seq1;
+	if (range[count-1].seq2 > writer->hdr.last_uid)
+		writer->hdr.last_uid = range[count-1].seq2;
+
+	buffer_set_used_size(writer->postings, 0);
+	fts_native_postings_encode(writer->postings, uids);
+
+	if (writer->hdr.term_count % FTS_NATIVE_SEGMENT_BLOCK_TERMS == 0) {
+		/* new block begins with the full term and the offset to its
+		   posting list */
+		block_offset = writer->dict->used;
+		array_append(&writer->block_offsets, &block_offset, 1);
+		numpack_encode(writer->dict, writer->output->offset);
+	} else {
+		while (prev[shared] == term[shared] && term[shared] != '\0')
+			shared++;
+	}
+	numpack_encode(writer->dict, shared);
+	numpack_encode(writer->dict, len - shared);
+	buffer_append(writer->dict, term + shared, len - shared);
+	numpack_encode(writer->dict, writer->postings->used);
+
+	o_stream_nsend(writer->output, writer->postings->data,
+		       writer->postings->used);
+	str_truncate(writer->prev_term, 0);
+	str_append(writer->prev_term, term);
+	writer->hdr.term_count++;
+}
+
+int fts_native_segment_writer_finish(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+	const unsigned char zero[sizeof(uint32_t)] = { 0, };
+	size_t pad;
+	int ret = 0;
+
+	*_writer = NULL;
+
+	writer->hdr.dict_offset = writer->output->offset;
+	o_stream_nsend(writer->output, writer->dict->data, writer->dict->used);
+	/* the block offsets are accessed directly from the mmap */
+	pad = (sizeof(uint32_t) - writer->output->offset % sizeof(uint32_t)) %
+		sizeof(uint32_t);
+	o_stream_nsend(writer->output, zero, pad);
+	writer->hdr.block_index_offset = writer->dict->used + pad;
+	writer->hdr.block_count = array_count(&writer->block_offsets);
+	if (writer->hdr.block_count > 0) {
+		o_stream_nsend(writer->output,
+			       array_idx(&writer->block_offsets, 0),
+			       writer->hdr.block_count * sizeof(uint32_t));
+	}
+	if (writer->output->offset > (uint32_t)-1) {
+		i_error("fts-native: Segment %s too large", writer->path);
+		ret = -1;
+	}
+	writer->hdr.file_size = writer->output->offset;
+
+	if (ret == 0 && o_stream_nfinish(writer->output) < 0) {
+		i_error("write(%s) failed: %s", writer->temp_path,
+			o_stream_get_error(writer->output));
+		ret = -1;
+	}
+	if (ret == 0 && pwrite_full(writer->fd, &writer->hdr,
+				    sizeof(writer->hdr), 0) < 0) {
+		i_error("pwrite(%s) failed: %m", writer->temp_path);
+		ret = -1;
+	}
+	if (ret == 0 && writer->fsync_mode != FSYNC_MODE_NEVER &&
+	    fdatasync(writer->fd) < 0) {
+		i_error("fdatasync(%s) failed: %m", writer->temp_path);
+		ret = -1;
+	}
+	if (ret == 0 && rename(writer->temp_path, writer->path) < 0) {
+		i_error("rename(%s, %s) failed: %m",
+			writer->temp_path, writer->path);
+		ret = -1;
+	}
+	if (ret < 0 && unlink(writer->temp_path) < 0 && errno != ENOENT)
+		i_error("unlink(%s) failed: %m", writer->temp_path);
+	fts_native_segment_writer_free(writer);
+	return ret;
+}
+
+void fts_native_segment_writer_abort(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	*_writer = NULL;
+	o_stream_ignore_last_errors(writer->output);
+	if (unlink(writer->temp_path) < 0 && errno != ENOENT)
+		i_error("unlink(%s) failed: %m", writer->temp_path);
+	fts_native_segment_writer_free(writer);
+}
+
+static void
+fts_native_segment_set_corrupted(struct fts_native_segment *segment,
+				 const char *reason)
+{
+	if (segment->corrupted)
+		return;
+	segment->corrupted = TRUE;
+	i_error("fts-native: Corrupted segment %s: %s", segment->path, reason);
+}
+
+static int fts_native_segment_check_header(struct fts_native_segment *segment)
+{
+	const struct fts_native_segment_header *hdr = segment->hdr;
+
+	if (hdr->magic != FTS_NATIVE_SEGMENT_MAGIC ||
+	    hdr->version != FTS_NATIVE_SEGMENT_VERSION) {
+		fts_native_segment_set_corrupted(segment, "Invalid header");
+		return -1;
+	}
+	if (hdr->file_size != segment->size) {
+		fts_native_segment_set_corrupted(segment, t_strdup_printf(
+			"File size %"PRIuSIZE_T" doesn't match header's %u",
+			segment->size, hdr->file_size));
+		return -1;
+	}
+	if (hdr->dict_offset < sizeof(*hdr) ||
+	    hdr->dict_offset > segment->size ||
+	    (hdr->dict_offset + hdr->block_index_offset) %
+	    sizeof(uint32_t) != 0 ||
+	    hdr->block_index_offset > segment->size - hdr->dict_offset ||
+	    hdr->block_count != (segment->size - hdr->dict_offset -
+				 hdr->block_index_offset) / sizeof(uint32_t) ||
+	    hdr->block_count != (hdr->term_count +
+				 FTS_NATIVE_SEGMENT_BLOCK_TERMS - 1) /
+				FTS_NATIVE_SEGMENT_BLOCK_TERMS) {
+		fts_native_segment_set_corrupted(segment,
+						 "Invalid offsets in header");
+		return -1;
+	}
+	segment->dict = segment->data + hdr->dict_offset;
+	segment->dict_size = hdr->block_index_offset;
+	segment->block_offsets = (const void *)(segment->dict +
+						hdr->block_index_offset);
+	return 0;
+}
+
+int fts_native_segment_open(const char *path, bool mmap_disable,
+			    struct fts_native_segment **segment_r,
+			    bool *corrupted_r)
+{
+	struct fts_native_segment *segment;
+	struct stat st;
+	void *data;
+	int fd, ret;
+
+	*corrupted_r = FALSE;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("open(%s) failed: %m", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	segment = i_new(struct fts_native_segment, 1);
+	segment->path = i_strdup(path);
+	segment->dev = st.st_dev;
+	segment->ino = st.st_ino;
+	segment->size = st.st_size;
+	if (st.st_size < (off_t)sizeof(struct fts_native_segment_header) ||
+	    st.st_size > (off_t)(uint32_t)-1) {
+		fts_native_segment_set_corrupted(segment, "Invalid file size");
+		ret = -1;
+	} else if (mmap_disable) {
+		data = i_malloc(segment->size);
+		if ((ret = read_full(fd, data, segment->size)) <= 0) {
+			if (ret == 0)
+				errno = EINVAL;
+			i_error("read(%s) failed: %m", path);
+			i_free(data);
+			ret = -1;
+		} else {
+			segment->data_buf = data;
+			segment->data = data;
+			ret = 0;
+		}
+	} else {
+		data = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			i_error("mmap(%s) failed: %m", path);
+			ret = -1;
+		} else {
+			segment->mmap_base = data;
+			segment->data = data;
+			ret = 0;
+		}
+	}
+	i_close_fd(&fd);
+
+	if (ret == 0) {
+		segment->hdr = (const void *)segment->data;
+		ret = fts_native_segment_check_header(segment);
+	}
+	if (ret < 0) {
+		*corrupted_r = segment->corrupted;
+		fts_native_segment_close(&segment);
+		return -1;
+	}
+	*segment_r = segment;
+	return 1;
+}
+
+void fts_native_segment_close(struct fts_native_segment **_segment)
+{
+	struct fts_native_segment *segment = *_segment;
+
+	*_segment = NULL;
+	if (segment->mmap_base != NULL) {
+		if (munmap(segment->mmap_base, segment->size) < 0)
+			i_error("munmap(%s) failed: %m", segment->path);
+	}
+	i_free(segment->data_buf);
+	i_free(segment->path);
+	i_free(segment);
+}
+
+bool fts_native_segment_is_replaced(struct fts_native_segment *segment)
+{
+	struct stat st;
+
+	if (stat(segment->path, &st) < 0) {
+		if (errno != ENOENT)
+			i_error("stat(%s) failed: %m", segment->path);
+		return TRUE;
+	}
+	return st.st_ino != segment->ino ||
+		!CMP_DEV_T(st.st_dev, segment->dev) ||
+		st.st_size != (off_t)segment->size;
+}
+
+bool fts_native_segment_is_corrupted(struct fts_native_segment *segment)
+{
+	return segment->corrupted;
+}
+
+const struct fts_native_segment_header *
+fts_native_segment_get_header(struct fts_native_segment *segment)
+{
+	return segment->hdr;
+}
+
+uint64_t fts_native_segment_get_size(struct fts_native_segment *segment)
+{
+	return segment->size;
+}
+
+static void
+fts_native_segment_iter_set_corrupted(struct fts_native_segment_iter *iter,
+				      const char *reason)
+{
+	iter->failed = TRUE;
+	fts_native_segment_set_corrupted(iter->segment, reason);
+}
+
+struct fts_native_segment_iter *
+fts_native_segment_iter_init(struct fts_native_segment *segment)
+{
+	struct fts_native_segment_iter *iter;
+
+	iter = i_new(struct fts_native_segment_iter, 1);
+	iter->segment = segment;
+	iter->term = str_new(default_pool, 128);
+	iter->end = segment->dict + segment->dict_size;
+	return iter;
+}
+
+static void
+fts_native_segment_iter_seek_block(struct fts_native_segment_iter *iter,
+				   uint32_t block_idx)
+{
+	iter->term_idx = block_idx * FTS_NATIVE_SEGMENT_BLOCK_TERMS;
+}
+
+const char *fts_native_segment_iter_next(struct fts_native_segment_iter *iter)
+{
+	struct fts_native_segment *segment = iter->segment;
+	uint32_t offset, shared, len;
+
+	if (iter->failed || iter->term_idx >= segment->hdr->term_count)
+		return NULL;
+
+	if (iter->term_idx % FTS_NATIVE_SEGMENT_BLOCK_TERMS == 0) {
+		offset = segment->block_offsets[iter->term_idx /
+						FTS_NATIVE_SEGMENT_BLOCK_TERMS];
+		if (offset >= segment->dict_size) {
+			fts_native_segment_iter_set_corrupted(iter,
+				"Block offset points outside dictionary");
+			return NULL;
+		}
+		iter->p = segment->dict + offset;
+		if (numpack_decode32(&iter->p, iter->end,
+				     &iter->next_postings_offset) < 0) {
+			fts_native_segment_iter_set_corrupted(iter,
+				"Truncated block");
+			return NULL;
+		}
+		str_truncate(iter->term, 0);
+	}
+
+	if (numpack_decode32(&iter->p, iter->end, &shared) < 0 ||
+	    numpack_decode32(&iter->p, iter->end, &len) < 0 ||
+	    len > (size_t)(iter->end - iter->p)) {
+		fts_native_segment_iter_set_corrupted(iter, "Truncated term");
+		return NULL;
+	}
+	if (shared > str_len(iter->term) ||
+	    (shared == 0 && len == 0)) {
+		fts_native_segment_iter_set_corrupted(iter, "Invalid term");
+		return NULL;
+	}
+	str_truncate(iter->term, shared);
+	str_append_n(iter->term, iter->p, len);
+	iter->p += len;
+
+	if (numpack_decode32(&iter->p, iter->end, &iter->postings_size) < 0) {
+		fts_native_segment_iter_set_corrupted(iter, "Truncated term");
+		return NULL;
+	}
+	iter->postings_offset = iter->next_postings_offset;
+	if (iter->postings_offset < sizeof(*segment->hdr) ||
+	    iter->postings_offset > segment->hdr->dict_offset ||
+	    iter->postings_size > segment->hdr->dict_offset -
+	    			  iter->postings_offset) {
+		fts_native_segment_iter_set_corrupted(iter,
+			"Posting list points outside file");
+		return NULL;
+	}
+	iter->next_postings_offset += iter->postings_size;
+	iter->term_idx++;
+	return str_c(iter->term);
+}
+
+void fts_native_segment_iter_get_uids(struct fts_native_segment_iter *iter,
+				      ARRAY_TYPE(seq_range) *uids)
+{
+	const unsigned char *p, *end;
+	uint32_t i, count, delta, len;
+	uint64_t seq1, seq2 = 0;
+
+	p = iter->segment->data + iter->postings_offset;
+	end = p + iter->postings_size;
+	if (numpack_decode32(&p, end, &count) < 0) {
+		fts_native_segment_iter_set_corrupted(iter,
+			"Truncated posting list");
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (numpack_decode32(&p, end, &delta) < 0 ||
+		    numpack_decode32(&p, end, &len) < 0) {
+			fts_native_segment_iter_set_corrupted(iter,
+				"Truncated posting list");
+			return;
+		}
+		seq1 = seq2 + delta;
+		seq2 = seq1 + len;
+		if (delta == 0 || seq2 > (uint32_t)-1) {
+			fts_native_segment_iter_set_corrupted(iter,
+				"Invalid UIDs in posting list");
+			return;
+		}
+		seq_range_array_add_range(uids, seq1, seq2);
+	}
+}
+
+int fts_native_segment_iter_deinit(struct fts_native_segment_iter **_iter)
+{
+	struct fts_native_segment_iter *iter = *_iter;
+	int ret = iter->failed ? -1 : 0;
+
+	*_iter = NULL;
+	str_free(&iter->term);
+	i_free(iter);
+	return ret;
+}
+
+static int
+fts_native_segment_block_cmp(struct fts_native_segment *segment,
+			     uint32_t block_idx, const char *prefix,
+			     int *cmp_r)
+{
+	const unsigned char *p, *end = segment->dict + segment->dict_size;
+	uint32_t offset, num, len;
+	size_t prefix_len = strlen(prefix);
+	int cmp;
+
+	offset = segment->block_offsets[block_idx];
+	if (offset >= segment->dict_size) {
+		fts_native_segment_set_corrupted(segment,
+			"Block offset points outside dictionary");
+		return -1;
+	}
+	p = segment->dict + offset;
+	if (numpack_decode32(&p, end, &num) < 0 ||
+	    numpack_decode32(&p, end, &num) < 0 || num != 0 ||
+	    numpack_decode32(&p, end, &len) < 0 ||
+	    len > (size_t)(end - p)) {
+		fts_native_segment_set_corrupted(segment, "Truncated block");
+		return -1;
+	}
+	cmp = memcmp(p, prefix, I_MIN(len, prefix_len));
+	if (cmp == 0)
+		cmp = len < prefix_len ? -1 : (len > prefix_len ? 1 : 0);
+	*cmp_r = cmp;
+	return 0;
+}
+
+int fts_native_segment_lookup_prefix(struct fts_native_segment *segment,
+				     const char *prefix,
+				     ARRAY_TYPE(seq_range) *uids)
+{
+	struct fts_native_segment_iter *iter;
+	const char *term;
+	size_t prefix_len = strlen(prefix);
+	unsigned int left, right, idx;
+	int cmp;
+
+	if (segment->corrupted)
+		return -1;
+
+	/* find the last block whose first term is smaller than prefix.
+	   all the matching terms are after it. */
+	left = 0; right = segment->hdr->block_count;
+	while (left < right) {
+		idx = (left + right) / 2;
+		if (fts_native_segment_block_cmp(segment, idx, prefix, &cmp) < 0)
+			return -1;
+		if (cmp < 0)
+			left = idx + 1;
+		else
+			right = idx;
+	}
+
+	iter = fts_native_segment_iter_init(segment);
+	fts_native_segment_iter_seek_block(iter, left == 0 ? 0 : left - 1);
+	while ((term = fts_native_segment_iter_next(iter)) != NULL) {
+		cmp = strncmp(term, prefix, prefix_len);
+		if (cmp > 0)
+			break;
+		if (cmp == 0)
+			fts_native_segment_iter_get_uids(iter, uids);
+	}
+	return fts_native_segment_iter_deinit(&iter);
+}
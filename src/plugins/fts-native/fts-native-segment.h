@@ -0,0 +1,118 @@
+#ifndef FTS_NATIVE_SEGMENT_H
+#define FTS_NATIVE_SEGMENT_H
+
+#include "fsync-mode.h"
+#include "seq-range-array.h"
+
+/* Segments are immutable files containing an inverted index for some set of
+   messages. The file begins with a header, followed by the posting lists and
+   finally the term dictionary. Terms are sorted and front-coded in blocks of
+   FTS_NATIVE_SEGMENT_BLOCK_TERMS terms. The block index at the end of the
+   file points to the beginning of each block, so lookups can binary search
+   the blocks and only scan one of them.
+
+   Each posting list is a list of UID ranges, delta-encoded against the
+   previous range and stored using numpack variable length integers. */
+
+#define FTS_NATIVE_SEGMENT_MAGIC 0x4e535446
+#define FTS_NATIVE_SEGMENT_VERSION 1
+#define FTS_NATIVE_SEGMENT_BLOCK_TERMS 32
+
+struct fts_native_segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t file_size;
+
+	uint32_t term_count;
+	uint32_t block_count;
+	/* offset to the term dictionary */
+	uint32_t dict_offset;
+	/* offset to the uint32_t block offsets, relative to dict_offset.
+	   The block offsets are aligned to 4 bytes within the file. */
+	uint32_t block_index_offset;
+
+	/* UID range of the messages in this segment */
+	uint32_t first_uid, last_uid;
+};
+
+struct fts_native_file_settings {
+	mode_t mode;
+	gid_t gid;
+	const char *gid_origin;
+	/* fsync the files before they're renamed into place unless this is
+	   FSYNC_MODE_NEVER */
+	enum fsync_mode fsync_mode;
+	bool mmap_disable;
+};
+
+struct fts_native_segment;
+struct fts_native_segment_builder;
+struct fts_native_segment_writer;
+struct fts_native_segment_iter;
+
+/* Builder collects postings into memory. They can then be written to a new
+   segment file. */
+struct fts_native_segment_builder *fts_native_segment_builder_init(void);
+void fts_native_segment_builder_deinit(struct fts_native_segment_builder **builder);
+/* Add term to the given UID. UIDs should be added mostly in ascending
+   order, since that's the fast path. */
+void fts_native_segment_builder_add(struct fts_native_segment_builder *builder,
+				    const char *term, uint32_t uid);
+/* Returns approximately how much memory the builder is using. */
+size_t
+fts_native_segment_builder_get_memory_usage(struct fts_native_segment_builder *builder);
+bool fts_native_segment_builder_is_empty(struct fts_native_segment_builder *builder);
+/* Write the builder's contents into a new segment and reset the builder.
+   Returns 0 if ok, -1 if error. */
+int fts_native_segment_builder_write(struct fts_native_segment_builder *builder,
+				     const char *path,
+				     const struct fts_native_file_settings *set);
+
+/* Create a new segment to the given path. It's written to a temporary file
+   and renamed to the final path only by a successful _finish(). */
+struct fts_native_segment_writer *
+fts_native_segment_writer_init(const char *path,
+			       const struct fts_native_file_settings *set);
+/* Add a posting list. Terms must be added in strictly ascending strcmp()
+   order. Empty posting lists are skipped. */
+void fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+				   const char *term,
+				   const ARRAY_TYPE(seq_range) *uids);
+/* Returns 0 if ok, -1 if error. The writer is freed in any case. */
+int fts_native_segment_writer_finish(struct fts_native_segment_writer **writer);
+void fts_native_segment_writer_abort(struct fts_native_segment_writer **writer);
+
+/* Returns 1 if ok, 0 if the file doesn't exist, -1 if error. Corrupted files
+   are treated as errors, but *corrupted_r is also set to TRUE for them. */
+int fts_native_segment_open(const char *path, bool mmap_disable,
+			    struct fts_native_segment **segment_r,
+			    bool *corrupted_r);
+void fts_native_segment_close(struct fts_native_segment **segment);
+/* Returns TRUE if the segment's path no longer points to the opened file. */
+bool fts_native_segment_is_replaced(struct fts_native_segment *segment);
+/* Returns TRUE if corruption has been detected in the segment. */
+bool fts_native_segment_is_corrupted(struct fts_native_segment *segment);
+
+const struct fts_native_segment_header *
+fts_native_segment_get_header(struct fts_native_segment *segment);
+uint64_t fts_native_segment_get_size(struct fts_native_segment *segment);
+
+/* Add to uids the UIDs of all the terms beginning with prefix.
+   Returns 0 if ok, -1 if the segment is corrupted. */
+int fts_native_segment_lookup_prefix(struct fts_native_segment *segment,
+				     const char *prefix,
+				     ARRAY_TYPE(seq_range) *uids);
+
+/* Iterate through all the terms in the segment in sorted order. */
+struct fts_native_segment_iter *
+fts_native_segment_iter_init(struct fts_native_segment *segment);
+/* Returns the next term or NULL if there are no more terms. The returned
+   string is valid until the next call. */
+const char *fts_native_segment_iter_next(struct fts_native_segment_iter *iter);
+/* Add the UIDs of the current term to uids. */
+void fts_native_segment_iter_get_uids(struct fts_native_segment_iter *iter,
+				      ARRAY_TYPE(seq_range) *uids);
+/* Returns 0 if ok, -1 if the segment was found to be corrupted. */
+int fts_native_segment_iter_deinit(struct fts_native_segment_iter **iter);
+
+#endif
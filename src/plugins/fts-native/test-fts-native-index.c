@@ -0,0 +1,364 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "unlink-directory.h"
+#include "fts-native-index.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-native-index"
+#define TEST_PATH TEST_DIR"/index"
+
+static const struct fts_native_index_settings test_index_set = {
+	.file = {
+		.mode = 0600,
+		.gid = (gid_t)-1
+	},
+	.merge_factor = 2,
+	.max_segments = 3
+};
+
+static void test_index_init(void)
+{
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_index_deinit(void)
+{
+	if (unlink_directory(TEST_DIR, TRUE) < 0)
+		i_error("unlink_directory(%s) failed: %m", TEST_DIR);
+}
+
+static unsigned int test_segment_file_count(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	unsigned int count = 0;
+
+	dir = opendir(TEST_DIR);
+	if (dir == NULL)
+		i_fatal("opendir(%s) failed: %m", TEST_DIR);
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, "index.", 6) == 0 &&
+		    strstr(d->d_name, ".lock") == NULL)
+			count++;
+	}
+	(void)closedir(dir);
+	return count;
+}
+
+static uint32_t test_segment_max_id(void)
+{
+	DIR *dir;
+	struct dirent *d;
+	uint32_t id, max_id = 0;
+
+	dir = opendir(TEST_DIR);
+	if (dir == NULL)
+		i_fatal("opendir(%s) failed: %m", TEST_DIR);
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, "index.", 6) == 0 &&
+		    str_to_uint32(d->d_name + 6, &id) == 0 && id > max_id)
+			max_id = id;
+	}
+	(void)closedir(dir);
+	return max_id;
+}
+
+static const char *
+test_lookup(struct fts_native_index *index, const char *prefix)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	t_array_init(&uids, 8);
+	if (fts_native_index_lookup(index, prefix, &uids) < 0)
+		return "error";
+	array_foreach(&uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (range->seq1 == range->seq2)
+			str_printfa(str, "%u", range->seq1);
+		else
+			str_printfa(str, "%u-%u", range->seq1, range->seq2);
+	}
+	return str_c(str);
+}
+
+static void test_commit_uid(struct fts_native_index *index, uint32_t uid)
+{
+	struct fts_native_segment_builder *builder;
+
+	builder = fts_native_segment_builder_init();
+	fts_native_segment_builder_add(builder, "b:foo", uid);
+	fts_native_segment_builder_add(builder,
+		t_strdup_printf("b:uid%u", uid), uid);
+	test_assert(fts_native_index_commit(index, builder, uid) == 0);
+	fts_native_segment_builder_deinit(&builder);
+}
+
+static void test_fts_native_index_commit(void)
+{
+	struct fts_native_index *index, *index2;
+	uint32_t uid;
+
+	test_begin("fts native index commit");
+	test_index_init();
+
+	index = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert(!fts_native_index_exists(index));
+	test_assert(fts_native_index_get_last_uid(index) == 0);
+
+	for (uid = 1; uid <= 10; uid++) {
+		test_commit_uid(index, uid);
+		test_assert_idx(test_segment_file_count() <=
+				test_index_set.max_segments, uid);
+	}
+	test_assert(fts_native_index_exists(index));
+	test_assert(fts_native_index_get_last_uid(index) == 10);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "1-10") == 0);
+	test_assert(strcmp(test_lookup(index, "b:uid1"), "1,10") == 0);
+
+	/* another process sees the same index */
+	index2 = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert(fts_native_index_get_last_uid(index2) == 10);
+	test_assert(strcmp(test_lookup(index2, "b:uid5"), "5") == 0);
+	fts_native_index_deinit(&index2);
+
+	/* changed UIDVALIDITY makes the index empty */
+	index2 = fts_native_index_init(TEST_PATH, 2, &test_index_set);
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert(!fts_native_index_exists(index2));
+	test_assert(strcmp(test_lookup(index2, "b:foo"), "") == 0);
+	fts_native_index_deinit(&index2);
+
+	fts_native_index_deinit(&index);
+	test_index_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_optimize(void)
+{
+	struct fts_native_index *index;
+	ARRAY_TYPE(seq_range) expunged;
+	uint32_t uid;
+
+	test_begin("fts native index optimize");
+	test_index_init();
+
+	index = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_assert(fts_native_index_refresh(index) == 0);
+	for (uid = 1; uid <= 3; uid++)
+		test_commit_uid(index, uid);
+	test_assert(test_segment_file_count() == 3);
+	test_assert(fts_native_index_need_optimize(index));
+
+	/* the small segments are all on the same level */
+	test_assert(fts_native_index_optimize(index, NULL, NULL) == 0);
+	test_assert(test_segment_file_count() == 1);
+	test_assert(!fts_native_index_need_optimize(index));
+	test_assert(strcmp(test_lookup(index, "b:foo"), "1-3") == 0);
+
+	/* expunged UIDs are dropped while rewriting */
+	t_array_init(&expunged, 4);
+	seq_range_array_add(&expunged, 2);
+	fts_native_index_expunge(index, "", &expunged);
+	test_assert(fts_native_index_optimize(index, NULL, NULL) == 0);
+	test_assert(test_segment_file_count() == 1);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "1,3") == 0);
+	test_assert(strcmp(test_lookup(index, "b:uid2"), "") == 0);
+
+	/* segment disappears once everything in it is expunged */
+	seq_range_array_add_range(&expunged, 1, 3);
+	fts_native_index_expunge(index, "", &expunged);
+	test_assert(fts_native_index_optimize(index, NULL, NULL) == 0);
+	test_assert(test_segment_file_count() == 0);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "") == 0);
+	test_assert(fts_native_index_get_last_uid(index) == 3);
+
+	test_assert(fts_native_index_reset(index) == 0);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert(fts_native_index_get_last_uid(index) == 0);
+
+	fts_native_index_deinit(&index);
+	test_index_deinit();
+	test_end();
+}
+
+static bool test_filter_callback(const char *term, void *context)
+{
+	const char *prefix = context;
+
+	return strncmp(term, prefix, strlen(prefix)) != 0;
+}
+
+static void
+test_commit_boxes(struct fts_native_index *index, uint32_t uid)
+{
+	struct fts_native_segment_builder *builder;
+
+	builder = fts_native_segment_builder_init();
+	fts_native_segment_builder_add(builder, "box1:b:foo", uid);
+	fts_native_segment_builder_add(builder, "box2:b:foo", uid);
+	fts_native_segment_builder_add(builder, "box3:b:foo", uid);
+	fts_native_segment_builder_add(builder, "u:box1", uid);
+	test_assert(fts_native_index_commit(index, builder, 0) == 0);
+	fts_native_segment_builder_deinit(&builder);
+}
+
+static void test_fts_native_index_prefix_expunges(void)
+{
+	struct fts_native_index_settings set = test_index_set;
+	struct fts_native_index *index, *index2;
+	ARRAY_TYPE(seq_range) expunged;
+	uint32_t uid;
+
+	test_begin("fts native index prefix expunges");
+	test_index_init();
+
+	/* shared index with per-mailbox prefixes */
+	set.merge_factor = 4;
+	set.max_segments = 10;
+	set.expunge_prefix_len = 5;
+	index = fts_native_index_init(TEST_PATH, 0, &set);
+	test_assert(fts_native_index_refresh(index) == 0);
+	for (uid = 1; uid <= 3; uid++)
+		test_commit_boxes(index, uid);
+	test_assert(test_segment_file_count() == 3);
+	test_assert(fts_native_index_get_last_uid(index) == 0);
+
+	/* nothing is merged, but the expunges are filtered out of the
+	   lookups. terms shorter than the prefix aren't affected. */
+	t_array_init(&expunged, 4);
+	seq_range_array_add(&expunged, 2);
+	fts_native_index_expunge(index, "box1:", &expunged);
+	test_assert(fts_native_index_optimize(index, NULL, NULL) == 0);
+	test_assert(test_segment_file_count() == 3);
+	test_assert(strcmp(test_lookup(index, "box1:b:foo"), "1,3") == 0);
+	test_assert(strcmp(test_lookup(index, "box2:b:foo"), "1-3") == 0);
+	test_assert(strcmp(test_lookup(index, "u:box1"), "1-3") == 0);
+
+	index2 = fts_native_index_init(TEST_PATH, 0, &set);
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert(strcmp(test_lookup(index2, "box1:b:"), "1,3") == 0);
+	fts_native_index_deinit(&index2);
+
+	/* merging drops the expunged UIDs and the filtered terms */
+	test_commit_boxes(index, 4);
+	test_assert(fts_native_index_need_optimize(index));
+	test_assert(fts_native_index_optimize(index, test_filter_callback,
+					      "box3:") == 0);
+	test_assert(test_segment_file_count() == 1);
+	test_assert(strcmp(test_lookup(index, "box1:b:foo"), "1,3-4") == 0);
+	test_assert(strcmp(test_lookup(index, "box2:b:foo"), "1-4") == 0);
+	test_assert(strcmp(test_lookup(index, "box3:b:foo"), "") == 0);
+	test_assert(strcmp(test_lookup(index, "u:box1"), "1-4") == 0);
+
+	fts_native_index_deinit(&index);
+	test_index_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_segment_ids(void)
+{
+	struct fts_native_index *index;
+	uint32_t max_id;
+
+	test_begin("fts native index segment ids");
+	test_index_init();
+
+	index = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_commit_uid(index, 1);
+	test_commit_uid(index, 2);
+	max_id = test_segment_max_id();
+	test_assert(max_id == 2);
+
+	/* IDs aren't reused after reset */
+	test_assert(fts_native_index_reset(index) == 0);
+	test_assert(test_segment_file_count() == 0);
+	test_commit_uid(index, 1);
+	test_assert(test_segment_max_id() == max_id + 1);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "1") == 0);
+	max_id = test_segment_max_id();
+
+	/* or after the list is lost. the orphaned segments are deleted. */
+	test_assert(unlink(TEST_PATH) == 0);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert(!fts_native_index_exists(index));
+	test_commit_uid(index, 2);
+	test_assert(test_segment_file_count() == 1);
+	test_assert(test_segment_max_id() == max_id + 1);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "2") == 0);
+	max_id = test_segment_max_id();
+
+	/* or after the list is corrupted */
+	test_assert(truncate(TEST_PATH, 10) == 0);
+	test_expect_errors(2);
+	test_assert(fts_native_index_refresh(index) == -1);
+	test_expect_no_more_errors();
+	test_assert(test_segment_file_count() == 0);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert(fts_native_index_get_last_uid(index) == 0);
+	test_commit_uid(index, 3);
+	test_assert(test_segment_max_id() == max_id + 1);
+
+	fts_native_index_deinit(&index);
+	test_index_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_corrupted_segment(void)
+{
+	struct fts_native_index *index;
+	uint32_t uid;
+
+	test_begin("fts native index corrupted segment");
+	test_index_init();
+
+	index = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_assert(fts_native_index_refresh(index) == 0);
+	for (uid = 1; uid <= 3; uid++)
+		test_commit_uid(index, uid);
+	fts_native_index_deinit(&index);
+	test_assert(test_segment_file_count() == 3);
+
+	/* only the corrupted segment and the ones after it are dropped */
+	test_assert(truncate(TEST_PATH".2", 4) == 0);
+	index = fts_native_index_init(TEST_PATH, 1, &test_index_set);
+	test_expect_errors(2);
+	test_assert(fts_native_index_refresh(index) == -1);
+	test_expect_no_more_errors();
+	test_assert(test_segment_file_count() == 1);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert(fts_native_index_get_last_uid(index) == 1);
+	test_assert(strcmp(test_lookup(index, "b:foo"), "1") == 0);
+
+	fts_native_index_deinit(&index);
+	test_index_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_native_index_commit,
+		test_fts_native_index_optimize,
+		test_fts_native_index_prefix_expunges,
+		test_fts_native_index_segment_ids,
+		test_fts_native_index_corrupted_segment,
+		NULL
+	};
+	return test_run(test_functions);
+}
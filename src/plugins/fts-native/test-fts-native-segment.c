@@ -0,0 +1,241 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "fts-native-segment.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-native"
+#define TEST_PATH TEST_DIR"/segment"
+
+static const struct fts_native_file_settings test_file_set = {
+	.mode = 0600,
+	.gid = (gid_t)-1
+};
+
+static void test_segment_init(void)
+{
+	(void)unlink_directory(TEST_DIR, TRUE);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_segment_deinit(void)
+{
+	if (unlink_directory(TEST_DIR, TRUE) < 0)
+		i_error("unlink_directory(%s) failed: %m", TEST_DIR);
+}
+
+static const char *test_uids_str(const ARRAY_TYPE(seq_range) *uids)
+{
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	array_foreach(uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (range->seq1 == range->seq2)
+			str_printfa(str, "%u", range->seq1);
+		else
+			str_printfa(str, "%u-%u", range->seq1, range->seq2);
+	}
+	return str_c(str);
+}
+
+static const char *
+test_lookup(struct fts_native_segment *segment, const char *prefix)
+{
+	ARRAY_TYPE(seq_range) uids;
+
+	t_array_init(&uids, 8);
+	if (fts_native_segment_lookup_prefix(segment, prefix, &uids) < 0)
+		return "error";
+	return test_uids_str(&uids);
+}
+
+static void test_fts_native_segment_build_lookup(void)
+{
+	struct fts_native_segment_builder *builder;
+	struct fts_native_segment *segment;
+	const struct fts_native_segment_header *hdr;
+	bool corrupted;
+
+	test_begin("fts native segment build and lookup");
+	test_segment_init();
+
+	builder = fts_native_segment_builder_init();
+	test_assert(fts_native_segment_builder_is_empty(builder));
+	fts_native_segment_builder_add(builder, "b:hello", 1);
+	fts_native_segment_builder_add(builder, "b:hello", 1);
+	fts_native_segment_builder_add(builder, "b:hello", 2);
+	fts_native_segment_builder_add(builder, "b:help", 3);
+	fts_native_segment_builder_add(builder, "b:world", 2);
+	fts_native_segment_builder_add(builder, "h:hello", 100000);
+	fts_native_segment_builder_add(builder, "b:hello", 5);
+	test_assert(!fts_native_segment_builder_is_empty(builder));
+	test_assert(fts_native_segment_builder_get_memory_usage(builder) > 0);
+	test_assert(fts_native_segment_builder_write(builder, TEST_PATH,
+						     &test_file_set) == 0);
+	test_assert(fts_native_segment_builder_is_empty(builder));
+	fts_native_segment_builder_deinit(&builder);
+
+	test_assert(fts_native_segment_open(TEST_PATH, FALSE, &segment,
+					    &corrupted) == 1);
+	hdr = fts_native_segment_get_header(segment);
+	test_assert(hdr->term_count == 4);
+	test_assert(hdr->first_uid == 1 && hdr->last_uid == 100000);
+	test_assert((hdr->dict_offset + hdr->block_index_offset) %
+		    sizeof(uint32_t) == 0);
+	test_assert(!fts_native_segment_is_replaced(segment));
+
+	test_assert(strcmp(test_lookup(segment, "b:hello"), "1-2,5") == 0);
+	test_assert(strcmp(test_lookup(segment, "b:hel"), "1-3,5") == 0);
+	test_assert(strcmp(test_lookup(segment, "b:"), "1-3,5") == 0);
+	test_assert(strcmp(test_lookup(segment, "h:hello"), "100000") == 0);
+	test_assert(strcmp(test_lookup(segment, "b:helloo"), "") == 0);
+	test_assert(strcmp(test_lookup(segment, "a"), "") == 0);
+	test_assert(strcmp(test_lookup(segment, "z"), "") == 0);
+
+	/* the same path is recreated */
+	builder = fts_native_segment_builder_init();
+	fts_native_segment_builder_add(builder, "b:hello", 6);
+	test_assert(fts_native_segment_builder_write(builder, TEST_PATH,
+						     &test_file_set) == 0);
+	fts_native_segment_builder_deinit(&builder);
+	test_assert(fts_native_segment_is_replaced(segment));
+	fts_native_segment_close(&segment);
+
+	test_assert(fts_native_segment_open(TEST_PATH".nonexistent", FALSE,
+					    &segment, &corrupted) == 0);
+	test_assert(!corrupted);
+	test_segment_deinit();
+	test_end();
+}
+
+static void test_fts_native_segment_many_terms(void)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment *segment;
+	struct fts_native_segment_iter *iter;
+	ARRAY_TYPE(seq_range) uids;
+	const char *term;
+	unsigned int i, count = FTS_NATIVE_SEGMENT_BLOCK_TERMS * 10 + 3;
+	bool mmap_disable, corrupted;
+
+	test_begin("fts native segment many terms");
+	test_segment_init();
+
+	/* multiple blocks, each term has a different posting list */
+	writer = fts_native_segment_writer_init(TEST_PATH, &test_file_set);
+	t_array_init(&uids, 8);
+	for (i = 0; i < count; i++) T_BEGIN {
+		array_clear(&uids);
+		seq_range_array_add(&uids, i + 1);
+		seq_range_array_add_range(&uids, 1000 + i, 1000 + i*2);
+		fts_native_segment_writer_add(writer,
+			t_strdup_printf("term%05u", i), &uids);
+	} T_END;
+	test_assert(fts_native_segment_writer_finish(&writer) == 0);
+
+	for (mmap_disable = FALSE;; mmap_disable = TRUE) {
+		test_assert(fts_native_segment_open(TEST_PATH, mmap_disable,
+						    &segment, &corrupted) == 1);
+		for (i = 0; i < count; i++) T_BEGIN {
+			const char *expected = i == 0 ? "1,1000" :
+				t_strdup_printf("%u,%u-%u", i + 1,
+						1000 + i, 1000 + i*2);
+			test_assert_idx(strcmp(test_lookup(segment,
+				t_strdup_printf("term%05u", i)), expected) == 0, i);
+		} T_END;
+		test_assert(strcmp(test_lookup(segment, "term0032"),
+				   "321-323,1320-1644") == 0);
+
+		iter = fts_native_segment_iter_init(segment);
+		for (i = 0; (term = fts_native_segment_iter_next(iter)) != NULL; i++) {
+			test_assert_idx(strcmp(term,
+				t_strdup_printf("term%05u", i)) == 0, i);
+		}
+		test_assert(i == count);
+		test_assert(fts_native_segment_iter_deinit(&iter) == 0);
+		fts_native_segment_close(&segment);
+		if (mmap_disable)
+			break;
+	}
+	test_segment_deinit();
+	test_end();
+}
+
+static void test_fts_native_segment_empty(void)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment *segment;
+	bool corrupted;
+
+	test_begin("fts native segment empty");
+	test_segment_init();
+	writer = fts_native_segment_writer_init(TEST_PATH, &test_file_set);
+	test_assert(fts_native_segment_writer_finish(&writer) == 0);
+	test_assert(fts_native_segment_open(TEST_PATH, FALSE, &segment,
+					    &corrupted) == 1);
+	test_assert(strcmp(test_lookup(segment, "b:foo"), "") == 0);
+	fts_native_segment_close(&segment);
+
+	/* aborting doesn't replace the existing file */
+	writer = fts_native_segment_writer_init(TEST_PATH, &test_file_set);
+	fts_native_segment_writer_abort(&writer);
+	test_assert(fts_native_segment_open(TEST_PATH, FALSE, &segment,
+					    &corrupted) == 1);
+	fts_native_segment_close(&segment);
+	test_segment_deinit();
+	test_end();
+}
+
+static void test_fts_native_segment_corrupted(void)
+{
+	struct fts_native_segment_builder *builder;
+	struct fts_native_segment *segment;
+	struct stat st;
+	bool corrupted;
+
+	test_begin("fts native segment corrupted");
+	test_segment_init();
+	builder = fts_native_segment_builder_init();
+	fts_native_segment_builder_add(builder, "b:foo", 1);
+	test_assert(fts_native_segment_builder_write(builder, TEST_PATH,
+						     &test_file_set) == 0);
+	fts_native_segment_builder_deinit(&builder);
+
+	test_assert(stat(TEST_PATH, &st) == 0);
+	test_assert(truncate(TEST_PATH, st.st_size - 1) == 0);
+	test_expect_errors(1);
+	test_assert(fts_native_segment_open(TEST_PATH, FALSE, &segment,
+					    &corrupted) == -1);
+	test_expect_no_more_errors();
+	test_assert(corrupted);
+
+	test_assert(truncate(TEST_PATH, 4) == 0);
+	test_expect_errors(1);
+	test_assert(fts_native_segment_open(TEST_PATH, FALSE, &segment,
+					    &corrupted) == -1);
+	test_expect_no_more_errors();
+	test_assert(corrupted);
+	test_segment_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_native_segment_build_lookup,
+		test_fts_native_segment_many_terms,
+		test_fts_native_segment_empty,
+		test_fts_native_segment_corrupted,
+		NULL
+	};
+	return test_run(test_functions);
+}
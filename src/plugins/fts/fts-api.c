@@ -379,6 +379,7 @@ int fts_backend_lookup_multi(struct fts_backend *backend,
 	for (i = 0; boxes[i] != NULL; i++) {
 		struct fts_result *box_result = &result->box_results[i];
 
+		box_result->box = boxes[i];
 		p_array_init(&box_result->definite_uids, result->pool, 32);
 		p_array_init(&box_result->maybe_uids, result->pool, 32);
 		p_array_init(&box_result->scores, result->pool, 32);
@@ -2,12 +2,17 @@
 
 #include "lib.h"
 #include "istream.h"
+#include "ostream.h"
+#include "iostream-temp.h"
 #include "buffer.h"
 #include "str.h"
+#include "hex-binary.h"
+#include "sha1.h"
 #include "rfc822-parser.h"
 #include "message-address.h"
 #include "message-parser.h"
 #include "message-decoder.h"
+#include "mail-user.h"
 #include "mail-storage.h"
 #include "index-mail.h"
 #include "fts-parser.h"
@@ -25,12 +30,25 @@
    wherever */
 #define MAX_WORD_SIZE 1024
 
+/* A body part whose text is being extracted in the background */
+struct fts_mail_build_pending_part {
+	struct fts_parser *parser;
+	struct message_part *part;
+	char *content_type, *content_disposition;
+	char *cache_key;
+};
+
 struct fts_mail_build_context {
 	struct mail *mail;
 	struct fts_backend_update_context *update_ctx;
 
 	char *content_type, *content_disposition;
 	struct fts_parser *body_parser;
+	struct message_part *body_part;
+	/* the body_parser's input when it wants it all at once */
+	struct ostream *parser_input;
+	struct sha1_ctxt parser_input_hash;
+	ARRAY(struct fts_mail_build_pending_part) pending_parts;
 
 	buffer_t *word_buf, *pending_input;
 	struct fts_user_language *cur_user_lang;
@@ -211,6 +229,26 @@ static int fts_build_mail_header(struct fts_mail_build_context *ctx,
 	return ret;
 }
 
+static void
+fts_build_parser_input_begin(struct fts_mail_build_context *ctx,
+			     struct mail_storage *storage)
+{
+	string_t *temp_prefix = t_str_new(128);
+
+	/* buffer the input, so it can be looked up from the cache before
+	   anything is sent to the parser */
+	mail_user_set_get_temp_prefix(temp_prefix,
+				      mail_storage_get_user(storage)->set);
+	ctx->parser_input = iostream_temp_create(str_c(temp_prefix), 0);
+	sha1_init(&ctx->parser_input_hash);
+}
+
+static void fts_build_parser_input_abort(struct fts_mail_build_context *ctx)
+{
+	o_stream_ignore_last_errors(ctx->parser_input);
+	o_stream_destroy(&ctx->parser_input);
+}
+
 static bool
 fts_build_body_begin(struct fts_mail_build_context *ctx,
 		     struct message_part *part, bool *binary_body_r)
@@ -241,6 +279,9 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 		/* extract text using the the returned parser */
 		*binary_body_r = TRUE;
 		key.type = FTS_BACKEND_BUILD_KEY_BODY_PART;
+		ctx->body_part = part;
+		if (fts_parser_want_full_input(ctx->body_parser))
+			fts_build_parser_input_begin(ctx, storage);
 	} else if (strncmp(content_type, "text/", 5) == 0 ||
 		   strncmp(content_type, "message/", 8) == 0) {
 		/* text body parts */
@@ -258,6 +299,8 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 	key.body_content_disposition = ctx->content_disposition;
 	ctx->cur_user_lang = NULL;
 	if (!fts_backend_update_set_build_key(ctx->update_ctx, &key)) {
+		if (ctx->parser_input != NULL)
+			fts_build_parser_input_abort(ctx);
 		if (ctx->body_parser != NULL)
 			(void)fts_parser_deinit(&ctx->body_parser);
 		return FALSE;
@@ -434,25 +477,204 @@ static int fts_build_body_block(struct fts_mail_build_context *ctx,
 	return fts_build_data(ctx, block->data, block->size, last);
 }
 
-static int fts_body_parser_finish(struct fts_mail_build_context *ctx)
+static void fts_body_parser_more(struct fts_mail_build_context *ctx,
+				 struct message_block *block)
+{
+	if (ctx->parser_input == NULL) {
+		fts_parser_more(ctx->body_parser, block);
+		return;
+	}
+	o_stream_nsend(ctx->parser_input, block->data, block->size);
+	sha1_loop(&ctx->parser_input_hash, block->data, block->size);
+	block->size = 0;
+}
+
+/* Read the parser's output and index it. If text isn't NULL, the output is
+   also appended to it as long as it stays within max_text_size. */
+static int
+fts_body_parser_read_output(struct fts_mail_build_context *ctx,
+			    struct fts_parser **parser,
+			    buffer_t *text, size_t max_text_size)
 {
 	struct message_block block;
 	int ret = 0;
 
 	do {
 		memset(&block, 0, sizeof(block));
-		fts_parser_more(ctx->body_parser, &block);
+		fts_parser_more(*parser, &block);
+		if (text != NULL && text->used + block.size > max_text_size)
+			text = NULL;
+		if (text != NULL)
+			buffer_append(text, block.data, block.size);
 		if (fts_build_body_block(ctx, &block, FALSE) < 0) {
 			ret = -1;
 			break;
 		}
 	} while (block.size > 0);
 
-	if (fts_parser_deinit(&ctx->body_parser) < 0)
+	if (fts_parser_deinit(parser) < 0)
 		ret = -1;
+	return ret < 0 ? -1 : (text != NULL ? 1 : 0);
+}
+
+static void
+fts_build_pending_part_free(struct fts_mail_build_pending_part *pending)
+{
+	if (pending->parser != NULL)
+		(void)fts_parser_deinit(&pending->parser);
+	i_free(pending->content_type);
+	i_free(pending->content_disposition);
+	i_free(pending->cache_key);
+}
+
+static int
+fts_build_pending_part_finish(struct fts_mail_build_context *ctx,
+			      struct fts_mail_build_pending_part *pending)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+	struct fts_backend_build_key key;
+	struct message_block block;
+	buffer_t *text = NULL;
+	size_t max_text_size;
+	int ret = 0;
+
+	memset(&key, 0, sizeof(key));
+	key.uid = ctx->mail->uid;
+	key.part = pending->part;
+	key.type = FTS_BACKEND_BUILD_KEY_BODY_PART;
+	key.body_content_type = pending->content_type;
+	key.body_content_disposition = pending->content_disposition;
+
+	fts_backend_update_unset_build_key(ctx->update_ctx);
+	ctx->cur_user_lang = NULL;
+	if (!fts_backend_update_set_build_key(ctx->update_ctx, &key)) {
+		fts_build_pending_part_free(pending);
+		return 0;
+	}
+
+	max_text_size = fts_parser_cache_get_max_text_size(user);
+	if (max_text_size > 0)
+		text = buffer_create_dynamic(default_pool, 1024);
+	ret = fts_body_parser_read_output(ctx, &pending->parser,
+					  text, max_text_size);
+	if (ret > 0)
+		fts_parser_cache_add(user, pending->cache_key, text);
+	if (ret >= 0) {
+		/* finish the last word before the build key changes */
+		memset(&block, 0, sizeof(block));
+		ret = fts_build_body_block(ctx, &block, TRUE);
+	}
+	fts_backend_update_unset_build_key(ctx->update_ctx);
+
+	if (text != NULL)
+		buffer_free(&text);
+	fts_build_pending_part_free(pending);
+	return ret < 0 ? -1 : 0;
+}
+
+/* Index the count oldest pending parts. They're most likely to be converted
+   already. */
+static int fts_build_pending_parts_finish(struct fts_mail_build_context *ctx,
+					  unsigned int count)
+{
+	struct fts_mail_build_pending_part *pending;
+	int ret = 0;
+
+	while (count > 0 && array_count(&ctx->pending_parts) > 0) {
+		pending = array_idx_modifiable(&ctx->pending_parts, 0);
+		if (ret < 0)
+			fts_build_pending_part_free(pending);
+		else if (fts_build_pending_part_finish(ctx, pending) < 0)
+			ret = -1;
+		array_delete(&ctx->pending_parts, 0, 1);
+		count--;
+	}
 	return ret;
 }
 
+static void fts_build_pending_parts_free(struct fts_mail_build_context *ctx)
+{
+	struct fts_mail_build_pending_part *pending;
+
+	array_foreach_modifiable(&ctx->pending_parts, pending)
+		fts_build_pending_part_free(pending);
+	array_free(&ctx->pending_parts);
+}
+
+static int fts_body_parser_start(struct fts_mail_build_context *ctx)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+	struct fts_mail_build_pending_part *pending;
+	struct istream *input;
+	const buffer_t *text;
+	unsigned char digest[SHA1_RESULTLEN];
+	const char *cache_key;
+	unsigned int max_parallel;
+
+	sha1_result(&ctx->parser_input_hash, digest);
+	cache_key = t_strdup_printf("%s %s",
+		binary_to_hex(digest, sizeof(digest)),
+		ctx->content_type != NULL ? ctx->content_type : "");
+	text = fts_parser_cache_lookup(user, cache_key);
+	if (text != NULL) {
+		/* the same attachment was already converted */
+		fts_build_parser_input_abort(ctx);
+		(void)fts_parser_deinit(&ctx->body_parser);
+		return fts_build_data(ctx, text->data, text->used, TRUE);
+	}
+
+	if (o_stream_nfinish(ctx->parser_input) < 0) {
+		i_error("fts: write(%s) failed: %s",
+			o_stream_get_name(ctx->parser_input),
+			o_stream_get_error(ctx->parser_input));
+		fts_build_parser_input_abort(ctx);
+		(void)fts_parser_deinit(&ctx->body_parser);
+		return -1;
+	}
+
+	/* make room for this conversion */
+	if (!array_is_created(&ctx->pending_parts))
+		i_array_init(&ctx->pending_parts, 4);
+	max_parallel = fts_parser_get_max_parallel(user);
+	if (array_count(&ctx->pending_parts) >= max_parallel) {
+		if (fts_build_pending_parts_finish(ctx,
+				array_count(&ctx->pending_parts) -
+				max_parallel + 1) < 0) {
+			fts_build_parser_input_abort(ctx);
+			(void)fts_parser_deinit(&ctx->body_parser);
+			return -1;
+		}
+	}
+
+	input = iostream_temp_finish(&ctx->parser_input, IO_BLOCK_SIZE);
+	fts_parser_set_input(ctx->body_parser, input);
+	i_stream_unref(&input);
+
+	pending = array_append_space(&ctx->pending_parts);
+	pending->parser = ctx->body_parser;
+	pending->part = ctx->body_part;
+	pending->content_type = i_strdup(ctx->content_type);
+	pending->content_disposition = i_strdup(ctx->content_disposition);
+	pending->cache_key = i_strdup(cache_key);
+	ctx->body_parser = NULL;
+	return 0;
+}
+
+static int fts_body_parser_finish(struct fts_mail_build_context *ctx)
+{
+	int ret;
+
+	if (ctx->parser_input != NULL) {
+		/* the text is extracted in the background and indexed
+		   after the rest of the mail */
+		T_BEGIN {
+			ret = fts_body_parser_start(ctx);
+		} T_END;
+		return ret;
+	}
+	return fts_body_parser_read_output(ctx, &ctx->body_parser, NULL, 0);
+}
+
 static int
 fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 		    struct mail *mail)
@@ -554,7 +776,7 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 		} else {
 			i_assert(body_part);
 			if (ctx.body_parser != NULL)
-				fts_parser_more(ctx.body_parser, &block);
+				fts_body_parser_more(&ctx, &block);
 			if (fts_build_body_block(&ctx, &block, FALSE) < 0) {
 				ret = -1;
 				break;
@@ -565,14 +787,24 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	if (ctx.body_parser != NULL) {
 		if (ret == 0)
 			ret = fts_body_parser_finish(&ctx);
-		else
+		else {
+			if (ctx.parser_input != NULL)
+				fts_build_parser_input_abort(&ctx);
 			(void)fts_parser_deinit(&ctx.body_parser);
+		}
 	}
-	if (ret == 0 && body_part && !skip_body && !body_added) {
+	if (ret == 0 && body_part && !skip_body && !body_added &&
+	    update_ctx->build_key_open) {
 		/* make sure body is added even when it doesn't exist */
 		block.data = NULL; block.size = 0;
 		ret = fts_build_body_block(&ctx, &block, TRUE);
 	}
+	if (array_is_created(&ctx.pending_parts)) {
+		if (ret == 0 &&
+		    fts_build_pending_parts_finish(&ctx, UINT_MAX) < 0)
+			ret = -1;
+		fts_build_pending_parts_free(&ctx);
+	}
 	if (message_parser_deinit_from_parts(&parser, &parts, &error) < 0)
 		index_mail_set_message_parts_corrupted(mail, error);
 	message_decoder_deinit(&decoder);
@@ -2,22 +2,20 @@
 
 #include "lib.h"
 #include "ioloop.h"
-#include "net.h"
 #include "istream.h"
-#include "write-full.h"
 #include "strescape.h"
 #include "time-util.h"
 #include "settings-parser.h"
 #include "mail-user.h"
 #include "mail-storage-private.h"
+#include "mail-indexer.h"
 #include "fts-api.h"
 #include "fts-indexer.h"
 
 #define INDEXER_NOTIFY_INTERVAL_SECS 10
 
-#define INDEXER_SOCKET_NAME "indexer"
 #define INDEXER_WAIT_MSECS 250
-#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
+#define INDEXER_CONNECT_RETRY_MSECS 1000
 
 struct fts_indexer_context {
 	struct mailbox *box;
@@ -34,30 +32,6 @@ struct fts_indexer_context {
 	unsigned int failed:1;
 };
 
-int fts_indexer_cmd(struct mail_user *user, const char *cmd,
-		    const char **path_r)
-{
-	const char *path;
-	int fd;
-
-	path = t_strconcat(user->set->base_dir,
-			   "/"INDEXER_SOCKET_NAME, NULL);
-	fd = net_connect_unix_with_retries(path, 1000);
-	if (fd == -1) {
-		i_error("net_connect_unix(%s) failed: %m", path);
-		return -1;
-	}
-
-	cmd = t_strconcat(INDEXER_HANDSHAKE, cmd, NULL);
-	if (write_full(fd, cmd, strlen(cmd)) < 0) {
-		i_error("write(%s) failed: %m", path);
-		i_close_fd(&fd);
-		return -1;
-	}
-	*path_r = path;
-	return fd;
-}
-
 static void fts_indexer_notify(struct fts_indexer_context *ctx)
 {
 	unsigned long long elapsed_msecs, est_total_msecs;
@@ -117,7 +91,8 @@ int fts_indexer_init(struct fts_backend *backend, struct mailbox *box,
 			      str_tabescape(box->storage->user->username),
 			      str_tabescape(box->vname),
 			      str_tabescape(box->storage->user->session_id));
-	fd = fts_indexer_cmd(box->storage->user, cmd, &path);
+	fd = mail_indexer_cmd(box->storage->user, cmd,
+			      INDEXER_CONNECT_RETRY_MSECS, &path);
 	if (fd == -1)
 		return -1;
 
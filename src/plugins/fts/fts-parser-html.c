@@ -61,5 +61,6 @@ struct fts_parser_vfuncs fts_parser_html = {
 	fts_parser_html_try_init,
 	fts_parser_html_more,
 	fts_parser_html_deinit,
+	NULL,
 	NULL
 };
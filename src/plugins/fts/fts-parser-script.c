@@ -1,6 +1,7 @@
 /* Copyright (c) 2011-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "str.h"
 #include "net.h"
 #include "istream.h"
@@ -12,6 +13,8 @@
 #include "mail-user.h"
 #include "fts-parser.h"
 
+#include <poll.h>
+
 #define SCRIPT_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_parser_script_user_module)
 
@@ -35,8 +38,12 @@ struct script_fts_parser {
 	char *path;
 
 	unsigned char outbuf[IO_BLOCK_SIZE];
+	/* output that the script sent while its input was being written */
+	buffer_t *early_output;
+	size_t early_output_pos;
 	bool failed;
 	bool shutdown;
+	bool output_eof;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(fts_parser_script_user_module,
@@ -237,6 +244,15 @@ static void fts_parser_script_more(struct fts_parser *_parser,
 			parser->failed = TRUE;
 		}
 		block->size = 0;
+	} else if (parser->early_output != NULL &&
+		   parser->early_output_pos < parser->early_output->used) {
+		block->data = CONST_PTR_OFFSET(parser->early_output->data,
+					       parser->early_output_pos);
+		block->size = parser->early_output->used -
+			parser->early_output_pos;
+		parser->early_output_pos = parser->early_output->used;
+	} else if (parser->output_eof) {
+		/* the script already closed its output */
 	} else {
 		if (!parser->shutdown) {
 			if (shutdown(parser->fd, SHUT_WR) < 0)
@@ -254,6 +270,88 @@ static void fts_parser_script_more(struct fts_parser *_parser,
 	}
 }
 
+static void script_read_early_output(struct script_fts_parser *parser)
+{
+	unsigned char *data;
+	ssize_t ret;
+
+	if (parser->early_output == NULL)
+		parser->early_output = buffer_create_dynamic(default_pool, 1024);
+	data = buffer_append_space_unsafe(parser->early_output, IO_BLOCK_SIZE);
+	ret = read(parser->fd, data, IO_BLOCK_SIZE);
+	buffer_set_used_size(parser->early_output,
+			     parser->early_output->used - IO_BLOCK_SIZE +
+			     I_MAX(ret, 0));
+	if (ret == 0)
+		parser->output_eof = TRUE;
+	else if (ret < 0 && errno != EAGAIN) {
+		i_error("read(%s) failed: %m", parser->path);
+		parser->output_eof = TRUE;
+		parser->failed = TRUE;
+	}
+}
+
+static void script_write_input(struct script_fts_parser *parser,
+			       const unsigned char *data, size_t size)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	/* the script may start writing its output before it has read all of
+	   its input. keep reading the output while writing, so neither side
+	   blocks on a full socket buffer. */
+	while (size > 0 && !parser->failed) {
+		memset(&pfd, 0, sizeof(pfd));
+		pfd.fd = parser->fd;
+		pfd.events = POLLOUT | (parser->output_eof ? 0 : POLLIN);
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			i_error("poll(%s) failed: %m", parser->path);
+			parser->failed = TRUE;
+			break;
+		}
+		if ((pfd.revents & POLLIN) != 0)
+			script_read_early_output(parser);
+		if ((pfd.revents & (POLLOUT | POLLERR | POLLHUP)) == 0)
+			continue;
+
+		ret = write(parser->fd, data, size);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				continue;
+			i_error("write(%s) failed: %m", parser->path);
+			parser->failed = TRUE;
+			break;
+		}
+		data += ret;
+		size -= ret;
+	}
+}
+
+static void fts_parser_script_set_input(struct fts_parser *_parser,
+					struct istream *input)
+{
+	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
+	const unsigned char *data;
+	size_t size;
+
+	net_set_nonblock(parser->fd, TRUE);
+	while (i_stream_read_data(input, &data, &size, 0) > 0) {
+		script_write_input(parser, data, size);
+		i_stream_skip(input, size);
+	}
+	net_set_nonblock(parser->fd, FALSE);
+	if (input->stream_errno != 0) {
+		i_error("read(%s) failed: %s", i_stream_get_name(input),
+			i_stream_get_error(input));
+		parser->failed = TRUE;
+	}
+	if (shutdown(parser->fd, SHUT_WR) < 0)
+		i_error("shutdown(%s) failed: %m", parser->path);
+	parser->shutdown = TRUE;
+}
+
 static int fts_parser_script_deinit(struct fts_parser *_parser)
 {
 	struct script_fts_parser *parser = (struct script_fts_parser *)_parser;
@@ -261,6 +359,8 @@ static int fts_parser_script_deinit(struct fts_parser *_parser)
 
 	if (close(parser->fd) < 0)
 		i_error("close(%s) failed: %m", parser->path);
+	if (parser->early_output != NULL)
+		buffer_free(&parser->early_output);
 	i_free(parser->path);
 	i_free(parser);
 	return ret;
@@ -270,5 +370,6 @@ struct fts_parser_vfuncs fts_parser_script = {
 	fts_parser_script_try_init,
 	fts_parser_script_more,
 	fts_parser_script_deinit,
-	NULL
+	NULL,
+	fts_parser_script_set_input
 };
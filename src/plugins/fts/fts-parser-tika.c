@@ -28,6 +28,8 @@ struct tika_fts_parser {
 	struct istream *payload;
 
 	bool failed;
+	/* the whole input was given with set_input() */
+	bool submitted;
 };
 
 static struct http_client *tika_http_client = NULL;
@@ -64,7 +66,10 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	if (tika_http_client == NULL) {
 		memset(&http_set, 0, sizeof(http_set));
 		http_set.max_idle_time_msecs = 100;
-		http_set.max_parallel_connections = 1;
+		/* each parallel attachment conversion needs its own
+		   connection */
+		http_set.max_parallel_connections =
+			fts_parser_get_max_parallel(user);
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
@@ -161,6 +166,24 @@ fts_parser_tika_try_init(struct mail_user *user, const char *content_type,
 	return &parser->parser;
 }
 
+static void fts_parser_tika_wait(struct tika_fts_parser *parser)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+	struct ioloop *ioloop;
+
+	/* other parsers' requests may also be running. wait only until
+	   this parser's response has been received. */
+	ioloop = io_loop_create();
+	http_client_switch_ioloop(tika_http_client);
+	while (parser->payload == NULL && !parser->failed)
+		io_loop_run(ioloop);
+
+	io_loop_set_current(prev_ioloop);
+	http_client_switch_ioloop(tika_http_client);
+	io_loop_set_current(ioloop);
+	io_loop_destroy(&ioloop);
+}
+
 static void fts_parser_tika_more(struct fts_parser *_parser,
 				 struct message_block *block)
 {
@@ -181,7 +204,12 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 		return;
 	}
 
-	if (parser->payload == NULL) {
+	if (parser->payload == NULL && parser->submitted) {
+		/* the request was already sent with set_input() */
+		fts_parser_tika_wait(parser);
+		if (parser->failed)
+			return;
+	} else if (parser->payload == NULL) {
 		/* read the result from Tika */
 		if (!parser->failed &&
 		    http_client_request_finish_payload(&parser->http_req) < 0)
@@ -229,6 +257,18 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 	}
 }
 
+static void fts_parser_tika_set_input(struct fts_parser *_parser,
+				      struct istream *input)
+{
+	struct tika_fts_parser *parser = (struct tika_fts_parser *)_parser;
+
+	/* the request is sent the next time the ioloop runs, which allows
+	   multiple conversions to run in parallel */
+	http_client_request_set_payload(parser->http_req, input, FALSE);
+	http_client_request_submit(parser->http_req);
+	parser->submitted = TRUE;
+}
+
 static int fts_parser_tika_deinit(struct fts_parser *_parser)
 {
 	struct tika_fts_parser *parser = (struct tika_fts_parser *)_parser;
@@ -260,5 +300,6 @@ struct fts_parser_vfuncs fts_parser_tika = {
 	fts_parser_tika_try_init,
 	fts_parser_tika_more,
 	fts_parser_tika_deinit,
-	fts_parser_tika_unload
+	fts_parser_tika_unload,
+	fts_parser_tika_set_input
 };
@@ -2,10 +2,37 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "hash.h"
+#include "llist.h"
 #include "unichar.h"
+#include "settings-parser.h"
 #include "message-parser.h"
+#include "mail-user.h"
 #include "fts-parser.h"
 
+#define FTS_PARSER_DEFAULT_MAX_PARALLEL 4
+#define FTS_PARSER_DEFAULT_CACHE_SIZE (4*1024*1024)
+/* Don't let a single text take more than this fraction of the cache */
+#define FTS_PARSER_CACHE_TEXT_DIVISOR 4
+
+struct fts_parser_cache_entry {
+	struct fts_parser_cache_entry *prev, *next;
+
+	char *key;
+	buffer_t *text;
+};
+
+struct fts_parser_cache {
+	char *username;
+	size_t size;
+
+	HASH_TABLE(char *, struct fts_parser_cache_entry *) entries;
+	/* least recently used first */
+	struct fts_parser_cache_entry *head, *tail;
+};
+
+static struct fts_parser_cache *parser_cache = NULL;
+
 static const struct fts_parser_vfuncs *parsers[] = {
 	&fts_parser_html,
 	&fts_parser_script,
@@ -106,10 +133,148 @@ int fts_parser_deinit(struct fts_parser **_parser)
 	return ret;
 }
 
+bool fts_parser_want_full_input(struct fts_parser *parser)
+{
+	return parser->v.set_input != NULL;
+}
+
+void fts_parser_set_input(struct fts_parser *parser, struct istream *input)
+{
+	i_assert(parser->v.set_input != NULL);
+
+	parser->v.set_input(parser, input);
+}
+
+unsigned int fts_parser_get_max_parallel(struct mail_user *user)
+{
+	const char *value;
+	unsigned int max_parallel;
+
+	value = mail_user_plugin_getenv(user, "fts_parser_max_parallel");
+	if (value == NULL)
+		return FTS_PARSER_DEFAULT_MAX_PARALLEL;
+	if (str_to_uint(value, &max_parallel) < 0 || max_parallel == 0) {
+		i_error("Invalid fts_parser_max_parallel setting: %s", value);
+		return FTS_PARSER_DEFAULT_MAX_PARALLEL;
+	}
+	return max_parallel;
+}
+
+static size_t fts_parser_cache_get_max_size(struct mail_user *user)
+{
+	const char *value, *error;
+	uoff_t size;
+
+	value = mail_user_plugin_getenv(user, "fts_parser_cache_size");
+	if (value == NULL)
+		return FTS_PARSER_DEFAULT_CACHE_SIZE;
+	if (settings_get_size(value, &size, &error) < 0) {
+		i_error("Invalid fts_parser_cache_size setting: %s", error);
+		return FTS_PARSER_DEFAULT_CACHE_SIZE;
+	}
+	return I_MIN(size, SSIZE_T_MAX);
+}
+
+static void
+fts_parser_cache_entry_free(struct fts_parser_cache *cache,
+			    struct fts_parser_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->size -= entry->text->used;
+
+	buffer_free(&entry->text);
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static void fts_parser_cache_free(struct fts_parser_cache **_cache)
+{
+	struct fts_parser_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->head != NULL)
+		fts_parser_cache_entry_free(cache, cache->head);
+	hash_table_destroy(&cache->entries);
+	i_free(cache->username);
+	i_free(cache);
+}
+
+static struct fts_parser_cache *
+fts_parser_cache_get(struct mail_user *user, bool create)
+{
+	if (parser_cache != NULL &&
+	    strcmp(parser_cache->username, user->username) != 0) {
+		/* don't share the cache between users */
+		fts_parser_cache_free(&parser_cache);
+	}
+	if (parser_cache == NULL && create) {
+		parser_cache = i_new(struct fts_parser_cache, 1);
+		parser_cache->username = i_strdup(user->username);
+		hash_table_create(&parser_cache->entries, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	return parser_cache;
+}
+
+const buffer_t *
+fts_parser_cache_lookup(struct mail_user *user, const char *key)
+{
+	struct fts_parser_cache *cache;
+	struct fts_parser_cache_entry *entry;
+
+	cache = fts_parser_cache_get(user, FALSE);
+	if (cache == NULL)
+		return NULL;
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry == NULL)
+		return NULL;
+
+	/* move to the end of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_APPEND(&cache->head, &cache->tail, entry);
+	return entry->text;
+}
+
+size_t fts_parser_cache_get_max_text_size(struct mail_user *user)
+{
+	return fts_parser_cache_get_max_size(user) /
+		FTS_PARSER_CACHE_TEXT_DIVISOR;
+}
+
+void fts_parser_cache_add(struct mail_user *user, const char *key,
+			  const buffer_t *text)
+{
+	struct fts_parser_cache *cache;
+	struct fts_parser_cache_entry *entry;
+	size_t max_size = fts_parser_cache_get_max_size(user);
+
+	if (max_size == 0 ||
+	    text->used > max_size / FTS_PARSER_CACHE_TEXT_DIVISOR)
+		return;
+
+	cache = fts_parser_cache_get(user, TRUE);
+	if (hash_table_lookup(cache->entries, key) != NULL)
+		return;
+	while (cache->head != NULL && cache->size + text->used > max_size)
+		fts_parser_cache_entry_free(cache, cache->head);
+
+	entry = i_new(struct fts_parser_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->text = buffer_create_dynamic(default_pool, text->used + 1);
+	buffer_append_buf(entry->text, text, 0, (size_t)-1);
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_APPEND(&cache->head, &cache->tail, entry);
+	cache->size += text->used;
+}
+
 void fts_parsers_unload(void)
 {
 	unsigned int i;
 
+	if (parser_cache != NULL)
+		fts_parser_cache_free(&parser_cache);
+
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
 		if (parsers[i]->unload != NULL)
 			parsers[i]->unload();
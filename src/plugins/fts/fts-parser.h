@@ -1,6 +1,7 @@
 #ifndef FTS_PARSER_H
 #define FTS_PARSER_H
 
+struct istream;
 struct message_block;
 struct mail_user;
 
@@ -11,6 +12,10 @@ struct fts_parser_vfuncs {
 	void (*more)(struct fts_parser *parser, struct message_block *block);
 	int (*deinit)(struct fts_parser *parser);
 	void (*unload)(void);
+	/* If set, the input is given all at once with this instead of with
+	   more(). The conversion can then run in the background until the
+	   output is read with more(). */
+	void (*set_input)(struct fts_parser *parser, struct istream *input);
 };
 
 struct fts_parser {
@@ -33,6 +38,28 @@ struct fts_parser *fts_parser_text_init(void);
 void fts_parser_more(struct fts_parser *parser, struct message_block *block);
 int fts_parser_deinit(struct fts_parser **parser);
 
+/* Returns TRUE if the parser converts the input externally and wants it all
+   at once with fts_parser_set_input() instead of fts_parser_more(). */
+bool fts_parser_want_full_input(struct fts_parser *parser);
+/* Give the whole input to the parser and start converting it. The output is
+   read with fts_parser_more() the same way as after the message is
+   finished. */
+void fts_parser_set_input(struct fts_parser *parser, struct istream *input);
+/* Returns the maximum number of parsers that may be converting their input
+   at the same time (fts_parser_max_parallel setting). */
+unsigned int fts_parser_get_max_parallel(struct mail_user *user);
+
+/* Text extracted from attachments is cached by the attachment's hash, so
+   identical attachments are converted only once. The cache is kept for the
+   latest user only. */
+const buffer_t *
+fts_parser_cache_lookup(struct mail_user *user, const char *key);
+/* Returns the size of the largest text that can be cached, or 0 if caching
+   is disabled (fts_parser_cache_size=0). */
+size_t fts_parser_cache_get_max_text_size(struct mail_user *user);
+void fts_parser_cache_add(struct mail_user *user, const char *key,
+			  const buffer_t *text);
+
 void fts_parsers_unload(void);
 
 #endif
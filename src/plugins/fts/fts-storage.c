@@ -2,13 +2,12 @@
 
 #include "lib.h"
 #include "array.h"
-#include "net.h"
 #include "str.h"
 #include "strescape.h"
-#include "write-full.h"
 #include "mail-search-build.h"
 #include "mail-storage-private.h"
 #include "mailbox-list-private.h"
+#include "mail-indexer.h"
 #include "../virtual/virtual-storage.h"
 #include "fts-api-private.h"
 #include "fts-tokenizer.h"
@@ -26,9 +25,6 @@
 #define FTS_LIST_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_mailbox_list_module)
 
-#define INDEXER_SOCKET_NAME "indexer"
-#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
-
 struct fts_mailbox_list {
 	union mailbox_list_module_context module_ctx;
 	struct fts_backend *backend;
@@ -595,18 +591,10 @@ static void fts_queue_index(struct mailbox *box)
 	unsigned int max_recent_msgs;
 	int fd;
 
-	path = t_strconcat(user->set->base_dir, "/"INDEXER_SOCKET_NAME, NULL);
-	fd = net_connect_unix(path);
-	if (fd == -1) {
-		i_error("net_connect_unix(%s) failed: %m", path);
-		return;
-	}
-
 	value = mail_user_plugin_getenv(user, "fts_autoindex_max_recent_msgs");
 	if (value == NULL || str_to_uint(value, &max_recent_msgs) < 0)
 		max_recent_msgs = 0;
 
-	str_append(str, INDEXER_HANDSHAKE);
 	str_append(str, "APPEND\t0\t");
 	str_append_tabescaped(str, user->username);
 	str_append_c(str, '\t');
@@ -615,9 +603,9 @@ static void fts_queue_index(struct mailbox *box)
 	str_append_c(str, '\t');
 	str_append_tabescaped(str, box->storage->user->session_id);
 	str_append_c(str, '\n');
-	if (write_full(fd, str_data(str), str_len(str)) < 0)
-		i_error("write(%s) failed: %m", path);
-	i_close_fd(&fd);
+	fd = mail_indexer_cmd(user, str_c(str), 0, &path);
+	if (fd != -1)
+		i_close_fd(&fd);
 }
 
 static int
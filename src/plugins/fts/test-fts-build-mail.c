@@ -0,0 +1,328 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "message-parser.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "index-mail.h"
+#include "fts-language.h"
+#include "fts-tokenizer.h"
+#include "fts-filter.h"
+#include "fts-user.h"
+#include "fts-parser.h"
+#include "fts-api-private.h"
+#include "fts-build-mail.h"
+#include "test-common.h"
+
+#define TEST_ATTACHMENT_COUNT 5
+
+struct test_parser {
+	struct fts_parser parser;
+	buffer_t *output;
+	bool output_sent;
+};
+
+static struct mail_user test_user;
+static struct istream *test_mail_input;
+static unsigned int test_max_parallel;
+static unsigned int test_parsers_running, test_parsers_max_running;
+static string_t *test_indexed, *test_build_key;
+
+/* parser stubs: application/x-test parts are converted in the background
+   and the output is the input in uppercase */
+static void test_parser_set_input(struct fts_parser *_parser,
+				  struct istream *input)
+{
+	struct test_parser *parser = (struct test_parser *)_parser;
+	const unsigned char *data;
+	size_t size;
+
+	parser->output = str_new(default_pool, 128);
+	while (i_stream_read_data(input, &data, &size, 0) > 0) {
+		str_append_n(parser->output, data, size);
+		i_stream_skip(input, size);
+	}
+	(void)str_ucase(str_c_modifiable(parser->output));
+	test_parsers_running++;
+	test_parsers_max_running = I_MAX(test_parsers_max_running,
+					 test_parsers_running);
+}
+
+bool fts_parser_init(struct mail_user *user ATTR_UNUSED,
+		     const char *content_type,
+		     const char *content_disposition ATTR_UNUSED,
+		     struct fts_parser **parser_r)
+{
+	struct test_parser *parser;
+
+	if (strcmp(content_type, "application/x-test") != 0)
+		return FALSE;
+	parser = i_new(struct test_parser, 1);
+	parser->parser.v.set_input = test_parser_set_input;
+	*parser_r = &parser->parser;
+	return TRUE;
+}
+
+struct fts_parser *fts_parser_text_init(void)
+{
+	return i_new(struct fts_parser, 1);
+}
+
+void fts_parser_more(struct fts_parser *_parser, struct message_block *block)
+{
+	struct test_parser *parser = (struct test_parser *)_parser;
+
+	if (_parser->v.set_input == NULL) {
+		/* text parser */
+		return;
+	}
+	test_assert(parser->output != NULL);
+	if (parser->output != NULL && !parser->output_sent) {
+		block->data = parser->output->data;
+		block->size = parser->output->used;
+		parser->output_sent = TRUE;
+	}
+}
+
+int fts_parser_deinit(struct fts_parser **_parser)
+{
+	struct test_parser *parser = (struct test_parser *)*_parser;
+
+	*_parser = NULL;
+	if (parser->parser.v.set_input != NULL && parser->output != NULL) {
+		test_parsers_running--;
+		buffer_free(&parser->output);
+	}
+	i_free(parser);
+	return 0;
+}
+
+bool fts_parser_want_full_input(struct fts_parser *parser)
+{
+	return parser->v.set_input != NULL;
+}
+
+void fts_parser_set_input(struct fts_parser *parser, struct istream *input)
+{
+	parser->v.set_input(parser, input);
+}
+
+unsigned int fts_parser_get_max_parallel(struct mail_user *user ATTR_UNUSED)
+{
+	return test_max_parallel;
+}
+
+const buffer_t *
+fts_parser_cache_lookup(struct mail_user *user ATTR_UNUSED,
+			const char *key ATTR_UNUSED)
+{
+	return NULL;
+}
+
+size_t fts_parser_cache_get_max_text_size(struct mail_user *user ATTR_UNUSED)
+{
+	return 0;
+}
+
+void fts_parser_cache_add(struct mail_user *user ATTR_UNUSED,
+			  const char *key ATTR_UNUSED,
+			  const buffer_t *text ATTR_UNUSED)
+{
+}
+
+/* backend stubs: headers aren't indexed, body parts are written to
+   test_indexed prefixed by their content type. deferred parts open their
+   key twice, so the key is written only when it receives text. */
+bool fts_backend_update_set_build_key(struct fts_backend_update_context *ctx,
+				      const struct fts_backend_build_key *key)
+{
+	if (key->type != FTS_BACKEND_BUILD_KEY_BODY_PART)
+		return FALSE;
+	test_assert(!ctx->build_key_open);
+	ctx->build_key_open = TRUE;
+	str_truncate(test_build_key, 0);
+	str_printfa(test_build_key, "[%s]", key->body_content_type);
+	return TRUE;
+}
+
+void fts_backend_update_unset_build_key(struct fts_backend_update_context *ctx)
+{
+	ctx->build_key_open = FALSE;
+}
+
+int fts_backend_update_build_more(struct fts_backend_update_context *ctx,
+				  const unsigned char *data, size_t size)
+{
+	test_assert(ctx->build_key_open);
+	if (size > 0) {
+		str_append_str(test_indexed, test_build_key);
+		str_truncate(test_build_key, 0);
+		str_append_n(test_indexed, data, size);
+	}
+	return 0;
+}
+
+/* the rest isn't used by the test */
+int mail_get_stream(struct mail *mail ATTR_UNUSED,
+		    struct message_size *hdr_size ATTR_UNUSED,
+		    struct message_size *body_size ATTR_UNUSED,
+		    struct istream **stream_r)
+{
+	*stream_r = test_mail_input;
+	return 0;
+}
+struct mail_storage *mailbox_get_storage(const struct mailbox *box ATTR_UNUSED)
+{
+	return NULL;
+}
+struct mail_user *
+mail_storage_get_user(struct mail_storage *storage ATTR_UNUSED)
+{
+	return &test_user;
+}
+void mail_user_set_get_temp_prefix(string_t *dest,
+				   const struct mail_user_settings *set ATTR_UNUSED)
+{
+	str_append(dest, ".test-fts-build-mail.");
+}
+const char *mailbox_get_vname(const struct mailbox *box ATTR_UNUSED)
+{
+	return "INBOX";
+}
+const char *mailbox_get_last_error(struct mailbox *box ATTR_UNUSED,
+				   enum mail_error *error_r ATTR_UNUSED)
+{
+	return "error";
+}
+void index_mail_set_message_parts_corrupted(struct mail *mail ATTR_UNUSED,
+					    const char *error ATTR_UNUSED)
+{
+}
+bool fts_header_has_language(const char *hdr_name ATTR_UNUSED)
+{
+	i_unreached();
+}
+struct fts_user_language *
+fts_user_get_data_lang(struct mail_user *user ATTR_UNUSED)
+{
+	i_unreached();
+}
+struct fts_language_list *
+fts_user_get_language_list(struct mail_user *user ATTR_UNUSED)
+{
+	i_unreached();
+}
+struct fts_user_language *
+fts_user_language_find(struct mail_user *user ATTR_UNUSED,
+		       const struct fts_language *lang ATTR_UNUSED)
+{
+	i_unreached();
+}
+const struct fts_language *
+fts_language_list_get_first(struct fts_language_list *list ATTR_UNUSED)
+{
+	i_unreached();
+}
+enum fts_language_result
+fts_language_detect(struct fts_language_list *list ATTR_UNUSED,
+		    const unsigned char *text ATTR_UNUSED,
+		    size_t size ATTR_UNUSED,
+		    const struct fts_language **lang_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+void fts_tokenizer_reset(struct fts_tokenizer *tok ATTR_UNUSED)
+{
+	i_unreached();
+}
+int fts_tokenizer_next(struct fts_tokenizer *tok ATTR_UNUSED,
+		       const unsigned char *data ATTR_UNUSED,
+		       size_t size ATTR_UNUSED,
+		       const char **token_r ATTR_UNUSED,
+		       const char **error_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+int fts_filter_filter(struct fts_filter *filter ATTR_UNUSED,
+		      const char **token ATTR_UNUSED,
+		      const char **error_r ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+static void test_build_mail(unsigned int max_parallel)
+{
+	struct mail_namespace ns;
+	struct fts_backend backend;
+	struct fts_backend_update_context update_ctx;
+	struct mail mail;
+	string_t *input, *expected;
+	unsigned int i;
+
+	input = t_str_new(1024);
+	str_append(input, "From: user@example.com\n"
+		   "Content-Type: multipart/mixed; boundary=\"b\"\n\n"
+		   "--b\n\ntext body\n");
+	for (i = 1; i <= TEST_ATTACHMENT_COUNT; i++) {
+		str_printfa(input, "--b\n"
+			    "Content-Type: application/x-test\n\n"
+			    "attachment %u\n", i);
+	}
+	str_append(input, "--b--\n");
+	test_mail_input = i_stream_create_from_data(str_data(input),
+						    str_len(input));
+
+	memset(&ns, 0, sizeof(ns));
+	ns.user = &test_user;
+	memset(&backend, 0, sizeof(backend));
+	backend.ns = &ns;
+	memset(&update_ctx, 0, sizeof(update_ctx));
+	update_ctx.backend = &backend;
+	memset(&mail, 0, sizeof(mail));
+	mail.uid = 1;
+
+	test_max_parallel = max_parallel;
+	test_parsers_running = test_parsers_max_running = 0;
+	test_indexed = str_new(default_pool, 256);
+	test_build_key = str_new(default_pool, 64);
+	test_assert(fts_build_mail(&update_ctx, &mail) == 1);
+
+	/* at most max_parallel conversions were running at the same time,
+	   and they were all finished */
+	test_assert(test_parsers_max_running ==
+		    I_MIN(max_parallel, TEST_ATTACHMENT_COUNT));
+	test_assert(test_parsers_running == 0);
+	test_assert(!update_ctx.build_key_open);
+
+	/* all the attachments were indexed in order under their own key */
+	expected = t_str_new(256);
+	str_append(expected, "[text/plain]text body");
+	for (i = 1; i <= TEST_ATTACHMENT_COUNT; i++)
+		str_printfa(expected, "[application/x-test]ATTACHMENT %u", i);
+	test_assert(strcmp(str_c(test_indexed), str_c(expected)) == 0);
+
+	str_free(&test_indexed);
+	str_free(&test_build_key);
+	i_stream_unref(&test_mail_input);
+}
+
+static void test_fts_build_mail_max_parallel(void)
+{
+	test_begin("fts build mail max parallel");
+	test_build_mail(1);
+	test_build_mail(2);
+	test_build_mail(TEST_ATTACHMENT_COUNT + 1);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_build_mail_max_parallel,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,149 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "mail-user.h"
+#include "test-common.h"
+#include "fts-parser.h"
+
+struct fts_parser_vfuncs fts_parser_html, fts_parser_script, fts_parser_tika;
+
+static const char *test_cache_size, *test_max_parallel;
+
+const char *mail_user_plugin_getenv(struct mail_user *user ATTR_UNUSED,
+				    const char *name)
+{
+	if (strcmp(name, "fts_parser_cache_size") == 0)
+		return test_cache_size;
+	if (strcmp(name, "fts_parser_max_parallel") == 0)
+		return test_max_parallel;
+	return NULL;
+}
+
+static void test_cache_add(struct mail_user *user, const char *key,
+			   size_t size)
+{
+	buffer_t *text = buffer_create_dynamic(pool_datastack_create(), size);
+
+	buffer_append_zero(text, size);
+	memset(buffer_get_modifiable_data(text, NULL), key[0], size);
+	fts_parser_cache_add(user, key, text);
+}
+
+static bool test_cache_has(struct mail_user *user, const char *key,
+			   size_t size)
+{
+	const buffer_t *text = fts_parser_cache_lookup(user, key);
+
+	return text != NULL && text->used == size &&
+		((const char *)text->data)[0] == key[0];
+}
+
+static void test_fts_parser_cache_lru(void)
+{
+	struct mail_user user;
+
+	test_begin("fts parser cache lru");
+	memset(&user, 0, sizeof(user));
+	user.username = "user1";
+	test_cache_size = "4k";
+
+	test_assert(fts_parser_cache_get_max_text_size(&user) == 1024);
+	test_cache_add(&user, "a", 1000);
+	test_cache_add(&user, "b", 1000);
+	test_cache_add(&user, "c", 1000);
+	test_assert(test_cache_has(&user, "a", 1000));
+	test_assert(test_cache_has(&user, "b", 1000));
+	test_assert(test_cache_has(&user, "c", 1000));
+	test_assert(fts_parser_cache_lookup(&user, "d") == NULL);
+
+	/* the lookup of "a" made "b" the least recently used */
+	test_assert(test_cache_has(&user, "a", 1000));
+	test_cache_add(&user, "d", 1000);
+	test_cache_add(&user, "e", 1000);
+	test_assert(fts_parser_cache_lookup(&user, "b") == NULL);
+	test_assert(test_cache_has(&user, "a", 1000));
+	test_assert(test_cache_has(&user, "c", 1000));
+	test_assert(test_cache_has(&user, "d", 1000));
+	test_assert(test_cache_has(&user, "e", 1000));
+
+	/* adding an existing key doesn't replace it */
+	test_cache_add(&user, "a", 10);
+	test_assert(test_cache_has(&user, "a", 1000));
+
+	/* too large texts aren't cached and don't evict anything */
+	test_cache_add(&user, "f", 1025);
+	test_assert(fts_parser_cache_lookup(&user, "f") == NULL);
+	test_assert(test_cache_has(&user, "c", 1000));
+
+	fts_parsers_unload();
+	test_end();
+}
+
+static void test_fts_parser_cache_user(void)
+{
+	struct mail_user user1, user2;
+
+	test_begin("fts parser cache per user");
+	memset(&user1, 0, sizeof(user1));
+	memset(&user2, 0, sizeof(user2));
+	user1.username = "user1";
+	user2.username = "user2";
+	test_cache_size = "4k";
+
+	test_cache_add(&user1, "a", 100);
+	test_assert(test_cache_has(&user1, "a", 100));
+	/* another user doesn't see the first user's texts, and the cache is
+	   dropped when the user changes */
+	test_assert(fts_parser_cache_lookup(&user2, "a") == NULL);
+	test_assert(fts_parser_cache_lookup(&user1, "a") == NULL);
+
+	test_cache_add(&user2, "b", 100);
+	test_assert(test_cache_has(&user2, "b", 100));
+	test_cache_add(&user1, "c", 100);
+	test_assert(fts_parser_cache_lookup(&user2, "b") == NULL);
+
+	/* fts_parser_cache_size=0 disables caching */
+	test_cache_size = "0";
+	test_assert(fts_parser_cache_get_max_text_size(&user1) == 0);
+	test_cache_add(&user1, "d", 1);
+	test_assert(fts_parser_cache_lookup(&user1, "d") == NULL);
+
+	fts_parsers_unload();
+	test_end();
+}
+
+static void test_fts_parser_max_parallel(void)
+{
+	struct mail_user user;
+
+	test_begin("fts parser max parallel");
+	memset(&user, 0, sizeof(user));
+	user.username = "user1";
+	test_max_parallel = NULL;
+	test_assert(fts_parser_get_max_parallel(&user) == 4);
+	test_max_parallel = "1";
+	test_assert(fts_parser_get_max_parallel(&user) == 1);
+	test_max_parallel = "10";
+	test_assert(fts_parser_get_max_parallel(&user) == 10);
+
+	/* invalid values fall back to the default */
+	test_max_parallel = "0";
+	test_expect_errors(1);
+	test_assert(fts_parser_get_max_parallel(&user) == 4);
+	test_max_parallel = "foo";
+	test_expect_errors(1);
+	test_assert(fts_parser_get_max_parallel(&user) == 4);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_parser_cache_lru,
+		test_fts_parser_cache_user,
+		test_fts_parser_max_parallel,
+		NULL
+	};
+	return test_run(test_functions);
+}
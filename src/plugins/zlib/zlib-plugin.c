@@ -149,7 +149,10 @@ static int zlib_istream_opened(struct mail *_mail, struct istream **stream)
 		*stream = handler->create_istream(input, TRUE);
 		i_stream_unref(&input);
 
-		*stream = zlib_mail_cache_open(zuser, _mail, *stream);
+		/* streams with a seek index can jump directly to the wanted
+		   offset, so there's no need to cache the uncompressed data */
+		if (!compression_istream_is_seekable_fast(*stream))
+			*stream = zlib_mail_cache_open(zuser, _mail, *stream);
 	}
 	return zmail->module_ctx.super.istream_opened(_mail, stream);
 }